@@ -1,15 +1,47 @@
+#ifdef __linux__
+#define _GNU_SOURCE                 // accept4
+#endif
 #include <signal.h>
 #include <ctype.h>
 #include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <dirent.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CSERVER_URING
+#endif
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+// SSE2 is always there; AVX2 is checked at run time
+#include <immintrin.h>
+#define HTML_ESCAPE_X86
+#endif
 
 // Markdown
 #include "md4c/src/md4c-html.h"
@@ -18,6 +50,21 @@
 #include "mustach/mustach.h"
 #include "mustach/mustach-cjson.h"
 
+#ifdef CSERVER_LUA
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#endif
+
+#ifdef CSERVER_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#ifdef CSERVER_ZLIB
+#include <zlib.h>
+#endif
+
 #include "cserver.h"
 
 // Constants
@@ -27,16 +74,25 @@ const char *content_type_json = "application/json";
 
 #ifndef CSERVER_TEST                // Exlude main from test target
 int main(int argc, char **argv) {
+    memory_init();
     if (argc < 2) {
         print_help();
     } else if (argc == 3 && strcmp(argv[1], "run") == 0) {
         return start_server(argv[2], true);
+    } else if (argc == 4 && strcmp(argv[1], "run") == 0 && strcmp(argv[2], "--bundle") == 0) {
+        return start_server(argv[3], true);
     } else if (argc == 3 && strcmp(argv[1], "start") == 0) {
         return start_server(argv[2], false);
+    } else if (argc == 4 && strcmp(argv[1], "start") == 0 && strcmp(argv[2], "--bundle") == 0) {
+        return start_server(argv[3], false);
+    } else if (argc == 4 && strcmp(argv[1], "pack") == 0) {
+        return pack_site(argv[2], argv[3]);
     } else if (strcmp(argv[1], "list") == 0) {
         return list_servers();
     } else if (argc == 3 && strcmp(argv[1], "restart") == 0) {
         return restart_server(argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "reload") == 0) {
+        return reload_server(argv[2]);
     } else if (argc == 3 && strcmp(argv[1], "stop") == 0) {
         return stop_server(argv[2]);
     } else {
@@ -70,6 +126,7 @@ string string_make(const char* value) {
     size_t value_length = strlen(value);
     string result = { .value = malloc(value_length + 1), .length = value_length };
     strcpy(result.value, value);
+    memory_count_string(value_length + 1);
     return result;
 }
 
@@ -109,6 +166,7 @@ string read_file(const char *filename) {
         return result;
     }
     content[file_length] = '\0'; // Null-terminate the string
+    memory_count_string(file_length + 1);
 
     // Close the file
     fclose(file);
@@ -119,16 +177,30 @@ string read_file(const char *filename) {
     return result;
 }
 
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+    // FNV-1a
+    for (const unsigned char *c = data; length > 0; c++, length--) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
 // Server management functions ////////////////////////////////////////////////
 
 int print_help() {
     printf("Usage: \n");
-    printf("  cserver run <path>    Run new server in console\n");
-    printf("  cserver start <path>  Start new server at <path>\n");
-    printf("  cserver restart <id>  Restart server at path\n");
-    printf("  cserver list          List all servers\n");
-    printf("  cserver stop <id>     Stop server with <id>\n");
-    printf("  cserver               Print this help\n");
+    printf("  cserver run <path>        Run new server in console\n");
+    printf("  cserver start <path>      Start new server at <path>\n");
+    printf("  cserver run --bundle <bundle>\n");
+    printf("  cserver start --bundle <bundle>\n");
+    printf("                            Serve a bundle made by cserver pack\n");
+    printf("  cserver pack <path> <bundle>\n");
+    printf("                            Render the site at <path> into <bundle>\n");
+    printf("  cserver restart <path>    Restart server at <path>\n");
+    printf("  cserver reload <path>     Reload configuration and metadata\n");
+    printf("  cserver list              List all servers\n");
+    printf("  cserver stop <pid|path>   Stop server\n");
+    printf("  cserver                   Print this help\n");
     return EXIT_SUCCESS;
 }
 
@@ -156,756 +228,8413 @@ void daemonize(char *path) {
         exit(EXIT_FAILURE);
     }
 
-    // Close out the standard file descriptors
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    // Close out the standard file descriptors; keep them pointing to
+    // /dev/null so that sockets never get these numbers
+    int null_desc = open("/dev/null", O_RDWR);
+    dup2(null_desc, STDIN_FILENO);
+    dup2(null_desc, STDOUT_FILENO);
+    dup2(null_desc, STDERR_FILENO);
+    if (null_desc > STDERR_FILENO) close(null_desc);
 }
 
-int start_server(char* path, bool cli_mode) {
+// Server state shared by the worker and the control thread
+static struct {
+    pid_t pid;
+    char path[MAX_PATH_LEN];        // absolute path to the server files
+    int port;
+    time_t started;
+    struct listener listeners[LISTENERS_MAX];
+    int listener_count;
+    bool handed_off;                // listeners passed to a new instance
+    int control;                    // Unix control socket
+    char control_path[MAX_PATH_LEN];
+    int wake[2];                    // pipe, wakes up threads waiting in poll
+    int signals[2];                 // pipe, written by signal handlers
+    _Atomic bool running;
+    pthread_t control_thread;
+    // Request counts sampled by the control thread, for requests per second
+    struct { uint64_t time; uint64_t requests; } samples[STATS_SAMPLES];
+    int sample_count;
+    int sample_next;
+} server = { .control = -1 };
+
+// SIGHUP reloads the site, SIGUSR2 writes the memory counters to stderr,
+// SIGINT and SIGTERM stop the server
+static void server_signal(int signal) {
+    int saved_errno = errno;
+    char signal_byte = signal == SIGHUP ? 'r' : signal == SIGUSR2 ? 'm' : 's';
+    ssize_t written = write(server.signals[1], &signal_byte, 1);
+    (void)written;
+    errno = saved_errno;
+}
 
-    if (cli_mode) {
-        chdir(path);
-    } else {
-        daemonize(path);
-    }
+// Stops accepting connections; the worker finishes the current request
+static void server_stop() {
+    atomic_store(&server.running, false);
+    ssize_t written = write(server.wake[1], "w", 1);
+    (void)written;
+}
 
-    // Request data buffer length
-    const size_t buffer_len = 4096;
-    // HTTP method length
-    const size_t method_len = 8;
-    // Request url length
-    const size_t url_len = 1024;
+static void server_reload() {
+    // Rebuild in the background; workers pick the new site up
+    // on their next request
+    site_invalidate(NULL);
+    site_publish(site_load());
+    file_cache_clear();
+    fprintf(stderr, "Configuration and metadata reloaded\n");
+}
 
-    // Read configuration
-    cJSON *config = NULL;
-    string config_content = read_file("config.json");
-    if (config_content.value != NULL) {
-        config = cJSON_Parse(config_content.value);
-        string_free(config_content);
+// Records the request count once per STATS_INTERVAL
+static void stats_sample() {
+    uint64_t now = metrics_now();
+    if (server.sample_count > 0) {
+        int last = (server.sample_next + STATS_SAMPLES - 1) % STATS_SAMPLES;
+        if (now - server.samples[last].time < STATS_INTERVAL * 1000000ULL) return;
     }
-    if (config == NULL) config = cJSON_CreateObject();
-
-    int port = read_int(config, "port", PORT);
-
-    // Metadata
-    char pages_path[MAX_PATH_LEN];
-    snprintf(pages_path, MAX_PATH_LEN, "%s/static", path);
-    cJSON *site_metadata = cJSON_CreateObject();
-    collect_metadata(site_metadata, pages_path, NULL);
-    create_index(site_metadata);
-    
-    // Create socket descriptor
-    // man socket(2)
-    int server_desc = socket(PF_INET, SOCK_STREAM, IPPROTO_IP);
+    server.samples[server.sample_next].time = now;
+    server.samples[server.sample_next].requests = metrics_requests();
+    server.sample_next = (server.sample_next + 1) % STATS_SAMPLES;
+    if (server.sample_count < STATS_SAMPLES) server.sample_count++;
+}
 
-    // Define the server address
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+// Requests per second over the sampled window
+static double stats_rate(uint64_t requests) {
+    if (server.sample_count == 0) return 0;
+    int oldest = server.sample_count < STATS_SAMPLES ? 0 : server.sample_next;
+    uint64_t elapsed = metrics_now() - server.samples[oldest].time;
+    if (elapsed == 0) return 0;
+    return (requests - server.samples[oldest].requests) * 1e9 / elapsed;
+}
 
-    socklen_t address_len = sizeof(address);
+// Resident set size in bytes
+static size_t resident_memory() {
+#ifdef __linux__
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(statm);
+    }
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+#else
+    // Peak resident size; ru_maxrss is in bytes on macOS
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#endif
+}
 
-    // Bind the socket to the network address and port
-    int bind_result = bind(server_desc, (struct sockaddr *)&address, address_len);
-    if (bind_result != 0) {
-        perror("bind failed");
-        return 1;
+// Opens a listening socket, or takes the one bound to the same address
+// from the sockets handed over by the previous instance. With `take_only`
+// the socket is left at -1 if none was handed over.
+static int listener_open(struct listener *listener, const char *text, const char *mode,
+                         int *handed, int handed_count, bool take_only) {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    if (listen_address_parse(text, &address, &address_len) != 0) {
+        fprintf(stderr, "Invalid listen address: %s\n", text);
+        return -1;
     }
+    listen_address_format((struct sockaddr *)&address, listener->name, sizeof(listener->name));
+    listener->unix_socket = address.ss_family == AF_UNIX;
+#ifdef CSERVER_TLS
+    // Behind a proxy, the proxy terminates TLS
+    listener->tls = tls_enabled() && !listener->unix_socket && !listener->proxy_protocol;
+#endif
 
-    // Listen for connections
-    int listen_result = listen(server_desc, 3);
-    if (listen_result != 0) {
-        perror("listen failed");
-        return 1;
+    for (int i = 0; i < handed_count; i++) {
+        struct sockaddr_storage bound;
+        socklen_t bound_len = sizeof(bound);
+        char name[sizeof(listener->name)];
+        if (handed[i] < 0 || getsockname(handed[i], (struct sockaddr *)&bound, &bound_len) != 0) continue;
+        listen_address_format((struct sockaddr *)&bound, name, sizeof(name));
+        if (strcmp(name, listener->name) != 0) continue;
+        listener->socket = handed[i];
+        handed[i] = -1;
+        return 0;
     }
+    if (take_only) return 0;
 
-    // mustach library hook for partials, see mustach-wrap.h
-    mustach_wrap_get_partial = load_partial;
+    // Create socket descriptor
+    // man socket(2)
+    int server_desc = socket(address.ss_family, SOCK_STREAM, 0);
+    if (server_desc < 0) {
+        perror("socket failed");
+        return -1;
+    }
 
-    while (1) {
-        printf("Waiting for a connection...\n");
-        
-        // Accept a connection
-        int socket_desc = accept(server_desc, (struct sockaddr *)&address, &address_len);
-        if (socket_desc < 0) {
-            perror("accept failed");
-            exit(EXIT_FAILURE);
+    const char *path = ((struct sockaddr_un *)&address)->sun_path;
+    if (listener->unix_socket) {
+        // A socket file nobody accepts on is left over from a previous run
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&address, address_len) != 0 && errno == ECONNREFUSED) {
+            unlink(path);
         }
-
-        // Parse the request and send a response
-        char buffer[buffer_len];
-        memset(buffer, 0, buffer_len);
-        long recv_result = recv(socket_desc, buffer, buffer_len, 0);
-        if (recv_result < 0) {
-            perror("recv failed");
-            exit(EXIT_FAILURE);
+        if (probe >= 0) close(probe);
+    } else {
+        // Allow binding while connections of a previous instance are in TIME_WAIT
+        int enabled = 1;
+        setsockopt(server_desc, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+        // IPv4 addresses have listeners of their own
+        if (address.ss_family == AF_INET6) {
+            setsockopt(server_desc, IPPROTO_IPV6, IPV6_V6ONLY, &enabled, sizeof(enabled));
         }
-        printf("%li bytes received\n", recv_result);
-        printf("--------------------------------\n");
-        printf("%s\n", buffer);
-        printf("--------------------------------\n");
-
-        // Parse the request
-        char method[method_len];
-        char url[url_len];
-        sscanf(buffer, "%s %s", method, url);
-        printf("Method: %s\nURL: %s\n", method, url);
-        char *path = resource_path(url);
+    }
 
-        cJSON *context = cJSON_CreateObject();
-        add_request(context, method, url, path);
-        cJSON_AddItemToObject(context, "config", config);
-        cJSON_AddItemToObject(context, "site", site_metadata);
+    // Bind the socket to the address and listen for connections. After a
+    // handoff the previous instance may still hold an address that moved
+    // to another listener until it closes its copies.
+    int attempts = handed_count > 0 ? LISTEN_RETRIES : 1;
+    while (bind(server_desc, (struct sockaddr *)&address, address_len) != 0) {
+        if (errno == EADDRINUSE && --attempts > 0) {
+            poll(NULL, 0, TIMER_TICK);
+            continue;
+        }
+        fprintf(stderr, "bind %s failed: %s\n", listener->name, strerror(errno));
+        close(server_desc);
+        return -1;
+    }
+    if (listener->unix_socket && mode != NULL) chmod(path, strtol(mode, NULL, 8));
+    if (listen(server_desc, SOMAXCONN) != 0) {
+        perror("listen failed");
+        close(server_desc);
+        return -1;
+    }
 
-        string response;
+    // Port 0 is bound to a free port
+    address_len = sizeof(address);
+    if (getsockname(server_desc, (struct sockaddr *)&address, &address_len) == 0) {
+        listen_address_format((struct sockaddr *)&address, listener->name, sizeof(listener->name));
+    }
+    listener->socket = server_desc;
+    return 0;
+}
 
-        if (path != NULL) {
-            const char *content_type = get_content_type(url, path);
-            string content = render_page(context, path);
-            response = make_response(HTTP_STATUS_200, content_type, content);
-            string_free(content);
-        } else {
-            char *page_404_path = resource_path("/404");
-            if (page_404_path != NULL) {
-                const char *content_type = get_content_type(url, page_404_path);
-                string content = render_page(context, page_404_path);
-                response = make_response(HTTP_STATUS_404, content_type, content);
-                string_free(content);
-            } else {
-                string not_found = string_make("File not found.");
-                response = make_response(HTTP_STATUS_404, content_type_text, not_found);
-                string_free(not_found);
+// Opens the listeners from "listen" in config.json, by default one for all
+// IPv4 interfaces on the port. Handed over sockets are taken first and the
+// ones that are not needed any more are closed before new addresses are
+// bound, so changed addresses take effect on restart.
+static int listeners_open(cJSON *config, int port, int *handed, int handed_count) {
+    cJSON *listen_config = cJSON_GetObjectItem(config, "listen");
+    bool list = cJSON_IsArray(listen_config);
+    int count = list ? cJSON_GetArraySize(listen_config) : 1;
+    if (count > LISTENERS_MAX) {
+        fprintf(stderr, "Only the first %d listen addresses are used\n", LISTENERS_MAX);
+        count = LISTENERS_MAX;
+    }
+    server.listener_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < count; i++) {
+            // An address, a port, or an object with "address", "proxy_protocol"
+            // and "mode" for Unix socket files
+            cJSON *entry = list ? cJSON_GetArrayItem(listen_config, i) : listen_config;
+            char port_text[16];
+            snprintf(port_text, sizeof(port_text), "%d", cJSON_IsNumber(entry) ? entry->valueint : port);
+            const char *text = cJSON_IsString(entry) ? entry->valuestring : read_string(entry, "address", port_text);
+            struct listener *listener = &server.listeners[i];
+            if (pass == 1 && listener->socket >= 0) continue;
+            memset(listener, 0, sizeof(*listener));
+            listener->socket = -1;
+            listener->proxy_protocol = read_bool(entry, "proxy_protocol", false);
+            if (listener_open(listener, text, read_string(entry, "mode", NULL), handed, handed_count, pass == 0) != 0) {
+                return -1;
             }
         }
+        for (int i = 0; i < handed_count; i++) {
+            if (handed[i] >= 0) close(handed[i]);
+            handed[i] = -1;
+        }
+    }
+    server.listener_count = count;
+    return server.listener_count > 0 ? 0 : -1;
+}
 
-        // char *context_value = cJSON_Print(context);
-        // printf("Context:\n%s\n", context_value);
-        // free(context_value);
-        cJSON_free(context);
+// Closes the listeners; Unix socket files are removed unless a new
+// instance took them over
+static void listeners_close() {
+    for (int i = 0; i < server.listener_count; i++) {
+        struct listener *listener = &server.listeners[i];
+        close(listener->socket);
+        if (listener->unix_socket && !server.handed_off) unlink(listener->name + strlen("unix:"));
+    }
+    server.listener_count = 0;
+}
 
-        int send_result = send(socket_desc, response.value, response.length, 0);
-        if (send_result < 0) {
-            perror("send failed.\n");
-            exit(EXIT_FAILURE);
-        }
-        string_free(response);
+// Sends file descriptors over a Unix socket
+static int send_descriptors(int socket_desc, const int *descriptors, int count) {
+    char data = 'L';
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * LISTENERS_MAX)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer, .msg_controllen = CMSG_SPACE(sizeof(int) * count)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), descriptors, sizeof(int) * count);
+    return sendmsg(socket_desc, &message, 0) == 1 ? 0 : -1;
+}
 
-        // Close the connection
+// Receives file descriptors sent with send_descriptors; returns their
+// number, -1 on failure
+static int receive_descriptors(int socket_desc, int *descriptors, int max) {
+    char data;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * LISTENERS_MAX)];
+    } control;
+    struct msghdr message = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)
+    };
+    if (recvmsg(socket_desc, &message, 0) != 1) return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    int received[LISTENERS_MAX];
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(received, CMSG_DATA(cmsg), sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        if (i < max) descriptors[i] = received[i];
+        else close(received[i]);
+    }
+    return count < max ? count : max;
+}
+
+// Connects to a control socket; returns the connected socket or -1
+static int control_connect(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, socket_path);
+    int socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_desc < 0) return -1;
+    if (connect(socket_desc, (struct sockaddr *)&address, sizeof(address)) != 0) {
         close(socket_desc);
+        return -1;
     }
+    return socket_desc;
 }
 
-// WARNING: Refactor the code and store running servers in a file
-//          or get via IPC.
-int get_pid_path(pid_t pid, char *path) {
-    char command[256];
-    char line[MAX_PATH_LEN];    // Buffer for command output
-    char *last_arg = NULL;      // that should point to the last argument
-    snprintf(command, sizeof(command), "ps -p %d -o args", pid);
-    FILE *fp = popen(command, "r");
-    if (fp == NULL) return -1;
+int control_handoff(const char *socket_path, int *descriptors, int max) {
+    int socket_desc = control_connect(socket_path);
+    if (socket_desc < 0) return -1;
+    const char *command = "handoff\n";
+    int count = -1;
+    if (send(socket_desc, command, strlen(command), 0) == (ssize_t)strlen(command)) {
+        count = receive_descriptors(socket_desc, descriptors, max);
+    }
+    close(socket_desc);
+    return count;
+}
 
-    while (fgets(line, sizeof(line)-1, fp) != NULL) {
-        char *token = strtok(line, " ");
-        while (token != NULL) {
-            last_arg = token; // Keep updating last_arg until the end
-            token = strtok(NULL, " ");
+// Handles one control connection
+static void control_command(int client) {
+    char command[64];
+    ssize_t length = recv(client, command, sizeof(command) - 1, 0);
+    if (length <= 0) return;
+    command[length] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+
+    if (strcmp(command, "handoff") == 0) {
+        // Pass the listening sockets to the new instance, then stop accepting
+        // connections; the worker finishes the request it is processing
+        int descriptors[LISTENERS_MAX];
+        for (int i = 0; i < server.listener_count; i++) descriptors[i] = server.listeners[i].socket;
+        if (send_descriptors(client, descriptors, server.listener_count) != 0) {
+            perror("Failed to hand off the listening sockets");
+            return;
+        }
+        server.handed_off = true;
+        server_stop();
+    } else if (strcmp(command, "stats") == 0) {
+        uint64_t requests = metrics_requests();
+        cJSON *stats = cJSON_CreateObject();
+        cJSON_AddNumberToObject(stats, "pid", server.pid);
+        cJSON_AddStringToObject(stats, "path", server.path);
+        cJSON_AddNumberToObject(stats, "port", server.port);
+        cJSON_AddNumberToObject(stats, "uptime", difftime(time(NULL), server.started));
+        cJSON_AddNumberToObject(stats, "requests", requests);
+        cJSON_AddNumberToObject(stats, "requests_per_second", stats_rate(requests));
+        cJSON_AddNumberToObject(stats, "rss", resident_memory());
+        uint64_t cache_hits, cache_misses;
+        file_cache_stats(&cache_hits, &cache_misses, NULL, NULL);
+        if (cache_hits + cache_misses > 0) {
+            cJSON_AddNumberToObject(stats, "cache_hit_rate", (double)cache_hits / (cache_hits + cache_misses));
+        }
+        cJSON *memory = cJSON_AddObjectToObject(stats, "memory");
+        cJSON_AddNumberToObject(memory, "heap", memory_heap());
+        for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+            struct memory_stats memory_counts;
+            memory_stats(subsystem, &memory_counts);
+            cJSON *counts = cJSON_AddObjectToObject(memory, memory_subsystem_name(subsystem));
+            cJSON_AddNumberToObject(counts, "json_bytes", memory_counts.json_bytes);
+            cJSON_AddNumberToObject(counts, "json_allocations", memory_counts.json_allocations);
+            cJSON_AddNumberToObject(counts, "string_allocations", memory_counts.string_allocations);
+            cJSON_AddNumberToObject(counts, "string_bytes", memory_counts.string_bytes);
+        }
+        char *response = cJSON_PrintUnformatted(stats);
+        cJSON_Delete(stats);
+        if (response == NULL) return;
+        size_t length = strlen(response), sent = 0;
+        while (sent < length) {
+            ssize_t result = send(client, response + sent, length - sent, 0);
+            if (result <= 0) break;
+            sent += result;
         }
+        cJSON_free(response);
+    } else if (strcmp(command, "reload") == 0) {
+        server_reload();
+        send(client, "ok\n", 3, 0);
+    } else if (strcmp(command, "stop") == 0) {
+        send(client, "ok\n", 3, 0);
+        server_stop();
     }
-    if (last_arg == NULL) return -1;
-    strcpy(path, last_arg);
-    path[strcspn(path, "\n")] = 0;
-    return 0;
 }
 
-pid_t get_path_pid(char *path) {
-    FILE *fp;
-    char result[1024];
-    char server_path[MAX_PATH_LEN];
+static void *control_thread(void *arg) {
+    struct pollfd fds[4] = {
+        { .fd = server.control, .events = POLLIN },
+        { .fd = server.signals[0], .events = POLLIN },
+        { .fd = server.wake[0], .events = POLLIN },
+        { .fd = file_cache_descriptor(), .events = POLLIN }
+    };
+    stats_sample();
+    while (atomic_load(&server.running)) {
+        int poll_result = poll(fds, 4, STATS_INTERVAL);
+        stats_sample();
+        if (poll_result <= 0) continue;
+        // Changed pages: the metadata is collected again in the background
+        // and cached pages are checked against it
+        if ((fds[3].revents & POLLIN) && file_cache_events()) site_publish(site_load());
+        if (fds[1].revents & POLLIN) {
+            char signal_byte;
+            if (read(server.signals[0], &signal_byte, 1) == 1) {
+                if (signal_byte == 'r') {
+                    server_reload();
+                } else if (signal_byte == 'm') {
+                    memory_dump(stderr);
+                } else {
+                    server_stop();
+                }
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept(server.control, NULL, NULL);
+            if (client >= 0) {
+                control_command(client);
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
 
-    fp = popen("pgrep ^cserver", "r");
-    if (fp == NULL) {
-        printf("Failed to run command\n" );
-        exit(EXIT_FAILURE);
+// Opens the control socket and starts the control thread
+static int control_open(const char *socket_path) {
+    if (pipe(server.wake) != 0 || pipe(server.signals) != 0) {
+        perror("pipe failed");
+        return -1;
     }
 
-    while (fgets(result, sizeof(result)-1, fp) != NULL) {
-        pid_t pid = atoi(result);
-        memset(server_path, 0, MAX_PATH_LEN);
-        if (get_pid_path(pid, server_path) == 0) {
-            if (strcmp(trim_whitespace(server_path), path) == 0) {
-                pclose(fp);
-                return pid;
-            }
-        }
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, socket_path);
+    strcpy(server.control_path, socket_path);
+    // Left over from a process with the same pid
+    unlink(socket_path);
+    server.control = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.control < 0 ||
+        bind(server.control, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server.control, 8) != 0) {
+        perror("Failed to open control socket");
+        return -1;
     }
+    chmod(socket_path, 0600);
 
-    pclose(fp);
+    struct sigaction action = { .sa_handler = server_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (pthread_create(&server.control_thread, NULL, control_thread, NULL) != 0) {
+        perror("Failed to start control thread");
+        return -1;
+    }
     return 0;
 }
 
-int list_servers() {
-    FILE *fp;
-    char result[1024];
-    char path[MAX_PATH_LEN];
+// Stops the control thread and removes the instance from the registry
+static void control_close() {
+    if (server.control < 0) return;
+    server_stop();
+    pthread_join(server.control_thread, NULL);
+    close(server.control);
+    server.control = -1;
+    registry_remove(server.pid);
+}
 
-    fp = popen("pgrep ^cserver", "r");
-    if (fp == NULL) {
-        printf("Failed to run command\n" );
-        exit(EXIT_FAILURE);
-    }
+// Request processing /////////////////////////////////////////////////////////
 
-    printf("Running instances:\n");
-    while (fgets(result, sizeof(result)-1, fp) != NULL) {
-        int pid = atoi(result);
-        memset(path, 0, MAX_PATH_LEN);
-        get_pid_path(pid, path);
-        printf("%i %s\n", pid, path);
-    }
 
-    pclose(fp);
-    return EXIT_SUCCESS;
+bool request_complete(const char *request, size_t length) {
+    // The HTTP/2 preface contains an empty line before its end
+    if (length < 24 && strncmp(request, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", length) == 0) return false;
+    return length >= REQUEST_BUFFER_SIZE - 1 || strstr(request, "\r\n\r\n") != NULL;
 }
 
-int restart_server(char *path) {
-    pid_t pid = get_path_pid(path);
-    if (pid == 0) {
-        perror("Error: No running server found for the provided path");
-        exit(EXIT_FAILURE);
+void parse_request_line(const char *request, char *method, char *url) {
+    method[0] = url[0] = '\0';
+    sscanf(request, "%7s %1023s", method, url);
+}
+
+// Renders a page or sends a cached file; `links` are the preloads of a
+// rendered page, NULL if there are none
+static string file_response(struct site *site, cJSON *context, char *http_status, struct file_cache_entry *file,
+                            const char *links, struct access_log_entry *log_entry) {
+    string response;
+    uint64_t stage_start;
+    // Cache policy applies to the file's own URL only, not to the 404 page
+    const char *headers = strcmp(http_status, HTTP_STATUS_200) == 0 && file->headers ? file->headers : "";
+    if (file->map) {
+        // Small static files are served from memory without file system access
+        substring content = { .value = (char *)file->map, .length = file->size };
+        stage_start = metrics_now();
+        response = make_response_headers(http_status, file->content_type, headers, content);
+        metrics_record(STAGE_RESPONSE, stage_start);
+        log_entry->bytes = content.length;
+        return response;
     }
-    if (kill(pid, SIGTERM) == -1) {
-        perror("Error sending SIGTERM");
-        exit(EXIT_FAILURE);
+#ifdef CSERVER_LUA
+    if (strends(file->path, ".lua") == 0) {
+        return lua_response(context, http_status, file, log_entry);
     }
-    waitpid(pid, NULL, 0);
-    
-    return start_server(path, false);
+#endif
+    string content;
+    char *page_headers = NULL;
+    if (file->rendered) {
+        // Rendered pages are cached for their own URL only, not as 404 pages
+        bool found = strcmp(http_status, HTTP_STATUS_200) == 0;
+        content = found ? page_cache_render(site, context, file) : render_page(site, context, file->path);
+        // Preloads sent with 103 Early Hints are repeated in the response
+        if (links && (page_headers = malloc(strlen(headers) + strlen(links) + 1)) != NULL) {
+            sprintf(page_headers, "%s%s", headers, links);
+            headers = page_headers;
+        }
+    } else {
+        stage_start = metrics_now();
+        content = file_cache_read(file);
+        metrics_record(STAGE_READ_FILE, stage_start);
+    }
+    stage_start = metrics_now();
+    response = make_response_headers(http_status, file->content_type, headers, content);
+    metrics_record(STAGE_RESPONSE, stage_start);
+    log_entry->bytes = content.length;
+    string_free(content);
+    free(page_headers);
+    return response;
 }
 
-int stop_server(char *id) {
-    // TODO: Make sure it kills only cserevr processes
-    int pid = atoi(id);
-    if (kill(pid, SIGTERM) == -1) {
-        perror("Error sending SIGTERM");
-        exit(EXIT_FAILURE);
+string process_request(struct site *site, char *method, char *url, struct file_cache_entry *file,
+                       const char *links, struct access_log_entry *log_entry) {
+    enum memory_subsystem previous = memory_enter(MEMORY_REQUEST);
+    struct site *previous_site = site_enter(site);
+    cJSON *context = cJSON_CreateObject();
+    add_request(context, method, url, file ? file->path : NULL);
+    // References: the site is shared with other requests and may outlive
+    // this context or be freed after a reload
+    cJSON_AddItemReferenceToObject(context, "config", site->config);
+    cJSON_AddItemReferenceToObject(context, "site", site->metadata);
+
+    string response;
+
+    if (site->metrics_path[0] != '\0' && strcmp(url, site->metrics_path) == 0) {
+        string content = metrics_render();
+        uint64_t stage_start = metrics_now();
+        response = make_response(HTTP_STATUS_200, "text/plain; version=0.0.4", content);
+        metrics_record(STAGE_RESPONSE, stage_start);
+        log_entry->status = 200;
+        log_entry->bytes = content.length;
+        string_free(content);
+    } else if (file != NULL) {
+        log_entry->status = 200;
+        response = file_response(site, context, HTTP_STATUS_200, file, links, log_entry);
+    } else {
+        log_entry->status = 404;
+        struct file_cache_entry *page_404 = site_file(site, "/404", NULL);
+        if (page_404 != NULL) {
+            response = file_response(site, context, HTTP_STATUS_404, page_404, NULL, log_entry);
+            file_cache_release(page_404);
+        } else {
+            string not_found = string_make("File not found.");
+            response = make_response(HTTP_STATUS_404, content_type_text, not_found);
+            log_entry->bytes = not_found.length;
+            string_free(not_found);
+        }
     }
-    return EXIT_SUCCESS;
-}
 
-///////////////////////////////////////////////////////////////////////////////
+    cJSON_Delete(context);
+    site_enter(previous_site);
+    memory_leave(previous);
+    return response;
+}
 
-void append_path(char *result, size_t result_len, char *p1, char *p2) {
-    if (!p1) {
-        snprintf(result, result_len, "%s", p2);
-    } else if (!p2) {
-        snprintf(result, result_len, "%s", p1);
+// Records metrics and writes the access log entry and the trace of a
+// finished request
+static void finish_request(struct access_log_entry *log_entry, const char *request,
+                           const char *method, const char *url, struct trace *trace,
+                           uint64_t request_start, size_t received, size_t sent) {
+    uint64_t request_end = metrics_record(STAGE_REQUEST, request_start);
+    metrics_count_response(log_entry->status, received, sent);
+    log_entry->duration_us = (request_end - request_start) / 1000;
+    snprintf(log_entry->method, sizeof(log_entry->method), "%s", method);
+    snprintf(log_entry->url, sizeof(log_entry->url), "%s", url);
+    // The version ends the request line; HTTP/2 streams get one as well
+    const char *line_end = strstr(request, "\r\n");
+    const char *version = line_end;
+    while (version != NULL && version > request && version[-1] != ' ') version--;
+    if (version != NULL && strncmp(version, "HTTP/", 5) == 0 && line_end - version < (long)sizeof(log_entry->protocol)) {
+        snprintf(log_entry->protocol, sizeof(log_entry->protocol), "%.*s", (int)(line_end - version), version);
     } else {
-        snprintf(result, result_len, "%s/%s", p1, p2);
+        strcpy(log_entry->protocol, "HTTP/1.1");
     }
+    request_header(request, "Referer", log_entry->referer, sizeof(log_entry->referer));
+    request_header(request, "User-Agent", log_entry->user_agent, sizeof(log_entry->user_agent));
+    trace_finish(trace, log_entry, method, url, request_start);
+    access_log_write(0, log_entry);
 }
 
-void to_lowercase_and_dash(char *output, const char *input) {
-    while (*input) {
-        if (isspace((unsigned char)*input)) {
-            *output = '-';
-        } else {
-            *output = tolower((unsigned char)*input);
+// Returns the current site, replacing the worker's reference after a reload
+static struct site *worker_site(struct site *site) {
+    if (site != atomic_load_explicit(&current_site, memory_order_acquire)) {
+        site_release(site);
+        site = site_acquire();
+    }
+    return site;
+}
+
+
+// Timers /////////////////////////////////////////////////////////////////////
+
+
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_RANGE (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick) {
+    wheel->tick = tick;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
         }
-        output++;
-        input++;
     }
-    *output = '\0';
 }
 
-void store_metadata(cJSON *metadata, char *key, char *value, char *filename) {
-    if (!cJSON_HasObjectItem(metadata, key)) {
-        cJSON_AddObjectToObject(metadata, key);
+uint64_t timer_tick() {
+    return metrics_now() / (TIMER_TICK * 1000000ULL);
+}
+
+// Puts the timer into the slot of the coarsest level that still tells its
+// expiry apart from now; coarse slots are spread over finer ones later
+static void timer_link(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel->tick) expires = wheel->tick;
+    if (expires - wheel->tick >= TIMER_RANGE) expires = wheel->tick + TIMER_RANGE - 1;
+    uint64_t delta = expires - wheel->tick;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_LEVEL_BITS * (level + 1))) level++;
+    struct timer *head = &wheel->slots[level][(expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->prev = head;
+    timer->next = head->next;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+static void timer_unlink(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t expires) {
+    if (timer->next) {
+        timer_unlink(timer);
+    } else {
+        wheel->count++;
     }
-    cJSON *key_json = cJSON_GetObjectItem(metadata, key);
+    // The current slot has been processed already
+    timer->expires = expires > wheel->tick ? expires : wheel->tick + 1;
+    timer_link(wheel, timer);
+}
 
-    if (strcmp(key, "slug") == 0) {                             // "slug": { "slug-value": "filename" }
-        cJSON_AddStringToObject(key_json, value, filename);     
-    } else if (strcmp(key, "published") == 0) {                 // "published": { "filename": "date" }
-        cJSON_AddStringToObject(key_json, filename, value);     
-    } else if (strcmp(key, "tags") == 0) {                      // "tags": { "name": ["filename", ...]  }
-        char *tag = strtok(value, ",");
-        while (tag != NULL) {
-            trim_whitespace(tag);
-            if (!cJSON_HasObjectItem(key_json, tag)) {
-                cJSON_AddArrayToObject(key_json, tag);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if (timer->next == NULL) return;
+    timer_unlink(timer);
+    wheel->count--;
+}
+
+void timer_advance(struct timer_wheel *wheel, uint64_t tick, timer_callback expired, void *data) {
+    if (wheel->count == 0 && tick > wheel->tick) wheel->tick = tick;
+    while (wheel->tick < tick) {
+        wheel->tick++;
+        // Spread the coarse slots that start now, the coarsest first
+        for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+            if (wheel->tick & ((1ULL << (TIMER_LEVEL_BITS * level)) - 1)) continue;
+            struct timer *head = &wheel->slots[level][(wheel->tick >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+            struct timer *timer = head->next;
+            head->next = head->prev = head;
+            while (timer != head) {
+                struct timer *next = timer->next;
+                timer_link(wheel, timer);
+                timer = next;
             }
-            cJSON *tag_array = cJSON_GetObjectItem(key_json, tag);
-            cJSON_AddItemToArray(tag_array, cJSON_CreateString(filename));
-            tag = strtok(NULL, ",");
         }
-    } else {                                                    // "category": { "name": ["filename", ...]},
-        if (!cJSON_HasObjectItem(key_json, value)) {            // "author": { "name": ["filename", ...] }, ...
-            cJSON_AddArrayToObject(key_json, value);
+
+        // Detach the due slot first: callbacks may schedule timers
+        struct timer *head = &wheel->slots[0][wheel->tick & (TIMER_SLOTS - 1)];
+        if (head->next == head) continue;
+        struct timer due = { .next = head->next, .prev = head->prev };
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        while (due.next != &due) {
+            struct timer *timer = due.next;
+            timer_unlink(timer);
+            wheel->count--;
+            expired(timer, data);
         }
-        cJSON *value_array = cJSON_GetObjectItem(key_json, value);
-        cJSON_AddItemToArray(value_array, cJSON_CreateString(filename));
     }
 }
 
-void process_file(cJSON *metadata, cJSON *files, const char *filename, const char *relative_name) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Failed to open file");
-        return;
+
+// Listeners //////////////////////////////////////////////////////////////////
+
+
+int listen_address_parse(const char *text, struct sockaddr_storage *address, socklen_t *address_len) {
+    memset(address, 0, sizeof(*address));
+    if (strncmp(text, "unix:", 5) == 0) {
+        struct sockaddr_un *unix_address = (struct sockaddr_un *)address;
+        const char *path = text + 5;
+        if (path[0] == '\0' || strlen(path) >= sizeof(unix_address->sun_path)) return -1;
+        unix_address->sun_family = AF_UNIX;
+        strcpy(unix_address->sun_path, path);
+        *address_len = sizeof(*unix_address);
+        return 0;
     }
 
-    // Store relative paths only, 
-    // /path/to/file.md -> /file
-    // /path/to/file/index.md -> /file
-    // Remove the file extension if present
-    char *file_without_ext = strdup(relative_name);
-    char *dot = strrchr(file_without_ext, '.');
-    if (dot) {
-        *dot = '\0';
+    // The host is everything before the last colon; IPv6 hosts are in brackets
+    char host[INET6_ADDRSTRLEN] = "";
+    const char *port_text = text;
+    bool ipv6 = text[0] == '[';
+    if (ipv6) {
+        const char *end = strchr(text, ']');
+        if (end == NULL || end[1] != ':' || (size_t)(end - text - 1) >= sizeof(host)) return -1;
+        memcpy(host, text + 1, end - text - 1);
+        port_text = end + 2;
+    } else if (strchr(text, ':') != NULL) {
+        const char *colon = strrchr(text, ':');
+        if ((size_t)(colon - text) >= sizeof(host)) return -1;
+        memcpy(host, text, colon - text);
+        port_text = colon + 1;
     }
-    // Remove "/index" part if it exists
-    char *index_part = strstr(file_without_ext, "/index");
-    if (index_part) {
-        *index_part = '\0';
+    char *end;
+    long port = strtol(port_text, &end, 10);
+    if (port_text[0] == '\0' || *end != '\0' || port < 0 || port > 65535) return -1;
+
+    if (ipv6) {
+        struct sockaddr_in6 *ipv6_address = (struct sockaddr_in6 *)address;
+        ipv6_address->sin6_family = AF_INET6;
+        ipv6_address->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, host, &ipv6_address->sin6_addr) != 1) return -1;
+        *address_len = sizeof(*ipv6_address);
+    } else {
+        struct sockaddr_in *ipv4_address = (struct sockaddr_in *)address;
+        ipv4_address->sin_family = AF_INET;
+        ipv4_address->sin_port = htons(port);
+        ipv4_address->sin_addr.s_addr = INADDR_ANY;
+        if (host[0] != '\0' && strcmp(host, "*") != 0 &&
+            inet_pton(AF_INET, host, &ipv4_address->sin_addr) != 1) return -1;
+        *address_len = sizeof(*ipv4_address);
     }
+    return 0;
+}
 
-    // Store initial value in files object
-    char *bare_filename = strrchr(file_without_ext, '/') ? strrchr(file_without_ext, '/') + 1 : file_without_ext;
-    cJSON_AddStringToObject(files, file_without_ext, bare_filename);
-
-    char line[1024];
-    int metadata_section = 0;
-    while (fgets(line, sizeof(line), file)) {
-        if (strcmp(line, "---\n") == 0) {
-            metadata_section = !metadata_section;  // Toggle metadata section state
-            if (!metadata_section) {               // End of metadata section
-                break;
-            }
-        } else if (metadata_section) {
-            char *colon = strchr(line, ':');
-            if (colon) {
-                *colon = '\0';                     // Split the string into key and value
-                char *key = line;
-                char *value = colon + 1;
-                key = trim_whitespace(key);
-                value = trim_whitespace(value);
-                // Store title directly into files object
-                if (strcmp(key, "title") == 0) {
-                    cJSON_ReplaceItemInObject(files, file_without_ext, cJSON_CreateString(value));
-                }
-                store_metadata(metadata, key, value, file_without_ext);
-            }
-        }
+void listen_address_format(const struct sockaddr *address, char *name, size_t name_len) {
+    char host[INET6_ADDRSTRLEN];
+    if (address->sa_family == AF_UNIX) {
+        snprintf(name, name_len, "unix:%s", ((const struct sockaddr_un *)address)->sun_path);
+    } else if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *ipv6_address = (const struct sockaddr_in6 *)address;
+        inet_ntop(AF_INET6, &ipv6_address->sin6_addr, host, sizeof(host));
+        snprintf(name, name_len, "[%s]:%u", host, ntohs(ipv6_address->sin6_port));
+    } else if (address->sa_family == AF_INET) {
+        const struct sockaddr_in *ipv4_address = (const struct sockaddr_in *)address;
+        inet_ntop(AF_INET, &ipv4_address->sin_addr, host, sizeof(host));
+        snprintf(name, name_len, "%s:%u", host, ntohs(ipv4_address->sin_port));
+    } else {
+        snprintf(name, name_len, "-");
     }
+}
 
-    fclose(file);
-    free(file_without_ext);
+// Maps an IPv4 address to ::ffff:a.b.c.d
+static void client_address_ipv4(struct client_address *address, const void *ipv4) {
+    memset(address->bytes, 0, 10);
+    address->bytes[10] = address->bytes[11] = 0xFF;
+    memcpy(address->bytes + 12, ipv4, 4);
 }
 
-void collect_metadata(cJSON *metadata, char *base_path, char *path) {
-    char full_path[MAX_PATH_LEN];
-    append_path(full_path, sizeof(full_path), base_path, path);
-    DIR *dir = opendir(full_path);
-    if (!dir) {
-        perror("Failed to open directory");
-        return;
+void client_address_set(struct client_address *address, const struct sockaddr *peer) {
+    memset(address, 0, sizeof(*address));
+    if (peer == NULL) return;
+    if (peer->sa_family == AF_INET) {
+        client_address_ipv4(address, &((const struct sockaddr_in *)peer)->sin_addr);
+    } else if (peer->sa_family == AF_INET6) {
+        memcpy(address->bytes, &((const struct sockaddr_in6 *)peer)->sin6_addr, 16);
     }
+}
 
-    cJSON *files = cJSON_GetObjectItem(metadata, "files");
-    if (!files) {
-        files = cJSON_CreateObject();
-        cJSON_AddItemToObject(metadata, "files", files);
+int client_address_parse(struct client_address *address, const char *text) {
+    uint8_t ipv4[4];
+    if (inet_pton(AF_INET, text, ipv4) == 1) {
+        client_address_ipv4(address, ipv4);
+        return 0;
     }
+    if (inet_pton(AF_INET6, text, address->bytes) == 1) return 0;
+    memset(address, 0, sizeof(*address));
+    return -1;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
+bool client_address_unknown(const struct client_address *address) {
+    static const struct client_address unknown;
+    return memcmp(address, &unknown, sizeof(unknown)) == 0;
+}
 
-            char new_path[1024];
-            append_path(new_path, sizeof(new_path), path, entry->d_name);
-            collect_metadata(metadata, base_path, new_path);
-        } else if (entry->d_type == DT_REG) {
-            char *dot = strrchr(entry->d_name, '.');
-            if (dot && strcmp(dot, ".md") == 0) {
-                char filename[1024];
-                append_path(filename, sizeof(filename), full_path, entry->d_name);
-                char relative_name[1024];
-                append_path(relative_name, sizeof(relative_name), path, entry->d_name);
-                process_file(metadata, files, filename, relative_name);
-            }
-        }
+void client_address_format(const struct client_address *address, char *text, size_t text_len) {
+    static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    char buffer[INET6_ADDRSTRLEN];
+    if (client_address_unknown(address)) {
+        snprintf(text, text_len, "-");
+    } else if (memcmp(address->bytes, mapped, sizeof(mapped)) == 0) {
+        inet_ntop(AF_INET, address->bytes + 12, buffer, sizeof(buffer));
+        snprintf(text, text_len, "%s", buffer);
+    } else {
+        inet_ntop(AF_INET6, address->bytes, buffer, sizeof(buffer));
+        snprintf(text, text_len, "%s", buffer);
     }
-
-    closedir(dir);
 }
 
-void create_index(cJSON *metadata) {
-    cJSON *index = cJSON_CreateObject();
-    cJSON *categories = cJSON_CreateArray();
+// Signature that starts PROXY protocol v2 headers
+static const char proxy_signature[12] = "\r\n\r\n\0\r\nQUIT\n";
+
+int proxy_header_parse(const char *data, size_t length, struct client_address *address) {
+    if (length > 0 && data[0] == '\r') {
+        // v2: signature, version and command, family, length, addresses
+        if (memcmp(data, proxy_signature, length < 12 ? length : 12) != 0) return -1;
+        if (length < 16) return 0;
+        const uint8_t *header = (const uint8_t *)data;
+        if ((header[12] & 0xF0) != 0x20 || (header[12] & 0x0F) > 1) return -1;
+        size_t total = 16 + ((size_t)header[14] << 8 | header[15]);
+        if (total > PROXY_HEADER_MAX) return -1;
+        if (length < total) return 0;
+        // LOCAL connections come from the proxy itself, health checks
+        bool proxied = (header[12] & 0x0F) == 1;
+        if (proxied && header[13] >> 4 == 1 && total >= 16 + 12) {
+            client_address_ipv4(address, header + 16);
+        } else if (proxied && header[13] >> 4 == 2 && total >= 16 + 36) {
+            memcpy(address->bytes, header + 16, 16);
+        }
+        return total;
+    }
+
+    // v1: "PROXY TCP4 <source> <destination> <source port> <destination port>\r\n"
+    if (memcmp(data, "PROXY ", length < 6 ? length : 6) != 0) return -1;
+    const char *end = memchr(data, '\n', length < 107 ? length : 107);
+    if (end == NULL) return length < 107 ? 0 : -1;
+    if (end - data < 7 || end[-1] != '\r') return -1;
+    char line[108];
+    memcpy(line, data, end - data - 1);
+    line[end - data - 1] = '\0';
+    char protocol[8], source[INET6_ADDRSTRLEN];
+    int fields = sscanf(line, "PROXY %7s %45s", protocol, source);
+    if (fields < 1) return -1;
+    if (strcmp(protocol, "TCP4") == 0 || strcmp(protocol, "TCP6") == 0) {
+        struct client_address parsed;
+        uint8_t ipv4[4];
+        if (fields < 2) return -1;
+        if (protocol[3] == '4') {
+            if (inet_pton(AF_INET, source, ipv4) != 1) return -1;
+            client_address_ipv4(&parsed, ipv4);
+        } else if (inet_pton(AF_INET6, source, parsed.bytes) != 1) {
+            return -1;
+        }
+        *address = parsed;
+    } else if (strcmp(protocol, "UNKNOWN") != 0) {
+        return -1;
+    }
+    return end - data + 1;
+}
+
+
+// Connection limits //////////////////////////////////////////////////////////
+
+
+static _Atomic unsigned long connections_rejected = 0;
+static _Atomic unsigned long connections_timed_out = 0;
+
+// Reads a limit; negative values count as 0
+static unsigned limits_read(cJSON *limits_config, char *name, int default_value) {
+    int value = read_int(limits_config, name, default_value);
+    return value > 0 ? (unsigned)value : 0;
+}
+
+int limits_init(struct connection_limits *limits, cJSON *config) {
+    cJSON *limits_config = cJSON_GetObjectItem(config, "limits");
+    memset(limits, 0, sizeof(*limits));
+    limits->max_connections = limits_read(limits_config, "connections", LIMIT_CONNECTIONS);
+    limits->max_per_client = limits_read(limits_config, "connections_per_client", LIMIT_CONNECTIONS_PER_CLIENT);
+    limits->header_timeout = limits_read(limits_config, "header_timeout", LIMIT_HEADER_TIMEOUT) / TIMER_TICK;
+    limits->write_timeout = limits_read(limits_config, "write_timeout", LIMIT_WRITE_TIMEOUT) / TIMER_TICK;
+    limits->min_rate = limits_read(limits_config, "min_rate", LIMIT_MIN_RATE);
+    // Timeouts below a tick still need one
+    if (limits->header_timeout == 0 && read_int(limits_config, "header_timeout", LIMIT_HEADER_TIMEOUT) > 0) {
+        limits->header_timeout = 1;
+    }
+    if (limits->write_timeout == 0 && read_int(limits_config, "write_timeout", LIMIT_WRITE_TIMEOUT) > 0) {
+        limits->write_timeout = 1;
+    }
+
+    if (limits->max_per_client > 0) {
+        // Open addressing, at most half full; without a global cap the
+        // table starts at the default one and grows
+        unsigned connections = limits->max_connections > 0 ? limits->max_connections : LIMIT_CONNECTIONS;
+        limits->client_slots = 1;
+        while (limits->client_slots < (size_t)connections * 2) limits->client_slots <<= 1;
+        limits->clients = calloc(limits->client_slots, sizeof(*limits->clients));
+        if (limits->clients == NULL) return -1;
+    }
+    return 0;
+}
+
+void limits_free(struct connection_limits *limits) {
+    free(limits->clients);
+    limits->clients = NULL;
+}
+
+// FNV-1a of the address bytes
+static size_t limits_hash(const struct client_address *address) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 16; i++) hash = (hash ^ address->bytes[i]) * 16777619u;
+    return hash;
+}
+
+static size_t limits_slot(struct connection_limits *limits, const struct client_address *address) {
+    size_t slot = limits_hash(address) & (limits->client_slots - 1);
+    while (limits->clients[slot].count > 0 &&
+           memcmp(&limits->clients[slot].address, address, sizeof(*address)) != 0) {
+        slot = (slot + 1) & (limits->client_slots - 1);
+    }
+    return slot;
+}
+
+// Doubles the client table; false if it cannot be allocated
+static bool limits_grow(struct connection_limits *limits) {
+    struct connection_limits grown = *limits;
+    grown.client_slots = limits->client_slots * 2;
+    grown.clients = calloc(grown.client_slots, sizeof(*grown.clients));
+    if (grown.clients == NULL) return false;
+    for (size_t i = 0; i < limits->client_slots; i++) {
+        if (limits->clients[i].count > 0) grown.clients[limits_slot(&grown, &limits->clients[i].address)] = limits->clients[i];
+    }
+    free(limits->clients);
+    limits->clients = grown.clients;
+    limits->client_slots = grown.client_slots;
+    return true;
+}
+
+// Counts a connection of a known client; false if it is at its cap
+static bool limits_client_add(struct connection_limits *limits, const struct client_address *address) {
+    if (limits->clients == NULL || client_address_unknown(address)) return true;
+    size_t slot = limits_slot(limits, address);
+    if (limits->clients[slot].count >= limits->max_per_client) return false;
+    if (limits->clients[slot].count == 0) {
+        // Keep the table at most half full
+        if ((limits->client_count + 1) * 2 > limits->client_slots) {
+            if (!limits_grow(limits)) return false;
+            slot = limits_slot(limits, address);
+        }
+        limits->client_count++;
+    }
+    limits->clients[slot].address = *address;
+    limits->clients[slot].count++;
+    return true;
+}
+
+static void limits_client_remove(struct connection_limits *limits, const struct client_address *address) {
+    if (limits->clients == NULL || client_address_unknown(address)) return;
+    size_t slot = limits_slot(limits, address);
+    if (limits->clients[slot].count == 0 || --limits->clients[slot].count > 0) return;
+    limits->client_count--;
+
+    // Move later entries of the probe sequence into the freed slot
+    size_t mask = limits->client_slots - 1;
+    size_t next = (slot + 1) & mask;
+    while (limits->clients[next].count > 0) {
+        size_t home = limits_hash(&limits->clients[next].address) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            limits->clients[slot] = limits->clients[next];
+            limits->clients[next].count = 0;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+bool limits_admit(struct connection_limits *limits, const struct client_address *address) {
+    if ((limits->max_connections > 0 && limits->connections >= limits->max_connections) ||
+        !limits_client_add(limits, address)) {
+        atomic_fetch_add_explicit(&connections_rejected, 1, memory_order_relaxed);
+        return false;
+    }
+    limits->connections++;
+    return true;
+}
+
+void limits_release(struct connection_limits *limits, const struct client_address *address) {
+    limits->connections--;
+    limits_client_remove(limits, address);
+}
+
+bool limits_move(struct connection_limits *limits, const struct client_address *from,
+                 const struct client_address *to) {
+    if (!limits_client_add(limits, to)) {
+        atomic_fetch_add_explicit(&connections_rejected, 1, memory_order_relaxed);
+        return false;
+    }
+    limits_client_remove(limits, from);
+    return true;
+}
+
+bool limits_check_rate(struct connection_limits *limits, size_t sent, size_t total, size_t *checked) {
+    size_t required = (size_t)limits->min_rate * limits->write_timeout * TIMER_TICK / 1000;
+    // The rest of the response may be shorter than a full period's worth
+    if (required > total - *checked) required = total - *checked;
+    if (required == 0) required = 1;
+    bool progressing = sent >= *checked + required;
+    *checked = sent;
+    if (!progressing) atomic_fetch_add_explicit(&connections_timed_out, 1, memory_order_relaxed);
+    return progressing;
+}
+
+void limits_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t timeout) {
+    if (timeout > 0) {
+        timer_schedule(wheel, timer, timer_tick() + timeout);
+    } else {
+        timer_cancel(wheel, timer);
+    }
+}
+
+void limits_count_timeout() {
+    atomic_fetch_add_explicit(&connections_timed_out, 1, memory_order_relaxed);
+}
+
+void limits_stats(unsigned long *rejected, unsigned long *timed_out) {
+    *rejected = atomic_load_explicit(&connections_rejected, memory_order_relaxed);
+    *timed_out = atomic_load_explicit(&connections_timed_out, memory_order_relaxed);
+}
+
+// Sent to clients that did not finish their request headers in time
+const char *request_timeout_response =
+    "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+
+// Rate limits ////////////////////////////////////////////////////////////////
+
+
+static struct {
+    struct rate_limit_slot *slots;
+    size_t slot_count;              // power of two
+    _Atomic unsigned long limited;
+    _Atomic unsigned long evicted;
+} rate_limits;
+
+int rate_limits_init(cJSON *config) {
+    cJSON *rate_config = cJSON_GetObjectItem(config, "rate_limits");
+    if (rate_config == NULL) return -1;
+    size_t entries = read_int(rate_config, "entries", RATE_LIMIT_ENTRIES);
+    if (entries == 0) return -1;
+    rate_limits.slot_count = 1;
+    while (rate_limits.slot_count < entries) rate_limits.slot_count <<= 1;
+    rate_limits.slots = calloc(rate_limits.slot_count, sizeof(struct rate_limit_slot));
+    return rate_limits.slots ? 0 : -1;
+}
+
+bool rate_limits_enabled() {
+    return rate_limits.slots != NULL;
+}
+
+// Rule with the longest prefix of the URL, like cache_policy
+static cJSON *rate_limit_rule(cJSON *config, const char *url) {
+    cJSON *rules = cJSON_GetObjectItem(cJSON_GetObjectItem(config, "rate_limits"), "rules");
+    cJSON *rule = NULL;
+    size_t rule_length = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, rules) {
+        size_t length = strlen(item->string);
+        if (cJSON_IsObject(item) && length >= rule_length && strncmp(url, item->string, length) == 0) {
+            rule = item;
+            rule_length = length;
+        }
+    }
+    return rule;
+}
+
+// Refill times are kept in microseconds modulo 2^40, about 12 days
+#define RATE_LIMIT_TIME_MASK ((1ULL << 40) - 1)
+
+// Finds or claims the bucket of a key among the probed slots; NULL if
+// another worker takes the last candidate first
+static struct rate_limit_slot *rate_limit_slot(uint64_t key, uint64_t now) {
+    size_t mask = rate_limits.slot_count - 1;
+    size_t start = (key ^ (key >> 29)) * 0xBF58476D1CE4E5B9ULL >> 17;
+    struct rate_limit_slot *oldest = NULL;
+    uint64_t oldest_key = 0, oldest_age = 0;
+    for (size_t i = 0; i < RATE_LIMIT_PROBES; i++) {
+        struct rate_limit_slot *slot = &rate_limits.slots[(start + i) & mask];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (current == 0 && atomic_compare_exchange_strong(&slot->key, &current, key)) return slot;
+        if (current == key) return slot;
+        // Buckets are refilled on every request, so the refill time tells
+        // when the client was last seen
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        uint64_t age = state == 0 ? RATE_LIMIT_TIME_MASK : (now - (state >> 24)) & RATE_LIMIT_TIME_MASK;
+        if (oldest == NULL || age > oldest_age) {
+            oldest = slot;
+            oldest_key = current;
+            oldest_age = age;
+        }
+    }
+    if (oldest == NULL) return NULL;
+    if (!atomic_compare_exchange_strong(&oldest->key, &oldest_key, key)) return oldest_key == key ? oldest : NULL;
+    atomic_store_explicit(&oldest->state, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rate_limits.evicted, 1, memory_order_relaxed);
+    return oldest;
+}
+
+bool rate_limit_admit(cJSON *config, const struct client_address *address, const char *url,
+                      unsigned *retry_after) {
+    if (rate_limits.slots == NULL || client_address_unknown(address)) return true;
+    cJSON *rule = rate_limit_rule(config, url);
+    double rate = read_double(rule, "rate", 0);
+    if (rule == NULL || rate <= 0) return true;
+    // Tokens are kept in 1/256 in 24 bits
+    uint64_t capacity = read_double(rule, "burst", rate < 1 ? 1 : rate) * 256;
+    if (capacity < 256) capacity = 256;
+    if (capacity > 0xFFFFFF) capacity = 0xFFFFFF;
+    // Refill in 1/256 tokens per 1000 s, so that slow rates stay above 0
+    double refill_rate = rate * 256000;
+    uint64_t refill = refill_rate < 1 ? 1 : refill_rate > 1e15 ? 1000000000000000ULL : refill_rate;
+
+    // FNV-1a of the rule prefix and the address; 0 marks free slots
+    uint64_t key = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)rule->string; *c; c++) key = (key ^ *c) * 1099511628211ULL;
+    for (int i = 0; i < 16; i++) key = (key ^ address->bytes[i]) * 1099511628211ULL;
+    key |= 1;
+    uint64_t now = metrics_now() / 1000 & RATE_LIMIT_TIME_MASK;
+    struct rate_limit_slot *slot = rate_limit_slot(key, now);
+    if (slot == NULL) return true;
+
+    uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+    while (1) {
+        uint64_t tokens = capacity;
+        uint64_t stamp = now;
+        uint64_t elapsed = 0;
+        if (state != 0) {
+            stamp = state >> 24;
+            elapsed = (now - stamp) & RATE_LIMIT_TIME_MASK;
+            // Another thread may have stored a later time since `now` was read
+            if (elapsed > RATE_LIMIT_TIME_MASK / 2) elapsed = 0;
+            tokens = state & 0xFFFFFF;
+            if (tokens >= capacity || elapsed >= (capacity - tokens) * 1000000000 / refill) {
+                tokens = capacity;
+                if (elapsed > 0) stamp = now;
+                elapsed = 0;
+            } else {
+                // The stamp only moves by the time turned into whole 1/256,
+                // so that frequent requests keep the fractions
+                uint64_t gained = elapsed * refill / 1000000000;
+                uint64_t used = (gained * 1000000000 + refill - 1) / refill;
+                tokens += gained;
+                stamp = (stamp + used) & RATE_LIMIT_TIME_MASK;
+                elapsed -= used;
+            }
+        }
+        bool admitted = tokens >= 256;
+        // Denied requests refill too, so that a limited client stays recent
+        uint64_t next = stamp << 24 | (admitted ? tokens - 256 : tokens);
+        if (atomic_compare_exchange_weak_explicit(&slot->state, &state, next,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            if (!admitted) {
+                uint64_t wait = ((256 - tokens) * 1000000000 + refill - 1) / refill;
+                wait = wait > elapsed ? wait - elapsed : 0;
+                *retry_after = (wait + 999999) / 1000000;
+                if (*retry_after == 0) *retry_after = 1;
+                atomic_fetch_add_explicit(&rate_limits.limited, 1, memory_order_relaxed);
+            }
+            return admitted;
+        }
+    }
+}
+
+string rate_limit_response(unsigned retry_after, struct access_log_entry *log_entry) {
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Retry-After: %u\r\n", retry_after);
+    string content = string_make("Too many requests.");
+    string response = make_response_headers(HTTP_STATUS_429, content_type_text, headers, content);
+    log_entry->status = 429;
+    log_entry->bytes = content.length;
+    string_free(content);
+    return response;
+}
+
+void rate_limits_stats(unsigned long *limited, unsigned long *evicted) {
+    *limited = atomic_load_explicit(&rate_limits.limited, memory_order_relaxed);
+    *evicted = atomic_load_explicit(&rate_limits.evicted, memory_order_relaxed);
+}
+
+
+// HTTP/2 /////////////////////////////////////////////////////////////////////
+
+
+// Frame types, flags, settings and error codes (RFC 9113)
+enum h2_frame_type {
+    H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE, H2_PING,
+    H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+enum h2_setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE
+};
+enum h2_error {
+    H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_DEFAULT_WINDOW 65535
+#define H2_PREFACE_LENGTH 24
+
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static _Atomic unsigned long h2_connections = 0;
+static _Atomic unsigned long h2_streams = 0;
+
+static inline uint32_t h2_get32(const uint8_t *data) {
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+static inline void h2_put32(char *data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+// Grows the buffer by `length` bytes; returns the new region, NULL if out of memory
+static char *h2_buffer_extend(struct h2_buffer *buffer, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) capacity *= 2;
+        char *value = realloc(buffer->value, capacity);
+        if (value == NULL) return NULL;
+        buffer->value = value;
+        buffer->capacity = capacity;
+    }
+    char *region = buffer->value + buffer->length;
+    buffer->length += length;
+    return region;
+}
+
+static void h2_buffer_append(struct h2_buffer *buffer, const void *data, size_t length) {
+    char *region = h2_buffer_extend(buffer, length);
+    if (region != NULL) memcpy(region, data, length);
+}
+
+// Canonical Huffman code of RFC 7541 Appendix B: number of codes of each
+// length and the symbols ordered by code; 256 is EOS
+static const uint16_t hpack_huffman_counts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const uint16_t hpack_huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256
+};
+
+// RFC 7541 Appendix A
+#define HPACK_STATIC_ENTRIES 61
+static const char *hpack_static_table[HPACK_STATIC_ENTRIES][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+void hpack_table_init(struct hpack_table *table, size_t max_size) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = table->limit = max_size;
+}
+
+// Drops the oldest fields until the table fits into `size`
+static void hpack_evict(struct hpack_table *table, size_t size) {
+    size_t evicted = 0;
+    while (table->size > size && evicted < table->count) {
+        struct hpack_field *field = &table->fields[evicted++];
+        table->size -= field->name_length + field->value_length + 32;
+        free(field->name);
+    }
+    memmove(table->fields, table->fields + evicted, (table->count - evicted) * sizeof(struct hpack_field));
+    table->count -= evicted;
+}
+
+void hpack_table_free(struct hpack_table *table) {
+    hpack_evict(table, 0);
+    free(table->fields);
+    table->fields = NULL;
+    table->slots = 0;
+}
+
+static void hpack_insert(struct hpack_table *table, const char *name, size_t name_length,
+                         const char *value, size_t value_length) {
+    size_t size = name_length + value_length + 32;
+    if (size > table->max_size) {
+        // A field larger than the table empties it
+        hpack_evict(table, 0);
+        return;
+    }
+    // Copied before eviction: the name may refer to an evicted field
+    char *data = malloc(name_length + value_length + 2);
+    if (data == NULL) return;
+    memcpy(data, name, name_length);
+    data[name_length] = '\0';
+    memcpy(data + name_length + 1, value, value_length);
+    data[name_length + 1 + value_length] = '\0';
+    hpack_evict(table, table->max_size - size);
+    if (table->count == table->slots) {
+        size_t slots = table->slots ? table->slots * 2 : 16;
+        struct hpack_field *fields = realloc(table->fields, slots * sizeof(struct hpack_field));
+        if (fields == NULL) {
+            free(data);
+            return;
+        }
+        table->fields = fields;
+        table->slots = slots;
+    }
+    table->fields[table->count++] = (struct hpack_field){
+        .name = data, .name_length = name_length, .value = data + name_length + 1, .value_length = value_length
+    };
+    table->size += size;
+}
+
+// Static entries are looked up directly; dynamic index 62 is the newest field
+static int hpack_lookup(struct hpack_table *table, size_t index, substring *name, substring *value) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_ENTRIES) {
+        name->value = (char *)hpack_static_table[index - 1][0];
+        name->length = strlen(name->value);
+        value->value = (char *)hpack_static_table[index - 1][1];
+        value->length = strlen(value->value);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES;
+    if (index > table->count) return -1;
+    struct hpack_field *field = &table->fields[table->count - index];
+    *name = (substring){ .value = field->name, .length = field->name_length };
+    *value = (substring){ .value = field->value, .length = field->value_length };
+    return 0;
+}
+
+static int hpack_integer(const uint8_t **data, const uint8_t *end, int prefix, size_t *value) {
+    if (*data >= end) return -1;
+    size_t mask = (1u << prefix) - 1;
+    size_t result = *(*data)++ & mask;
+    if (result < mask) {
+        *value = result;
+        return 0;
+    }
+    for (int shift = 0; *data < end && shift <= 28; shift += 7) {
+        uint8_t byte = *(*data)++;
+        result += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int hpack_huffman_decode(const uint8_t *data, size_t length, char *output, size_t *output_length) {
+    size_t written = 0;
+    int code = 0, first = 0, index = 0, bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code |= (data[i] >> bit) & 1;
+            int count = hpack_huffman_counts[++bits];
+            if (code - count < first) {
+                int symbol = hpack_huffman_symbols[index + code - first];
+                if (symbol == 256) return -1;
+                output[written++] = symbol;
+                code = first = index = bits = 0;
+                continue;
+            }
+            if (bits == 30) return -1;
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    // Padding is a prefix of EOS: up to 7 one bits
+    if (bits > 7 || (code >> 1) != (1 << bits) - 1) return -1;
+    *output_length = written;
+    return 0;
+}
+
+// Reads a string literal into the scratch buffer; returns its offset, -1 on errors
+static long hpack_string(const uint8_t **data, const uint8_t *end, struct h2_buffer *scratch, size_t *length) {
+    bool huffman = *data < end && (**data & 0x80);
+    size_t encoded;
+    if (hpack_integer(data, end, 7, &encoded) != 0 || encoded > (size_t)(end - *data)) return -1;
+    size_t offset = scratch->length;
+    // Huffman codes are at least 5 bits long
+    char *output = h2_buffer_extend(scratch, huffman ? encoded * 8 / 5 + 1 : encoded);
+    if (output == NULL) return -1;
+    if (huffman) {
+        if (hpack_huffman_decode(*data, encoded, output, length) != 0) return -1;
+        scratch->length = offset + *length;
+    } else {
+        memcpy(output, *data, encoded);
+        *length = encoded;
+    }
+    *data += encoded;
+    return offset;
+}
+
+int hpack_decode(struct hpack_table *table, const uint8_t *data, size_t length,
+                 hpack_callback callback, void *callback_data) {
+    const uint8_t *end = data + length;
+    struct h2_buffer scratch = { 0 };
+    int result = 0;
+    while (data < end && result == 0) {
+        uint8_t byte = *data;
+        size_t index;
+        substring name, value;
+        scratch.length = 0;
+        if (byte & 0x80) {
+            // Indexed field
+            result = hpack_integer(&data, end, 7, &index) != 0 || hpack_lookup(table, index, &name, &value) != 0 ? -1 : 0;
+            if (result == 0) callback(callback_data, name, value);
+        } else if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update, up to the advertised size
+            if (hpack_integer(&data, end, 5, &index) != 0 || index > table->limit) {
+                result = -1;
+            } else {
+                table->max_size = index;
+                hpack_evict(table, index);
+            }
+        } else {
+            // Literal field: with incremental indexing, without indexing or never indexed
+            bool indexing = (byte & 0xc0) == 0x40;
+            long name_offset, value_offset;
+            size_t name_length, value_length;
+            if (hpack_integer(&data, end, indexing ? 6 : 4, &index) != 0) {
+                result = -1;
+                break;
+            }
+            if (index == 0) {
+                name_offset = hpack_string(&data, end, &scratch, &name_length);
+            } else if (hpack_lookup(table, index, &name, &value) == 0) {
+                name_offset = scratch.length;
+                name_length = name.length;
+                h2_buffer_append(&scratch, name.value, name.length);
+            } else {
+                name_offset = -1;
+            }
+            value_offset = name_offset < 0 ? -1 : hpack_string(&data, end, &scratch, &value_length);
+            if (value_offset < 0) {
+                result = -1;
+                break;
+            }
+            name = (substring){ .value = scratch.value + name_offset, .length = name_length };
+            value = (substring){ .value = scratch.value + value_offset, .length = value_length };
+            callback(callback_data, name, value);
+            if (indexing) hpack_insert(table, name.value, name.length, value.value, value.length);
+        }
+    }
+    free(scratch.value);
+    return result;
+}
+
+static void hpack_encode_integer(struct h2_buffer *output, uint8_t flags, int prefix, size_t value) {
+    size_t mask = (1u << prefix) - 1;
+    if (value < mask) {
+        uint8_t byte = flags | value;
+        h2_buffer_append(output, &byte, 1);
+        return;
+    }
+    uint8_t bytes[8] = { flags | mask };
+    int count = 1;
+    for (value -= mask; value >= 0x80; value >>= 7) bytes[count++] = (value & 0x7f) | 0x80;
+    bytes[count++] = value;
+    h2_buffer_append(output, bytes, count);
+}
+
+// Literal without indexing; names are taken from the static table when
+// possible, values are not Huffman coded
+static void hpack_encode_field(struct h2_buffer *output, const char *name, size_t name_length,
+                               const char *value, size_t value_length) {
+    size_t index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES && index == 0; i++) {
+        if (strncmp(hpack_static_table[i][0], name, name_length) == 0 && hpack_static_table[i][0][name_length] == '\0') {
+            index = i + 1;
+        }
+    }
+    hpack_encode_integer(output, 0, 4, index);
+    if (index == 0) {
+        hpack_encode_integer(output, 0, 7, name_length);
+        h2_buffer_append(output, name, name_length);
+    }
+    hpack_encode_integer(output, 0, 7, value_length);
+    h2_buffer_append(output, value, value_length);
+}
+
+// Hop-by-hop headers are not valid in HTTP/2 responses
+static bool h2_connection_header(const char *name, size_t length) {
+    static const char *names[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == length && strncasecmp(names[i], name, length) == 0) return true;
+    }
+    return false;
+}
+
+int h2_response_headers(struct h2_buffer *output, const char *response, size_t length,
+                        int *status, size_t *body_offset) {
+    const char *head_end = memmem(response, length, "\r\n\r\n", 4);
+    if (head_end == NULL || length < 12 || strncmp(response, "HTTP/1.", 7) != 0) return -1;
+    *status = atoi(response + 9);
+    *body_offset = head_end + 4 - response;
+
+    // Statuses in the static table are a single byte
+    static const int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    size_t index = 0;
+    for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); i++) {
+        if (indexed[i] == *status) index = 8 + i;
+    }
+    if (index > 0) {
+        hpack_encode_integer(output, 0x80, 7, index);
+    } else {
+        char code[16];
+        snprintf(code, sizeof(code), "%03d", *status >= 100 && *status <= 999 ? *status : 500);
+        hpack_encode_field(output, ":status", 7, code, 3);
+    }
+
+    const char *line = strstr(response, "\r\n") + 2;
+    while (line < head_end + 2) {
+        const char *line_end = strstr(line, "\r\n");
+        const char *colon = memchr(line, ':', line_end - line);
+        if (colon != NULL) {
+            // Field names are lowercase in HTTP/2
+            char name[64];
+            size_t name_length = colon - line;
+            const char *value = colon + 1;
+            while (*value == ' ' || *value == '\t') value++;
+            if (name_length < sizeof(name) && !h2_connection_header(line, name_length)) {
+                for (size_t i = 0; i < name_length; i++) name[i] = tolower((unsigned char)line[i]);
+                hpack_encode_field(output, name, name_length, value, line_end - value);
+            }
+        }
+        line = line_end + 2;
+    }
+    return 0;
+}
+
+// Appends a frame header; returns the payload to fill, NULL if out of memory
+static char *h2_frame(struct h2_session *session, int type, int flags, uint32_t stream_id, size_t length) {
+    char *frame = h2_buffer_extend(&session->pending, 9 + length);
+    if (frame == NULL) {
+        session->failed = true;
+        return NULL;
+    }
+    frame[0] = length >> 16;
+    frame[1] = length >> 8;
+    frame[2] = length;
+    frame[3] = type;
+    frame[4] = flags;
+    h2_put32(frame + 5, stream_id & H2_WINDOW_MAX);
+    return frame + 9;
+}
+
+static void h2_goaway(struct h2_session *session, enum h2_error error) {
+    if (!session->closing) {
+        char *payload = h2_frame(session, H2_GOAWAY, 0, 0, 8);
+        if (payload != NULL) {
+            h2_put32(payload, session->last_stream);
+            h2_put32(payload + 4, error);
+        }
+        session->closing = true;
+    }
+    // Input is ignored after a connection error
+    if (error != H2_NO_ERROR) session->failed = true;
+}
+
+static void h2_reset(struct h2_session *session, uint32_t stream_id, enum h2_error error) {
+    char *payload = h2_frame(session, H2_RST_STREAM, 0, stream_id, 4);
+    if (payload != NULL) h2_put32(payload, error);
+}
+
+static void h2_window_update(struct h2_session *session, uint32_t stream_id, uint32_t increment) {
+    char *payload = h2_frame(session, H2_WINDOW_UPDATE, 0, stream_id, 4);
+    if (payload != NULL) h2_put32(payload, increment);
+}
+
+// Counts a PING, SETTINGS or RST_STREAM frame; a client that sends more
+// than H2_CONTROL_FRAMES a second, like one resetting every stream it
+// opens, is sent GOAWAY. Returns false then.
+static bool h2_control_frame(struct h2_session *session) {
+    uint64_t now = metrics_now();
+    if (now - session->control_start >= 1000000000ULL) {
+        session->control_start = now;
+        session->control_frames = 0;
+    }
+    if (++session->control_frames <= H2_CONTROL_FRAMES) return true;
+    h2_goaway(session, H2_ENHANCE_YOUR_CALM);
+    return false;
+}
+
+static struct h2_stream *h2_find(struct h2_session *session, uint32_t id) {
+    for (struct h2_stream *stream = session->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id) return stream;
+    }
+    return NULL;
+}
+
+static struct h2_stream *h2_stream_open(struct h2_session *session, uint32_t id) {
+    struct h2_stream *stream = calloc(1, sizeof(struct h2_stream));
+    if (stream == NULL) return NULL;
+    stream->id = id;
+    stream->window = session->initial_window;
+    stream->weight = 16;
+    stream->urgency = 3;
+    stream->pass = session->pass;
+    stream->response = string_init();
+    stream->request_start = metrics_now();
+    stream->log_entry = session->log_template;
+    clock_gettime(CLOCK_REALTIME, &stream->log_entry.time);
+    stream->next = session->streams;
+    session->streams = stream;
+    session->stream_count++;
+    session->last_stream = id;
+    atomic_fetch_add_explicit(&h2_streams, 1, memory_order_relaxed);
+    return stream;
+}
+
+// Removes the stream; processed requests are logged with the bytes sent so far
+static void h2_stream_close(struct h2_session *session, struct h2_stream *stream) {
+    struct h2_stream **link = &session->streams;
+    while (*link != stream) link = &(*link)->next;
+    *link = stream->next;
+    session->stream_count--;
+    if (stream->processed) {
+        finish_request(&stream->log_entry, stream->request, stream->method, stream->url, stream->trace,
+                       stream->request_start, stream->request_length, stream->sent);
+    }
+    string_free(stream->response);
+    free(stream);
+}
+
+static void h2_apply_priority(struct h2_session *session, struct h2_stream *stream, const uint8_t *data) {
+    uint32_t parent = h2_get32(data) & H2_WINDOW_MAX;
+    // A stream cannot depend on itself
+    if (parent == stream->id) return;
+    // Depending on one of its own dependents moves that dependent to the
+    // former parent first (RFC 7540, section 5.3.3)
+    struct h2_stream *ancestor = h2_find(session, parent);
+    for (size_t depth = 0; ancestor != NULL && depth < session->stream_count; depth++) {
+        if (ancestor->parent == stream->id) {
+            ancestor->parent = stream->parent;
+            break;
+        }
+        ancestor = ancestor->parent ? h2_find(session, ancestor->parent) : NULL;
+    }
+    stream->parent = parent;
+    stream->weight = data[4] + 1;
+}
+
+// Renders the response of a complete request and queues its headers
+static void h2_process(struct h2_session *session, struct site *site, struct h2_stream *stream) {
+    parse_request_line(stream->request, stream->method, stream->url);
+    stream->trace = trace_start(stream->request);
+    site = site_host(site, stream->request);
+    unsigned retry_after;
+    if (!rate_limit_admit(site->config, &session->address, stream->url, &retry_after)) {
+        stream->response = rate_limit_response(retry_after, &stream->log_entry);
+    } else {
+        uint64_t stage_start = metrics_now();
+        struct file_cache_entry *file = site_file(site, stream->url, stream->request);
+        metrics_record(STAGE_RESOURCE_PATH, stage_start);
+        string links = early_hints_links(site, file);
+        stream->response = process_request(site, stream->method, stream->url, file, links.value, &stream->log_entry);
+        string_free(links);
+        file_cache_release(file);
+    }
+    trace_sending(stream->trace);
+    stream->processed = true;
+
+    struct h2_buffer block = { 0 };
+    int status;
+    if (stream->response.value == NULL ||
+        h2_response_headers(&block, stream->response.value, stream->response.length, &status, &stream->body) != 0) {
+        free(block.value);
+        h2_reset(session, stream->id, H2_INTERNAL_ERROR);
+        h2_stream_close(session, stream);
+        return;
+    }
+    bool empty = stream->body == stream->response.length || strcmp(stream->method, "HEAD") == 0;
+    if (empty) stream->body = stream->response.length;
+
+    // Header blocks larger than a frame continue in CONTINUATION frames
+    size_t offset = 0;
+    do {
+        size_t length = block.length - offset;
+        if (length > session->max_frame) length = session->max_frame;
+        int flags = offset + length == block.length ? H2_FLAG_END_HEADERS : 0;
+        if (offset == 0 && empty) flags |= H2_FLAG_END_STREAM;
+        char *payload = h2_frame(session, offset == 0 ? H2_HEADERS : H2_CONTINUATION, flags, stream->id, length);
+        if (payload != NULL) memcpy(payload, block.value + offset, length);
+        offset += length;
+    } while (offset < block.length);
+    stream->sent = block.length;
+    free(block.value);
+    if (empty) h2_stream_close(session, stream);
+}
+
+// Rebuilds the request head from the decoded fields, so the request is
+// handled and logged like an HTTP/1.1 one
+struct h2_request {
+    struct h2_stream *stream;
+    char method[8];
+    char path[1024];
+    char fields[REQUEST_BUFFER_SIZE - 1024 - 32];
+    size_t length;
+    bool malformed;                 // a field would change the request head
+};
+
+// CR, LF and NUL would end the line a field is copied into (RFC 9113 8.2.1)
+static bool h2_field_valid(substring text) {
+    for (size_t i = 0; i < text.length; i++) {
+        if (text.value[i] == '\r' || text.value[i] == '\n' || text.value[i] == '\0') return false;
+    }
+    return true;
+}
+
+static void h2_request_field(void *data, substring name, substring value) {
+    struct h2_request *request = data;
+    struct h2_stream *stream = request->stream;
+    if (stream == NULL || request->malformed) return;
+    if (!h2_field_valid(name) || !h2_field_valid(value)) {
+        request->malformed = true;
+        return;
+    }
+    if (name.length > 0 && name.value[0] == ':') {
+        bool method = name.length == 7 && strncmp(name.value, ":method", 7) == 0;
+        bool path = name.length == 5 && strncmp(name.value, ":path", 5) == 0;
+        // Spaces separate the parts of the request line
+        if ((method || path) && memchr(value.value, ' ', value.length) != NULL) {
+            request->malformed = true;
+            return;
+        }
+        if (method) {
+            if (value.length < sizeof(request->method)) {
+                snprintf(request->method, sizeof(request->method), "%.*s", (int)value.length, value.value);
+            }
+            return;
+        }
+        if (path) {
+            if (value.length < sizeof(request->path)) {
+                snprintf(request->path, sizeof(request->path), "%.*s", (int)value.length, value.value);
+            }
+            return;
+        }
+        if (name.length != 10 || strncmp(name.value, ":authority", 10) != 0) return;
+        name = (substring){ .value = "host", .length = 4 };
+    }
+    if (name.length == 8 && strncmp(name.value, "priority", 8) == 0) {
+        // Extensible priorities (RFC 9218): urgency u=0..7
+        const char *urgency = memmem(value.value, value.length, "u=", 2);
+        if (urgency != NULL && urgency + 2 < value.value + value.length &&
+            urgency[2] >= '0' && urgency[2] <= '7') {
+            stream->urgency = urgency[2] - '0';
+        }
+    }
+    // Fields that do not fit are dropped, like in a full HTTP/1.1 request buffer
+    size_t line_length = name.length + value.length + 4;
+    if (request->length + line_length > sizeof(request->fields)) return;
+    char *line = request->fields + request->length;
+    memcpy(line, name.value, name.length);
+    memcpy(line + name.length, ": ", 2);
+    memcpy(line + name.length + 2, value.value, value.length);
+    memcpy(line + name.length + 2 + value.length, "\r\n", 2);
+    request->length += line_length;
+}
+
+// Decodes a complete header block; the stream is NULL for refused and
+// trailing header blocks, which are only decoded for the HPACK state
+static void h2_headers(struct h2_session *session, struct site *site, struct h2_stream *stream,
+                       const uint8_t *block, size_t length, bool end_stream) {
+    struct h2_request request = { .stream = stream };
+    if (hpack_decode(&session->decoder, block, length, h2_request_field, &request) != 0) {
+        h2_goaway(session, H2_COMPRESSION_ERROR);
+        return;
+    }
+    if (stream == NULL) return;
+    if (request.malformed || request.method[0] == '\0' || request.path[0] == '\0') {
+        h2_reset(session, stream->id, H2_PROTOCOL_ERROR);
+        h2_stream_close(session, stream);
+        return;
+    }
+    int line_length = snprintf(stream->request, sizeof(stream->request), "%s %s HTTP/2\r\n", request.method, request.path);
+    memcpy(stream->request + line_length, request.fields, request.length);
+    memcpy(stream->request + line_length + request.length, "\r\n", 3);
+    stream->request_length = line_length + request.length + 2;
+    stream->headers_received = true;
+    if (end_stream) h2_process(session, site, stream);
+}
+
+static int h2_apply_settings(struct h2_session *session, const uint8_t *data, size_t length) {
+    if (length % 6 != 0) return H2_FRAME_SIZE_ERROR;
+    for (size_t offset = 0; offset < length; offset += 6) {
+        int id = data[offset] << 8 | data[offset + 1];
+        uint32_t value = h2_get32(data + offset + 2);
+        if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+            // Applies to the open streams too, none of which may exceed the maximum
+            int64_t delta = (int64_t)value - session->initial_window;
+            for (struct h2_stream *stream = session->streams; stream != NULL; stream = stream->next) {
+                if (stream->window + delta > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+                stream->window += delta;
+            }
+            session->initial_window = value;
+        } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (value < 16384 || value > 16777215) return H2_PROTOCOL_ERROR;
+            session->max_frame = value;
+        } else if (id == H2_SETTINGS_ENABLE_PUSH && value > 1) {
+            return H2_PROTOCOL_ERROR;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+static void h2_receive_frame(struct h2_session *session, struct site *site, int type, int flags,
+                             uint32_t stream_id, const uint8_t *payload, size_t length) {
+    // A header block is not interleaved with other frames
+    if (session->continuation != 0 && (type != H2_CONTINUATION || stream_id != session->continuation)) {
+        h2_goaway(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (!session->settings_received && type != H2_SETTINGS) {
+        h2_goaway(session, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    // Padding of DATA and HEADERS
+    size_t frame_length = length;
+    if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) {
+        if (length < 1 || payload[0] >= length) {
+            h2_goaway(session, H2_PROTOCOL_ERROR);
+            return;
+        }
+        length -= 1 + payload[0];
+        payload++;
+    }
+
+    struct h2_stream *stream = stream_id ? h2_find(session, stream_id) : NULL;
+    switch (type) {
+        case H2_DATA:
+            if (stream_id == 0) {
+                h2_goaway(session, H2_PROTOCOL_ERROR);
+                break;
+            }
+            // Request bodies are discarded; their flow control credit is returned
+            if (frame_length > 0) {
+                h2_window_update(session, 0, frame_length);
+                if (stream != NULL && !(flags & H2_FLAG_END_STREAM)) h2_window_update(session, stream_id, frame_length);
+            }
+            if (stream != NULL && !stream->processed && (flags & H2_FLAG_END_STREAM)) {
+                if (stream->headers_received) h2_process(session, site, stream);
+            }
+            break;
+        case H2_HEADERS: {
+            if (stream_id == 0 || stream_id % 2 == 0) {
+                h2_goaway(session, H2_PROTOCOL_ERROR);
+                break;
+            }
+            bool priority = flags & H2_FLAG_PRIORITY;
+            if (priority && length < 5) {
+                h2_goaway(session, H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (stream == NULL && stream_id > session->last_stream) {
+                if (session->closing || session->stream_count >= H2_MAX_STREAMS) {
+                    // Decoded for the HPACK state, then refused
+                    h2_reset(session, stream_id, H2_REFUSED_STREAM);
+                    session->last_stream = stream_id;
+                } else {
+                    stream = h2_stream_open(session, stream_id);
+                    if (stream == NULL) h2_reset(session, stream_id, H2_REFUSED_STREAM);
+                }
+                if (stream != NULL && priority) h2_apply_priority(session, stream, payload);
+            } else if (stream == NULL) {
+                // Closed streams cannot be reopened
+                h2_goaway(session, H2_STREAM_CLOSED);
+                break;
+            } else if (stream->processed) {
+                // Trailers after a complete request
+                stream = NULL;
+            }
+            if (priority) {
+                payload += 5;
+                length -= 5;
+            }
+            session->continuation_end = flags & H2_FLAG_END_STREAM;
+            if (flags & H2_FLAG_END_HEADERS) {
+                // A trailing block of an open request ends it
+                if (stream != NULL && stream->headers_received) {
+                    h2_headers(session, site, NULL, payload, length, false);
+                    if (!session->failed && session->continuation_end) h2_process(session, site, stream);
+                } else {
+                    h2_headers(session, site, stream, payload, length, session->continuation_end);
+                }
+            } else {
+                session->continuation = stream_id;
+                session->header_block.length = 0;
+                h2_buffer_append(&session->header_block, payload, length);
+            }
+            break;
+        }
+        case H2_CONTINUATION:
+            if (session->continuation == 0) {
+                h2_goaway(session, H2_PROTOCOL_ERROR);
+                break;
+            }
+            h2_buffer_append(&session->header_block, payload, length);
+            if (session->header_block.length > H2_MAX_HEADER_BLOCK) {
+                h2_goaway(session, H2_PROTOCOL_ERROR);
+                break;
+            }
+            if (flags & H2_FLAG_END_HEADERS) {
+                session->continuation = 0;
+                const uint8_t *block = (const uint8_t *)session->header_block.value;
+                size_t block_length = session->header_block.length;
+                if (stream != NULL && stream->processed) stream = NULL;
+                if (stream != NULL && stream->headers_received) {
+                    h2_headers(session, site, NULL, block, block_length, false);
+                    if (!session->failed && session->continuation_end) h2_process(session, site, stream);
+                } else {
+                    h2_headers(session, site, stream, block, block_length, session->continuation_end);
+                }
+            }
+            break;
+        case H2_PRIORITY:
+            if (length != 5 || stream_id == 0) {
+                h2_goaway(session, length != 5 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+                break;
+            }
+            if (stream != NULL) h2_apply_priority(session, stream, payload);
+            break;
+        case H2_RST_STREAM:
+            if (length != 4 || stream_id == 0) {
+                h2_goaway(session, length != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+                break;
+            }
+            if (!h2_control_frame(session)) break;
+            if (stream != NULL) h2_stream_close(session, stream);
+            break;
+        case H2_SETTINGS: {
+            if (stream_id != 0 || ((flags & H2_FLAG_ACK) && length != 0)) {
+                h2_goaway(session, stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (!h2_control_frame(session) || (flags & H2_FLAG_ACK)) break;
+            enum h2_error error = h2_apply_settings(session, payload, length);
+            if (error != H2_NO_ERROR) {
+                h2_goaway(session, error);
+                break;
+            }
+            session->settings_received = true;
+            h2_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+            break;
+        }
+        case H2_PUSH_PROMISE:
+            // Clients do not push
+            h2_goaway(session, H2_PROTOCOL_ERROR);
+            break;
+        case H2_PING:
+            if (length != 8 || stream_id != 0) {
+                h2_goaway(session, length != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+                break;
+            }
+            if (!h2_control_frame(session)) break;
+            if (!(flags & H2_FLAG_ACK)) {
+                char *pong = h2_frame(session, H2_PING, H2_FLAG_ACK, 0, 8);
+                if (pong != NULL) memcpy(pong, payload, 8);
+            }
+            break;
+        case H2_GOAWAY:
+            // Streams in progress are finished, no new ones are started
+            session->peer_closing = true;
+            break;
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                h2_goaway(session, H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            uint32_t increment = h2_get32(payload) & H2_WINDOW_MAX;
+            int64_t *window = stream_id == 0 ? &session->window : stream ? &stream->window : NULL;
+            if (increment == 0 && stream_id == 0) {
+                h2_goaway(session, H2_PROTOCOL_ERROR);
+            } else if (window != NULL && (increment == 0 || *window + increment > H2_WINDOW_MAX)) {
+                if (stream_id == 0) {
+                    h2_goaway(session, H2_FLOW_CONTROL_ERROR);
+                } else {
+                    h2_reset(session, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                    h2_stream_close(session, stream);
+                }
+            } else if (window != NULL) {
+                *window += increment;
+            }
+            break;
+        }
+        default:
+            // Unknown frame types are ignored
+            break;
+    }
+}
+
+// Queues the server preface: settings with the stream limit
+static void h2_start(struct h2_session *session) {
+    char *payload = h2_frame(session, H2_SETTINGS, 0, 0, 6);
+    if (payload == NULL) return;
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put32(payload + 2, H2_MAX_STREAMS);
+}
+
+static struct h2_session *h2_session_new(const char *client) {
+    struct h2_session *session = calloc(1, sizeof(struct h2_session));
+    if (session == NULL) return NULL;
+    session->window = H2_DEFAULT_WINDOW;
+    session->initial_window = H2_DEFAULT_WINDOW;
+    session->max_frame = 16384;
+    hpack_table_init(&session->decoder, H2_HEADER_TABLE_SIZE);
+    snprintf(session->log_template.client, sizeof(session->log_template.client), "%s", client ? client : "-");
+    client_address_parse(&session->address, session->log_template.client);
+    return session;
+}
+
+struct h2_session *h2_session_create(const char *client) {
+    struct h2_session *session = h2_session_new(client);
+    if (session == NULL) return NULL;
+    atomic_fetch_add_explicit(&h2_connections, 1, memory_order_relaxed);
+    h2_start(session);
+    return session;
+}
+
+void h2_session_free(struct h2_session *session) {
+    if (session == NULL) return;
+    while (session->streams != NULL) h2_stream_close(session, session->streams);
+    hpack_table_free(&session->decoder);
+    free(session->input.value);
+    free(session->pending.value);
+    free(session->sending.value);
+    free(session->header_block.value);
+    free(session);
+}
+
+int h2_receive(struct h2_session *session, struct site *site, const char *data, size_t length) {
+    if (session->failed) return -1;
+    // Complete frames are read in place; a partial frame is kept for the next call
+    const uint8_t *input = (const uint8_t *)data;
+    if (session->input.length > 0) {
+        h2_buffer_append(&session->input, data, length);
+        input = (const uint8_t *)session->input.value;
+        length = session->input.length;
+    }
+
+    size_t offset = 0;
+    if (!session->preface_received) {
+        if (length < H2_PREFACE_LENGTH) {
+            if (memcmp(input, h2_preface, length) != 0) h2_goaway(session, H2_PROTOCOL_ERROR);
+        } else if (memcmp(input, h2_preface, H2_PREFACE_LENGTH) != 0) {
+            h2_goaway(session, H2_PROTOCOL_ERROR);
+        } else {
+            session->preface_received = true;
+            offset = H2_PREFACE_LENGTH;
+        }
+    }
+    while (session->preface_received && !session->failed && length - offset >= 9) {
+        const uint8_t *frame = input + offset;
+        size_t frame_length = (size_t)frame[0] << 16 | frame[1] << 8 | frame[2];
+        if (frame_length > H2_MAX_FRAME_SIZE) {
+            h2_goaway(session, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (length - offset < 9 + frame_length) break;
+        h2_receive_frame(session, site, frame[3], frame[4], h2_get32(frame + 5) & H2_WINDOW_MAX, frame + 9, frame_length);
+        offset += 9 + frame_length;
+    }
+    if (session->failed) return -1;
+
+    size_t rest = length - offset;
+    if (input == (const uint8_t *)session->input.value) {
+        memmove(session->input.value, session->input.value + offset, rest);
+        session->input.length = rest;
+    } else if (rest > 0) {
+        h2_buffer_append(&session->input, input + offset, rest);
+    }
+    return 0;
+}
+
+// Decodes the base64url HTTP2-Settings header of an upgrade request
+static int h2_upgrade_settings(struct h2_session *session, const char *value) {
+    uint8_t settings[256];
+    size_t length = 0;
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (const char *c = value; *c && *c != '='; c++) {
+        int digit;
+        if (*c >= 'A' && *c <= 'Z') digit = *c - 'A';
+        else if (*c >= 'a' && *c <= 'z') digit = *c - 'a' + 26;
+        else if (*c >= '0' && *c <= '9') digit = *c - '0' + 52;
+        else if (*c == '-' || *c == '+') digit = 62;
+        else if (*c == '_' || *c == '/') digit = 63;
+        else return -1;
+        bits = bits << 6 | digit;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            if (length == sizeof(settings)) return -1;
+            bit_count -= 8;
+            settings[length++] = bits >> bit_count;
+        }
+    }
+    return h2_apply_settings(session, settings, length) == H2_NO_ERROR ? 0 : -1;
+}
+
+static bool h2_upgrade_request(const char *request) {
+    char value[256];
+    if (request_header(request, "Upgrade", value, sizeof(value)) != 0 || strcasestr(value, "h2c") == NULL) return false;
+    if (request_header(request, "HTTP2-Settings", value, sizeof(value)) != 0) return false;
+    // Requests with a body stay on HTTP/1.1
+    if (request_header(request, "Transfer-Encoding", value, sizeof(value)) == 0) return false;
+    return request_header(request, "Content-Length", value, sizeof(value)) != 0 || atol(value) == 0;
+}
+
+struct h2_session *h2_accept(struct site *site, const char *request, size_t length, const char *client) {
+    bool preface = length >= H2_PREFACE_LENGTH && memcmp(request, h2_preface, H2_PREFACE_LENGTH) == 0;
+    if (!preface && !h2_upgrade_request(request)) return NULL;
+    if (!read_bool(site->config, "http2", true)) return NULL;
+
+    if (preface) {
+        struct h2_session *session = h2_session_create(client);
+        if (session != NULL) h2_receive(session, site, request, length);
+        return session;
+    }
+
+    // Upgrade: the request becomes stream 1, answered after the 101 response
+    // and the server preface
+    const char *head_end = strstr(request, "\r\n\r\n");
+    char settings[256];
+    request_header(request, "HTTP2-Settings", settings, sizeof(settings));
+    struct h2_session *session = h2_session_new(client);
+    if (session == NULL) return NULL;
+    if (head_end == NULL || h2_upgrade_settings(session, settings) != 0) {
+        h2_session_free(session);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&h2_connections, 1, memory_order_relaxed);
+    const char *switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    h2_buffer_append(&session->pending, switching, strlen(switching));
+    h2_start(session);
+    // The settings were acknowledged by the upgrade
+    session->settings_received = true;
+
+    struct h2_stream *stream = h2_stream_open(session, 1);
+    if (stream == NULL) {
+        h2_session_free(session);
+        return NULL;
+    }
+    size_t request_length = head_end + 4 - request;
+    if (request_length >= sizeof(stream->request)) request_length = sizeof(stream->request) - 1;
+    memcpy(stream->request, request, request_length);
+    stream->request[request_length] = '\0';
+    stream->request_length = request_length;
+    stream->headers_received = true;
+    h2_process(session, site, stream);
+    // The client preface may have arrived with the request
+    if (length > (size_t)(head_end + 4 - request)) {
+        h2_receive(session, site, head_end + 4, length - (head_end + 4 - request));
+    }
+    return session;
+}
+
+// A stream waits while the stream it depends on can send
+static bool h2_stream_blocked(struct h2_session *session, struct h2_stream *stream) {
+    if (stream->parent == 0) return false;
+    struct h2_stream *parent = h2_find(session, stream->parent);
+    return parent != NULL && parent->processed && parent->body < parent->response.length && parent->window > 0;
+}
+
+// Queues DATA frames within the flow control windows: the most urgent
+// streams first, then by weight
+static void h2_schedule(struct h2_session *session) {
+    while (!session->failed && session->pending.length < H2_OUTPUT_CHUNK && session->window > 0) {
+        struct h2_stream *next = NULL;
+        for (struct h2_stream *stream = session->streams; stream != NULL; stream = stream->next) {
+            if (!stream->processed || stream->body >= stream->response.length || stream->window <= 0) continue;
+            if (h2_stream_blocked(session, stream)) continue;
+            if (next == NULL || stream->urgency < next->urgency ||
+                (stream->urgency == next->urgency && stream->pass < next->pass)) {
+                next = stream;
+            }
+        }
+        if (next == NULL) break;
+
+        size_t length = next->response.length - next->body;
+        if ((int64_t)length > next->window) length = next->window;
+        if ((int64_t)length > session->window) length = session->window;
+        if (length > session->max_frame) length = session->max_frame;
+        bool last = next->body + length == next->response.length;
+        char *payload = h2_frame(session, H2_DATA, last ? H2_FLAG_END_STREAM : 0, next->id, length);
+        if (payload == NULL) break;
+        memcpy(payload, next->response.value + next->body, length);
+        next->body += length;
+        next->sent += length;
+        next->window -= length;
+        session->window -= length;
+        // Weighted fair queuing: the virtual time advances slower for heavier streams
+        next->pass += length * 256 / next->weight;
+        session->pass = next->pass;
+        if (last) h2_stream_close(session, next);
+    }
+}
+
+const char *h2_output(struct h2_session *session, size_t *length) {
+    if (session->sending.length == 0) {
+        h2_schedule(session);
+        struct h2_buffer sending = session->sending;
+        session->sending = session->pending;
+        session->pending = sending;
+    }
+    *length = session->sending.length;
+    return session->sending.value;
+}
+
+void h2_output_sent(struct h2_session *session) {
+    session->sending.length = 0;
+}
+
+bool h2_done(struct h2_session *session) {
+    if (session->pending.length > 0 || session->sending.length > 0) return false;
+    return session->failed || ((session->closing || session->peer_closing) && session->streams == NULL);
+}
+
+bool h2_idle(struct h2_session *session) {
+    return session->streams == NULL && session->pending.length == 0 && session->sending.length == 0;
+}
+
+bool h2_reading(struct h2_session *session) {
+    return session->pending.length + session->sending.length <= H2_OUTPUT_LIMIT;
+}
+
+void h2_shutdown(struct h2_session *session) {
+    h2_goaway(session, H2_NO_ERROR);
+}
+
+void h2_stats(unsigned long *connections, unsigned long *streams) {
+    *connections = atomic_load_explicit(&h2_connections, memory_order_relaxed);
+    *streams = atomic_load_explicit(&h2_streams, memory_order_relaxed);
+}
+
+int h2_flush(struct h2_session *session, int socket_desc, size_t *offset) {
+    while (1) {
+        size_t length;
+        const char *output = h2_output(session, &length);
+        if (length == 0) return 1;
+        while (*offset < length) {
+            ssize_t sent = send(socket_desc, output + *offset, length - *offset, 0);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            *offset += sent;
+            session->written += sent;
+        }
+        *offset = 0;
+        h2_output_sent(session);
+    }
+}
+
+
+// TLS ////////////////////////////////////////////////////////////////////////
+
+
+#ifdef CSERVER_TLS
+
+static SSL_CTX *tls_context;
+static _Atomic uint64_t tls_handshakes, tls_resumed, tls_offloaded;
+
+int tls_init(cJSON *config) {
+    cJSON *tls_config = cJSON_GetObjectItem(config, "tls");
+    char *certificate = read_string(tls_config, "certificate", NULL);
+    if (certificate == NULL) return 0;
+    char *key = read_string(tls_config, "key", certificate);
+
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(context, certificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) {
+        fprintf(stderr, "Failed to load the TLS certificate %s and key %s\n", certificate, key);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        return -1;
+    }
+
+    // Writes behave like send: partial writes, retried from the remaining data
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Clients that close without close_notify end the connection like plain TCP
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // After the handshake the kernel encrypts records, so sendfile works
+    if (read_bool(tls_config, "ktls", true)) SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+
+    // Resumption with session ids from a server side cache, or with tickets
+    // encrypted with a key generated at start
+    static const unsigned char session_id_context[] = "cserver";
+    SSL_CTX_set_session_id_context(context, session_id_context, sizeof(session_id_context) - 1);
+    int cache_size = read_int(tls_config, "session_cache", TLS_SESSION_CACHE);
+    bool tickets = read_bool(tls_config, "tickets", true);
+    if (cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(context, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    }
+    if (!tickets) SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+    // TLS 1.3 sends one ticket per handshake instead of two; without tickets
+    // and the cache there is nothing to resume
+    SSL_CTX_set_num_tickets(context, tickets || cache_size > 0 ? 1 : 0);
+
+    tls_context = context;
+    fprintf(stderr, "Using TLS with %s\n", certificate);
+    return 0;
+}
+
+bool tls_enabled() {
+    return tls_context != NULL;
+}
+
+void tls_free() {
+    SSL_CTX_free(tls_context);
+    tls_context = NULL;
+}
+
+SSL *tls_accept(int socket_desc) {
+    SSL *tls = SSL_new(tls_context);
+    if (tls == NULL) return NULL;
+    if (SSL_set_fd(tls, socket_desc) != 1) {
+        SSL_free(tls);
+        return NULL;
+    }
+    SSL_set_accept_state(tls);
+    return tls;
+}
+
+int tls_handshake(SSL *tls) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(tls);
+    if (result == 1) {
+        atomic_fetch_add_explicit(&tls_handshakes, 1, memory_order_relaxed);
+        if (SSL_session_reused(tls)) atomic_fetch_add_explicit(&tls_resumed, 1, memory_order_relaxed);
+        if (BIO_get_ktls_send(SSL_get_wbio(tls))) atomic_fetch_add_explicit(&tls_offloaded, 1, memory_order_relaxed);
+        return 0;
+    }
+    switch (SSL_get_error(tls, result)) {
+        case SSL_ERROR_WANT_READ: return POLLIN;
+        case SSL_ERROR_WANT_WRITE: return POLLOUT;
+        default: return -1;
+    }
+}
+
+// Maps the result of an SSL call to the recv and send conventions
+static ssize_t tls_result(SSL *tls, int result) {
+    if (result > 0) return result;
+    switch (SSL_get_error(tls, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0 || errno == EAGAIN) errno = ECONNRESET;
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t tls_recv(SSL *tls, void *buffer, size_t length) {
+    ERR_clear_error();
+    return tls_result(tls, SSL_read(tls, buffer, length < INT_MAX ? (int)length : INT_MAX));
+}
+
+ssize_t tls_send(SSL *tls, const void *data, size_t length) {
+    ERR_clear_error();
+    return tls_result(tls, SSL_write(tls, data, length < INT_MAX ? (int)length : INT_MAX));
+}
+
+ssize_t tls_send_file(SSL *tls, int fd, off_t offset, size_t length) {
+    if (BIO_get_ktls_send(SSL_get_wbio(tls))) {
+        ERR_clear_error();
+        ossl_ssize_t sent = SSL_sendfile(tls, fd, offset, length, 0);
+        return sent > 0 ? sent : tls_result(tls, (int)sent);
+    }
+    // One record at a time; a retry reads the same data again
+    char buffer[16384];
+    ssize_t count = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if (count <= 0) return count;
+    return tls_send(tls, buffer, count);
+}
+
+void tls_close(SSL *tls) {
+    if (tls == NULL) return;
+    if (SSL_is_init_finished(tls)) SSL_shutdown(tls);
+    SSL_free(tls);
+}
+
+void tls_stats(unsigned long *handshakes, unsigned long *resumed, unsigned long *offloaded) {
+    *handshakes = atomic_load_explicit(&tls_handshakes, memory_order_relaxed);
+    *resumed = atomic_load_explicit(&tls_resumed, memory_order_relaxed);
+    *offloaded = atomic_load_explicit(&tls_offloaded, memory_order_relaxed);
+}
+
+#endif
+
+
+// I/O backends ///////////////////////////////////////////////////////////////
+
+
+enum io_backend io_backend_parse(const char *name) {
+#ifdef __linux__
+    if (strcmp(name, "blocking") == 0) return IO_BACKEND_BLOCKING;
+    if (strcmp(name, "epoll") == 0) return IO_BACKEND_EPOLL;
+#ifdef CSERVER_URING
+    return IO_BACKEND_URING;
+#else
+    return IO_BACKEND_EPOLL;
+#endif
+#else
+    (void)name;
+    return IO_BACKEND_BLOCKING;
+#endif
+}
+
+const char *io_backend_name(enum io_backend backend) {
+    switch (backend) {
+        case IO_BACKEND_URING: return "io_uring";
+        case IO_BACKEND_EPOLL: return "epoll";
+        default: return "blocking";
+    }
+}
+
+// Sets the receive or send timeout of a blocking socket
+static void socket_timeout(int socket_desc, int option, uint64_t milliseconds) {
+    struct timeval timeout = { .tv_sec = milliseconds / 1000, .tv_usec = (milliseconds % 1000) * 1000 };
+    setsockopt(socket_desc, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+// Milliseconds left until a deadline from `metrics_now`; 0, which leaves
+// the socket without a timeout, for no deadline
+static uint64_t deadline_timeout(uint64_t deadline) {
+    if (deadline == UINT64_MAX) return 0;
+    uint64_t now = metrics_now();
+    return (deadline > now ? deadline - now : 0) / 1000000 + 1;
+}
+
+#ifndef CSERVER_TLS
+typedef struct ssl_st SSL;          // connections have no TLS session without TLS support
+#endif
+
+// Receives on a connection, through its TLS session if it has one
+static ssize_t transport_recv(int socket_desc, SSL *tls, char *buffer, size_t length) {
+#ifdef CSERVER_TLS
+    if (tls != NULL) return tls_recv(tls, buffer, length);
+#endif
+    return recv(socket_desc, buffer, length, 0);
+}
+
+// Sends on a connection; the flags apply to plain sockets
+static ssize_t transport_send(int socket_desc, SSL *tls, const char *data, size_t length, int flags) {
+#ifdef CSERVER_TLS
+    if (tls != NULL) return tls_send(tls, data, length);
+#endif
+    return send(socket_desc, data, length, flags);
+}
+
+// Sends file data on a connection, without copies through user space on
+// plain sockets and with kernel TLS
+static ssize_t transport_send_file(int socket_desc, SSL *tls, int fd, off_t offset, size_t length) {
+#ifdef CSERVER_TLS
+    if (tls != NULL) return tls_send_file(tls, fd, offset, length);
+#endif
+#ifdef __linux__
+    return sendfile(socket_desc, fd, &offset, length);
+#else
+    char buffer[16384];
+    ssize_t count = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if (count <= 0) return count;
+    return send(socket_desc, buffer, count, 0);
+#endif
+}
+
+static void transport_close(int socket_desc, SSL *tls) {
+#ifdef CSERVER_TLS
+    tls_close(tls);
+#else
+    (void)tls;
+#endif
+    close(socket_desc);
+}
+
+// Static files too large to be mapped are sent from their descriptors after
+// a separate header. Returns the header, without a value if the response is
+// rendered by process_request instead.
+static string file_send_header(struct site *site, const char *url, struct file_cache_entry *file,
+                               struct access_log_entry *log_entry) {
+    string header = string_init();
+    if (file == NULL || file->rendered || file->map != NULL || file->size == 0) return header;
+    if (site->metrics_path[0] != '\0' && strcmp(url, site->metrics_path) == 0) return header;
+    uint64_t stage_start = metrics_now();
+    char buffer[1024];
+    if (format_response_header(buffer, sizeof(buffer), HTTP_STATUS_200, file->content_type,
+                               file->headers ? file->headers : "", file->size) == 0) {
+        return header;
+    }
+    header = string_make(buffer);
+    metrics_record(STAGE_RESPONSE, stage_start);
+    log_entry->status = 200;
+    log_entry->bytes = file->size;
+    return header;
+}
+
+// Sends 103 Early Hints before the page is rendered. Nothing else is being
+// sent on the connection, so the interim response normally fits the socket
+// buffer; the part that does not is returned to go before the final one.
+static string early_hints_send(int socket_desc, SSL *tls, const char *request, string links) {
+    string hints = early_hints_response(request, links);
+    size_t sent = 0;
+    while (sent < hints.length) {
+        ssize_t send_result = transport_send(socket_desc, tls, hints.value + sent, hints.length - sent, MSG_DONTWAIT);
+        if (send_result <= 0) break;
+        sent += send_result;
+    }
+    if (sent == hints.length) {
+        string_free(hints);
+        return string_init();
+    }
+    memmove(hints.value, hints.value + sent, hints.length - sent + 1);
+    hints.length -= sent;
+    return hints;
+}
+
+// Puts the unsent part of the interim response before the final response
+static string early_hints_join(string rest, string response) {
+    if (rest.value == NULL) return response;
+    char *joined = response.value ? realloc(rest.value, rest.length + response.length + 1) : NULL;
+    if (joined == NULL) {
+        // The connection is closed without a response
+        string_free(rest);
+        string_free(response);
+        return string_init();
+    }
+    memcpy(joined + rest.length, response.value, response.length + 1);
+    memory_count_string(response.length);
+    string_free(response);
+    return (string){ .value = joined, .length = rest.length + response.length };
+}
+
+// Serves an HTTP/2 connection until the client closes it or leaves it idle
+// for a tick; other clients wait meanwhile
+static void serve_h2_blocking(int socket_desc, struct h2_session *h2, struct site *site,
+                              struct connection_limits *limits) {
+    char buffer[REQUEST_BUFFER_SIZE];
+    size_t offset = 0;
+    uint64_t waited = 0;
+    socket_timeout(socket_desc, SO_RCVTIMEO, TIMER_TICK);
+    while (h2_flush(h2, socket_desc, &offset) == 1 && !h2_done(h2)) {
+        if (!atomic_load_explicit(&server.running, memory_order_relaxed)) h2_shutdown(h2);
+        ssize_t received = recv(socket_desc, buffer, sizeof(buffer), 0);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (h2_idle(h2)) {
+                h2_shutdown(h2);
+            } else if (limits->write_timeout > 0 && ++waited >= limits->write_timeout) {
+                // No window updates from the client
+                limits_count_timeout();
+                break;
+            }
+            continue;
+        }
+        if (received <= 0) break;
+        waited = 0;
+        // Streams received together share their renderings
+        h2_receive(h2, site, buffer, received);
+        page_cache_batch_end();
+    }
+    h2_session_free(h2);
+}
+
+// One request at a time: accept, read, render, send, close
+static void serve_blocking(cJSON *config) {
+    struct site *site = site_acquire();
+    char request[REQUEST_BUFFER_SIZE];
+    // Connection caps do not apply with a single connection
+    struct connection_limits limits;
+    limits_init(&limits, config);
+    limits_free(&limits);
+    uint64_t header_timeout = limits.header_timeout * TIMER_TICK * 1000000ULL;
+
+    // Non-blocking listeners: accept is tried first and the server waits in
+    // poll only when there are no pending connections, so the accept stage
+    // measures the call itself rather than idle time.
+    struct pollfd fds[LISTENERS_MAX + 1];
+    for (int i = 0; i < server.listener_count; i++) {
+        int listener = server.listeners[i].socket;
+        fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+        fds[i] = (struct pollfd){ .fd = listener, .events = POLLIN };
+    }
+    fds[server.listener_count] = (struct pollfd){ .fd = server.wake[0], .events = POLLIN };
+    int next_listener = 0;
+
+    while (atomic_load_explicit(&server.running, memory_order_relaxed)) {
+        // Switch to the new configuration and metadata after a reload
+        site = worker_site(site);
+
+        // Accept a connection, taking the listeners in turn
+        uint64_t request_start = metrics_now();
+        struct sockaddr_storage peer;
+        struct listener *listener = NULL;
+        int socket_desc = -1;
+        for (int i = 0; i < server.listener_count && socket_desc < 0; i++) {
+            listener = &server.listeners[(next_listener + i) % server.listener_count];
+            socklen_t peer_len = sizeof(peer);
+            socket_desc = accept(listener->socket, (struct sockaddr *)&peer, &peer_len);
+            if (socket_desc < 0 && (errno == EMFILE || errno == ENFILE)) {
+                // Out of descriptors: cached files are closed, or the server
+                // waits a tick before trying again
+                if (file_cache_shrink() == 0) poll(NULL, 0, TIMER_TICK);
+                break;
+            }
+            if (socket_desc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                perror("accept failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        next_listener = (next_listener + 1) % server.listener_count;
+        if (socket_desc < 0) {
+            poll(fds, server.listener_count + 1, -1);
+            continue;
+        }
+#ifndef __linux__
+        // BSD sockets inherit O_NONBLOCK from the listener
+        fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL) & ~O_NONBLOCK);
+#endif
+        uint64_t stage_start = metrics_record(STAGE_ACCEPT, request_start);
+
+        struct access_log_entry log_entry = { .status = 0, .bytes = 0 };
+        clock_gettime(CLOCK_REALTIME, &log_entry.time);
+        // Behind a proxy the client address comes from the PROXY header
+        struct client_address address;
+        client_address_set(&address, listener->proxy_protocol ? NULL : (struct sockaddr *)&peer);
+        client_address_format(&address, log_entry.client, sizeof(log_entry.client));
+        uint64_t header_deadline = header_timeout > 0 ? request_start + header_timeout : UINT64_MAX;
+
+        // The handshake counts towards the header timeout
+        SSL *tls = NULL;
+#ifdef CSERVER_TLS
+        if (listener->tls) {
+            tls = tls_accept(socket_desc);
+            int waiting = tls == NULL ? -1 : POLLIN;
+            while (waiting > 0 && metrics_now() < header_deadline) {
+                socket_timeout(socket_desc, SO_RCVTIMEO, deadline_timeout(header_deadline));
+                socket_timeout(socket_desc, SO_SNDTIMEO, deadline_timeout(header_deadline));
+                waiting = tls_handshake(tls);
+            }
+            if (waiting != 0) {
+                if (waiting > 0) limits_count_timeout();
+                transport_close(socket_desc, tls);
+                continue;
+            }
+        }
+#endif
+
+        // Read the request headers before the deadline, after the PROXY
+        // header on listeners behind a proxy
+        size_t received = 0;
+        request[0] = '\0';
+        bool timed_out = false;
+        bool proxy = listener->proxy_protocol;
+        while (proxy || !request_complete(request, received)) {
+            uint64_t now = metrics_now();
+            if (now >= header_deadline) {
+                timed_out = true;
+                break;
+            }
+            socket_timeout(socket_desc, SO_RCVTIMEO, deadline_timeout(header_deadline));
+            ssize_t recv_result = transport_recv(socket_desc, tls, request + received, sizeof(request) - 1 - received);
+            if (recv_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (recv_result <= 0) break;
+            received += recv_result;
+            request[received] = '\0';
+            if (proxy) {
+                int header_length = proxy_header_parse(request, received, &address);
+                if (header_length < 0) break;
+                if (header_length == 0) continue;
+                proxy = false;
+                received -= header_length;
+                memmove(request, request + header_length, received + 1);
+                client_address_format(&address, log_entry.client, sizeof(log_entry.client));
+            }
+        }
+        if (proxy && !timed_out) {
+            close(socket_desc);
+            continue;
+        }
+        if (timed_out) {
+            limits_count_timeout();
+            log_entry.status = 408;
+            transport_send(socket_desc, tls, request_timeout_response, strlen(request_timeout_response), MSG_DONTWAIT);
+            transport_close(socket_desc, tls);
+            finish_request(&log_entry, request, "", "", NULL, request_start, received, 0);
+            continue;
+        }
+        // A send that makes no progress for the write timeout fails
+        socket_timeout(socket_desc, SO_SNDTIMEO, limits.write_timeout * TIMER_TICK);
+
+        // HTTP/2 is cleartext only
+        struct h2_session *h2 = tls == NULL ? h2_accept(site, request, received, log_entry.client) : NULL;
+        if (h2 != NULL) {
+            metrics_record(STAGE_RECV, stage_start);
+            serve_h2_blocking(socket_desc, h2, site, &limits);
+            close(socket_desc);
+            continue;
+        }
+
+        // Parse the request
+        char method[8], url[1024];
+        parse_request_line(request, method, url);
+        struct trace *trace = trace_start(request);
+        stage_start = metrics_record(STAGE_RECV, stage_start);
+        // Limited clients are answered before the URL is resolved
+        struct site *served = site_host(site, request);
+        unsigned retry_after;
+        bool admitted = rate_limit_admit(served->config, &address, url, &retry_after);
+        struct file_cache_entry *file = admitted ? site_file(served, url, request) : NULL;
+        metrics_record(STAGE_RESOURCE_PATH, stage_start);
+
+        // Either a header followed by the file, or a complete response
+        string response = file_send_header(served, url, file, &log_entry);
+        size_t total = response.length + (response.value != NULL ? (size_t)file->size : 0);
+        if (response.value == NULL && admitted) {
+            string links = early_hints_links(served, file);
+            string hints = early_hints_send(socket_desc, tls, request, links);
+            response = early_hints_join(hints, process_request(served, method, url, file, links.value, &log_entry));
+            string_free(links);
+            total = response.length;
+        } else if (response.value == NULL) {
+            response = rate_limit_response(retry_after, &log_entry);
+            total = response.length;
+        }
+        trace_sending(trace);
+
+        stage_start = metrics_now();
+        size_t sent = 0;
+        while (sent < total) {
+            ssize_t send_result = sent < response.length
+                ? transport_send(socket_desc, tls, response.value + sent, response.length - sent, 0)
+                : transport_send_file(socket_desc, tls, file->fd, sent - response.length, total - sent);
+            if (send_result <= 0) break;
+            sent += send_result;
+        }
+        metrics_record(STAGE_SEND, stage_start);
+        string_free(response);
+        file_cache_release(file);
+        page_cache_batch_end();
+
+        // Close the connection
+        transport_close(socket_desc, tls);
+        finish_request(&log_entry, request, method, url, trace, request_start, received, sent);
+    }
+
+    site_release(site);
+}
+
+#ifdef __linux__
+
+// Client connection of the event driven backends
+struct connection {
+    int socket;                     // descriptor, or fixed file index for io_uring
+    bool active;
+    char request[REQUEST_BUFFER_SIZE];
+    size_t received;
+    char method[8];
+    char url[1024];
+    string response;                // rendered response
+    const char *output;             // data being sent
+    size_t output_length;
+    size_t sent;
+    struct file_cache_entry *file;  // static file read into the io_uring buffer, or sent after the header by epoll
+    struct timer timer;             // header deadline, then transfer rate checks
+    struct client_address address;
+    bool proxy;                     // PROXY protocol header not received yet
+    size_t checked;                 // bytes sent at the last rate check
+    bool timed_out;
+    struct h2_session *h2;          // HTTP/2 session, NULL for HTTP/1.1
+    bool receiving;                 // io_uring receive in flight
+    bool blocked;                   // epoll: output waits for the socket
+    bool paused;                    // epoll: HTTP/2 input waits for the output to be read
+    bool closing;                   // HTTP/2: closed once pending operations complete
+    struct connection *next, *prev; // epoll: list of HTTP/2 connections
+    SSL *tls;                       // epoll: TLS session, NULL for plain connections
+    bool handshake;                 // TLS handshake in progress
+    uint64_t request_start;
+    uint64_t stage_start;
+    struct access_log_entry log_entry;
+    struct trace *trace;            // NULL unless the request is traced
+};
+
+static void connection_start(struct connection *connection, const struct sockaddr *peer, bool proxy) {
+    connection->active = true;
+    connection->received = 0;
+    connection->request[0] = '\0';
+    connection->response = string_init();
+    connection->output = NULL;
+    connection->output_length = 0;
+    connection->sent = 0;
+    connection->file = NULL;
+    connection->timer.next = connection->timer.prev = NULL;
+    client_address_set(&connection->address, peer);
+    connection->proxy = proxy;
+    connection->checked = 0;
+    connection->timed_out = false;
+    connection->h2 = NULL;
+    connection->receiving = connection->blocked = connection->closing = false;
+    connection->next = connection->prev = NULL;
+    connection->tls = NULL;
+    connection->handshake = false;
+    connection->method[0] = connection->url[0] = '\0';
+    connection->trace = NULL;
+    memset(&connection->log_entry, 0, sizeof(connection->log_entry));
+    clock_gettime(CLOCK_REALTIME, &connection->log_entry.time);
+    client_address_format(&connection->address, connection->log_entry.client, sizeof(connection->log_entry.client));
+    connection->request_start = metrics_now();
+    connection->stage_start = connection->request_start;
+}
+
+// Takes the client address from the PROXY header at the start of the
+// received data and removes the header. Returns 1 once the header is
+// done, 0 if more data is needed, -1 if the connection must be closed.
+static int connection_proxy(struct connection *connection, struct connection_limits *limits) {
+    struct client_address address = connection->address;
+    int header_length = proxy_header_parse(connection->request, connection->received, &address);
+    if (header_length == 0 && connection->received >= PROXY_HEADER_MAX) return -1;
+    if (header_length <= 0) return header_length;
+    if (memcmp(&address, &connection->address, sizeof(address)) != 0) {
+        if (!limits_move(limits, &connection->address, &address)) return -1;
+        connection->address = address;
+        client_address_format(&address, connection->log_entry.client, sizeof(connection->log_entry.client));
+    }
+    connection->proxy = false;
+    connection->received -= header_length;
+    memmove(connection->request, connection->request + header_length, connection->received + 1);
+    return 1;
+}
+
+// Parses the received request and renders the response
+static void connection_process(struct site *site, struct connection *connection) {
+    parse_request_line(connection->request, connection->method, connection->url);
+    connection->trace = trace_start(connection->request);
+    uint64_t stage_start = metrics_record(STAGE_RECV, connection->stage_start);
+    site = site_host(site, connection->request);
+    unsigned retry_after;
+    bool admitted = rate_limit_admit(site->config, &connection->address, connection->url, &retry_after);
+    struct file_cache_entry *file = admitted ? site_file(site, connection->url, connection->request) : NULL;
+    metrics_record(STAGE_RESOURCE_PATH, stage_start);
+    connection->response = file_send_header(site, connection->url, file, &connection->log_entry);
+    if (connection->response.value != NULL) {
+        // The file stays open until the connection is closed
+        connection->file = file;
+        connection->output_length = connection->response.length + file->size;
+    } else {
+        if (admitted) {
+            string links = early_hints_links(site, file);
+            string hints = early_hints_send(connection->socket, connection->tls, connection->request, links);
+            connection->response = early_hints_join(hints, process_request(site, connection->method, connection->url,
+                                                                           file, links.value, &connection->log_entry));
+            string_free(links);
+        } else {
+            connection->response = rate_limit_response(retry_after, &connection->log_entry);
+        }
+        file_cache_release(file);
+        connection->output_length = connection->response.length;
+    }
+    trace_sending(connection->trace);
+    connection->output = connection->response.value;
+    connection->sent = 0;
+    connection->stage_start = metrics_now();
+}
+
+// Sends the response header or the file data that follows it
+static ssize_t connection_send(struct connection *connection) {
+    size_t header_length = connection->file ? connection->response.length : connection->output_length;
+    if (connection->sent < header_length) {
+        return transport_send(connection->socket, connection->tls, connection->output + connection->sent,
+                              header_length - connection->sent, 0);
+    }
+    return transport_send_file(connection->socket, connection->tls, connection->file->fd,
+                               connection->sent - header_length, connection->output_length - connection->sent);
+}
+
+static void connection_finish(struct connection *connection) {
+    metrics_record(STAGE_SEND, connection->stage_start);
+    finish_request(&connection->log_entry, connection->request, connection->method, connection->url,
+                   connection->trace, connection->request_start, connection->received, connection->sent);
+    connection->trace = NULL;
+    string_free(connection->response);
+    connection->response = string_init();
+    connection->active = false;
+}
+
+// Connection from its timer
+static struct connection *timer_connection(struct timer *timer) {
+    return (struct connection *)((char *)timer - offsetof(struct connection, timer));
+}
+
+// Event loop state of the epoll backend
+struct epoll_server {
+    int epoll;
+    size_t active;
+    struct timer_wheel wheel;
+    struct connection_limits limits;
+    struct connection *h2_connections;
+};
+
+static void epoll_close(struct epoll_server *es, struct connection *connection) {
+    timer_cancel(&es->wheel, &connection->timer);
+    limits_release(&es->limits, &connection->address);
+    if (connection->h2 != NULL) {
+        if (connection->prev) connection->prev->next = connection->next;
+        else es->h2_connections = connection->next;
+        if (connection->next) connection->next->prev = connection->prev;
+        h2_session_free(connection->h2);
+    }
+    // Closing the socket removes it from the epoll set
+    transport_close(connection->socket, connection->tls);
+    if (connection->output != NULL) connection_finish(connection);
+    trace_free(connection->trace);
+    file_cache_release(connection->file);
+    string_free(connection->response);
+    free(connection);
+    es->active--;
+}
+
+// Reads frames and writes the output of an HTTP/2 connection; returns
+// true when the connection is done
+static bool epoll_h2(struct epoll_server *es, struct site *site, struct connection *connection, bool readable) {
+    struct h2_session *h2 = connection->h2;
+    uint32_t last_stream = h2->last_stream;
+    uint64_t written = h2->written;
+    if (readable && h2_reading(h2)) {
+        ssize_t received = recv(connection->socket, connection->request, sizeof(connection->request), 0);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) return true;
+        if (received > 0) h2_receive(h2, site, connection->request, received);
+    }
+    int flushed = h2_flush(h2, connection->socket, &connection->sent);
+    if (flushed < 0 || (flushed == 1 && h2_done(h2))) return true;
+    // Frames are still read while the output waits for the socket, unless
+    // the client leaves too much of it unread
+    bool paused = !h2_reading(h2);
+    if (connection->blocked != (flushed == 0) || connection->paused != paused) {
+        connection->blocked = flushed == 0;
+        connection->paused = paused;
+        struct epoll_event event = { .events = (paused ? 0 : EPOLLIN) | (connection->blocked ? EPOLLOUT : 0),
+                                     .data.ptr = connection };
+        epoll_ctl(es->epoll, EPOLL_CTL_MOD, connection->socket, &event);
+    }
+    // A busy connection times out unless new requests arrive or the client
+    // reads the output
+    if (h2_idle(h2)) {
+        limits_schedule(&es->wheel, &connection->timer, es->limits.header_timeout);
+    } else if (h2->last_stream != last_stream || h2->written != written) {
+        limits_schedule(&es->wheel, &connection->timer, es->limits.write_timeout);
+    }
+    return false;
+}
+
+static void epoll_timeout(struct timer *timer, void *data) {
+    struct epoll_server *es = data;
+    struct connection *connection = timer_connection(timer);
+    if (connection->h2 != NULL) {
+        // Idle connections are closed with GOAWAY, stalled ones without
+        if (h2_idle(connection->h2)) {
+            h2_shutdown(connection->h2);
+            h2_flush(connection->h2, connection->socket, &connection->sent);
+        } else {
+            limits_count_timeout();
+        }
+        epoll_close(es, connection);
+    } else if (connection->output == NULL) {
+        // Headers not received in time: best effort 408, then close
+        limits_count_timeout();
+        connection->log_entry.status = 408;
+        connection->output = request_timeout_response;
+        connection->output_length = strlen(request_timeout_response);
+        ssize_t sent = connection->handshake ? 0 : transport_send(connection->socket, connection->tls, connection->output,
+                                                                  connection->output_length, MSG_DONTWAIT);
+        connection->sent = sent > 0 ? sent : 0;
+        connection->stage_start = metrics_now();
+        epoll_close(es, connection);
+    } else if (limits_check_rate(&es->limits, connection->sent, connection->output_length, &connection->checked)) {
+        limits_schedule(&es->wheel, timer, es->limits.write_timeout);
+    } else {
+        epoll_close(es, connection);
+    }
+}
+
+// Event loop over non-blocking sockets
+static int serve_epoll(cJSON *config) {
+    struct epoll_server es = { .active = 0 };
+    es.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (es.epoll < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    if (limits_init(&es.limits, config) != 0) {
+        close(es.epoll);
+        return -1;
+    }
+    timer_wheel_init(&es.wheel, timer_tick());
+
+    // Listeners and the wake pipe are told apart from connections by their
+    // data pointers
+    struct epoll_event event = { .events = EPOLLIN };
+    for (int i = 0; i < server.listener_count; i++) {
+        int listener = server.listeners[i].socket;
+        fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+        event.data.ptr = &server.listeners[i];
+        epoll_ctl(es.epoll, EPOLL_CTL_ADD, listener, &event);
+    }
+    event.data.ptr = &server.wake;
+    epoll_ctl(es.epoll, EPOLL_CTL_ADD, server.wake[0], &event);
+
+    fprintf(stderr, "Using epoll\n");
+    struct site *site = site_acquire();
+    struct epoll_event events[64];
+    bool accepting = true;
+
+    while (accepting || es.active > 0) {
+        site = worker_site(site);
+        if (accepting && !atomic_load_explicit(&server.running, memory_order_relaxed)) {
+            // Stopped or handed off: finish the open connections
+            for (int i = 0; i < server.listener_count; i++) {
+                epoll_ctl(es.epoll, EPOLL_CTL_DEL, server.listeners[i].socket, NULL);
+            }
+            epoll_ctl(es.epoll, EPOLL_CTL_DEL, server.wake[0], NULL);
+            accepting = false;
+            struct connection *connection = es.h2_connections;
+            while (connection != NULL) {
+                struct connection *next = connection->next;
+                h2_shutdown(connection->h2);
+                if (epoll_h2(&es, site, connection, false)) epoll_close(&es, connection);
+                connection = next;
+            }
+            continue;
+        }
+
+        // Wake up every tick while timers are pending
+        int count = epoll_wait(es.epoll, events, sizeof(events) / sizeof(events[0]),
+                               es.wheel.count > 0 ? TIMER_TICK : -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &server.wake) continue;
+
+            struct listener *listener = events[i].data.ptr;
+            if (listener >= server.listeners && listener < server.listeners + server.listener_count) {
+                while (1) {
+                    uint64_t accept_start = metrics_now();
+                    struct sockaddr_storage peer;
+                    socklen_t peer_len = sizeof(peer);
+                    int socket_desc = accept4(listener->socket, (struct sockaddr *)&peer, &peer_len,
+                                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (socket_desc < 0) {
+                        // Out of descriptors: cached files are closed for the next try
+                        if (errno == EMFILE || errno == ENFILE) file_cache_shrink();
+                        break;
+                    }
+                    // Behind a proxy the client address comes from the PROXY header
+                    struct sockaddr *client = listener->proxy_protocol ? NULL : (struct sockaddr *)&peer;
+                    struct client_address address;
+                    client_address_set(&address, client);
+                    if (!limits_admit(&es.limits, &address)) {
+                        close(socket_desc);
+                        continue;
+                    }
+                    struct connection *connection = malloc(sizeof(struct connection));
+                    if (connection == NULL) {
+                        limits_release(&es.limits, &address);
+                        close(socket_desc);
+                        break;
+                    }
+                    connection_start(connection, client, listener->proxy_protocol);
+                    connection->socket = socket_desc;
+#ifdef CSERVER_TLS
+                    if (listener->tls) {
+                        connection->tls = tls_accept(socket_desc);
+                        connection->handshake = true;
+                        if (connection->tls == NULL) {
+                            limits_release(&es.limits, &address);
+                            close(socket_desc);
+                            free(connection);
+                            continue;
+                        }
+                    }
+#endif
+                    connection->request_start = accept_start;
+                    connection->stage_start = metrics_record(STAGE_ACCEPT, accept_start);
+                    limits_schedule(&es.wheel, &connection->timer, es.limits.header_timeout);
+                    struct epoll_event client_event = { .events = EPOLLIN, .data.ptr = connection };
+                    epoll_ctl(es.epoll, EPOLL_CTL_ADD, socket_desc, &client_event);
+                    es.active++;
+                }
+                continue;
+            }
+
+            struct connection *connection = events[i].data.ptr;
+            if (connection->h2 != NULL) {
+                if (epoll_h2(&es, site, connection, events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    epoll_close(&es, connection);
+                }
+                continue;
+            }
+#ifdef CSERVER_TLS
+            if (connection->handshake) {
+                int waiting = tls_handshake(connection->tls);
+                if (waiting < 0) {
+                    epoll_close(&es, connection);
+                    continue;
+                }
+                struct epoll_event client_event = { .events = waiting == POLLOUT ? EPOLLOUT : EPOLLIN,
+                                                    .data.ptr = connection };
+                epoll_ctl(es.epoll, EPOLL_CTL_MOD, connection->socket, &client_event);
+                if (waiting > 0) continue;
+                // The request may have arrived with the end of the handshake
+                connection->handshake = false;
+            }
+#endif
+            bool done = false;
+            if (connection->output == NULL) {
+                // Reading the request
+                ssize_t received = transport_recv(connection->socket, connection->tls,
+                                                  connection->request + connection->received,
+                                                  sizeof(connection->request) - 1 - connection->received);
+                if (received > 0) {
+                    connection->received += received;
+                    connection->request[connection->received] = '\0';
+                    if (connection->proxy && connection_proxy(connection, &es.limits) < 0) done = true;
+                } else if (received == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    done = true;
+                }
+                if (!done && !connection->proxy && request_complete(connection->request, connection->received)) {
+                    // HTTP/2 is cleartext only
+                    connection->h2 = connection->tls != NULL ? NULL :
+                        h2_accept(site, connection->request, connection->received, connection->log_entry.client);
+                    if (connection->h2 != NULL) {
+                        metrics_record(STAGE_RECV, connection->stage_start);
+                        connection->sent = 0;
+                        connection->next = es.h2_connections;
+                        if (es.h2_connections) es.h2_connections->prev = connection;
+                        es.h2_connections = connection;
+                        if (epoll_h2(&es, site, connection, false)) epoll_close(&es, connection);
+                        continue;
+                    }
+                    connection_process(site, connection);
+                    if (connection->output == NULL) {
+                        done = true;
+                    } else {
+                        limits_schedule(&es.wheel, &connection->timer, es.limits.write_timeout);
+                    }
+                }
+            }
+            if (!done && connection->output != NULL) {
+                // Sending the response
+                while (connection->sent < connection->output_length) {
+                    ssize_t sent = connection_send(connection);
+                    if (sent <= 0) break;
+                    connection->sent += sent;
+                }
+                if (connection->sent == connection->output_length ||
+                    (errno != EAGAIN && errno != EINTR)) {
+                    done = true;
+                } else {
+                    struct epoll_event client_event = { .events = EPOLLOUT, .data.ptr = connection };
+                    epoll_ctl(es.epoll, EPOLL_CTL_MOD, connection->socket, &client_event);
+                }
+            }
+            if (done) epoll_close(&es, connection);
+        }
+
+        // After the events: shared renderings and expired connections are freed
+        page_cache_batch_end();
+        timer_advance(&es.wheel, timer_tick(), epoll_timeout, &es);
+    }
+
+    close(es.epoll);
+    limits_free(&es.limits);
+    site_release(site);
+    return 0;
+}
+
+#endif  // __linux__
+
+#ifdef CSERVER_URING
+
+// Minimal io_uring ring over the raw system calls
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;         // includes prepared, unpublished entries
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+// Operation kinds, stored in the low byte of the user data
+enum uring_operation {
+    URING_ACCEPT, URING_RECV, URING_READ, URING_WRITE, URING_CLOSE, URING_WAKE, URING_CANCEL, URING_TICK
+};
+
+static inline uint64_t uring_data(unsigned index, enum uring_operation operation) {
+    return ((uint64_t)index << 8) | operation;
+}
+
+static void uring_free(struct uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+static int uring_setup(struct uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Submissions only come from the worker thread
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    ring->cq_ring = single_mmap ? ring->sq_ring :
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+        uring_free(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Publishes prepared entries, submits them and waits for `wait` completions
+static int uring_submit(struct uring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        unsigned pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0 && wait == 0) return 0;
+        int result = syscall(__NR_io_uring_enter, ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result >= 0 || errno != EINTR) return result;
+        // Interrupted while waiting; completions may be ready anyway
+        if (wait && *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        // Full: submit what is prepared so far
+        uring_submit(ring, 0);
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Checks that the kernel supports all operations the backend uses
+static bool uring_supported(struct uring *ring) {
+    const int operations[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL
+    };
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL) return false;
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(operations) / sizeof(operations[0]); i++) {
+        supported = operations[i] <= probe->last_op && (probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+// State of the io_uring backend
+struct uring_server {
+    struct uring ring;
+    struct connection *connections;     // indexed by fixed file slot
+    unsigned connection_count;
+    unsigned active;
+    char *buffers;                      // one buffer per connection
+    size_t buffer_size;
+    bool fixed_buffers;                 // buffers are registered
+    bool client_addresses;              // accept with client addresses
+    bool accepting;
+    // Multishot accept, or single-shot accepts with addresses, per listener
+    struct {
+        bool pending;
+        struct sockaddr_storage address;
+        socklen_t address_len;
+    } accepts[LISTENERS_MAX * URING_ACCEPTS];
+    unsigned accepts_pending;
+    bool accept_full;                   // out of connection slots
+    struct timer_wheel wheel;
+    struct connection_limits limits;
+};
+
+static void uring_arm_accepts(struct uring_server *us) {
+    if (!us->accepting || us->accept_full) return;
+    int count = us->client_addresses ? URING_ACCEPTS : 1;
+    // Each listener has URING_ACCEPTS slots
+    for (int i = 0; i < server.listener_count * URING_ACCEPTS; i++) {
+        if (i % URING_ACCEPTS >= count || us->accepts[i].pending) continue;
+        struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = server.listeners[i / URING_ACCEPTS].socket;
+        // Accepted sockets go straight into the fixed file table
+        sqe->file_index = IORING_FILE_INDEX_ALLOC;
+        if (us->client_addresses) {
+            // Single-shot: every accept needs its own address buffer
+            us->accepts[i].address_len = sizeof(us->accepts[i].address);
+            sqe->addr = (uintptr_t)&us->accepts[i].address;
+            sqe->addr2 = (uintptr_t)&us->accepts[i].address_len;
+        } else {
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        }
+        sqe->user_data = uring_data(i, URING_ACCEPT);
+        us->accepts[i].pending = true;
+        us->accepts_pending++;
+    }
+}
+
+static void uring_recv(struct uring_server *us, unsigned index) {
+    struct connection *connection = &us->connections[index];
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = index;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)(connection->request + connection->received);
+    sqe->len = sizeof(connection->request) - 1 - connection->received;
+    sqe->user_data = uring_data(index, URING_RECV);
+    connection->receiving = true;
+}
+
+// Sends the rest of the output; data in the connection buffer is written
+// from the registered buffer
+static void uring_write(struct uring_server *us, unsigned index, unsigned flags) {
+    struct connection *connection = &us->connections[index];
+    char *buffer = us->buffers + (size_t)index * us->buffer_size;
+    bool in_buffer = connection->output == buffer;
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    if (in_buffer && us->fixed_buffers) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = index;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+    }
+    sqe->fd = index;
+    sqe->flags = IOSQE_FIXED_FILE | flags;
+    sqe->addr = (uintptr_t)(connection->output + connection->sent);
+    sqe->len = connection->output_length - connection->sent;
+    sqe->user_data = uring_data(index, URING_WRITE);
+}
+
+static void uring_close(struct uring_server *us, unsigned index) {
+    struct connection *connection = &us->connections[index];
+    timer_cancel(&us->wheel, &connection->timer);
+    limits_release(&us->limits, &connection->address);
+    if (connection->output != NULL) connection_finish(connection);
+    trace_free(connection->trace);
+    connection->trace = NULL;
+    h2_session_free(connection->h2);
+    connection->h2 = NULL;
+    string_free(connection->response);
+    connection->response = string_init();
+    connection->active = false;
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+    sqe->user_data = uring_data(index, URING_CLOSE);
+}
+
+// Static files that fit into the connection buffer are sent from it: cached
+// files are copied, others are read with a read linked to the write.
+// Returns false if the file cannot be sent this way.
+static bool uring_send_file(struct uring_server *us, unsigned index, struct file_cache_entry *file) {
+    struct connection *connection = &us->connections[index];
+    if (file == NULL || file->rendered) return false;
+
+    uint64_t stage_start = metrics_now();
+    char *buffer = us->buffers + (size_t)index * us->buffer_size;
+    size_t header_length = format_response_header(buffer, us->buffer_size, HTTP_STATUS_200,
+                                                  file->content_type, file->headers ? file->headers : "",
+                                                  file->size);
+    if (header_length == 0 || header_length + file->size > us->buffer_size) return false;
+
+    connection->output = buffer;
+    connection->output_length = header_length + file->size;
+    connection->sent = 0;
+    connection->log_entry.status = 200;
+    connection->log_entry.bytes = file->size;
+
+    if (file->map) {
+        memcpy(buffer + header_length, file->map, file->size);
+        connection->stage_start = metrics_record(STAGE_RESPONSE, stage_start);
+        uring_write(us, index, 0);
+        return true;
+    }
+
+    metrics_record(STAGE_RESPONSE, stage_start);
+    connection->stage_start = metrics_now();
+    // The entry stays open until the read completes
+    atomic_fetch_add(&file->references, 1);
+    connection->file = file;
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = us->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t)(buffer + header_length);
+    sqe->len = file->size;
+    sqe->off = 0;
+    sqe->buf_index = index;
+    // A short read breaks the link and cancels the write
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = uring_data(index, URING_READ);
+    uring_write(us, index, 0);
+    return true;
+}
+
+static void uring_request(struct uring_server *us, struct site *site, unsigned index) {
+    struct connection *connection = &us->connections[index];
+    parse_request_line(connection->request, connection->method, connection->url);
+    connection->trace = trace_start(connection->request);
+    uint64_t stage_start = metrics_record(STAGE_RECV, connection->stage_start);
+    site = site_host(site, connection->request);
+    unsigned retry_after;
+    bool admitted = rate_limit_admit(site->config, &connection->address, connection->url, &retry_after);
+    struct file_cache_entry *file = admitted ? site_file(site, connection->url, connection->request) : NULL;
+    metrics_record(STAGE_RESOURCE_PATH, stage_start);
+
+    bool metrics_request = site->metrics_path[0] != '\0' && strcmp(connection->url, site->metrics_path) == 0;
+    limits_schedule(&us->wheel, &connection->timer, us->limits.write_timeout);
+    if (!metrics_request && uring_send_file(us, index, file)) {
+        trace_sending(connection->trace);
+        file_cache_release(file);
+        return;
+    }
+
+    string links = admitted ? early_hints_links(site, file) : string_init();
+    connection->response = admitted
+        ? process_request(site, connection->method, connection->url, file, links.value, &connection->log_entry)
+        : rate_limit_response(retry_after, &connection->log_entry);
+    string_free(links);
+    file_cache_release(file);
+    trace_sending(connection->trace);
+    connection->output = connection->response.value;
+    connection->output_length = connection->response.length;
+    connection->sent = 0;
+    if (connection->output == NULL) {
+        uring_close(us, index);
+        return;
+    }
+    // Small responses are copied into the registered buffer
+    char *buffer = us->buffers + (size_t)index * us->buffer_size;
+    if (us->fixed_buffers && connection->output_length <= us->buffer_size) {
+        memcpy(buffer, connection->output, connection->output_length);
+        connection->output = buffer;
+    }
+    connection->stage_start = metrics_now();
+    uring_write(us, index, 0);
+}
+
+static void uring_cancel(struct uring_server *us, unsigned index, enum uring_operation operation) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(index, operation);
+    sqe->user_data = uring_data(0, URING_CANCEL);
+}
+
+// Keeps a receive and a write in flight on an HTTP/2 connection; a closing
+// connection is closed once its operations completed or were cancelled.
+// The write timeout starts again on progress: new requests or output sent.
+static void uring_h2_continue(struct uring_server *us, unsigned index, bool progress) {
+    struct connection *connection = &us->connections[index];
+    struct h2_session *h2 = connection->h2;
+    if (!connection->closing && connection->output == NULL) {
+        size_t length;
+        const char *output = h2_output(h2, &length);
+        if (length > 0) {
+            connection->output = output;
+            connection->output_length = length;
+            connection->sent = 0;
+            uring_write(us, index, 0);
+        } else if (h2_done(h2)) {
+            connection->closing = true;
+        }
+    }
+    if (connection->closing) {
+        if (connection->receiving) {
+            uring_cancel(us, index, URING_RECV);
+        } else if (connection->output != NULL) {
+            uring_cancel(us, index, URING_WRITE);
+        } else {
+            uring_close(us, index);
+        }
+        return;
+    }
+    // Input waits while the client leaves too much output unread
+    if (!connection->receiving && h2_reading(h2)) uring_recv(us, index);
+    if (h2_idle(h2)) {
+        limits_schedule(&us->wheel, &connection->timer, us->limits.header_timeout);
+    } else if (progress) {
+        limits_schedule(&us->wheel, &connection->timer, us->limits.write_timeout);
+    }
+}
+
+// Pending operations of a timed out connection are cancelled; their
+// completions close it
+static void uring_timeout(struct timer *timer, void *data) {
+    struct uring_server *us = data;
+    struct connection *connection = timer_connection(timer);
+    unsigned index = connection - us->connections;
+    if (connection->h2 != NULL) {
+        // Idle connections get GOAWAY first, stalled ones are closed
+        if (h2_idle(connection->h2)) {
+            h2_shutdown(connection->h2);
+        } else {
+            limits_count_timeout();
+            connection->closing = true;
+        }
+        uring_h2_continue(us, index, false);
+    } else if (connection->output == NULL) {
+        connection->timed_out = true;
+        uring_cancel(us, index, URING_RECV);
+    } else if (limits_check_rate(&us->limits, connection->sent, connection->output_length, &connection->checked)) {
+        limits_schedule(&us->wheel, timer, us->limits.write_timeout);
+    } else {
+        connection->timed_out = true;
+        uring_cancel(us, index, URING_WRITE);
+    }
+}
+
+// Answers a request that was not received in time
+static void uring_request_timeout(struct uring_server *us, unsigned index) {
+    struct connection *connection = &us->connections[index];
+    limits_count_timeout();
+    connection->timed_out = false;
+    connection->log_entry.status = 408;
+    connection->output = request_timeout_response;
+    connection->output_length = strlen(request_timeout_response);
+    connection->sent = 0;
+    connection->stage_start = metrics_now();
+    limits_schedule(&us->wheel, &connection->timer, us->limits.write_timeout);
+    uring_write(us, index, 0);
+}
+
+static void uring_complete(struct uring_server *us, struct site *site, struct io_uring_cqe *cqe) {
+    unsigned index = cqe->user_data >> 8;
+    struct connection *connection = index < us->connection_count ? &us->connections[index] : NULL;
+
+    switch (cqe->user_data & 0xff) {
+        case URING_ACCEPT: {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                us->accepts[index].pending = false;
+                us->accepts_pending--;
+            }
+            if (cqe->res < 0) {
+                // Out of descriptors: cached files are closed, or accepts wait
+                // for a connection to close
+                if (cqe->res == -ENFILE || cqe->res == -EMFILE) us->accept_full = file_cache_shrink() == 0;
+                break;
+            }
+            if ((unsigned)cqe->res >= us->connection_count) break;
+            struct connection *accepted = &us->connections[cqe->res];
+            struct listener *listener = &server.listeners[index / URING_ACCEPTS];
+            struct sockaddr *peer = us->client_addresses && !listener->proxy_protocol
+                ? (struct sockaddr *)&us->accepts[index].address : NULL;
+            struct client_address address;
+            client_address_set(&address, peer);
+            us->active++;
+            if (!limits_admit(&us->limits, &address)) {
+                struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->file_index = cqe->res + 1;
+                sqe->user_data = uring_data(cqe->res, URING_CLOSE);
+                break;
+            }
+            connection_start(accepted, peer, listener->proxy_protocol);
+            accepted->socket = cqe->res;
+            limits_schedule(&us->wheel, &accepted->timer, us->limits.header_timeout);
+            uring_recv(us, cqe->res);
+            break;
+        }
+        case URING_RECV:
+            connection->receiving = false;
+            if (connection->h2 != NULL) {
+                uint32_t last_stream = connection->h2->last_stream;
+                if (cqe->res <= 0) {
+                    connection->closing = true;
+                } else if (!connection->closing) {
+                    h2_receive(connection->h2, site, connection->request, cqe->res);
+                }
+                uring_h2_continue(us, index, connection->h2->last_stream != last_stream);
+                break;
+            }
+            if (connection->timed_out) {
+                uring_request_timeout(us, index);
+                break;
+            }
+            if (cqe->res <= 0) {
+                uring_close(us, index);
+                break;
+            }
+            connection->received += cqe->res;
+            connection->request[connection->received] = '\0';
+            if (connection->proxy) {
+                int proxied = connection_proxy(connection, &us->limits);
+                if (proxied < 0) {
+                    uring_close(us, index);
+                    break;
+                }
+            }
+            if (!connection->proxy && request_complete(connection->request, connection->received)) {
+                connection->h2 = h2_accept(site, connection->request, connection->received,
+                                           connection->log_entry.client);
+                if (connection->h2 != NULL) {
+                    metrics_record(STAGE_RECV, connection->stage_start);
+                    connection->received = 0;
+                    uring_h2_continue(us, index, true);
+                } else {
+                    uring_request(us, site, index);
+                }
+            } else {
+                uring_recv(us, index);
+            }
+            break;
+        case URING_READ:
+            connection->stage_start = metrics_record(STAGE_READ_FILE, connection->stage_start);
+            file_cache_release(connection->file);
+            connection->file = NULL;
+            break;
+        case URING_WRITE:
+            if (connection->h2 != NULL) {
+                if (cqe->res > 0) connection->sent += cqe->res;
+                if (connection->sent < connection->output_length) {
+                    if (cqe->res <= 0) connection->closing = true;
+                    if (!connection->closing) {
+                        limits_schedule(&us->wheel, &connection->timer, us->limits.write_timeout);
+                        uring_write(us, index, 0);
+                        break;
+                    }
+                } else {
+                    h2_output_sent(connection->h2);
+                }
+                connection->output = NULL;
+                uring_h2_continue(us, index, cqe->res > 0);
+                break;
+            }
+            if (cqe->res < 0 || connection->timed_out) {
+                uring_close(us, index);
+                break;
+            }
+            connection->sent += cqe->res;
+            if (connection->sent < connection->output_length && cqe->res > 0) {
+                uring_write(us, index, 0);
+            } else {
+                uring_close(us, index);
+            }
+            break;
+        case URING_CLOSE:
+            us->active--;
+            us->accept_full = false;
+            break;
+    }
+}
+
+// Event loop over io_uring; returns -1 if io_uring is not available
+static int serve_uring(cJSON *config, bool log_clients) {
+    cJSON *uring_config = cJSON_GetObjectItem(config, "io_uring");
+    struct uring_server us;
+    memset(&us, 0, sizeof(us));
+    us.connection_count = read_int(uring_config, "connections", URING_CONNECTIONS);
+    us.buffer_size = read_int(uring_config, "buffer_size", URING_BUFFER_SIZE);
+    if (us.connection_count < 1 || us.connection_count > 65536) us.connection_count = URING_CONNECTIONS;
+    if (us.buffer_size < 4096) us.buffer_size = URING_BUFFER_SIZE;
+
+    unsigned entries = 1;
+    while (entries < us.connection_count * 2) entries <<= 1;
+    if (uring_setup(&us.ring, entries) != 0) return -1;
+    if (!uring_supported(&us.ring)) {
+        uring_free(&us.ring);
+        return -1;
+    }
+
+    // Sparse fixed file table, filled by direct accepts (Linux 5.19)
+    struct io_uring_rsrc_register files = { .nr = us.connection_count, .flags = IORING_RSRC_REGISTER_SPARSE };
+    if (syscall(__NR_io_uring_register, us.ring.fd, IORING_REGISTER_FILES2, &files, sizeof(files)) != 0) {
+        uring_free(&us.ring);
+        return -1;
+    }
+
+    us.connections = calloc(us.connection_count, sizeof(struct connection));
+    us.buffers = mmap(NULL, (size_t)us.connection_count * us.buffer_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (us.connections == NULL || us.buffers == MAP_FAILED) {
+        free(us.connections);
+        if (us.buffers != MAP_FAILED) munmap(us.buffers, (size_t)us.connection_count * us.buffer_size);
+        uring_free(&us.ring);
+        return -1;
+    }
+
+    // Registered buffers are pinned once instead of on every read and write;
+    // without them (RLIMIT_MEMLOCK) the same buffers are used unregistered
+    struct iovec *buffers = calloc(us.connection_count, sizeof(struct iovec));
+    for (unsigned i = 0; buffers && i < us.connection_count; i++) {
+        buffers[i].iov_base = us.buffers + (size_t)i * us.buffer_size;
+        buffers[i].iov_len = us.buffer_size;
+    }
+    us.fixed_buffers = buffers &&
+        syscall(__NR_io_uring_register, us.ring.fd, IORING_REGISTER_BUFFERS, buffers, us.connection_count) == 0;
+    free(buffers);
+
+    // Per-client caps and rate limits need the client addresses too
+    limits_init(&us.limits, config);
+    us.client_addresses = log_clients || us.limits.clients != NULL || rate_limits_enabled();
+    timer_wheel_init(&us.wheel, timer_tick());
+    struct __kernel_timespec tick = { .tv_sec = 0, .tv_nsec = TIMER_TICK * 1000000LL };
+    bool tick_pending = false;
+
+    fprintf(stderr, "Using io_uring%s\n", us.fixed_buffers ? "" : " without registered buffers");
+    struct site *site = site_acquire();
+    us.accepting = true;
+    bool wake_pending = false;
+
+    while (us.accepting || us.active > 0 || us.accepts_pending > 0) {
+        site = worker_site(site);
+
+        if (us.accepting && !atomic_load_explicit(&server.running, memory_order_relaxed)) {
+            // Stopped or handed off: cancel accepts, finish the open connections
+            us.accepting = false;
+            for (int i = 0; i < server.listener_count * URING_ACCEPTS; i++) {
+                if (!us.accepts[i].pending) continue;
+                struct io_uring_sqe *sqe = uring_get_sqe(&us.ring);
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = uring_data(i, URING_ACCEPT);
+                sqe->user_data = uring_data(0, URING_CANCEL);
+            }
+            for (unsigned i = 0; i < us.connection_count; i++) {
+                struct connection *connection = &us.connections[i];
+                if (!connection->active || connection->h2 == NULL || connection->closing) continue;
+                h2_shutdown(connection->h2);
+                uring_h2_continue(&us, i, false);
+            }
+        }
+        uring_arm_accepts(&us);
+        if (us.accepting && !wake_pending) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&us.ring);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = server.wake[0];
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = uring_data(0, URING_WAKE);
+            wake_pending = true;
+        }
+        if (us.wheel.count > 0 && !tick_pending) {
+            // Wakes the loop up for the timer wheel
+            struct io_uring_sqe *sqe = uring_get_sqe(&us.ring);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uintptr_t)&tick;
+            sqe->len = 1;
+            sqe->user_data = uring_data(0, URING_TICK);
+            tick_pending = true;
+        }
+
+        // One system call submits the batch and waits for completions
+        if (uring_submit(&us.ring, 1) < 0) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        timer_advance(&us.wheel, timer_tick(), uring_timeout, &us);
+
+        unsigned head = *us.ring.cq_head;
+        while (head != __atomic_load_n(us.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = us.ring.cqes[head & *us.ring.cq_mask];
+            __atomic_store_n(us.ring.cq_head, ++head, __ATOMIC_RELEASE);
+            if ((cqe.user_data & 0xff) == URING_WAKE) {
+                wake_pending = false;
+                continue;
+            }
+            if ((cqe.user_data & 0xff) == URING_TICK) {
+                tick_pending = false;
+                continue;
+            }
+            uring_complete(&us, site, &cqe);
+        }
+        page_cache_batch_end();
+    }
+
+    site_release(site);
+    for (unsigned i = 0; i < us.connection_count; i++) string_free(us.connections[i].response);
+    free(us.connections);
+    munmap(us.buffers, (size_t)us.connection_count * us.buffer_size);
+    uring_free(&us.ring);
+    limits_free(&us.limits);
+    return 0;
+}
+
+#endif  // CSERVER_URING
+
+int start_server(char* path, bool cli_mode) {
+
+    // The absolute path identifies the instance in the registry
+    char site_path[MAX_PATH_LEN];
+    if (realpath(path, site_path) == NULL) {
+        perror("Failed path");
+        return EXIT_FAILURE;
+    }
+    pid_t running_pid = get_path_pid(site_path);
+
+    // A bundle is served from its directory, where the access log and the
+    // TLS files are looked up
+    char directory[MAX_PATH_LEN];
+    snprintf(directory, sizeof(directory), "%s", site_path);
+    struct stat path_stat;
+    bool bundle = stat(site_path, &path_stat) == 0 && S_ISREG(path_stat.st_mode);
+    if (bundle) {
+        char *last_slash = strrchr(directory, '/');
+        if (last_slash == directory) last_slash++;
+        *last_slash = '\0';
+        site_use_bundle(site_path);
+    }
+
+    if (cli_mode) {
+        chdir(directory);
+    } else {
+        daemonize(directory);
+    }
+
+    // Read configuration and collect metadata
+    struct site *site = site_load();
+    if (site == NULL) return EXIT_FAILURE;
+    site_publish(site);
+    int port = read_int(site->config, "port", PORT);
+#ifdef CSERVER_TLS
+    if (tls_init(site->config) != 0) return EXIT_FAILURE;
+#endif
+
+    // Take over the listening sockets from a running instance at this path,
+    // so that there is no window with refused connections
+    char socket_path[MAX_PATH_LEN];
+    int handed[LISTENERS_MAX];
+    int handed_count = 0;
+    if (running_pid > 0 && registry_path(socket_path, sizeof(socket_path), running_pid, ".sock") == 0) {
+        handed_count = control_handoff(socket_path, handed, LISTENERS_MAX);
+        if (handed_count < 0) handed_count = 0;
+    }
+    if (listeners_open(site->config, port, handed, handed_count) != 0) return 1;
+
+    // The port shown by `cserver list` is the first TCP listener's
+    port = 0;
+    for (int i = 0; i < server.listener_count && port == 0; i++) {
+        struct sockaddr_storage address;
+        socklen_t address_len = sizeof(address);
+        if (getsockname(server.listeners[i].socket, (struct sockaddr *)&address, &address_len) != 0) continue;
+        if (address.ss_family == AF_INET) port = ntohs(((struct sockaddr_in *)&address)->sin_port);
+        if (address.ss_family == AF_INET6) port = ntohs(((struct sockaddr_in6 *)&address)->sin6_port);
+    }
+    for (int i = 0; i < server.listener_count; i++) {
+        fprintf(stderr, "Listening on %s%s\n", server.listeners[i].name,
+                server.listeners[i].proxy_protocol ? " (PROXY protocol)" : "");
+    }
+    server.pid = getpid();
+    snprintf(server.path, sizeof(server.path), "%s", site_path);
+    server.port = port;
+    server.started = time(NULL);
+    atomic_store(&server.running, true);
+    // Bundled routes are served from the mapping, without the caches
+    if (!bundle) {
+        file_cache_init(site->config);
+        page_cache_init(site->config);
+        fragment_cache_init(site->config);
+    }
+#ifdef CSERVER_LUA
+    if (lua_pool_init(site->config) != 0) fprintf(stderr, "Failed to create Lua states\n");
+#endif
+    if (registry_path(socket_path, sizeof(socket_path), server.pid, ".sock") == 0 &&
+        control_open(socket_path) == 0) {
+        registry_add(server.pid, server.path, server.port, server.started);
+    }
+
+    // mustach library hook for partials, see mustach-wrap.h
+    mustach_wrap_get_partial = load_partial;
+
+    if (rate_limits_init(site->config) == 0) fprintf(stderr, "Rate limits enabled\n");
+
+    // Client addresses are only needed for the access log
+    bool log_clients = access_log_open(site->config, 1, cli_mode) == 0;
+    if (trace_open(site->config) == 0) fprintf(stderr, "Tracing enabled\n");
+    // Closed connections are reported by send
+    signal(SIGPIPE, SIG_IGN);
+
+    // I/O backend; io_uring falls back to epoll, epoll to blocking calls
+    enum io_backend backend = io_backend_parse(read_string(site->config, "io", "auto"));
+#ifdef CSERVER_TLS
+    // io_uring accepts into fixed files, which have no descriptors for the handshake
+    if (tls_enabled() && backend == IO_BACKEND_URING) backend = IO_BACKEND_EPOLL;
+#endif
+    int served = -1;
+#ifdef CSERVER_URING
+    if (backend == IO_BACKEND_URING) {
+        served = serve_uring(site->config, log_clients);
+    }
+#endif
+#ifdef __linux__
+    if (served < 0 && backend >= IO_BACKEND_EPOLL) {
+        served = serve_epoll(site->config);
+    }
+#endif
+    if (served < 0) serve_blocking(site->config);
+    (void)log_clients;
+
+    // Stopped or handed off to a new instance
+    listeners_close();
+    control_close();
+    access_log_close();
+    trace_close();
+#ifdef CSERVER_LUA
+    lua_pool_close();
+#endif
+#ifdef CSERVER_TLS
+    tls_free();
+#endif
+    return EXIT_SUCCESS;
+}
+
+pid_t get_path_pid(char *path) {
+    char server_path[MAX_PATH_LEN];
+    if (realpath(path, server_path) == NULL) return 0;
+
+    pid_t result = 0;
+    cJSON *instances = registry_list();
+    cJSON *instance;
+    cJSON_ArrayForEach(instance, instances) {
+        cJSON *instance_path = cJSON_GetObjectItem(instance, "path");
+        if (cJSON_IsString(instance_path) && strcmp(instance_path->valuestring, server_path) == 0) {
+            result = read_int(instance, "pid", 0);
+        }
+    }
+    cJSON_Delete(instances);
+    return result;
+}
+
+// Formats seconds as [days d ]hh:mm:ss
+static void format_uptime(char *result, size_t result_len, long seconds) {
+    long days = seconds / 86400;
+    seconds %= 86400;
+    if (days > 0) {
+        snprintf(result, result_len, "%ldd %02ld:%02ld:%02ld", days, seconds / 3600, seconds / 60 % 60, seconds % 60);
+    } else {
+        snprintf(result, result_len, "%02ld:%02ld:%02ld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+    }
+}
+
+int list_servers() {
+    cJSON *instances = registry_list();
+    cJSON *instance;
+
+    printf("%-8s %-12s %8s %6s %8s  %s\n", "PID", "UPTIME", "REQ/S", "HIT", "RSS", "PATH");
+    cJSON_ArrayForEach(instance, instances) {
+        pid_t pid = read_int(instance, "pid", 0);
+        char *path = read_string(instance, "path", "");
+        string response = control_request(pid, "stats");
+        cJSON *stats = response.value ? cJSON_Parse(response.value) : NULL;
+        string_free(response);
+        if (stats == NULL) {
+            printf("%-8i %-12s %8s %6s %8s  %s\n", pid, "-", "-", "-", "-", path);
+            continue;
+        }
+
+        char uptime[32], hit_rate[16], rss[16];
+        format_uptime(uptime, sizeof(uptime), (long)read_double(stats, "uptime", 0));
+        // Instances without a page cache report no hit rate
+        double cache_hit_rate = read_double(stats, "cache_hit_rate", -1);
+        if (cache_hit_rate < 0) {
+            snprintf(hit_rate, sizeof(hit_rate), "-");
+        } else {
+            snprintf(hit_rate, sizeof(hit_rate), "%.1f%%", cache_hit_rate * 100);
+        }
+        snprintf(rss, sizeof(rss), "%.1fM", read_double(stats, "rss", 0) / (1024 * 1024));
+        printf("%-8i %-12s %8.1f %6s %8s  %s\n", pid, uptime,
+            read_double(stats, "requests_per_second", 0), hit_rate, rss, path);
+        cJSON_Delete(stats);
+    }
+
+    cJSON_Delete(instances);
+    return EXIT_SUCCESS;
+}
+
+int restart_server(char *path) {
+    pid_t pid = get_path_pid(path);
+    if (pid == 0) {
+        fprintf(stderr, "Error: No running server found for the provided path\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The new instance takes over the listening socket; the running one
+    // finishes its current request and exits
+    return start_server(path, false);
+}
+
+int reload_server(char *path) {
+    pid_t pid = get_path_pid(path);
+    if (pid == 0) {
+        fprintf(stderr, "Error: No running server found for the provided path\n");
+        exit(EXIT_FAILURE);
+    }
+    string response = control_request(pid, "reload");
+    if (response.value == NULL) {
+        fprintf(stderr, "Error: Server %i is not responding\n", pid);
+        exit(EXIT_FAILURE);
+    }
+    string_free(response);
+    return EXIT_SUCCESS;
+}
+
+int stop_server(char *id) {
+    // Process ID or path of a registered instance
+    char *end;
+    long number = strtol(id, &end, 10);
+    pid_t pid = (*id != '\0' && *end == '\0') ? (pid_t)number : get_path_pid(id);
+    cJSON *instance = pid > 0 ? registry_read(pid) : NULL;
+    if (instance == NULL) {
+        fprintf(stderr, "Error: %s is not a running cserver instance\n", id);
+        exit(EXIT_FAILURE);
+    }
+    cJSON_Delete(instance);
+
+    string response = control_request(pid, "stop");
+    if (response.value != NULL) {
+        string_free(response);
+        return EXIT_SUCCESS;
+    }
+
+    // Registered, but the control socket does not respond
+    if (kill(pid, SIGTERM) == -1) {
+        if (errno == ESRCH) registry_remove(pid);
+        perror("Error sending SIGTERM");
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void append_path(char *result, size_t result_len, char *p1, char *p2) {
+    if (!p1) {
+        snprintf(result, result_len, "%s", p2);
+    } else if (!p2) {
+        snprintf(result, result_len, "%s", p1);
+    } else {
+        snprintf(result, result_len, "%s/%s", p1, p2);
+    }
+}
+
+void to_lowercase_and_dash(char *output, const char *input) {
+    while (*input) {
+        if (isspace((unsigned char)*input)) {
+            *output = '-';
+        } else {
+            *output = tolower((unsigned char)*input);
+        }
+        output++;
+        input++;
+    }
+    *output = '\0';
+}
+
+void store_metadata(cJSON *metadata, char *key, char *value, char *filename) {
+    if (!cJSON_HasObjectItem(metadata, key)) {
+        cJSON_AddObjectToObject(metadata, key);
+    }
+    cJSON *key_json = cJSON_GetObjectItem(metadata, key);
+
+    if (strcmp(key, "slug") == 0) {                             // "slug": { "slug-value": "filename" }
+        cJSON_AddStringToObject(key_json, value, filename);     
+    } else if (strcmp(key, "published") == 0) {                 // "published": { "filename": "date" }
+        cJSON_AddStringToObject(key_json, filename, value);     
+    } else if (strcmp(key, "tags") == 0) {                      // "tags": { "name": ["filename", ...]  }
+        char *tag_state = NULL;
+        char *tag = strtok_r(value, ",", &tag_state);
+        while (tag != NULL) {
+            trim_whitespace(tag);
+            if (!cJSON_HasObjectItem(key_json, tag)) {
+                cJSON_AddArrayToObject(key_json, tag);
+            }
+            cJSON *tag_array = cJSON_GetObjectItem(key_json, tag);
+            cJSON_AddItemToArray(tag_array, cJSON_CreateString(filename));
+            tag = strtok_r(NULL, ",", &tag_state);
+        }
+    } else {                                                    // "category": { "name": ["filename", ...]},
+        if (!cJSON_HasObjectItem(key_json, value)) {            // "author": { "name": ["filename", ...] }, ...
+            cJSON_AddArrayToObject(key_json, value);
+        }
+        cJSON *value_array = cJSON_GetObjectItem(key_json, value);
+        cJSON_AddItemToArray(value_array, cJSON_CreateString(filename));
+    }
+}
+
+// Modification time with nanoseconds, stored with the front matter
+static struct timespec page_modified(const struct stat *file_stat) {
+#ifdef __APPLE__
+    return file_stat->st_mtimespec;
+#else
+    return file_stat->st_mtim;
+#endif
+}
+
+// First paragraph of the Markdown body that is plain text, on one line and
+// cut at a word boundary, or a character boundary if it has no spaces; NULL
+// if there is none
+static char *page_summary(const char *body, size_t length) {
+    const char *end = body + length;
+    const char *paragraph = body;
+    while (paragraph < end) {
+        // Paragraphs are separated by blank lines
+        while (paragraph < end && (*paragraph == '\n' || *paragraph == '\r')) paragraph++;
+        const char *paragraph_end = paragraph;
+        while (paragraph_end < end) {
+            const char *line_end = memchr(paragraph_end, '\n', end - paragraph_end);
+            if (line_end == NULL) {
+                paragraph_end = end;
+                break;
+            }
+            paragraph_end = line_end + 1;
+            if (paragraph_end < end && (*paragraph_end == '\n' || *paragraph_end == '\r')) break;
+        }
+        bool text = paragraph < paragraph_end && strchr("#<{!|-*>`=[", *paragraph) == NULL &&
+                    memmem(paragraph, paragraph_end - paragraph, "{{", 2) == NULL;
+        if (!text) {
+            paragraph = paragraph_end;
+            continue;
+        }
+        char *summary = malloc(CHILDREN_SUMMARY_MAX + 4);
+        if (summary == NULL) return NULL;
+        size_t summary_length = 0, word_end = 0;
+        const char *c = paragraph;
+        for (; c < paragraph_end && summary_length < CHILDREN_SUMMARY_MAX; c++) {
+            char character = *c == '\n' || *c == '\r' || *c == '\t' ? ' ' : *c;
+            if (character == ' ' && (summary_length == 0 || summary[summary_length - 1] == ' ')) continue;
+            if (character == ' ') word_end = summary_length;
+            summary[summary_length++] = character;
+        }
+        // Text without spaces is cut before a character split at the limit
+        if (word_end == 0 && c < paragraph_end && ((unsigned char)*c & 0xc0) == 0x80) {
+            while (summary_length > 0 && ((unsigned char)summary[summary_length - 1] & 0xc0) == 0x80) summary_length--;
+            if (summary_length > 0) summary_length--;
+        }
+        while (c < paragraph_end && isspace((unsigned char)*c)) c++;
+        if (c < paragraph_end) {
+            if (word_end > 0) summary_length = word_end;
+            memcpy(summary + summary_length, "...", 3);
+            summary_length += 3;
+        }
+        while (summary_length > 0 && summary[summary_length - 1] == ' ') summary_length--;
+        summary[summary_length] = '\0';
+        return summary;
+    }
+    return NULL;
+}
+
+// Lists a page with a title among the children of its directory
+static void add_child(cJSON *children, const char *link, const char *name, cJSON *page, char *summary) {
+    cJSON *title = cJSON_GetObjectItem(page, "title");
+    if (!cJSON_IsString(title)) return;
+    char directory[MAX_PATH_LEN];
+    const char *slash = strrchr(link, '/');
+    snprintf(directory, sizeof(directory), "%.*s", slash ? (int)(slash - link) : 0, link);
+    cJSON *siblings = cJSON_GetObjectItem(children, directory);
+    if (!siblings) siblings = cJSON_AddArrayToObject(children, directory);
+
+    cJSON *child = cJSON_CreateObject();
+    cJSON_AddStringToObject(child, "title", title->valuestring);
+    cJSON_AddStringToObject(child, "slug", read_string(page, "slug", (char *)name));
+    cJSON_AddStringToObject(child, "link", link);
+    char *published = read_string(page, "published", NULL);
+    if (published) cJSON_AddStringToObject(child, "published", published);
+    char *page_summary_value = read_string(page, "summary", summary);
+    if (page_summary_value) cJSON_AddStringToObject(child, "summary", page_summary_value);
+    cJSON_AddItemToArray(siblings, child);
+}
+
+void process_file(cJSON *metadata, cJSON *files, cJSON *pages, cJSON *children, const char *filename,
+                  const char *relative_name) {
+    struct stat file_stat;
+    string content = stat(filename, &file_stat) == 0 ? read_file(filename) : string_init();
+    if (content.value == NULL) {
+        perror("Failed to open file");
+        return;
+    }
+
+    // Store relative paths only, 
+    // /path/to/file.md -> /file
+    // /path/to/file/index.md -> /file
+    // Remove the file extension if present
+    char *file_without_ext = strdup(relative_name);
+    char *dot = strrchr(file_without_ext, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    // Remove "/index" part if it exists
+    char *index_part = strstr(file_without_ext, "/index");
+    if (index_part) {
+        *index_part = '\0';
+    }
+
+    // Store initial value in files object
+    char *bare_filename = strrchr(file_without_ext, '/') ? strrchr(file_without_ext, '/') + 1 : file_without_ext;
+    cJSON_AddStringToObject(files, file_without_ext, bare_filename);
+
+    cJSON *page = cJSON_CreateObject();
+    size_t body = parse_front_matter(content.value, content.length, page);
+    char *summary = page_summary(content.value + body, content.length - body);
+    string_free(content);
+    cJSON *item;
+    cJSON_ArrayForEach(item, page) {
+        // Store title directly into files object
+        if (strcmp(item->string, "title") == 0) {
+            cJSON_ReplaceItemInObject(files, file_without_ext, cJSON_CreateString(item->valuestring));
+        }
+        // store_metadata splits tags in place
+        char *value = strdup(item->valuestring);
+        if (value) store_metadata(metadata, item->string, value, file_without_ext);
+        free(value);
+    }
+
+    // Pages are rendered with the front matter parsed here
+    struct timespec modified = page_modified(&file_stat);
+    cJSON *entry = cJSON_CreateObject();
+    cJSON_AddItemToObject(entry, "page", page);
+    cJSON_AddNumberToObject(entry, "body", body);
+    cJSON_AddNumberToObject(entry, "size", file_stat.st_size);
+    cJSON_AddNumberToObject(entry, "modified", modified.tv_sec);
+    cJSON_AddNumberToObject(entry, "modified_ns", modified.tv_nsec);
+    cJSON_AddItemToObject(pages, filename, entry);
+
+    // The home page lists the children of the top directory
+    if (strcmp(relative_name, "index.md") != 0) add_child(children, file_without_ext, bare_filename, page, summary);
+    free(summary);
+    free(file_without_ext);
+}
+
+void collect_metadata(cJSON *metadata, cJSON *pages, cJSON *children, char *base_path, char *path) {
+    char full_path[MAX_PATH_LEN];
+    append_path(full_path, sizeof(full_path), base_path, path);
+    DIR *dir = opendir(full_path);
+    if (!dir) {
+        perror("Failed to open directory");
+        return;
+    }
+
+    cJSON *files = cJSON_GetObjectItem(metadata, "files");
+    if (!files) {
+        files = cJSON_CreateObject();
+        cJSON_AddItemToObject(metadata, "files", files);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_DIR) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            char new_path[1024];
+            append_path(new_path, sizeof(new_path), path, entry->d_name);
+            collect_metadata(metadata, pages, children, base_path, new_path);
+        } else if (entry->d_type == DT_REG) {
+            char *dot = strrchr(entry->d_name, '.');
+            if (dot && strcmp(dot, ".md") == 0) {
+                char filename[1024];
+                append_path(filename, sizeof(filename), full_path, entry->d_name);
+                char relative_name[1024];
+                append_path(relative_name, sizeof(relative_name), path, entry->d_name);
+                process_file(metadata, files, pages, children, filename, relative_name);
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+void create_index(cJSON *metadata) {
+    cJSON *index = cJSON_CreateObject();
+    cJSON *categories = cJSON_CreateArray();
     cJSON_AddItemToObject(index, "category", categories);
 
-    // Extract metadata objects required for creating index
-    cJSON *category_metadata = cJSON_GetObjectItem(metadata, "category");
-    cJSON *files_metadata = cJSON_GetObjectItem(metadata, "files");
+    // Extract metadata objects required for creating index
+    cJSON *category_metadata = cJSON_GetObjectItem(metadata, "category");
+    cJSON *files_metadata = cJSON_GetObjectItem(metadata, "files");
+
+    if (!category_metadata || !files_metadata) {
+        cJSON_AddItemToObject(metadata, "index", index);
+        return;
+    }
+
+    cJSON *category;
+    cJSON_ArrayForEach(category, category_metadata) {
+        const char *category_name = category->string;
+        char lowercased_name[256];
+        to_lowercase_and_dash(lowercased_name, category_name);
+
+        cJSON *category_object = cJSON_CreateObject();
+        cJSON_AddStringToObject(category_object, "name", lowercased_name);
+        cJSON_AddStringToObject(category_object, "title", category_name);
+
+        cJSON *pages_array = cJSON_CreateArray();
+        cJSON_AddItemToObject(category_object, "pages", pages_array);
+
+        cJSON *page;
+        cJSON_ArrayForEach(page, category) {
+            const char *page_link = page->valuestring;
+
+            cJSON *page_object = cJSON_CreateObject();
+            cJSON_AddStringToObject(page_object, "link", page_link);
+
+            cJSON *page_title = cJSON_GetObjectItem(files_metadata, page_link);
+            if (page_title) {
+                cJSON_AddStringToObject(page_object, "title", page_title->valuestring);
+            }
+
+            cJSON_AddItemToArray(pages_array, page_object);
+        }
+
+        cJSON_AddItemToArray(categories, category_object);
+    }
+
+    cJSON_AddItemToObject(metadata, "index", index);
+}
+
+// Newest first; pages without a date last, then by title
+static int child_compare(const void *a, const void *b) {
+    cJSON *first = *(cJSON * const *)a, *second = *(cJSON * const *)b;
+    const char *first_date = read_string(first, "published", "");
+    const char *second_date = read_string(second, "published", "");
+    int order = strcmp(second_date, first_date);
+    if (order != 0) return order;
+    return strcmp(read_string(first, "title", ""), read_string(second, "title", ""));
+}
+
+static void sort_children(cJSON *array) {
+    int count = cJSON_GetArraySize(array);
+    if (count < 2) return;
+    cJSON **items = malloc(count * sizeof(cJSON *));
+    if (items == NULL) return;
+    for (int i = 0; i < count; i++) items[i] = cJSON_DetachItemFromArray(array, 0);
+    qsort(items, count, sizeof(cJSON *), child_compare);
+    for (int i = 0; i < count; i++) cJSON_AddItemToArray(array, items[i]);
+    free(items);
+}
+
+void create_children(cJSON *metadata, cJSON *children) {
+    // Category pages, like "category/demo", list the pages of the category
+    cJSON *category;
+    cJSON_ArrayForEach(category, cJSON_GetObjectItem(metadata, "category")) {
+        char name[MAX_PATH_LEN];
+        char lowercased_name[256];
+        snprintf(lowercased_name, sizeof(lowercased_name), "%s", category->string);
+        to_lowercase_and_dash(lowercased_name, lowercased_name);
+        snprintf(name, sizeof(name), "category/%s", lowercased_name);
+        if (cJSON_HasObjectItem(children, name)) continue;
+        cJSON *pages = cJSON_AddArrayToObject(children, name);
+        cJSON *link;
+        cJSON_ArrayForEach(link, category) {
+            // The entry is kept with the page's directory
+            const char *slash = strrchr(link->valuestring, '/');
+            char directory[MAX_PATH_LEN];
+            snprintf(directory, sizeof(directory), "%.*s", slash ? (int)(slash - link->valuestring) : 0,
+                     link->valuestring);
+            cJSON *child;
+            cJSON_ArrayForEach(child, cJSON_GetObjectItem(children, directory)) {
+                if (strcmp(read_string(child, "link", ""), link->valuestring) == 0) {
+                    cJSON_AddItemToArray(pages, cJSON_CreateObjectReference(child->child));
+                    break;
+                }
+            }
+        }
+    }
+
+    cJSON *list;
+    cJSON_ArrayForEach(list, children) sort_children(list);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// CRLF is the standard line break (https://www.w3.org/MarkUp/html-spec/html-spec_8.html#SEC8.2.1)
+// Empty line separates headers from the content
+static const char *header_format = "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n";
+
+size_t format_response_header(char *buffer, size_t buffer_len, const char *http_status,
+                              const char *content_type, const char *headers, size_t content_length) {
+    int header_length = snprintf(buffer, buffer_len, header_format, http_status, content_type, content_length, headers);
+    if (header_length < 0 || (size_t)header_length >= buffer_len) return 0;
+    return header_length;
+}
+
+string make_response(char *http_status, const char *content_type, string content) {
+    return make_response_headers(http_status, content_type, "", content);
+}
+
+string make_response_headers(char *http_status, const char *content_type, const char *headers, string content) {
+    string result = string_init();
+    // Calculate the length of the HTTP response headers
+    int header_length = snprintf(NULL, 0, header_format, http_status, content_type, content.length, headers);
+
+    // Allocate memory for the complete HTTP response
+    // + 1 for the null terminator
+    size_t total_length = header_length + content.length;
+    char *response = (char*)malloc(total_length + 1);
+    if (response == NULL) {
+        return result;
+    }
+
+    // Construct the HTTP response
+    snprintf(response, header_length + 1, header_format, http_status, content_type, content.length, headers);
+    // Content, may contain binary data
+    if (content.value) {
+        memcpy(response + header_length, content.value, content.length);
+    }
+    response[total_length] = '\0';
+    memory_count_string(total_length + 1);
+
+    result.value = response;
+    result.length = total_length;
+    return result;
+}
+
+
+int file_exists(const char *path) {
+    struct stat path_stat;
+    return stat(path, &path_stat) == 0 && S_ISREG(path_stat.st_mode);
+}
+
+char* resource_path(char* request_path) {
+    static _Thread_local char filename[MAX_PATH_LEN];
+    int filenameLength = snprintf(filename, sizeof(filename), "%s" STATIC_FOLDER "%s", site_directory(), request_path);
+
+    // Check if the file exists as is
+    if (file_exists(filename)) {
+        return filename;
+    }
+
+    // Check if a directory exists with an index file
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, "/index.html");
+    if (file_exists(filename)) {
+        return filename;
+    }
+
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, "/index.md");
+    if (file_exists(filename)) {
+        return filename;
+    }
+
+#ifdef CSERVER_LUA
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, "/index.lua");
+    if (file_exists(filename)) {
+        return filename;
+    }
+#endif
+
+    // Reset the filename back to before checking for index files
+    filename[filenameLength] = '\0';
+
+    // Try appending .html and .md to the original URL
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, ".html");
+    if (file_exists(filename)) {
+        return filename;
+    }
+
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, ".md");
+    if (file_exists(filename)) {
+        return filename;
+    }
+
+#ifdef CSERVER_LUA
+    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, ".lua");
+    if (file_exists(filename)) {
+        return filename;
+    }
+#endif
+
+    // Check if there's a directory that matches the path minus the last element
+    char* last_slash = strrchr(filename, '/');
+    if (last_slash != NULL) {
+        *last_slash = '\0'; // Null-terminate to get the preceding directory path
+        snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), "/children.html");
+        if (file_exists(filename)) {
+            return filename;
+        }
+    }
+    if (last_slash != NULL) {
+        *last_slash = '\0'; // Null-terminate to get the preceding directory path
+        snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), "/children.md");
+        if (file_exists(filename)) {
+            return filename;
+        }
+    }
+
+    return NULL;
+}
+
+int strends(char *str, char *suffix) {
+    size_t str_len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return strcmp(str + str_len - suffix_len, suffix);
+}
+
+// Trims string in place; 
+// works with allocated strings
+void trim(char *str) {
+    char *p = str;
+    int len = strlen(p);
+    if (len == 0) return;
+
+    while(isspace(p[len - 1])) p[--len] = 0;
+    while(*p && isspace(*p)) ++p, --len;
+
+    memmove(str, p, len + 1);
+}
+
+const char* get_content_type(char *request_path, char *resource_path) {
+    if (strends(resource_path, ".md") == 0 ||
+        strends(resource_path, ".html") == 0 ||
+        strends(resource_path, ".mustache") == 0) {
+        return content_type_html;
+    } else if (strends(resource_path, ".json") == 0) {
+        return content_type_json;
+    } else {
+        return content_type_text;
+    }
+}
+
+void add_request(cJSON *context, char *method, char *request_path, char *resource_path) {
+    cJSON *request = cJSON_CreateObject();
+    cJSON *request_method = cJSON_CreateString(method);
+    cJSON_AddItemToObject(request, "method", request_method);
+    cJSON *request_request_path = cJSON_CreateString(request_path);
+    cJSON_AddItemToObject(request, "query", request_request_path);
+    cJSON *request_resource_path = cJSON_CreateString(resource_path);
+    cJSON_AddItemToObject(request, "resourcePath", request_resource_path);
+
+    // Extract the last and the one-but-last path components
+    char *path_copy = malloc(strlen(request_path) + 1);
+    strcpy(path_copy, request_path);
+    char *last_slash = strrchr(path_copy, '/');
+    char *page = last_slash ? last_slash + 1 : request_path;  // Point to the component after the last slash
+    cJSON_AddItemToObject(request, "page", cJSON_CreateString(page));
+    if (last_slash) {
+        *last_slash = '\0';
+        last_slash = strrchr(path_copy, '/');
+        if (last_slash) {
+            char *parent = last_slash + 1;
+            cJSON_AddItemToObject(request, "parent", cJSON_CreateString(parent));
+        }
+    }
+    free(path_copy);
+    cJSON_AddItemToObject(context, "request", request);
+}
+
+void add_references(cJSON *context) {
+    cJSON *request = cJSON_GetObjectItem(context, "request");
+    cJSON *site = cJSON_GetObjectItem(context, "site");
+    cJSON *index = cJSON_GetObjectItem(site, "index");
+    cJSON *references = cJSON_CreateObject();
+
+    // Ensure all required objects exist
+    if (!request || !index) {
+        cJSON_AddItemToObject(context, "references", references);
+        return;
+    }
+
+    // Get the parent and page from the request object
+    cJSON *parent_item = cJSON_GetObjectItem(request, "parent");
+    cJSON *page_item = cJSON_GetObjectItem(request, "page");
+
+    const char *parent = parent_item ? parent_item->valuestring : NULL;
+    const char *page = page_item ? page_item->valuestring : NULL;
+
+    // Case 1: If both parent and page exist in the request
+    char dependency[MAX_PATH_LEN];
+    if (parent && page) {
+        snprintf(dependency, sizeof(dependency), "index/%s", parent);
+        page_dependency_add(PAGE_DEPENDENCY_METADATA, dependency);
+        cJSON *metadata_array = cJSON_GetObjectItem(index, parent);
+        if (metadata_array) {
+            cJSON *metadata_item;
+            cJSON_ArrayForEach(metadata_item, metadata_array) {
+                cJSON *name_item = cJSON_GetObjectItem(metadata_item, "name");
+                if (name_item && strcmp(name_item->valuestring, page) == 0) {
+                    // Page matches an item within this category, add its pages to references;
+                    // the site outlives the context
+                    cJSON *pages = cJSON_GetObjectItem(metadata_item, "pages");
+                    if (pages) {
+                        cJSON_AddItemReferenceToObject(references, "pages", pages);
+                    }
+                    break;
+                }
+            }
+        }
+    // Case 2: If only page exists in the request
+    } else if (page) {
+        snprintf(dependency, sizeof(dependency), "index/%s", page);
+        page_dependency_add(PAGE_DEPENDENCY_METADATA, dependency);
+        cJSON *metadata_array = cJSON_GetObjectItem(index, page);
+        if (metadata_array) {
+            cJSON_AddItemReferenceToObject(references, page, metadata_array);
+        }
+    }
+
+    cJSON_AddItemToObject(context, "references", references);
+}
+int read_int(cJSON *object, char *name, int default_value) {
+    cJSON *value_object = cJSON_GetObjectItem(object, name);
+    if (value_object == NULL) return default_value;
+    double value = cJSON_GetNumberValue(value_object);
+    if (isnan(value)) return default_value;
+    return (int)value; 
+}
+
+char* read_string(cJSON *object, char *name, char *default_value) {
+    cJSON *value_object = cJSON_GetObjectItem(object, name);
+    char *value = cJSON_GetStringValue(value_object);
+    return value ? value : default_value;
+}
+
+bool read_bool(cJSON *object, char *name, bool default_value) {
+    cJSON *value_object = cJSON_GetObjectItem(object, name);
+    if (!cJSON_IsBool(value_object)) return default_value;
+    return cJSON_IsTrue(value_object);
+}
+double read_double(cJSON *object, char *name, double default_value) {
+    cJSON *value_object = cJSON_GetObjectItem(object, name);
+    if (value_object == NULL) return default_value;
+    double value = cJSON_GetNumberValue(value_object);
+    if (isnan(value)) return default_value;
+    return value;
+}
+
+int request_header(const char *request, const char *name, char *value, size_t value_len) {
+    size_t name_len = strlen(name);
+    value[0] = '\0';
+    // Skip the request line
+    const char *line = strstr(request, "\r\n");
+    while (line != NULL) {
+        line += 2;
+        if (strncmp(line, "\r\n", 2) == 0) break;     // end of headers
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *start = line + name_len + 1;
+            while (*start == ' ' || *start == '\t') start++;
+            const char *end = strstr(start, "\r\n");
+            size_t length = end ? (size_t)(end - start) : strlen(start);
+            if (length >= value_len) length = value_len - 1;
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return -1;
+}
+
+// Checks that the front matter was parsed from the file as it is
+static bool page_current(cJSON *page, const struct stat *file_stat) {
+    struct timespec modified = page_modified(file_stat);
+    return read_double(page, "size", -1) == file_stat->st_size &&
+           read_double(page, "modified", -1) == modified.tv_sec &&
+           read_double(page, "modified_ns", -1) == modified.tv_nsec;
+}
+
+// Reads a Markdown page from the body offset recorded with its front matter;
+// reads the whole file and sets `page` to NULL if the file changed since
+static string read_page(const char *path, cJSON **page, struct stat *file_stat) {
+    string result = string_init();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, file_stat) != 0) {
+        if (fd >= 0) close(fd);
+        return result;
+    }
+    off_t offset = 0;
+    if (*page != NULL && page_current(*page, file_stat)) {
+        offset = read_double(*page, "body", 0);
+        if (offset > file_stat->st_size) offset = file_stat->st_size;
+    } else {
+        *page = NULL;
+    }
+
+    result.value = malloc(file_stat->st_size - offset + 1);
+    while (result.value && offset + (off_t)result.length < file_stat->st_size) {
+        ssize_t bytes = pread(fd, result.value + result.length, file_stat->st_size - offset - result.length,
+                              offset + result.length);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        result.length += bytes;
+    }
+    if (result.value) {
+        result.value[result.length] = '\0';
+        memory_count_string(result.length + 1);
+    }
+    close(fd);
+    return result;
+}
+
+string render_page(struct site *site, cJSON *context, char *path) {
+
+    uint64_t stage_start = metrics_now();
+    if (strends(path, ".md") == 0) {
+        
+        // Front matter parsed when the site was loaded, the body read from its start
+        cJSON *stored = site ? site_page(site, path) : NULL;
+        // A body without Mustache tags converts the same way for every
+        // request; its HTML is taken from the fragment cache unread
+        struct stat file_stat;
+        string md_html_content = string_init();
+        if (stored != NULL && stat(path, &file_stat) == 0 && page_current(stored, &file_stat)) {
+            md_html_content = fragment_cache_get(path, &file_stat);
+        }
+        string file_content = string_init();
+        substring markdown_content = string_init();
+        if (md_html_content.value == NULL) {
+            trace_begin("read_file");
+            file_content = read_page(path, &stored, &file_stat);
+            trace_end();
+            stage_start = metrics_record(STAGE_READ_FILE, stage_start);
+            if (file_content.value == NULL) return file_content;
+            markdown_content = (substring){ .value = file_content.value, .length = file_content.length };
+        }
+        cJSON *page_metadata;
+        if (stored != NULL) {
+            page_metadata = cJSON_GetObjectItem(stored, "page");
+            cJSON_AddItemReferenceToObject(context, "page", page_metadata);
+        } else {
+            page_metadata = cJSON_CreateObject();
+            trace_begin("parse_front_matter");
+            size_t body = parse_front_matter(file_content.value, file_content.length, page_metadata);
+            trace_end();
+            markdown_content.value += body;
+            markdown_content.length -= body;
+            cJSON_AddItemToObject(context, "page", page_metadata);
+        }
+
+        trace_begin("add_references");
+        add_references(context);
+        if (site != NULL) {
+            const char *url = cJSON_GetStringValue(cJSON_GetObjectItem(cJSON_GetObjectItem(context, "request"), "query"));
+            cJSON *children = url ? site_children(site, url) : NULL;
+            if (children) cJSON_AddItemReferenceToObject(context, "children", children);
+        }
+        trace_end();
+        if (md_html_content.value == NULL) {
+            stage_start = metrics_now();
+            bool plain = memmem(markdown_content.value, markdown_content.length, "{{", 2) == NULL;
+            string md_expanded_content = string_init();
+            if (!plain) {
+                trace_begin("render_mustache content");
+                md_expanded_content = render_mustache(markdown_content, context);
+                trace_end();
+                stage_start = metrics_record(STAGE_MUSTACHE_CONTENT, stage_start);
+            }
+            trace_begin("render_markdown");
+            md_html_content = render_markdown(plain ? markdown_content : md_expanded_content);
+            trace_end();
+            metrics_record(STAGE_MARKDOWN, stage_start);
+            if (plain) fragment_cache_put(path, &file_stat, md_html_content);
+            string_free(md_expanded_content);
+        }
+        string_free(file_content);
+        
+        // context.content = rendered markdown data
+        cJSON *content = cJSON_CreateString(md_html_content.value);
+        cJSON_AddItemToObject(context, "content", content);
+        string_free(md_html_content);
+
+        // mustache template for the file
+        char *template_name = "default";
+        cJSON *page_template_object = cJSON_GetObjectItem(page_metadata, "template");
+        if (page_template_object) {
+            template_name = page_template_object->valuestring;
+        }
+        string template = load_template(template_name);
+        if (template.value == NULL) {
+            template = string_make("{{{content}}}");
+        }
+
+        // Render mustache template with the provided content
+        stage_start = metrics_now();
+        trace_begin("render_mustache template");
+        string html_content = render_mustache(template, context);
+        trace_end();
+        metrics_record(STAGE_MUSTACHE_TEMPLATE, stage_start);
+        string_free(template);
+
+        return html_content;
+
+    }
+
+    trace_begin("read_file");
+    string file_content = read_file(path);
+    trace_end();
+    metrics_record(STAGE_READ_FILE, stage_start);
+    if (file_content.value == NULL) return file_content;
+
+    if (strends(path, ".mustache") == 0) {
+        
+        // Render mustach file
+        stage_start = metrics_now();
+        trace_begin("render_mustache template");
+        string rendered_content = render_mustache(file_content, context);
+        trace_end();
+        metrics_record(STAGE_MUSTACHE_TEMPLATE, stage_start);
+        if (file_content.value) free(file_content.value);
+        return rendered_content;
+
+    } else {
+        
+        // Send raw file data
+        return file_content;
+
+    }
+}
+
+
+// Registry ///////////////////////////////////////////////////////////////////
+
+
+int registry_path(char *result, size_t result_len, pid_t pid, const char *extension) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    int length;
+    if (runtime_dir && runtime_dir[0] != '\0') {
+        length = snprintf(result, result_len, "%s/cserver", runtime_dir);
+    } else {
+        length = snprintf(result, result_len, "/tmp/cserver-%u", (unsigned)getuid());
+    }
+    if (length < 0 || (size_t)length >= result_len) return -1;
+
+    // The directory must belong to the current user
+    if (mkdir(result, 0700) != 0 && errno != EEXIST) return -1;
+    struct stat directory;
+    if (lstat(result, &directory) != 0 || !S_ISDIR(directory.st_mode) || directory.st_uid != getuid()) {
+        return -1;
+    }
+
+    if (pid > 0) {
+        int name_length = snprintf(result + length, result_len - length, "/%i%s", pid, extension);
+        if (name_length < 0 || (size_t)name_length >= result_len - length) return -1;
+    }
+    return 0;
+}
+
+int registry_add(pid_t pid, const char *path, int port, time_t started) {
+    char entry_path[MAX_PATH_LEN], temp_path[MAX_PATH_LEN + 8];
+    if (registry_path(entry_path, sizeof(entry_path), pid, ".json") != 0) return -1;
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", entry_path);
+
+    cJSON *entry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(entry, "pid", pid);
+    cJSON_AddStringToObject(entry, "path", path);
+    cJSON_AddNumberToObject(entry, "port", port);
+    cJSON_AddNumberToObject(entry, "started", (double)started);
+    char *content = cJSON_PrintUnformatted(entry);
+    cJSON_Delete(entry);
+    if (content == NULL) return -1;
+
+    // Write and rename, so that readers never see a partial file
+    int result = -1;
+    int file = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (file >= 0) {
+        size_t length = strlen(content);
+        if (write(file, content, length) == (ssize_t)length && close(file) == 0) {
+            result = rename(temp_path, entry_path);
+        } else {
+            close(file);
+        }
+        if (result != 0) unlink(temp_path);
+    }
+    cJSON_free(content);
+    if (result != 0) perror("Failed to register instance");
+    return result;
+}
+
+void registry_remove(pid_t pid) {
+    char entry_path[MAX_PATH_LEN];
+    if (registry_path(entry_path, sizeof(entry_path), pid, ".json") == 0) unlink(entry_path);
+    if (registry_path(entry_path, sizeof(entry_path), pid, ".sock") == 0) unlink(entry_path);
+}
+
+cJSON *registry_read(pid_t pid) {
+    char entry_path[MAX_PATH_LEN];
+    if (registry_path(entry_path, sizeof(entry_path), pid, ".json") != 0) return NULL;
+    string content = read_file(entry_path);
+    if (content.value == NULL) return NULL;
+    cJSON *entry = cJSON_Parse(content.value);
+    string_free(content);
+    if (entry && read_int(entry, "pid", 0) != pid) {
+        cJSON_Delete(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+cJSON *registry_list() {
+    cJSON *instances = cJSON_CreateArray();
+    char directory_path[MAX_PATH_LEN];
+    if (registry_path(directory_path, sizeof(directory_path), 0, NULL) != 0) return instances;
+    DIR *directory = opendir(directory_path);
+    if (directory == NULL) return instances;
+
+    struct dirent *file;
+    while ((file = readdir(directory)) != NULL) {
+        if (strends(file->d_name, ".json") != 0) continue;
+        pid_t pid = atoi(file->d_name);
+        if (pid <= 0) continue;
+        // Entries of processes that did not exit cleanly
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            registry_remove(pid);
+            continue;
+        }
+        cJSON *entry = registry_read(pid);
+        if (entry) cJSON_AddItemToArray(instances, entry);
+    }
+    closedir(directory);
+    return instances;
+}
+
+string control_request(pid_t pid, const char *command) {
+    string response = string_init();
+    char socket_path[MAX_PATH_LEN];
+    if (registry_path(socket_path, sizeof(socket_path), pid, ".sock") != 0) return response;
+    int socket_desc = control_connect(socket_path);
+    if (socket_desc < 0) return response;
+
+    char request[64];
+    int request_len = snprintf(request, sizeof(request), "%s\n", command);
+    if (send(socket_desc, request, request_len, 0) != request_len) {
+        close(socket_desc);
+        return response;
+    }
+    shutdown(socket_desc, SHUT_WR);
+
+    // Read the response until the instance closes the connection
+    char *output = NULL;
+    size_t output_size = 0;
+    FILE *output_stream = open_memstream(&output, &output_size);
+    char buffer[1024];
+    ssize_t length;
+    while ((length = recv(socket_desc, buffer, sizeof(buffer), 0)) > 0) {
+        fwrite(buffer, 1, length, output_stream);
+    }
+    fclose(output_stream);
+    close(socket_desc);
+
+    response.value = output;
+    response.length = output_size;
+    return response;
+}
+
+
+// Site ///////////////////////////////////////////////////////////////////////
+
+
+_Atomic(struct site *) current_site = NULL;
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+static char site_bundle[MAX_PATH_LEN];
+
+// Open addressing table over the names of an object's items, at most half
+// full; NULL if the object is empty
+static cJSON **site_index(cJSON *object, size_t *slots) {
+    size_t count = cJSON_GetArraySize(object);
+    if (count == 0) return NULL;
+    *slots = 1;
+    while (*slots < count * 2) *slots <<= 1;
+    cJSON **index = calloc(*slots, sizeof(cJSON *));
+    if (index == NULL) return NULL;
+    cJSON *item;
+    cJSON_ArrayForEach(item, object) {
+        size_t slot = hash_bytes(14695981039346656037ULL, item->string, strlen(item->string));
+        while (index[slot & (*slots - 1)]) slot++;
+        index[slot & (*slots - 1)] = item;
+    }
+    return index;
+}
+
+static cJSON *site_index_find(cJSON **index, size_t slots, const char *name, size_t length) {
+    if (index == NULL) return NULL;
+    size_t slot = hash_bytes(14695981039346656037ULL, name, length);
+    for (cJSON *item; (item = index[slot & (slots - 1)]) != NULL; slot++) {
+        if (strncmp(item->string, name, length) == 0 && item->string[length] == '\0') return item;
+    }
+    return NULL;
+}
+
+cJSON *site_page(struct site *site, const char *path) {
+    if (site->page_index == NULL) return NULL;
+    // resource_path joins directory URLs and index files with a double slash
+    char normalized[MAX_PATH_LEN];
+    size_t length = 0;
+    for (const char *c = path; *c && length < sizeof(normalized) - 1; c++) {
+        if (*c == '/' && length > 0 && normalized[length - 1] == '/') continue;
+        normalized[length++] = *c;
+    }
+    normalized[length] = '\0';
+    return site_index_find(site->page_index, site->page_slots, normalized, length);
+}
+
+cJSON *site_children(struct site *site, const char *url) {
+    // "/notes/" and "/notes?page=2" list "notes"
+    while (*url == '/') url++;
+    size_t length = strcspn(url, "?#");
+    while (length > 0 && url[length - 1] == '/') length--;
+    // Pages rendered without children are refreshed when some are added
+    char dependency[MAX_PATH_LEN];
+    snprintf(dependency, sizeof(dependency), "children/%.*s", (int)length, url);
+    page_dependency_add(PAGE_DEPENDENCY_METADATA, dependency);
+    return site_index_find(site->children_index, site->children_slots, url, length);
+}
+
+// Reads config.json and collects the metadata of the files in a directory
+static struct site *site_load_directory(const char *root, const char *host) {
+    struct site *site = calloc(1, sizeof(struct site));
+    if (site == NULL) return NULL;
+    site->root = strdup(root);
+    site->host = host ? strdup(host) : NULL;
+    if (site->root == NULL || (host && site->host == NULL)) {
+        free(site->root);
+        free(site->host);
+        free(site);
+        return NULL;
+    }
+    enum memory_subsystem previous = memory_enter(MEMORY_SITE);
+
+    // Read configuration; a bundle has the configuration it was packed with
+    if (site_bundle[0] != '\0' && host == NULL) {
+        site->bundle = bundle_open(site_bundle);
+        if (site->bundle == NULL) {
+            free(site->root);
+            free(site);
+            memory_leave(previous);
+            return NULL;
+        }
+        site->config = cJSON_Parse(site->bundle->map + site->bundle->header->config);
+    } else {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%sconfig.json", root);
+        string config_content = read_file(path);
+        if (config_content.value != NULL) {
+            site->config = cJSON_Parse(config_content.value);
+            string_free(config_content);
+        }
+    }
+    if (site->config == NULL) site->config = cJSON_CreateObject();
+    site->metrics_path = read_string(cJSON_GetObjectItem(site->config, "metrics"), "path", METRICS_PATH);
+
+    // Metadata; bundled pages are rendered already
+    char static_folder[MAX_PATH_LEN];
+    snprintf(static_folder, sizeof(static_folder), "%s" STATIC_FOLDER, root);
+    site->metadata = cJSON_CreateObject();
+    if (site->bundle == NULL) {
+        // Kept apart from the front matter keys, which may have any name
+        cJSON *children = cJSON_CreateObject();
+        site->pages = cJSON_CreateObject();
+        collect_metadata(site->metadata, site->pages, children, static_folder, NULL);
+        create_index(site->metadata);
+        create_children(site->metadata, children);
+        // The lists are site.children in templates, in place of a front
+        // matter key of that name
+        cJSON_DeleteItemFromObject(site->metadata, "children");
+        cJSON_AddItemToObject(site->metadata, "children", children);
+        site->page_index = site_index(site->pages, &site->page_slots);
+        site->children_index = site_index(children, &site->children_slots);
+    }
+    if (site->bundle == NULL && read_bool(site->config, "fingerprint", true)) {
+        cJSON *assets = cJSON_CreateObject();
+        collect_assets(assets, static_folder, NULL);
+        cJSON_AddItemToObject(site->metadata, "assets", assets);
+    }
+
+    static _Atomic uint64_t generations;
+    site->generation = atomic_fetch_add(&generations, 1) + 1;
+    site->config_hash = json_hash(site->config);
+    atomic_init(&site->references, 1);
+    memory_leave(previous);
+    return site;
+}
+
+static int site_compare_hosts(const void *a, const void *b) {
+    return strcmp((*(struct site * const *)a)->host, (*(struct site * const *)b)->host);
+}
+
+// Loads the hosted sites of the "sites" directory, keeping the ones of the
+// current site that did not change
+static void site_load_hosts(struct site *site) {
+    const char *sites = read_string(site->config, "sites", "");
+    if (sites[0] == '\0' || site->bundle != NULL) return;
+    DIR *dir = opendir(sites);
+    if (dir == NULL) {
+        perror("Failed to open sites directory");
+        return;
+    }
+    struct site *current = site_acquire();
+    struct dirent *entry;
+    size_t capacity = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= SITE_HOST_MAX) continue;
+        char root[MAX_PATH_LEN];
+        snprintf(root, sizeof(root), "%s/%s/", sites, entry->d_name);
+        struct stat root_stat;
+        if (stat(root, &root_stat) != 0 || !S_ISDIR(root_stat.st_mode)) continue;
+        // Host names are case-insensitive
+        char host[SITE_HOST_MAX];
+        size_t length = 0;
+        for (const char *c = entry->d_name; *c; c++) host[length++] = tolower((unsigned char)*c);
+        host[length] = '\0';
+
+        struct site *hosted = NULL;
+        for (size_t i = 0; current && i < current->host_count && hosted == NULL; i++) {
+            struct site *previous = current->hosts[i];
+            if (strcmp(previous->root, root) == 0 && !atomic_load(&previous->stale)) {
+                atomic_fetch_add(&previous->references, 1);
+                hosted = previous;
+            }
+        }
+        if (hosted == NULL) hosted = site_load_directory(root, host);
+        if (hosted == NULL) continue;
+        if (site->host_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct site **hosts = realloc(site->hosts, capacity * sizeof(struct site *));
+            if (hosts == NULL) {
+                site_release(hosted);
+                break;
+            }
+            site->hosts = hosts;
+        }
+        site->hosts[site->host_count++] = hosted;
+    }
+    closedir(dir);
+    site_release(current);
+    if (site->host_count > 0) qsort(site->hosts, site->host_count, sizeof(struct site *), site_compare_hosts);
+}
+
+struct site *site_load() {
+    struct site *site = site_load_directory("", NULL);
+    if (site != NULL) site_load_hosts(site);
+    return site;
+}
+
+void site_invalidate(const char *path) {
+    struct site *site = site_acquire();
+    for (size_t i = 0; site && i < site->host_count; i++) {
+        struct site *hosted = site->hosts[i];
+        if (path == NULL || strncmp(path, hosted->root, strlen(hosted->root)) == 0) {
+            atomic_store(&hosted->stale, true);
+        }
+    }
+    site_release(site);
+}
+
+struct site *site_host(struct site *site, const char *request) {
+    if (site == NULL || site->host_count == 0 || request == NULL) return site;
+    char host[SITE_HOST_MAX];
+    if (request_header(request, "Host", host, sizeof(host)) != 0) return site;
+    // Neither the port nor the dot of a fully qualified name are part of
+    // the directory name
+    size_t length = 0;
+    if (host[0] == '[') {
+        while (host[length] && host[length] != ']') length++;
+        if (host[length] == ']') length++;
+    } else {
+        while (host[length] && host[length] != ':') length++;
+    }
+    if (length > 0 && host[length - 1] == '.') length--;
+    host[length] = '\0';
+    for (size_t i = 0; i < length; i++) host[i] = tolower((unsigned char)host[i]);
+
+    size_t low = 0, high = site->host_count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int order = strcmp(host, site->hosts[middle]->host);
+        if (order == 0) return site->hosts[middle];
+        if (order < 0) high = middle; else low = middle + 1;
+    }
+    return site;
+}
+
+// Site whose files the thread resolves
+static _Thread_local struct site *site_serving = NULL;
+
+struct site *site_enter(struct site *site) {
+    struct site *previous = site_serving;
+    site_serving = site;
+    return previous;
+}
+
+const char *site_directory() {
+    return site_serving && site_serving->root ? site_serving->root : "";
+}
+
+struct site *site_acquire() {
+    pthread_mutex_lock(&site_lock);
+    struct site *site = atomic_load(&current_site);
+    if (site) atomic_fetch_add(&site->references, 1);
+    pthread_mutex_unlock(&site_lock);
+    return site;
+}
+
+void site_release(struct site *site) {
+    if (site == NULL) return;
+    if (atomic_fetch_sub(&site->references, 1) == 1) {
+        cJSON_Delete(site->config);
+        cJSON_Delete(site->metadata);
+        cJSON_Delete(site->pages);
+        free(site->page_index);
+        free(site->children_index);
+        bundle_release(site->bundle);
+        for (size_t i = 0; i < site->host_count; i++) site_release(site->hosts[i]);
+        free(site->hosts);
+        free(site->root);
+        free(site->host);
+        for (size_t i = 0; i < site->hint_count; i++) early_hints_free(site->hints[i]);
+        free(site->hints);
+        free(site);
+    }
+}
+
+void site_use_bundle(const char *path) {
+    snprintf(site_bundle, sizeof(site_bundle), "%s", path);
+}
+
+struct file_cache_entry *site_file(struct site *site, const char *url, const char *request) {
+    trace_begin("resource_path");
+    struct file_cache_entry *file;
+    if (site->bundle == NULL) {
+        struct site *previous = site_enter(site);
+        file = file_cache_get(url);
+        site_enter(previous);
+    } else {
+        char accept[256] = "";
+        if (request != NULL) request_header(request, "Accept-Encoding", accept, sizeof(accept));
+        file = bundle_get(site->bundle, url, accept);
+    }
+    trace_end();
+    return file;
+}
+
+void site_publish(struct site *site) {
+    if (site == NULL) return;
+    pthread_mutex_lock(&site_lock);
+    struct site *previous = atomic_load(&current_site);
+    atomic_store(&current_site, site);
+    pthread_mutex_unlock(&site_lock);
+    site_release(previous);
+}
+
+
+// Assets /////////////////////////////////////////////////////////////////////
+
+
+static const char *fingerprint_digits = "0123456789abcdef";
+
+int file_fingerprint(int fd, char *fingerprint) {
+    // FNV-1a over the file content
+    uint64_t hash = 14695981039346656037ULL;
+    char buffer[65536];
+    off_t offset = 0;
+    ssize_t length;
+    while ((length = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+        for (ssize_t i = 0; i < length; i++) {
+            hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL;
+        }
+        offset += length;
+    }
+    if (length < 0) return -1;
+    for (int i = FINGERPRINT_LENGTH - 1; i >= 0; i--) {
+        fingerprint[i] = fingerprint_digits[hash & 0xf];
+        hash >>= 4;
+    }
+    fingerprint[FINGERPRINT_LENGTH] = '\0';
+    return 0;
+}
+
+void fingerprint_url(char *buffer, size_t buffer_len, const char *url, const char *fingerprint) {
+    // The fingerprint goes before the extension of the last path element
+    const char *name = strrchr(url, '/');
+    const char *extension = strrchr(name ? name : url, '.');
+    if (extension == NULL || extension == name + 1) extension = url + strlen(url);
+    snprintf(buffer, buffer_len, "%.*s.%s%s", (int)(extension - url), url, fingerprint, extension);
+}
+
+bool fingerprint_strip(const char *url, char *original, size_t original_len, char *fingerprint) {
+    const char *name = strrchr(url, '/');
+    if (name == NULL) return false;
+    for (const char *dot = url + strlen(url) - 1; dot > name; dot--) {
+        if (*dot != '.') continue;
+        size_t digits = strspn(dot + 1, fingerprint_digits);
+        if (digits != FINGERPRINT_LENGTH || (dot[1 + digits] != '.' && dot[1 + digits] != '\0')) continue;
+        if (snprintf(original, original_len, "%.*s%s", (int)(dot - url), url, dot + 1 + digits) >= (int)original_len) {
+            return false;
+        }
+        memcpy(fingerprint, dot + 1, FINGERPRINT_LENGTH);
+        fingerprint[FINGERPRINT_LENGTH] = '\0';
+        return true;
+    }
+    return false;
+}
+
+void collect_assets(cJSON *assets, char *base_path, char *path) {
+    char full_path[MAX_PATH_LEN];
+    append_path(full_path, sizeof(full_path), base_path, path);
+    DIR *dir = opendir(full_path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char relative_name[1024];
+        append_path(relative_name, sizeof(relative_name), path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            collect_assets(assets, base_path, relative_name);
+            continue;
+        }
+        // Pages are rendered and may change with the site data
+        if (entry->d_type != DT_REG || strends(entry->d_name, ".md") == 0 ||
+            strends(entry->d_name, ".mustache") == 0 || strends(entry->d_name, ".lua") == 0) {
+            continue;
+        }
+        int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        char fingerprint[FINGERPRINT_LENGTH + 1];
+        if (file_fingerprint(fd, fingerprint) == 0) {
+            char url[MAX_PATH_LEN];
+            char hashed_url[MAX_PATH_LEN];
+            snprintf(url, sizeof(url), "/%s", relative_name);
+            fingerprint_url(hashed_url, sizeof(hashed_url), url, fingerprint);
+            cJSON_AddStringToObject(assets, relative_name, hashed_url);
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+const char *cache_policy(cJSON *config, const char *url) {
+    cJSON *policies = cJSON_GetObjectItem(config, "cache_policy");
+    const char *policy = NULL;
+    size_t policy_length = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, policies) {
+        // The longest matching prefix wins
+        size_t length = strlen(item->string);
+        if (cJSON_IsString(item) && length >= policy_length && strncmp(url, item->string, length) == 0) {
+            policy = item->valuestring;
+            policy_length = length;
+        }
+    }
+    return policy;
+}
+
+string expand_assets(substring template, cJSON *assets) {
+    string result = string_init();
+    const char *tag = "{{asset ";
+    size_t tag_length = strlen(tag);
+    const char *end = template.value + template.length;
+    const char *position = template.value;
+    const char *found = template.value ? memmem(position, end - position, tag, tag_length) : NULL;
+    if (found == NULL) return result;
+
+    char *output = NULL;
+    size_t output_size = 0;
+    FILE *output_stream = open_memstream(&output, &output_size);
+    while (found) {
+        // {{asset "path"}} or {{asset 'path'}}
+        const char *name = found + tag_length;
+        while (name < end && *name == ' ') name++;
+        const char *quote = name < end && (*name == '"' || *name == '\'') ? name : NULL;
+        const char *name_end = quote ? memchr(quote + 1, *quote, end - quote - 1) : NULL;
+        const char *close = name_end ? name_end + 1 : NULL;
+        while (close && close < end && *close == ' ') close++;
+        if (close == NULL || end - close < 2 || close[0] != '}' || close[1] != '}') {
+            fwrite(position, 1, found + tag_length - position, output_stream);
+            position = found + tag_length;
+        } else {
+            fwrite(position, 1, found - position, output_stream);
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%.*s", (int)(name_end - quote - 1), quote + 1);
+            char *key = path[0] == '/' ? path + 1 : path;
+            char dependency[MAX_PATH_LEN + 8];
+            snprintf(dependency, sizeof(dependency), "assets/%s", key);
+            page_dependency_add(PAGE_DEPENDENCY_METADATA, dependency);
+            cJSON *url = cJSON_GetObjectItem(assets, key);
+            if (cJSON_IsString(url)) {
+                fputs(url->valuestring, output_stream);
+            } else {
+                // Unknown assets keep their plain URL
+                fprintf(output_stream, "/%s", key);
+            }
+            position = close + 2;
+        }
+        found = memmem(position, end - position, tag, tag_length);
+    }
+    fwrite(position, 1, end - position, output_stream);
+    fclose(output_stream);
+
+    result.value = output;
+    result.length = output_size;
+    return result;
+}
+
+
+// Access log /////////////////////////////////////////////////////////////////
+
+
+// Single-producer single-consumer ring: the worker only moves `head`,
+// the writer thread only moves `tail`.
+struct access_log_ring {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    unsigned long sample_counter;   // owned by the worker
+    _Atomic unsigned long dropped;
+    struct access_log_entry entries[ACCESS_LOG_RING_SIZE];
+};
+
+static struct {
+    FILE *file;
+    char path[MAX_PATH_LEN];
+    enum access_log_format format;
+    unsigned long sample_every;     // log every Nth request, 0 disables logging
+    long flush_interval_ms;
+    int workers;
+    struct access_log_ring *rings;
+    pthread_t thread;
+    _Atomic bool running;
+} access_log = { .file = NULL, .rings = NULL };
+
+// Set by SIGUSR1, the writer thread reopens the log file
+static volatile sig_atomic_t access_log_reopen = 0;
+
+static void access_log_signal(int signal) {
+    access_log_reopen = 1;
+}
+
+// Appends a JSON string literal; returns the new length or buffer_len on overflow
+static size_t append_json_string(char *buffer, size_t length, size_t buffer_len, const char *value) {
+    if (length < buffer_len) buffer[length++] = '"';
+    for (const char *c = value; *c && length < buffer_len; c++) {
+        if (*c == '"' || *c == '\\') {
+            length += snprintf(buffer + length, buffer_len - length, "\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            length += snprintf(buffer + length, buffer_len - length, "\\u%04x", *c);
+        } else {
+            buffer[length++] = *c;
+        }
+    }
+    if (length < buffer_len) buffer[length++] = '"';
+    return length < buffer_len ? length : buffer_len;
+}
+
+size_t format_access_log_entry(char *buffer, size_t buffer_len, struct access_log_entry *entry, enum access_log_format format) {
+    struct tm tm;
+    char time_str[64];
+    size_t length;
+    localtime_r(&entry->time.tv_sec, &tm);
+
+    if (format == ACCESS_LOG_JSON) {
+        strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        length = snprintf(buffer, buffer_len, "{\"time\":\"%s\",\"client\":", time_str);
+        if (length >= buffer_len) return 0;
+        length = append_json_string(buffer, length, buffer_len, entry->client);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, ",\"method\":");
+        if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, entry->method);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, ",\"url\":");
+        if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, entry->url);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, ",\"protocol\":");
+        if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, entry->protocol);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length,
+            ",\"status\":%i,\"bytes\":%zu,\"duration_us\":%li,\"referer\":", entry->status, entry->bytes, entry->duration_us);
+        if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, entry->referer);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, ",\"user_agent\":");
+        if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, entry->user_agent);
+        if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, "}\n");
+    } else {
+        // host ident authuser [date] "request" status bytes "referer" "user-agent"
+        strftime(time_str, sizeof(time_str), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        length = snprintf(buffer, buffer_len, "%s - - [%s] \"%s %s %s\" %i %zu \"%s\" \"%s\"\n",
+            entry->client, time_str, entry->method, entry->url, entry->protocol, entry->status, entry->bytes,
+            entry->referer[0] ? entry->referer : "-", entry->user_agent[0] ? entry->user_agent : "-");
+    }
+    return length < buffer_len ? length : 0;
+}
+
+static void access_log_reopen_file() {
+    if (strcmp(access_log.path, "-") == 0) return;
+    if (access_log.file) fclose(access_log.file);
+    access_log.file = fopen(access_log.path, "a");
+    if (access_log.file == NULL) perror("Failed to open access log");
+}
+
+// Drains all rings into the batch buffer, writing it out when it fills up.
+// Returns the number of entries written.
+static size_t access_log_drain(char *batch, size_t *batch_length) {
+    size_t count = 0;
+    for (int i = 0; i < access_log.workers; i++) {
+        struct access_log_ring *ring = &access_log.rings[i];
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            struct access_log_entry *entry = &ring->entries[tail % ACCESS_LOG_RING_SIZE];
+            size_t length = format_access_log_entry(batch + *batch_length, ACCESS_LOG_BATCH_SIZE - *batch_length, entry, access_log.format);
+            if (length == 0 && *batch_length > 0) {
+                // No room left, write the batch out and retry the entry
+                if (access_log.file) fwrite(batch, 1, *batch_length, access_log.file);
+                *batch_length = 0;
+                continue;
+            }
+            *batch_length += length;
+            tail++;
+            count++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return count;
+}
+
+static void *access_log_thread(void *arg) {
+    char *batch = malloc(ACCESS_LOG_BATCH_SIZE);
+    size_t batch_length = 0;
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = access_log.flush_interval_ms * 1000000 };
+    if (batch == NULL) return NULL;
+
+    while (1) {
+        bool running = atomic_load(&access_log.running);
+        if (access_log_reopen) {
+            access_log_reopen = 0;
+            if (batch_length > 0 && access_log.file) fwrite(batch, 1, batch_length, access_log.file);
+            batch_length = 0;
+            access_log_reopen_file();
+        }
+        access_log_drain(batch, &batch_length);
+        if (batch_length > 0 && access_log.file) {
+            fwrite(batch, 1, batch_length, access_log.file);
+            fflush(access_log.file);
+        }
+        batch_length = 0;
+        if (!running) break;
+        nanosleep(&idle, NULL);
+    }
+    free(batch);
+    return NULL;
+}
+
+int access_log_open(cJSON *config, int workers, bool cli_mode) {
+    cJSON *log_config = cJSON_GetObjectItem(config, "access_log");
+    char *path = read_string(log_config, "path", cli_mode ? "-" : NULL);
+    double sample = read_double(log_config, "sample", 1.0);
+    if (path == NULL || sample <= 0) return -1;
+
+    snprintf(access_log.path, sizeof(access_log.path), "%s", path);
+    char *format = read_string(log_config, "format", "combined");
+    access_log.format = strcmp(format, "json") == 0 ? ACCESS_LOG_JSON : ACCESS_LOG_COMBINED;
+    access_log.sample_every = sample >= 1 ? 1 : (unsigned long)(1 / sample + 0.5);
+    access_log.flush_interval_ms = read_int(log_config, "flush", 100);
+    if (access_log.flush_interval_ms < 1 || access_log.flush_interval_ms > 999) access_log.flush_interval_ms = 100;
+    access_log.workers = workers;
+
+    if (strcmp(access_log.path, "-") == 0) {
+        access_log.file = stdout;
+    } else {
+        access_log_reopen_file();
+        if (access_log.file == NULL) return -1;
+    }
+
+    access_log.rings = calloc(workers, sizeof(struct access_log_ring));
+    if (access_log.rings == NULL) {
+        perror("Failed to allocate access log buffers");
+        return -1;
+    }
+
+    // Log rotation: move the file away, then send SIGUSR1
+    struct sigaction action = { .sa_handler = access_log_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    atomic_store(&access_log.running, true);
+    if (pthread_create(&access_log.thread, NULL, access_log_thread, NULL) != 0) {
+        perror("Failed to start access log thread");
+        free(access_log.rings);
+        access_log.rings = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void access_log_write(int worker, struct access_log_entry *entry) {
+    if (access_log.rings == NULL) return;
+    struct access_log_ring *ring = &access_log.rings[worker];
+    if (ring->sample_counter++ % access_log.sample_every != 0) return;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ACCESS_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring->entries[head % ACCESS_LOG_RING_SIZE] = *entry;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+unsigned long access_log_dropped() {
+    unsigned long dropped = 0;
+    for (int i = 0; access_log.rings && i < access_log.workers; i++) {
+        dropped += atomic_load(&access_log.rings[i].dropped);
+    }
+    return dropped;
+}
+
+void access_log_close() {
+    if (access_log.rings == NULL) return;
+    atomic_store(&access_log.running, false);
+    pthread_join(access_log.thread, NULL);
+    unsigned long dropped = access_log_dropped();
+    if (dropped > 0) fprintf(stderr, "Access log: %lu entries dropped\n", dropped);
+    if (access_log.file && access_log.file != stdout) fclose(access_log.file);
+    access_log.file = NULL;
+    free(access_log.rings);
+    access_log.rings = NULL;
+}
+
+
+// Tracing ////////////////////////////////////////////////////////////////////
+
+
+struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t end;                   // 0 while the span is open
+};
+
+struct trace {
+    uint64_t id;                    // track of the request in the trace file
+    uint64_t send_start;            // response ready, 0 before
+    size_t count;
+    size_t depth;
+    size_t open[TRACE_DEPTH];       // open spans, TRACE_SPANS for dropped ones
+    struct trace_span spans[TRACE_SPANS];
+};
+
+static struct {
+    int fd;
+    unsigned long sample_every;     // 0: only requests with the header are traced
+    char header[64];                // empty: the header is ignored
+    char secret[64];                // value the header must have, any if empty
+    uint64_t max_size;
+    _Atomic uint64_t size;          // of the trace file
+    _Atomic unsigned long counter;
+    _Atomic uint64_t ids;
+} tracing = { .fd = -1 };
+
+// Trace of the request the thread is rendering
+static _Thread_local struct trace *thread_trace;
+
+int trace_open(cJSON *config) {
+    cJSON *trace_config = cJSON_GetObjectItem(config, "trace");
+    char *path = read_string(trace_config, "path", "");
+    if (path[0] == '\0') return -1;
+    double sample = read_double(trace_config, "sample", 0);
+    tracing.sample_every = sample <= 0 ? 0 : sample >= 1 ? 1 : (unsigned long)(1 / sample + 0.5);
+    // Anyone can send the header, so it only works when configured
+    snprintf(tracing.header, sizeof(tracing.header), "%s", read_string(trace_config, "header", ""));
+    snprintf(tracing.secret, sizeof(tracing.secret), "%s", read_string(trace_config, "secret", ""));
+    double max_size = read_double(trace_config, "max_size", TRACE_SIZE);
+    tracing.max_size = max_size > 0 ? max_size : 0;
+
+    tracing.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (tracing.fd < 0) {
+        perror("Failed to open the trace file");
+        return -1;
+    }
+    // JSON array format: the closing bracket is optional, so requests are
+    // appended as they finish and the file can be opened at any time
+    struct stat file_stat;
+    if (fstat(tracing.fd, &file_stat) == 0 && file_stat.st_size == 0) {
+        ssize_t written = write(tracing.fd, "[\n", 2);
+        (void)written;
+    }
+    atomic_store(&tracing.size, fstat(tracing.fd, &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0);
+    return 0;
+}
+
+void trace_close() {
+    if (tracing.fd >= 0) close(tracing.fd);
+    tracing.fd = -1;
+}
+
+struct trace *trace_start(const char *request) {
+    thread_trace = NULL;
+    if (tracing.fd < 0 || atomic_load_explicit(&tracing.size, memory_order_relaxed) >= tracing.max_size) return NULL;
+    bool sampled = tracing.sample_every > 0 &&
+        atomic_fetch_add_explicit(&tracing.counter, 1, memory_order_relaxed) % tracing.sample_every == 0;
+    char value[sizeof(tracing.secret)];
+    if (!sampled && (tracing.header[0] == '\0' ||
+        request_header(request, tracing.header, value, sizeof(value)) != 0 ||
+        (tracing.secret[0] != '\0' && strcmp(value, tracing.secret) != 0))) {
+        return NULL;
+    }
+    struct trace *trace = malloc(sizeof(struct trace));
+    if (trace == NULL) return NULL;
+    trace->id = atomic_fetch_add_explicit(&tracing.ids, 1, memory_order_relaxed) + 1;
+    trace->send_start = 0;
+    trace->count = trace->depth = 0;
+    thread_trace = trace;
+    return trace;
+}
+
+void trace_begin(const char *name) {
+    struct trace *trace = thread_trace;
+    if (trace == NULL) return;
+    size_t index = trace->count < TRACE_SPANS && trace->depth < TRACE_DEPTH ? trace->count++ : TRACE_SPANS;
+    if (index < TRACE_SPANS) trace->spans[index] = (struct trace_span){ name, metrics_now(), 0 };
+    if (trace->depth < TRACE_DEPTH) trace->open[trace->depth] = index;
+    trace->depth++;
+}
+
+void trace_end() {
+    struct trace *trace = thread_trace;
+    if (trace == NULL || trace->depth == 0) return;
+    trace->depth--;
+    if (trace->depth < TRACE_DEPTH && trace->open[trace->depth] < TRACE_SPANS) {
+        trace->spans[trace->open[trace->depth]].end = metrics_now();
+    }
+}
+
+void trace_sending(struct trace *trace) {
+    if (trace != NULL) trace->send_start = metrics_now();
+    thread_trace = NULL;
+}
+
+// Appends a complete event; its track is the request, so that requests
+// served concurrently by one thread don't overlap
+static size_t trace_event(char *buffer, size_t length, size_t buffer_len, struct trace *trace,
+                          const char *name, uint64_t start, uint64_t end, const char *args) {
+    if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, "{\"name\":");
+    if (length < buffer_len) length = append_json_string(buffer, length, buffer_len, name);
+    if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length,
+        ",\"cat\":\"cserver\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%i,\"tid\":%llu%s%s},\n",
+        start / 1e3, (end - start) / 1e3, (int)getpid(), (unsigned long long)trace->id,
+        args ? ",\"args\":" : "", args ? args : "");
+    return length < buffer_len ? length : buffer_len;
+}
+
+void trace_finish(struct trace *trace, struct access_log_entry *log_entry, const char *method,
+                  const char *url, uint64_t request_start) {
+    if (trace == NULL) return;
+    if (thread_trace == trace) thread_trace = NULL;
+    uint64_t end = metrics_now();
+    char label[1040];
+    snprintf(label, sizeof(label), "%s %s", method, url);
+
+    // One write per request: O_APPEND keeps requests from different threads whole
+    size_t buffer_len = (trace->count + 4) * 256 + strlen(label) * 12;
+    char *buffer = malloc(buffer_len);
+    if (buffer == NULL) {
+        free(trace);
+        return;
+    }
+    size_t length = snprintf(buffer, buffer_len, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%llu,"
+        "\"args\":{\"name\":", (int)getpid(), (unsigned long long)trace->id);
+    length = append_json_string(buffer, length, buffer_len, label);
+    if (length < buffer_len) length += snprintf(buffer + length, buffer_len - length, "}},\n");
+    char args[64];
+    snprintf(args, sizeof(args), "{\"status\":%i,\"bytes\":%zu}", log_entry->status, log_entry->bytes);
+    length = trace_event(buffer, length, buffer_len, trace, "request", request_start, end, args);
+    if (trace->send_start != 0) {
+        length = trace_event(buffer, length, buffer_len, trace, "send", trace->send_start, end, NULL);
+    }
+    for (size_t i = 0; i < trace->count; i++) {
+        struct trace_span *span = &trace->spans[i];
+        uint64_t span_end = span->end ? span->end : trace->send_start ? trace->send_start : end;
+        length = trace_event(buffer, length, buffer_len, trace, span->name, span->start, span_end, NULL);
+    }
+    // Requests that would grow the file past its limit are dropped
+    if (length < buffer_len &&
+        atomic_fetch_add_explicit(&tracing.size, length, memory_order_relaxed) + length <= tracing.max_size) {
+        ssize_t written = write(tracing.fd, buffer, length);
+        (void)written;
+    }
+    free(buffer);
+    free(trace);
+}
+
+void trace_free(struct trace *trace) {
+    if (trace != NULL && thread_trace == trace) thread_trace = NULL;
+    free(trace);
+}
+
+
+// Metrics ////////////////////////////////////////////////////////////////////
+
+
+static const char *metrics_stage_names[STAGE_COUNT] = {
+    "accept", "recv", "resource_path", "read_file", "mustache_content",
+    "markdown", "mustache_template", "lua", "response", "send", "request"
+};
+
+// Per-thread metrics; each thread only writes its own copy
+struct metrics {
+    struct histogram stages[STAGE_COUNT];
+    _Atomic uint64_t responses[600];        // by status code
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t bytes_sent;
+    struct metrics *next;
+};
+
+static struct metrics *metrics_list = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct metrics *thread_metrics = NULL;
+
+// Single writer increment, avoids a locked instruction on the hot path
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+size_t histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t histogram_bucket_limit(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index + 1;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub + 1) << shift;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value) {
+    counter_add(&histogram->counts[histogram_bucket(value)], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum, value);
+}
+
+void histogram_merge(struct histogram *target, struct histogram *source) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counter_add(&target->counts[i], atomic_load_explicit(&source->counts[i], memory_order_relaxed));
+    }
+    counter_add(&target->count, atomic_load_explicit(&source->count, memory_order_relaxed));
+    counter_add(&target->sum, atomic_load_explicit(&source->sum, memory_order_relaxed));
+}
+
+uint64_t histogram_percentile(struct histogram *histogram, double p) {
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t)(count * p / 100.0 + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank) return histogram_bucket_limit(i) - 1;
+    }
+    return histogram_bucket_limit(HISTOGRAM_BUCKETS - 1);
+}
+
+uint64_t metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the calling thread's metrics, registering them on first use
+static struct metrics *metrics_get() {
+    if (thread_metrics) return thread_metrics;
+    thread_metrics = calloc(1, sizeof(struct metrics));
+    if (thread_metrics == NULL) return NULL;
+    pthread_mutex_lock(&metrics_lock);
+    thread_metrics->next = metrics_list;
+    metrics_list = thread_metrics;
+    pthread_mutex_unlock(&metrics_lock);
+    return thread_metrics;
+}
+
+uint64_t metrics_record(enum metrics_stage stage, uint64_t start) {
+    uint64_t now = metrics_now();
+    struct metrics *metrics = metrics_get();
+    if (metrics) histogram_record(&metrics->stages[stage], now - start);
+    return now;
+}
+
+void metrics_count_response(int status, size_t received, size_t sent) {
+    struct metrics *metrics = metrics_get();
+    if (metrics == NULL) return;
+    if (status >= 0 && status < 600) counter_add(&metrics->responses[status], 1);
+    counter_add(&metrics->bytes_received, received);
+    counter_add(&metrics->bytes_sent, sent);
+}
+
+uint64_t metrics_requests() {
+    uint64_t requests = 0;
+    pthread_mutex_lock(&metrics_lock);
+    for (struct metrics *metrics = metrics_list; metrics; metrics = metrics->next) {
+        requests += atomic_load_explicit(&metrics->stages[STAGE_REQUEST].count, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return requests;
+}
+
+string metrics_render() {
+    string result = string_init();
+    struct metrics *total = calloc(1, sizeof(struct metrics));
+    if (total == NULL) return result;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (struct metrics *metrics = metrics_list; metrics; metrics = metrics->next) {
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            histogram_merge(&total->stages[stage], &metrics->stages[stage]);
+        }
+        for (int status = 0; status < 600; status++) {
+            counter_add(&total->responses[status], atomic_load_explicit(&metrics->responses[status], memory_order_relaxed));
+        }
+        counter_add(&total->bytes_received, atomic_load_explicit(&metrics->bytes_received, memory_order_relaxed));
+        counter_add(&total->bytes_sent, atomic_load_explicit(&metrics->bytes_sent, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    char *output = NULL;
+    size_t output_size = 0;
+    FILE *output_stream = open_memstream(&output, &output_size);
+
+    // Stage histograms; buckets are reported at powers of two from ~1 µs
+    fprintf(output_stream, "# HELP cserver_stage_duration_seconds Time spent in request pipeline stages.\n");
+    fprintf(output_stream, "# TYPE cserver_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        struct histogram *histogram = &total->stages[stage];
+        const char *name = metrics_stage_names[stage];
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        for (int bits = 10; bits <= HISTOGRAM_MAX_BITS; bits++) {
+            uint64_t limit = (uint64_t)1 << bits;
+            while (bucket < HISTOGRAM_BUCKETS && histogram_bucket_limit(bucket) <= limit) {
+                cumulative += histogram->counts[bucket++];
+            }
+            fprintf(output_stream, "cserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                name, limit / 1e9, (unsigned long long)cumulative);
+        }
+        fprintf(output_stream, "cserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+            name, (unsigned long long)histogram->count);
+        fprintf(output_stream, "cserver_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", name, histogram->sum / 1e9);
+        fprintf(output_stream, "cserver_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+            name, (unsigned long long)histogram->count);
+    }
+
+    fprintf(output_stream, "# HELP cserver_responses_total Responses by status code.\n");
+    fprintf(output_stream, "# TYPE cserver_responses_total counter\n");
+    for (int status = 0; status < 600; status++) {
+        if (total->responses[status] == 0) continue;
+        fprintf(output_stream, "cserver_responses_total{code=\"%i\"} %llu\n",
+            status, (unsigned long long)total->responses[status]);
+    }
+    fprintf(output_stream, "# HELP cserver_received_bytes_total Request bytes received.\n");
+    fprintf(output_stream, "# TYPE cserver_received_bytes_total counter\n");
+    fprintf(output_stream, "cserver_received_bytes_total %llu\n", (unsigned long long)total->bytes_received);
+    fprintf(output_stream, "# HELP cserver_sent_bytes_total Response bytes sent.\n");
+    fprintf(output_stream, "# TYPE cserver_sent_bytes_total counter\n");
+    fprintf(output_stream, "cserver_sent_bytes_total %llu\n", (unsigned long long)total->bytes_sent);
+    uint64_t cache_hits, cache_misses;
+    size_t cache_entries, cache_bytes;
+    file_cache_stats(&cache_hits, &cache_misses, &cache_entries, &cache_bytes);
+    fprintf(output_stream, "# HELP cserver_file_cache_hits_total File cache hits.\n");
+    fprintf(output_stream, "# TYPE cserver_file_cache_hits_total counter\n");
+    fprintf(output_stream, "cserver_file_cache_hits_total %llu\n", (unsigned long long)cache_hits);
+    fprintf(output_stream, "# HELP cserver_file_cache_misses_total File cache misses.\n");
+    fprintf(output_stream, "# TYPE cserver_file_cache_misses_total counter\n");
+    fprintf(output_stream, "cserver_file_cache_misses_total %llu\n", (unsigned long long)cache_misses);
+    fprintf(output_stream, "# HELP cserver_file_cache_entries Open files in the file cache.\n");
+    fprintf(output_stream, "# TYPE cserver_file_cache_entries gauge\n");
+    fprintf(output_stream, "cserver_file_cache_entries %zu\n", cache_entries);
+    fprintf(output_stream, "# HELP cserver_file_cache_mapped_bytes Bytes of files mapped by the file cache.\n");
+    fprintf(output_stream, "# TYPE cserver_file_cache_mapped_bytes gauge\n");
+    fprintf(output_stream, "cserver_file_cache_mapped_bytes %zu\n", cache_bytes);
+    uint64_t page_hits, page_misses, page_invalidated, page_coalesced;
+    size_t page_entries, page_bytes;
+    page_cache_stats(&page_hits, &page_misses, &page_invalidated, &page_coalesced, &page_entries, &page_bytes);
+    fprintf(output_stream, "# HELP cserver_page_cache_hits_total Rendered pages served from the page cache.\n");
+    fprintf(output_stream, "# TYPE cserver_page_cache_hits_total counter\n");
+    fprintf(output_stream, "cserver_page_cache_hits_total %llu\n", (unsigned long long)page_hits);
+    fprintf(output_stream, "# HELP cserver_page_cache_misses_total Pages rendered for the page cache.\n");
+    fprintf(output_stream, "# TYPE cserver_page_cache_misses_total counter\n");
+    fprintf(output_stream, "cserver_page_cache_misses_total %llu\n", (unsigned long long)page_misses);
+    fprintf(output_stream, "# HELP cserver_page_cache_invalidated_total Cached pages dropped after a dependency changed.\n");
+    fprintf(output_stream, "# TYPE cserver_page_cache_invalidated_total counter\n");
+    fprintf(output_stream, "cserver_page_cache_invalidated_total %llu\n", (unsigned long long)page_invalidated);
+    fprintf(output_stream, "# HELP cserver_page_coalesced_total Requests served with the rendering of an earlier request in the same batch.\n");
+    fprintf(output_stream, "# TYPE cserver_page_coalesced_total counter\n");
+    fprintf(output_stream, "cserver_page_coalesced_total %llu\n", (unsigned long long)page_coalesced);
+    fprintf(output_stream, "# HELP cserver_page_cache_entries Rendered pages in the page cache.\n");
+    fprintf(output_stream, "# TYPE cserver_page_cache_entries gauge\n");
+    fprintf(output_stream, "cserver_page_cache_entries %zu\n", page_entries);
+    fprintf(output_stream, "# HELP cserver_page_cache_bytes Bytes of rendered pages in the page cache.\n");
+    fprintf(output_stream, "# TYPE cserver_page_cache_bytes gauge\n");
+    fprintf(output_stream, "cserver_page_cache_bytes %zu\n", page_bytes);
+    uint64_t fragment_hits, fragment_misses;
+    size_t fragment_entries, fragment_bytes;
+    fragment_cache_stats(&fragment_hits, &fragment_misses, &fragment_entries, &fragment_bytes);
+    fprintf(output_stream, "# HELP cserver_fragment_cache_hits_total Markdown bodies served from the fragment cache.\n");
+    fprintf(output_stream, "# TYPE cserver_fragment_cache_hits_total counter\n");
+    fprintf(output_stream, "cserver_fragment_cache_hits_total %llu\n", (unsigned long long)fragment_hits);
+    fprintf(output_stream, "# HELP cserver_fragment_cache_misses_total Markdown bodies without Mustache tags converted.\n");
+    fprintf(output_stream, "# TYPE cserver_fragment_cache_misses_total counter\n");
+    fprintf(output_stream, "cserver_fragment_cache_misses_total %llu\n", (unsigned long long)fragment_misses);
+    fprintf(output_stream, "# HELP cserver_fragment_cache_bytes Bytes of HTML in the fragment cache.\n");
+    fprintf(output_stream, "# TYPE cserver_fragment_cache_bytes gauge\n");
+    fprintf(output_stream, "cserver_fragment_cache_bytes %zu\n", fragment_bytes);
+    unsigned long rejected, timed_out;
+    limits_stats(&rejected, &timed_out);
+    fprintf(output_stream, "# HELP cserver_connections_rejected_total Connections closed over the connection caps.\n");
+    fprintf(output_stream, "# TYPE cserver_connections_rejected_total counter\n");
+    fprintf(output_stream, "cserver_connections_rejected_total %lu\n", rejected);
+    fprintf(output_stream, "# HELP cserver_connections_timed_out_total Connections closed by header timeouts or slow transfers.\n");
+    fprintf(output_stream, "# TYPE cserver_connections_timed_out_total counter\n");
+    fprintf(output_stream, "cserver_connections_timed_out_total %lu\n", timed_out);
+    unsigned long limited, evicted;
+    rate_limits_stats(&limited, &evicted);
+    fprintf(output_stream, "# HELP cserver_rate_limited_total Requests answered with 429 over the rate limits.\n");
+    fprintf(output_stream, "# TYPE cserver_rate_limited_total counter\n");
+    fprintf(output_stream, "cserver_rate_limited_total %lu\n", limited);
+    fprintf(output_stream, "# HELP cserver_rate_limit_evictions_total Token buckets replaced in the full rate limit table.\n");
+    fprintf(output_stream, "# TYPE cserver_rate_limit_evictions_total counter\n");
+    fprintf(output_stream, "cserver_rate_limit_evictions_total %lu\n", evicted);
+    unsigned long h2_connection_count, h2_stream_count;
+    h2_stats(&h2_connection_count, &h2_stream_count);
+    fprintf(output_stream, "# HELP cserver_http2_connections_total HTTP/2 connections.\n");
+    fprintf(output_stream, "# TYPE cserver_http2_connections_total counter\n");
+    fprintf(output_stream, "cserver_http2_connections_total %lu\n", h2_connection_count);
+    fprintf(output_stream, "# HELP cserver_http2_streams_total HTTP/2 request streams.\n");
+    fprintf(output_stream, "# TYPE cserver_http2_streams_total counter\n");
+    fprintf(output_stream, "cserver_http2_streams_total %lu\n", h2_stream_count);
+#ifdef CSERVER_TLS
+    unsigned long tls_handshake_count, tls_resumed_count, tls_offloaded_count;
+    tls_stats(&tls_handshake_count, &tls_resumed_count, &tls_offloaded_count);
+    fprintf(output_stream, "# HELP cserver_tls_handshakes_total Completed TLS handshakes.\n");
+    fprintf(output_stream, "# TYPE cserver_tls_handshakes_total counter\n");
+    fprintf(output_stream, "cserver_tls_handshakes_total %lu\n", tls_handshake_count);
+    fprintf(output_stream, "# HELP cserver_tls_resumed_total TLS handshakes that resumed a session.\n");
+    fprintf(output_stream, "# TYPE cserver_tls_resumed_total counter\n");
+    fprintf(output_stream, "cserver_tls_resumed_total %lu\n", tls_resumed_count);
+    fprintf(output_stream, "# HELP cserver_tls_ktls_total TLS connections with kernel record encryption.\n");
+    fprintf(output_stream, "# TYPE cserver_tls_ktls_total counter\n");
+    fprintf(output_stream, "cserver_tls_ktls_total %lu\n", tls_offloaded_count);
+#endif
+    fprintf(output_stream, "# HELP cserver_access_log_dropped_total Access log entries dropped.\n");
+    fprintf(output_stream, "# TYPE cserver_access_log_dropped_total counter\n");
+    fprintf(output_stream, "cserver_access_log_dropped_total %lu\n", access_log_dropped());
+    struct memory_stats memory[MEMORY_SUBSYSTEMS];
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) memory_stats(subsystem, &memory[subsystem]);
+    fprintf(output_stream, "# HELP cserver_memory_heap_bytes Heap bytes in use.\n");
+    fprintf(output_stream, "# TYPE cserver_memory_heap_bytes gauge\n");
+    fprintf(output_stream, "cserver_memory_heap_bytes %zu\n", memory_heap());
+    fprintf(output_stream, "# HELP cserver_memory_json_bytes cJSON bytes allocated and not freed.\n");
+    fprintf(output_stream, "# TYPE cserver_memory_json_bytes gauge\n");
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+        fprintf(output_stream, "cserver_memory_json_bytes{subsystem=\"%s\"} %llu\n", memory_subsystem_name(subsystem),
+                (unsigned long long)memory[subsystem].json_bytes);
+    }
+    fprintf(output_stream, "# HELP cserver_memory_json_allocations_total cJSON allocations.\n");
+    fprintf(output_stream, "# TYPE cserver_memory_json_allocations_total counter\n");
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+        fprintf(output_stream, "cserver_memory_json_allocations_total{subsystem=\"%s\"} %llu\n",
+                memory_subsystem_name(subsystem), (unsigned long long)memory[subsystem].json_allocations);
+    }
+    fprintf(output_stream, "# HELP cserver_memory_string_bytes_total Bytes of strings made.\n");
+    fprintf(output_stream, "# TYPE cserver_memory_string_bytes_total counter\n");
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+        fprintf(output_stream, "cserver_memory_string_bytes_total{subsystem=\"%s\"} %llu\n",
+                memory_subsystem_name(subsystem), (unsigned long long)memory[subsystem].string_bytes);
+    }
+
+    fclose(output_stream);
+    free(total);
+
+    result.value = output;
+    result.length = output_size;
+    return result;
+}
+
+
+// Memory /////////////////////////////////////////////////////////////////////
+
+
+static const char *memory_subsystem_names[MEMORY_SUBSYSTEMS] = {
+    "other", "request", "markdown", "mustache", "cache", "site"
+};
+
+// Per-thread counters; a block may be freed by another thread than the one
+// that allocated it, so only the sums over all threads are meaningful
+struct memory_counters {
+    struct {
+        _Atomic uint64_t json_allocations;
+        _Atomic uint64_t json_allocated;
+        _Atomic uint64_t json_freed;
+        _Atomic uint64_t string_allocations;
+        _Atomic uint64_t string_bytes;
+    } subsystems[MEMORY_SUBSYSTEMS];
+    struct memory_counters *next;
+};
+
+static struct memory_counters *memory_list = NULL;
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct memory_counters *thread_memory = NULL;
+static _Thread_local enum memory_subsystem memory_current = MEMORY_OTHER;
+
+// cJSON blocks start with their size and subsystem, keeping the alignment
+// of malloc
+struct memory_header {
+    size_t size;
+    size_t subsystem;
+} __attribute__((aligned(16)));
+
+static struct memory_counters *memory_get() {
+    if (thread_memory) return thread_memory;
+    thread_memory = calloc(1, sizeof(struct memory_counters));
+    if (thread_memory == NULL) return NULL;
+    pthread_mutex_lock(&memory_lock);
+    thread_memory->next = memory_list;
+    memory_list = thread_memory;
+    pthread_mutex_unlock(&memory_lock);
+    return thread_memory;
+}
+
+static void *memory_malloc(size_t size) {
+    struct memory_header *header = malloc(sizeof(struct memory_header) + size);
+    if (header == NULL) return NULL;
+    header->size = size;
+    header->subsystem = memory_current;
+    struct memory_counters *counters = memory_get();
+    if (counters) {
+        counter_add(&counters->subsystems[memory_current].json_allocations, 1);
+        counter_add(&counters->subsystems[memory_current].json_allocated, size);
+    }
+    return header + 1;
+}
+
+static void memory_free(void *pointer) {
+    if (pointer == NULL) return;
+    struct memory_header *header = (struct memory_header *)pointer - 1;
+    struct memory_counters *counters = memory_get();
+    if (counters) counter_add(&counters->subsystems[header->subsystem].json_freed, header->size);
+    free(header);
+}
+
+void memory_init() {
+    cJSON_Hooks hooks = { .malloc_fn = memory_malloc, .free_fn = memory_free };
+    cJSON_InitHooks(&hooks);
+}
+
+enum memory_subsystem memory_enter(enum memory_subsystem subsystem) {
+    enum memory_subsystem previous = memory_current;
+    memory_current = subsystem;
+    return previous;
+}
+
+void memory_leave(enum memory_subsystem previous) {
+    memory_current = previous;
+}
+
+void memory_count_string(size_t bytes) {
+    struct memory_counters *counters = memory_get();
+    if (counters == NULL) return;
+    counter_add(&counters->subsystems[memory_current].string_allocations, 1);
+    counter_add(&counters->subsystems[memory_current].string_bytes, bytes);
+}
+
+void memory_stats(enum memory_subsystem subsystem, struct memory_stats *stats) {
+    uint64_t allocated = 0, freed = 0;
+    *stats = (struct memory_stats){ 0 };
+    pthread_mutex_lock(&memory_lock);
+    for (struct memory_counters *counters = memory_list; counters; counters = counters->next) {
+        stats->json_allocations += atomic_load_explicit(&counters->subsystems[subsystem].json_allocations,
+                                                        memory_order_relaxed);
+        allocated += atomic_load_explicit(&counters->subsystems[subsystem].json_allocated, memory_order_relaxed);
+        freed += atomic_load_explicit(&counters->subsystems[subsystem].json_freed, memory_order_relaxed);
+        stats->string_allocations += atomic_load_explicit(&counters->subsystems[subsystem].string_allocations,
+                                                          memory_order_relaxed);
+        stats->string_bytes += atomic_load_explicit(&counters->subsystems[subsystem].string_bytes,
+                                                    memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&memory_lock);
+    // Counters of other threads may be read before the matching allocation
+    stats->json_bytes = allocated > freed ? allocated - freed : 0;
+}
+
+size_t memory_heap() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+const char *memory_subsystem_name(enum memory_subsystem subsystem) {
+    return subsystem < MEMORY_SUBSYSTEMS ? memory_subsystem_names[subsystem] : "";
+}
+
+void memory_dump(FILE *stream) {
+    fprintf(stream, "Memory: %zu heap bytes in use, %zu resident\n", memory_heap(), resident_memory());
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+        struct memory_stats stats;
+        memory_stats(subsystem, &stats);
+        fprintf(stream, "  %-10s %12llu JSON bytes live, %12llu JSON allocations, %12llu strings, %14llu string bytes\n",
+                memory_subsystem_name(subsystem), (unsigned long long)stats.json_bytes,
+                (unsigned long long)stats.json_allocations, (unsigned long long)stats.string_allocations,
+                (unsigned long long)stats.string_bytes);
+    }
+}
+
+
+// File cache /////////////////////////////////////////////////////////////////
+
+
+static struct {
+    pthread_mutex_t lock;
+    struct file_cache_entry **buckets;
+    size_t bucket_count;                // power of two
+    struct file_cache_entry *newest;    // LRU list
+    struct file_cache_entry *oldest;
+    size_t entries;
+    size_t mapped_bytes;
+    size_t max_entries;
+    size_t max_bytes;                   // budget for mapped files
+    size_t map_limit;                   // larger files are not mapped
+    uint64_t ttl;                       // ns between revalidations, 0 with inotify
+    uint64_t hits;
+    uint64_t misses;
+    _Atomic uint64_t versions;
+    int inotify;
+    struct { int watch; char *path; } *watches;
+    size_t watch_count;
+    char sites[MAX_PATH_LEN];           // directory of the hosted sites, "" if none
+} file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify = -1 };
+
+static uint64_t file_cache_hash(const char *url) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)url; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void file_cache_free(struct file_cache_entry *entry) {
+    if (entry->map) munmap((void *)entry->map, entry->size);
+    if (entry->fd >= 0) close(entry->fd);
+    free(entry->url);
+    free(entry->path);
+    free(entry->headers);
+    free(entry);
+}
+
+void file_cache_release(struct file_cache_entry *entry) {
+    if (entry && entry->bundle) {
+        // Bundle entries live as long as the mapping
+        bundle_release(entry->bundle);
+    } else if (entry && atomic_fetch_sub(&entry->references, 1) == 1) {
+        file_cache_free(entry);
+    }
+}
+
+// Removes the entry from the table and the LRU list; call with the lock held
+static void file_cache_remove(struct file_cache_entry *entry) {
+    struct file_cache_entry **link = &file_cache.buckets[entry->hash & (file_cache.bucket_count - 1)];
+    while (*link && *link != entry) link = &(*link)->next;
+    if (*link) *link = entry->next;
+    if (entry->newer) entry->newer->older = entry->older; else file_cache.newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else file_cache.oldest = entry->newer;
+    file_cache.entries--;
+    if (entry->map) file_cache.mapped_bytes -= entry->size;
+    file_cache_release(entry);
+}
+
+int file_cache_init(cJSON *config) {
+    cJSON *cache_config = cJSON_GetObjectItem(config, "file_cache");
+    file_cache.max_entries = read_int(cache_config, "entries", FILE_CACHE_ENTRIES);
+    file_cache.max_bytes = read_double(cache_config, "size", FILE_CACHE_SIZE);
+    file_cache.map_limit = read_double(cache_config, "map_limit", FILE_CACHE_MAP_LIMIT);
+    file_cache.ttl = read_double(cache_config, "ttl", FILE_CACHE_TTL) * 1000000;
+    if (file_cache.max_entries == 0) return -1;
+
+    file_cache.bucket_count = 1;
+    while (file_cache.bucket_count < file_cache.max_entries * 2) file_cache.bucket_count <<= 1;
+    file_cache.buckets = calloc(file_cache.bucket_count, sizeof(struct file_cache_entry *));
+    if (file_cache.buckets == NULL) return -1;
+
+#ifdef __linux__
+    // Changes are reported by inotify, entries need no revalidation
+    if (read_bool(cache_config, "inotify", true)) {
+        snprintf(file_cache.sites, sizeof(file_cache.sites), "%s", read_string(config, "sites", ""));
+        file_cache.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (file_cache.inotify >= 0 && file_cache_watch(STATIC_FOLDER) == 0 &&
+            file_cache_watch(TEMPLATES_FOLDER) == 0 &&
+            (file_cache.sites[0] == '\0' || file_cache_watch(file_cache.sites) == 0)) {
+            file_cache.ttl = 0;
+        }
+    }
+#endif
+    return 0;
+}
+
+int file_cache_descriptor() {
+    return file_cache.inotify;
+}
+
+// Adds inotify watches for the directory tree
+int file_cache_watch(const char *directory) {
+#ifdef __linux__
+    if (file_cache.inotify < 0) return -1;
+    int watch = inotify_add_watch(file_cache.inotify, directory,
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+        IN_DELETE_SELF | IN_ONLYDIR);
+    if (watch < 0) return -1;
+    void *watches = realloc(file_cache.watches, (file_cache.watch_count + 1) * sizeof(*file_cache.watches));
+    if (watches == NULL) return -1;
+    file_cache.watches = watches;
+    file_cache.watches[file_cache.watch_count].watch = watch;
+    file_cache.watches[file_cache.watch_count].path = strdup(directory);
+    file_cache.watch_count++;
+
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return 0;
+    struct dirent *entry;
+    int result = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        struct stat path_stat;
+        if (stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+            if (file_cache_watch(path) != 0) result = -1;
+        }
+    }
+    closedir(dir);
+    return result;
+#else
+    (void)directory;
+    return -1;
+#endif
+}
+
+bool file_cache_events() {
+    bool metadata_changed = false;
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(file_cache.inotify, buffer, sizeof(buffer))) > 0) {
+        for (char *position = buffer; position < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)position;
+            position += sizeof(struct inotify_event) + event->len;
+
+            const char *directory = NULL;
+            for (size_t i = 0; i < file_cache.watch_count; i++) {
+                if (file_cache.watches[i].watch == event->wd) directory = file_cache.watches[i].path;
+            }
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%s/%s", directory ? directory : "", event->len ? event->name : "");
+            // Files of a hosted site are relative to its directory, which
+            // is added or removed with its configuration
+            const char *site_path = path;
+            size_t sites_length = strlen(file_cache.sites);
+            if (sites_length > 0 && strncmp(path, file_cache.sites, sites_length) == 0 && path[sites_length] == '/') {
+                const char *separator = strchr(path + sites_length + 1, '/');
+                site_path = separator ? separator + 1 : "config.json";
+            }
+            bool static_file = strncmp(site_path, STATIC_FOLDER "/", strlen(STATIC_FOLDER "/")) == 0;
+            // Front matter and the set of pages make up the metadata; a
+            // write is reported once it is complete
+            if (((static_file && strends(path, ".md") == 0) ||
+                 (site_path != path && strcmp(site_path, "config.json") == 0)) && (event->mask & ~IN_MODIFY)) {
+                if (site_path != path) site_invalidate(path);
+                metadata_changed = true;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                page_cache_clear();
+                site_invalidate(NULL);
+                metadata_changed = true;
+            } else if (directory) {
+                // Pages that read the file, or looked for it if it was missing
+                page_cache_invalidate(path);
+            }
+
+            if ((static_file && (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) ||
+                (event->mask & IN_Q_OVERFLOW)) {
+                // A new or removed file may change how URLs resolve
+                file_cache_clear();
+            } else if (directory) {
+                file_cache_invalidate(path);
+            }
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR)) {
+                file_cache_watch(path);
+            }
+        }
+    }
+#endif
+    return metadata_changed;
+}
+
+void file_cache_invalidate(const char *path) {
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_cache_entry *entry = file_cache.newest;
+    while (entry) {
+        struct file_cache_entry *older = entry->older;
+        if (strcmp(entry->path, path) == 0) file_cache_remove(entry);
+        entry = older;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+void file_cache_clear() {
+    pthread_mutex_lock(&file_cache.lock);
+    while (file_cache.newest) file_cache_remove(file_cache.newest);
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+size_t file_cache_shrink() {
+    size_t dropped = 0;
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_cache_entry *entry = file_cache.oldest;
+    while (entry) {
+        struct file_cache_entry *newer = entry->newer;
+        // Files being sent keep their descriptors
+        if (entry->fd >= 0 && atomic_load(&entry->references) == 1) {
+            file_cache_remove(entry);
+            dropped++;
+        }
+        entry = newer;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return dropped;
+}
+
+// Opens and maps the file a URL resolves to
+static struct file_cache_entry *file_cache_load(const char *key, const char *url, uint64_t hash) {
+    char *path = resource_path((char *)url);
+    char fingerprint[FINGERPRINT_LENGTH + 1] = "";
+    char original_url[MAX_PATH_LEN];
+    if (path == NULL && fingerprint_strip(url, original_url, sizeof(original_url), fingerprint)) {
+        path = resource_path(original_url);
+    }
+    if (path == NULL) return NULL;
+    struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+    if (entry == NULL) return NULL;
+    entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (entry->fd < 0 && (errno == EMFILE || errno == ENFILE) && file_cache_shrink() > 0) {
+        entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat file_stat;
+    if (entry->fd < 0 || fstat(entry->fd, &file_stat) != 0) {
+        if (entry->fd >= 0) close(entry->fd);
+        free(entry);
+        return NULL;
+    }
+
+    // Fingerprinted URLs are immutable while the content matches; an
+    // outdated fingerprint gets the current content with the path's policy
+    const char *cache_control = NULL;
+    char content_fingerprint[FINGERPRINT_LENGTH + 1];
+    if (fingerprint[0] != '\0' && file_fingerprint(entry->fd, content_fingerprint) == 0 &&
+        strcmp(fingerprint, content_fingerprint) == 0) {
+        cache_control = FINGERPRINT_CACHE_CONTROL;
+    }
+    struct site *site = site_serving ? site_serving : site_acquire();
+    if (cache_control == NULL && site != NULL) cache_control = cache_policy(site->config, url);
+    if (cache_control != NULL) {
+        size_t headers_length = strlen("Cache-Control: \r\n") + strlen(cache_control) + 1;
+        entry->headers = malloc(headers_length);
+        if (entry->headers) snprintf(entry->headers, headers_length, "Cache-Control: %s\r\n", cache_control);
+    }
+    if (site != site_serving) site_release(site);
+    entry->url = strdup(key);
+    entry->path = strdup(path);
+    entry->hash = hash;
+    entry->size = file_stat.st_size;
+    entry->modified = file_stat.st_mtime;
+    entry->inode = file_stat.st_ino;
+    entry->content_type = get_content_type((char *)url, path);
+    entry->validated = metrics_now();
+    entry->version = atomic_fetch_add(&file_cache.versions, 1) + 1;
+    atomic_init(&entry->references, 1);
+
+    // Rendered pages are read by render_page; raw files are sent from memory
+    bool raw = strends(path, ".md") != 0 && strends(path, ".mustache") != 0;
+#ifdef CSERVER_LUA
+    raw = raw && strends(path, ".lua") != 0;
+#endif
+    entry->rendered = !raw;
+    if (raw && entry->size > 0 && (size_t)entry->size <= file_cache.map_limit) {
+        void *map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, entry->fd, 0);
+        if (map != MAP_FAILED) entry->map = map;
+    }
+    // Descriptors are kept only for files sent or read from them; pages
+    // are read by their path
+    if (entry->map || strends(path, ".md") == 0 || strends(path, ".mustache") == 0) {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+    return entry;
+}
+
+// Checks that the file did not change since it was cached
+static bool file_cache_valid(struct file_cache_entry *entry, uint64_t now) {
+    if (file_cache.ttl == 0 || now - entry->validated < file_cache.ttl) return true;
+    struct stat file_stat;
+    if (stat(entry->path, &file_stat) != 0 || file_stat.st_ino != entry->inode ||
+        file_stat.st_size != entry->size || file_stat.st_mtime != entry->modified) {
+        return false;
+    }
+    entry->validated = now;
+    return true;
+}
+
+struct file_cache_entry *file_cache_get(const char *url) {
+    // Sites share the cache, their URLs are told apart by the directory
+    char key[MAX_PATH_LEN];
+    if ((size_t)snprintf(key, sizeof(key), "%s%s", site_directory(), url) >= sizeof(key)) return NULL;
+    if (file_cache.buckets == NULL) return file_cache_load(key, url, 0);
+    uint64_t hash = file_cache_hash(key);
+    uint64_t now = metrics_now();
+
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_cache_entry *entry = file_cache.buckets[hash & (file_cache.bucket_count - 1)];
+    while (entry && (entry->hash != hash || strcmp(entry->url, key) != 0)) entry = entry->next;
+    if (entry && !file_cache_valid(entry, now)) {
+        file_cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        file_cache.hits++;
+        // Move to the front of the LRU list
+        if (entry->newer) {
+            entry->newer->older = entry->older;
+            if (entry->older) entry->older->newer = entry->newer; else file_cache.oldest = entry->newer;
+            entry->older = file_cache.newest;
+            entry->newer = NULL;
+            file_cache.newest->newer = entry;
+            file_cache.newest = entry;
+        }
+        atomic_fetch_add(&entry->references, 1);
+        pthread_mutex_unlock(&file_cache.lock);
+        return entry;
+    }
+    file_cache.misses++;
+    pthread_mutex_unlock(&file_cache.lock);
+
+    // Load without the lock; a concurrent miss for the same URL loads twice
+    // and one of the entries wins
+    entry = file_cache_load(key, url, hash);
+    if (entry == NULL) return NULL;
+
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_cache_entry **bucket = &file_cache.buckets[hash & (file_cache.bucket_count - 1)];
+    struct file_cache_entry *existing = *bucket;
+    while (existing && (existing->hash != hash || strcmp(existing->url, key) != 0)) existing = existing->next;
+    if (existing) file_cache_remove(existing);
+
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->older = file_cache.newest;
+    if (file_cache.newest) file_cache.newest->newer = entry; else file_cache.oldest = entry;
+    file_cache.newest = entry;
+    file_cache.entries++;
+    if (entry->map) file_cache.mapped_bytes += entry->size;
+    // Reference for the caller, the table holds the first one
+    atomic_fetch_add(&entry->references, 1);
+
+    // Evict the least recently used entries over the budget
+    while (file_cache.oldest != entry &&
+           (file_cache.entries > file_cache.max_entries || file_cache.mapped_bytes > file_cache.max_bytes)) {
+        file_cache_remove(file_cache.oldest);
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return entry;
+}
 
-    if (!category_metadata || !files_metadata) {
-        cJSON_AddItemToObject(metadata, "index", index);
+string file_cache_read(struct file_cache_entry *entry) {
+    string result = string_init();
+    char *content = malloc(entry->size + 1);
+    if (content == NULL) return result;
+    size_t total = 0;
+    if (entry->map) {
+        memcpy(content, entry->map, entry->size);
+        total = entry->size;
+    }
+    while (total < (size_t)entry->size) {
+        ssize_t length = pread(entry->fd, content + total, entry->size - total, total);
+        if (length <= 0) break;
+        total += length;
+    }
+    content[total] = '\0';
+    memory_count_string(total + 1);
+    result.value = content;
+    result.length = total;
+    return result;
+}
+
+void file_cache_stats(uint64_t *hits, uint64_t *misses, size_t *entries, size_t *mapped_bytes) {
+    pthread_mutex_lock(&file_cache.lock);
+    if (hits) *hits = file_cache.hits;
+    if (misses) *misses = file_cache.misses;
+    if (entries) *entries = file_cache.entries;
+    if (mapped_bytes) *mapped_bytes = file_cache.mapped_bytes;
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+
+// Page cache /////////////////////////////////////////////////////////////////
+
+
+// Rendering of a page the cache could not keep, reused by later requests
+// for it in the same batch of events. Requests are handled by one worker
+// thread, so a rendering is finished by the time another request finds it;
+// pages the cache keeps are found there instead.
+struct page_flight {
+    char *key;                      // method and URL
+    char *path;                     // page file
+    uint64_t hash;
+    uint64_t site_generation;
+    uint64_t config_hash;
+    string content;
+    struct page_flight *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct page_flight *flights;
+    struct page_cache_entry **buckets;
+    size_t bucket_count;                // power of two
+    struct page_cache_entry *newest;    // LRU list
+    struct page_cache_entry *oldest;
+    size_t entries;
+    size_t bytes;
+    size_t max_entries;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidated;
+    uint64_t coalesced;
+    uint64_t sequence;                  // counts invalidations, for renderings that overlap one
+} page_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Page being rendered by this thread and the site it is rendered with
+static _Thread_local struct page_cache_entry *page_recording = NULL;
+static _Thread_local struct site *page_recording_site = NULL;
+
+static uint64_t json_hash_value(uint64_t hash, const cJSON *item) {
+    hash = hash_bytes(hash, &item->type, sizeof(item->type));
+    if (item->string) hash = hash_bytes(hash, item->string, strlen(item->string) + 1);
+    if (cJSON_IsString(item) && item->valuestring) {
+        hash = hash_bytes(hash, item->valuestring, strlen(item->valuestring) + 1);
+    } else if (cJSON_IsNumber(item)) {
+        hash = hash_bytes(hash, &item->valuedouble, sizeof(item->valuedouble));
+    }
+    for (const cJSON *child = item->child; child; child = child->next) hash = json_hash_value(hash, child);
+    return hash;
+}
+
+uint64_t json_hash(const cJSON *item) {
+    return item ? json_hash_value(14695981039346656037ULL, item) : 0;
+}
+
+// Modification time, size and inode of a file
+static uint64_t page_stat_state(const struct stat *file_stat) {
+    struct timespec modified = page_modified(file_stat);
+    uint64_t state = hash_bytes(14695981039346656037ULL, &modified.tv_sec, sizeof(modified.tv_sec));
+    state = hash_bytes(state, &modified.tv_nsec, sizeof(modified.tv_nsec));
+    state = hash_bytes(state, &file_stat->st_size, sizeof(file_stat->st_size));
+    return hash_bytes(state, &file_stat->st_ino, sizeof(file_stat->st_ino));
+}
+
+// State of a file; 0 if it does not exist
+static uint64_t page_file_state(const char *path) {
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0) return 0;
+    return page_stat_state(&file_stat);
+}
+
+// Hash of a metadata entry named "<object>/<key>"; 0 if it does not exist
+static uint64_t page_metadata_state(struct site *site, const char *name) {
+    const char *separator = strchr(name, '/');
+    if (site == NULL || separator == NULL) return 0;
+    char object_name[64];
+    snprintf(object_name, sizeof(object_name), "%.*s", (int)(separator - name), name);
+    cJSON *object = cJSON_GetObjectItem(site->metadata, object_name);
+    return json_hash(cJSON_GetObjectItem(object, separator + 1));
+}
+
+static void page_cache_free(struct page_cache_entry *entry) {
+    for (size_t i = 0; i < entry->dependency_count; i++) free(entry->dependencies[i].name);
+    free(entry->dependencies);
+    string_free(entry->content);
+    free(entry->key);
+    free(entry);
+}
+
+// Removes the entry from the table and the LRU list; call with the lock held
+static void page_cache_remove(struct page_cache_entry *entry) {
+    struct page_cache_entry **link = &page_cache.buckets[entry->hash & (page_cache.bucket_count - 1)];
+    while (*link && *link != entry) link = &(*link)->next;
+    if (*link) *link = entry->next;
+    if (entry->newer) entry->newer->older = entry->older; else page_cache.newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else page_cache.oldest = entry->newer;
+    page_cache.entries--;
+    page_cache.bytes -= entry->content.length;
+    page_cache_free(entry);
+}
+
+int page_cache_init(cJSON *config) {
+    cJSON *cache_config = cJSON_GetObjectItem(config, "page_cache");
+    page_cache.max_entries = read_int(cache_config, "entries", PAGE_CACHE_ENTRIES);
+    page_cache.max_bytes = read_double(cache_config, "size", PAGE_CACHE_SIZE);
+    if (page_cache.max_entries == 0) return -1;
+
+    page_cache.bucket_count = 1;
+    while (page_cache.bucket_count < page_cache.max_entries * 2) page_cache.bucket_count <<= 1;
+    page_cache.buckets = calloc(page_cache.bucket_count, sizeof(struct page_cache_entry *));
+    return page_cache.buckets ? 0 : -1;
+}
+
+void page_dependency_add(enum page_dependency_kind kind, const char *name) {
+    struct page_cache_entry *entry = page_recording;
+    if (entry == NULL) return;
+    // resource_path joins directory URLs and index files with a double slash
+    char normalized[MAX_PATH_LEN];
+    size_t length = 0;
+    for (const char *c = kind == PAGE_DEPENDENCY_SITE ? "site" : name; *c && length < sizeof(normalized) - 1; c++) {
+        if (kind == PAGE_DEPENDENCY_FILE && *c == '/' && length > 0 && normalized[length - 1] == '/') continue;
+        normalized[length++] = *c;
+    }
+    normalized[length] = '\0';
+    for (size_t i = 0; i < entry->dependency_count; i++) {
+        if (entry->dependencies[i].kind == kind && strcmp(entry->dependencies[i].name, normalized) == 0) return;
+    }
+    if (entry->dependency_count == entry->dependency_capacity) {
+        size_t capacity = entry->dependency_capacity ? entry->dependency_capacity * 2 : 8;
+        struct page_dependency *dependencies = realloc(entry->dependencies, capacity * sizeof(struct page_dependency));
+        if (dependencies == NULL) return;
+        entry->dependencies = dependencies;
+        entry->dependency_capacity = capacity;
+    }
+    struct page_dependency *dependency = &entry->dependencies[entry->dependency_count];
+    dependency->kind = kind;
+    dependency->name = strdup(normalized);
+    if (dependency->name == NULL) return;
+    switch (kind) {
+        case PAGE_DEPENDENCY_FILE: dependency->state = page_file_state(normalized); break;
+        case PAGE_DEPENDENCY_METADATA: dependency->state = page_metadata_state(page_recording_site, normalized); break;
+        case PAGE_DEPENDENCY_SITE: dependency->state = page_recording_site ? page_recording_site->generation : 0; break;
+    }
+    entry->dependency_count++;
+}
+
+// Checks the dependencies against the file system, at most once per file
+// cache TTL, and against the site metadata after a reload; call with the
+// lock held
+static bool page_cache_valid(struct page_cache_entry *entry, struct site *site, uint64_t now) {
+    if (entry->config_hash != site->config_hash) return false;
+    bool check_files = file_cache.ttl > 0 && now - entry->validated >= file_cache.ttl;
+    bool check_metadata = entry->site_generation != site->generation;
+    if (!check_files && !check_metadata) return true;
+    for (size_t i = 0; i < entry->dependency_count; i++) {
+        struct page_dependency *dependency = &entry->dependencies[i];
+        if (dependency->kind == PAGE_DEPENDENCY_FILE && check_files &&
+            page_file_state(dependency->name) != dependency->state) {
+            return false;
+        }
+        if (dependency->kind == PAGE_DEPENDENCY_METADATA && check_metadata &&
+            page_metadata_state(site, dependency->name) != dependency->state) {
+            return false;
+        }
+        if (dependency->kind == PAGE_DEPENDENCY_SITE && check_metadata) return false;
+    }
+    if (check_files) entry->validated = now;
+    entry->site_generation = site->generation;
+    return true;
+}
+
+// Cache key: method and URL from the request context, and the directory
+// of a hosted site
+static char *page_cache_key(struct site *site, cJSON *context) {
+    cJSON *request = cJSON_GetObjectItem(context, "request");
+    const char *method = cJSON_GetStringValue(cJSON_GetObjectItem(request, "method"));
+    const char *url = cJSON_GetStringValue(cJSON_GetObjectItem(request, "query"));
+    const char *root = site->root ? site->root : "";
+    size_t key_length = strlen(method ? method : "") + strlen(root) + strlen(url ? url : "") + 2;
+    char *key = malloc(key_length);
+    if (key) snprintf(key, key_length, "%s %s%s", method ? method : "", root, url ? url : "");
+    return key;
+}
+
+static string page_copy(string content) {
+    string copy = string_init();
+    copy.value = content.value ? malloc(content.length + 1) : NULL;
+    if (copy.value) {
+        memcpy(copy.value, content.value, content.length + 1);
+        copy.length = content.length;
+        enum memory_subsystem previous = memory_enter(MEMORY_CACHE);
+        memory_count_string(copy.length + 1);
+        memory_leave(previous);
+    }
+    return copy;
+}
+
+static void page_flight_free(struct page_flight *flight) {
+    string_free(flight->content);
+    free(flight->path);
+    free(flight->key);
+    free(flight);
+}
+
+// Finds the rendering of the same page with the same site; call with the
+// lock held
+static struct page_flight *page_flight_find(struct site *site, uint64_t hash, const char *key, const char *path) {
+    struct page_flight *flight = page_cache.flights;
+    while (flight && (flight->hash != hash || flight->site_generation != site->generation ||
+                      flight->config_hash != site->config_hash || strcmp(flight->key, key) != 0 ||
+                      strcmp(flight->path, path) != 0)) {
+        flight = flight->next;
+    }
+    return flight;
+}
+
+// Drops the renderings of the batch; call with the lock held
+static void page_flights_expire() {
+    while (page_cache.flights) {
+        struct page_flight *flight = page_cache.flights;
+        page_cache.flights = flight->next;
+        page_flight_free(flight);
+    }
+}
+
+void page_cache_batch_end() {
+    pthread_mutex_lock(&page_cache.lock);
+    page_flights_expire();
+    pthread_mutex_unlock(&page_cache.lock);
+}
+
+string page_cache_render(struct site *site, cJSON *context, struct file_cache_entry *file) {
+    if (site == NULL) return render_page(site, context, file->path);
+    char *key = page_cache_key(site, context);
+    if (key == NULL) return render_page(site, context, file->path);
+    uint64_t hash = file_cache_hash(key);
+    uint64_t now = metrics_now();
+
+    pthread_mutex_lock(&page_cache.lock);
+    struct page_flight *flight = page_flight_find(site, hash, key, file->path);
+    if (flight) {
+        page_cache.coalesced++;
+        string content = page_copy(flight->content);
+        pthread_mutex_unlock(&page_cache.lock);
+        free(key);
+        return content.value ? content : render_page(site, context, file->path);
+    }
+
+    struct page_cache_entry *entry = NULL;
+    if (page_cache.buckets) {
+        entry = page_cache.buckets[hash & (page_cache.bucket_count - 1)];
+        while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) entry = entry->next;
+        if (entry && !page_cache_valid(entry, site, now)) {
+            page_cache.invalidated++;
+            page_cache_remove(entry);
+            entry = NULL;
+        }
+        if (entry) {
+            page_cache.hits++;
+            // Move to the front of the LRU list
+            if (entry->newer) {
+                entry->newer->older = entry->older;
+                if (entry->older) entry->older->newer = entry->newer; else page_cache.oldest = entry->newer;
+                entry->older = page_cache.newest;
+                entry->newer = NULL;
+                page_cache.newest->newer = entry;
+                page_cache.newest = entry;
+            }
+            string content = page_copy(entry->content);
+            pthread_mutex_unlock(&page_cache.lock);
+            free(key);
+            return content;
+        }
+        page_cache.misses++;
+    }
+
+    uint64_t sequence = page_cache.sequence;
+    pthread_mutex_unlock(&page_cache.lock);
+
+    // Render without the lock, recording what the page reads
+    entry = page_cache.buckets ? calloc(1, sizeof(struct page_cache_entry)) : NULL;
+    string content;
+    if (entry) {
+        entry->hash = hash;
+        entry->site_generation = site->generation;
+        entry->config_hash = site->config_hash;
+        entry->validated = now;
+        page_recording = entry;
+        page_recording_site = site;
+        page_dependency_add(PAGE_DEPENDENCY_FILE, file->path);
+        content = render_page(site, context, file->path);
+        page_recording = NULL;
+        page_recording_site = NULL;
+        entry->content = content.length <= page_cache.max_bytes ? page_copy(content) : string_init();
+        if (entry->content.value == NULL) {
+            page_cache_free(entry);
+            entry = NULL;
+        }
+    } else {
+        content = render_page(site, context, file->path);
+    }
+
+    pthread_mutex_lock(&page_cache.lock);
+    // A file changed during the rendering, which may have read it before
+    // the change; with inotify the entry would not be checked again
+    bool stale = page_cache.sequence != sequence;
+    if (entry != NULL && stale) {
+        page_cache_free(entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        // Later requests in the batch share a page the cache cannot keep
+        flight = stale || content.value == NULL ? NULL : calloc(1, sizeof(struct page_flight));
+        if (flight) {
+            flight->key = key;
+            key = NULL;
+            flight->path = strdup(file->path);
+            flight->hash = hash;
+            flight->site_generation = site->generation;
+            flight->config_hash = site->config_hash;
+            flight->content = page_copy(content);
+            if (flight->path && flight->content.value) {
+                flight->next = page_cache.flights;
+                page_cache.flights = flight;
+            } else {
+                page_flight_free(flight);
+            }
+        }
+        pthread_mutex_unlock(&page_cache.lock);
+        free(key);
+        return content;
+    }
+    entry->key = key;
+    struct page_cache_entry **bucket = &page_cache.buckets[hash & (page_cache.bucket_count - 1)];
+    struct page_cache_entry *existing = *bucket;
+    while (existing && (existing->hash != hash || strcmp(existing->key, entry->key) != 0)) existing = existing->next;
+    if (existing) page_cache_remove(existing);
+
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->older = page_cache.newest;
+    if (page_cache.newest) page_cache.newest->newer = entry; else page_cache.oldest = entry;
+    page_cache.newest = entry;
+    page_cache.entries++;
+    page_cache.bytes += entry->content.length;
+
+    // Evict the least recently used pages over the budget
+    while (page_cache.oldest != entry &&
+           (page_cache.entries > page_cache.max_entries || page_cache.bytes > page_cache.max_bytes)) {
+        page_cache_remove(page_cache.oldest);
+    }
+    pthread_mutex_unlock(&page_cache.lock);
+    return content;
+}
+
+// Markdown bodies converted to HTML, by file path and state
+struct fragment {
+    char *path;
+    uint64_t hash;
+    uint64_t state;                     // page_stat_state of the file
+    string html;
+    struct fragment *next;              // hash bucket
+    struct fragment *newer;             // LRU list
+    struct fragment *older;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct fragment **buckets;
+    size_t bucket_count;                // power of two
+    struct fragment *newest;
+    struct fragment *oldest;
+    size_t entries;
+    size_t bytes;
+    size_t max_entries;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+} fragment_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Removes the fragment from the table and the LRU list; call with the lock held
+static void fragment_cache_remove(struct fragment *fragment) {
+    struct fragment **link = &fragment_cache.buckets[fragment->hash & (fragment_cache.bucket_count - 1)];
+    while (*link && *link != fragment) link = &(*link)->next;
+    if (*link) *link = fragment->next;
+    if (fragment->newer) fragment->newer->older = fragment->older; else fragment_cache.newest = fragment->older;
+    if (fragment->older) fragment->older->newer = fragment->newer; else fragment_cache.oldest = fragment->newer;
+    fragment_cache.entries--;
+    fragment_cache.bytes -= fragment->html.length;
+    string_free(fragment->html);
+    free(fragment->path);
+    free(fragment);
+}
+
+// resource_path joins directory URLs and index files with a double slash
+static const char *fragment_path(char *normalized, size_t size, const char *path) {
+    size_t length = 0;
+    for (const char *c = path; *c && length < size - 1; c++) {
+        if (*c == '/' && length > 0 && normalized[length - 1] == '/') continue;
+        normalized[length++] = *c;
+    }
+    normalized[length] = '\0';
+    return normalized;
+}
+
+// Finds the fragment of a path; call with the lock held
+static struct fragment *fragment_cache_find(const char *path, uint64_t hash) {
+    struct fragment *fragment = fragment_cache.buckets[hash & (fragment_cache.bucket_count - 1)];
+    while (fragment && (fragment->hash != hash || strcmp(fragment->path, path) != 0)) fragment = fragment->next;
+    return fragment;
+}
+
+int fragment_cache_init(cJSON *config) {
+    cJSON *cache_config = cJSON_GetObjectItem(config, "fragment_cache");
+    fragment_cache.max_entries = read_int(cache_config, "entries", FRAGMENT_CACHE_ENTRIES);
+    fragment_cache.max_bytes = read_double(cache_config, "size", FRAGMENT_CACHE_SIZE);
+    if (fragment_cache.max_entries == 0) return -1;
+
+    fragment_cache.bucket_count = 1;
+    while (fragment_cache.bucket_count < fragment_cache.max_entries * 2) fragment_cache.bucket_count <<= 1;
+    fragment_cache.buckets = calloc(fragment_cache.bucket_count, sizeof(struct fragment *));
+    return fragment_cache.buckets ? 0 : -1;
+}
+
+string fragment_cache_get(const char *path, const struct stat *file_stat) {
+    string html = string_init();
+    if (fragment_cache.buckets == NULL) return html;
+    char normalized[MAX_PATH_LEN];
+    path = fragment_path(normalized, sizeof(normalized), path);
+    uint64_t hash = file_cache_hash(path);
+    pthread_mutex_lock(&fragment_cache.lock);
+    struct fragment *fragment = fragment_cache_find(path, hash);
+    if (fragment && fragment->state != page_stat_state(file_stat)) {
+        fragment_cache_remove(fragment);
+        fragment = NULL;
+    }
+    if (fragment) {
+        fragment_cache.hits++;
+        // Move to the front of the LRU list
+        if (fragment->newer) {
+            fragment->newer->older = fragment->older;
+            if (fragment->older) fragment->older->newer = fragment->newer; else fragment_cache.oldest = fragment->newer;
+            fragment->older = fragment_cache.newest;
+            fragment->newer = NULL;
+            fragment_cache.newest->newer = fragment;
+            fragment_cache.newest = fragment;
+        }
+        html = page_copy(fragment->html);
+    }
+    pthread_mutex_unlock(&fragment_cache.lock);
+    return html;
+}
+
+void fragment_cache_put(const char *path, const struct stat *file_stat, string html) {
+    if (fragment_cache.buckets == NULL || html.value == NULL || html.length > fragment_cache.max_bytes) return;
+    struct fragment *fragment = calloc(1, sizeof(struct fragment));
+    if (fragment == NULL) return;
+    char normalized[MAX_PATH_LEN];
+    path = fragment_path(normalized, sizeof(normalized), path);
+    fragment->path = strdup(path);
+    fragment->hash = file_cache_hash(path);
+    fragment->state = page_stat_state(file_stat);
+    fragment->html = page_copy(html);
+    if (fragment->path == NULL || fragment->html.value == NULL) {
+        string_free(fragment->html);
+        free(fragment->path);
+        free(fragment);
         return;
     }
 
-    cJSON *category;
-    cJSON_ArrayForEach(category, category_metadata) {
-        const char *category_name = category->string;
-        char lowercased_name[256];
-        to_lowercase_and_dash(lowercased_name, category_name);
+    pthread_mutex_lock(&fragment_cache.lock);
+    // Bodies with Mustache tags are not looked for, only conversions count
+    fragment_cache.misses++;
+    struct fragment *existing = fragment_cache_find(path, fragment->hash);
+    if (existing) fragment_cache_remove(existing);
+    struct fragment **bucket = &fragment_cache.buckets[fragment->hash & (fragment_cache.bucket_count - 1)];
+    fragment->next = *bucket;
+    *bucket = fragment;
+    fragment->older = fragment_cache.newest;
+    if (fragment_cache.newest) fragment_cache.newest->newer = fragment; else fragment_cache.oldest = fragment;
+    fragment_cache.newest = fragment;
+    fragment_cache.entries++;
+    fragment_cache.bytes += fragment->html.length;
+
+    // Evict the least recently used fragments over the budget
+    while (fragment_cache.oldest != fragment &&
+           (fragment_cache.entries > fragment_cache.max_entries || fragment_cache.bytes > fragment_cache.max_bytes)) {
+        fragment_cache_remove(fragment_cache.oldest);
+    }
+    pthread_mutex_unlock(&fragment_cache.lock);
+}
 
-        cJSON *category_object = cJSON_CreateObject();
-        cJSON_AddStringToObject(category_object, "name", lowercased_name);
-        cJSON_AddStringToObject(category_object, "title", category_name);
+// Drops the fragment of a changed file, or all of them for NULL
+static void fragment_cache_invalidate(const char *path) {
+    pthread_mutex_lock(&fragment_cache.lock);
+    if (path == NULL) {
+        while (fragment_cache.newest) fragment_cache_remove(fragment_cache.newest);
+    } else if (fragment_cache.buckets) {
+        struct fragment *fragment = fragment_cache_find(path, file_cache_hash(path));
+        if (fragment) fragment_cache_remove(fragment);
+    }
+    pthread_mutex_unlock(&fragment_cache.lock);
+}
 
-        cJSON *pages_array = cJSON_CreateArray();
-        cJSON_AddItemToObject(category_object, "pages", pages_array);
+void fragment_cache_stats(uint64_t *hits, uint64_t *misses, size_t *entries, size_t *bytes) {
+    pthread_mutex_lock(&fragment_cache.lock);
+    if (hits) *hits = fragment_cache.hits;
+    if (misses) *misses = fragment_cache.misses;
+    if (entries) *entries = fragment_cache.entries;
+    if (bytes) *bytes = fragment_cache.bytes;
+    pthread_mutex_unlock(&fragment_cache.lock);
+}
 
-        cJSON *page;
-        cJSON_ArrayForEach(page, category) {
-            const char *page_link = page->valuestring;
+size_t page_cache_invalidate(const char *path) {
+    fragment_cache_invalidate(path);
+    size_t dropped = 0;
+    pthread_mutex_lock(&page_cache.lock);
+    struct page_cache_entry *entry = page_cache.newest;
+    while (entry) {
+        struct page_cache_entry *older = entry->older;
+        for (size_t i = 0; i < entry->dependency_count; i++) {
+            if (entry->dependencies[i].kind == PAGE_DEPENDENCY_FILE && strcmp(entry->dependencies[i].name, path) == 0) {
+                page_cache_remove(entry);
+                dropped++;
+                break;
+            }
+        }
+        entry = older;
+    }
+    page_cache.invalidated += dropped;
+    page_cache.sequence++;
+    page_flights_expire();
+    pthread_mutex_unlock(&page_cache.lock);
+    return dropped;
+}
 
-            cJSON *page_object = cJSON_CreateObject();
-            cJSON_AddStringToObject(page_object, "link", page_link);
+// Records a dependency on all site metadata if a Mustache source reads
+// `site` directly, like {{site.title}} or {{#site.index.Notes}}
+static void page_dependency_scan(const char *source, size_t length) {
+    if (page_recording == NULL || source == NULL) return;
+    const char *end = source + length;
+    const char *tag = memmem(source, length, "{{", 2);
+    while (tag) {
+        const char *name = tag + 2;
+        while (name < end && strchr("{&#^/> ", *name)) name++;
+        if (end - name >= 4 && memcmp(name, "site", 4) == 0 &&
+            (end - name == 4 || !(isalnum((unsigned char)name[4]) || name[4] == '_'))) {
+            page_dependency_add(PAGE_DEPENDENCY_SITE, NULL);
+            return;
+        }
+        tag = memmem(name, end - name, "{{", 2);
+    }
+}
 
-            cJSON *page_title = cJSON_GetObjectItem(files_metadata, page_link);
-            if (page_title) {
-                cJSON_AddStringToObject(page_object, "title", page_title->valuestring);
+void page_cache_clear() {
+    fragment_cache_invalidate(NULL);
+    pthread_mutex_lock(&page_cache.lock);
+    while (page_cache.newest) page_cache_remove(page_cache.newest);
+    page_cache.sequence++;
+    page_flights_expire();
+    pthread_mutex_unlock(&page_cache.lock);
+}
+
+void page_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *invalidated, uint64_t *coalesced,
+                      size_t *entries, size_t *bytes) {
+    pthread_mutex_lock(&page_cache.lock);
+    if (coalesced) *coalesced = page_cache.coalesced;
+    if (hits) *hits = page_cache.hits;
+    if (misses) *misses = page_cache.misses;
+    if (invalidated) *invalidated = page_cache.invalidated;
+    if (entries) *entries = page_cache.entries;
+    if (bytes) *bytes = page_cache.bytes;
+    pthread_mutex_unlock(&page_cache.lock);
+}
+
+
+
+// Early hints ////////////////////////////////////////////////////////////////
+
+
+// Template or partial the links were found in
+struct early_hints_file {
+    char *path;
+    uint64_t state;                 // page_file_state, 0 for a missing partial
+};
+
+// Preload links of a template and the partials it includes
+struct early_hints {
+    char *template;
+    struct early_hints_file files[EARLY_HINTS_FILES];
+    size_t file_count;
+    char links[EARLY_HINTS_SIZE];   // Link header lines
+    size_t length;
+    uint64_t validated;             // when the files were last checked
+    uint64_t sequence;              // of the page cache at that time
+};
+
+static pthread_mutex_t early_hints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Finds an attribute between the tag name and the end of a tag; returns
+// its value, empty for attributes without one, NULL if it is missing
+static const char *html_attribute(const char *tag, const char *end, const char *name, size_t *length) {
+    size_t name_length = strlen(name);
+    const char *p = tag;
+    while (p < end) {
+        while (p < end && (isspace((unsigned char)*p) || *p == '/')) p++;
+        const char *attribute = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '=' && *p != '/') p++;
+        size_t attribute_length = p - attribute;
+        if (attribute_length == 0) break;
+        while (p < end && isspace((unsigned char)*p)) p++;
+        const char *value = p;
+        *length = 0;
+        if (p < end && *p == '=') {
+            p++;
+            while (p < end && isspace((unsigned char)*p)) p++;
+            if (p < end && (*p == '"' || *p == '\'')) {
+                const char *close = memchr(p + 1, *p, end - p - 1);
+                if (close == NULL) return NULL;
+                value = p + 1;
+                *length = close - value;
+                p = close + 1;
+            } else {
+                value = p;
+                while (p < end && !isspace((unsigned char)*p)) p++;
+                *length = p - value;
             }
+        }
+        if (attribute_length == name_length && strncasecmp(attribute, name, name_length) == 0) return value;
+    }
+    return NULL;
+}
 
-            cJSON_AddItemToArray(pages_array, page_object);
+// Checks whether a space separated attribute value has a token
+static bool html_token(const char *value, size_t length, const char *token) {
+    size_t token_length = strlen(token);
+    const char *end = value + length;
+    while (value < end) {
+        while (value < end && isspace((unsigned char)*value)) value++;
+        const char *start = value;
+        while (value < end && !isspace((unsigned char)*value)) value++;
+        if ((size_t)(value - start) == token_length && strncasecmp(start, token, token_length) == 0) return true;
+    }
+    return false;
+}
+
+// Checks the name of the tag starting at `tag`
+static bool html_tag(const char *tag, const char *end, const char *name) {
+    size_t name_length = strlen(name);
+    return (size_t)(end - tag) > name_length + 1 && strncasecmp(tag + 1, name, name_length) == 0 &&
+           isspace((unsigned char)tag[name_length + 1]);
+}
+
+// URLs go into a header as they are; template values and inline data are
+// not preloaded
+static bool preload_url(const char *url, size_t length) {
+    if (length == 0 || length > 512 || (length >= 5 && strncasecmp(url, "data:", 5) == 0)) return false;
+    if (memmem(url, length, "{{", 2) != NULL) return false;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = url[i];
+        if (c <= ' ' || c == '<' || c == '>' || c == '"' || c >= 0x7f) return false;
+    }
+    return true;
+}
+
+size_t preload_links(substring html, char *links, size_t length, size_t size) {
+    const char *end = html.value + html.length;
+    for (const char *tag = html.value; (tag = memchr(tag, '<', end - tag)) != NULL; tag++) {
+        const char *tag_end = memchr(tag, '>', end - tag);
+        if (tag_end == NULL) break;
+        const char *url, *type, *as = NULL;
+        size_t url_length = 0, type_length = 0, as_length = 0;
+        size_t crossorigin_length;
+        bool module = false;
+        if (html_tag(tag, tag_end, "link")) {
+            type = html_attribute(tag + 5, tag_end, "rel", &type_length);
+            if (type == NULL) continue;
+            if (html_token(type, type_length, "stylesheet")) {
+                as = "style";
+                as_length = 5;
+            } else if (html_token(type, type_length, "preload")) {
+                as = html_attribute(tag + 5, tag_end, "as", &as_length);
+                if (as == NULL || as_length == 0 || as_length > 16) continue;
+            } else {
+                continue;
+            }
+            url = html_attribute(tag + 5, tag_end, "href", &url_length);
+        } else if (html_tag(tag, tag_end, "script")) {
+            url = html_attribute(tag + 7, tag_end, "src", &url_length);
+            type = html_attribute(tag + 7, tag_end, "type", &type_length);
+            module = type != NULL && type_length == 6 && strncasecmp(type, "module", 6) == 0;
+            as = "script";
+            as_length = 6;
+        } else {
+            continue;
         }
+        if (url == NULL || !preload_url(url, url_length)) continue;
+        bool crossorigin = html_attribute(tag + 1, tag_end, "crossorigin", &crossorigin_length) != NULL;
+        for (size_t i = 0; i < as_length; i++) {
+            if (!isalpha((unsigned char)as[i])) as_length = 0;
+        }
+        if (as_length == 0) continue;
+
+        char line[640];
+        int line_length = module
+            ? snprintf(line, sizeof(line), "Link: <%.*s>; rel=modulepreload%s\r\n",
+                       (int)url_length, url, crossorigin ? "; crossorigin" : "")
+            : snprintf(line, sizeof(line), "Link: <%.*s>; rel=preload; as=%.*s%s\r\n",
+                       (int)url_length, url, (int)as_length, as, crossorigin ? "; crossorigin" : "");
+        if (line_length < 0 || (size_t)line_length >= sizeof(line)) continue;
+        if (memmem(links, length, line, line_length) != NULL) continue;
+        if (length + line_length >= size) break;
+        memcpy(links + length, line, line_length + 1);
+        length += line_length;
+    }
+    return length;
+}
 
-        cJSON_AddItemToArray(categories, category_object);
+// Adds the links of a template or partial file and of the partials it
+// includes; every file is scanned once
+static void early_hints_scan(struct site *site, struct early_hints *hints, const char *path, cJSON *assets) {
+    for (size_t i = 0; i < hints->file_count; i++) {
+        if (strcmp(hints->files[i].path, path) == 0) return;
     }
+    if (hints->file_count == EARLY_HINTS_FILES) return;
+    struct early_hints_file *file = &hints->files[hints->file_count++];
+    file->path = strdup(path);
+    file->state = page_file_state(path);
+    string content = read_file(path);
+    if (content.value == NULL) return;
+
+    substring template = { .value = content.value, .length = content.length };
+    string expanded = expand_assets(template, assets);
+    if (expanded.value) template = expanded;
+    hints->length = preload_links(template, hints->links, hints->length, sizeof(hints->links));
+
+    const char *end = template.value + template.length;
+    for (const char *tag = template.value; (tag = memmem(tag, end - tag, "{{>", 3)) != NULL; ) {
+        tag += 3;
+        while (tag < end && isspace((unsigned char)*tag)) tag++;
+        const char *name = tag;
+        while (tag < end && !isspace((unsigned char)*tag) && *tag != '}') tag++;
+        if (tag == name) continue;
+        char partial[MAX_PATH_LEN];
+        snprintf(partial, sizeof(partial), "%s" TEMPLATES_FOLDER "/partials/%.*s.mustache",
+                 site->root, (int)(tag - name), name);
+        early_hints_scan(site, hints, partial, assets);
+    }
+    string_free(expanded);
+    string_free(content);
+}
 
-    cJSON_AddItemToObject(metadata, "index", index);
+// Whether none of the files changed since the links were found. Like
+// cached pages, the files are checked after an invalidation with inotify,
+// otherwise once per file cache TTL.
+static bool early_hints_current(struct early_hints *hints, uint64_t now) {
+    pthread_mutex_lock(&page_cache.lock);
+    uint64_t sequence = page_cache.sequence;
+    pthread_mutex_unlock(&page_cache.lock);
+    bool check_files = file_cache.ttl > 0 ? now - hints->validated >= file_cache.ttl : sequence != hints->sequence;
+    if (!check_files) return true;
+    for (size_t i = 0; i < hints->file_count; i++) {
+        if (page_file_state(hints->files[i].path) != hints->files[i].state) return false;
+    }
+    hints->validated = now;
+    hints->sequence = sequence;
+    return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+void early_hints_free(struct early_hints *hints) {
+    if (hints == NULL) return;
+    for (size_t i = 0; i < hints->file_count; i++) free(hints->files[i].path);
+    free(hints->template);
+    free(hints);
+}
 
-string make_response(char *http_status, const char *content_type, string content) {
-    string result = string_init();
-    // Calculate the lengths of various parts of the HTTP response
-    // CRLF is the standard line break (https://www.w3.org/MarkUp/html-spec/html-spec_8.html#SEC8.2.1)
-    int status_line_length = snprintf(NULL, 0, "HTTP/1.1 %s\r\n", http_status);
-    int content_type_length = snprintf(NULL, 0, "Content-Type: %s\r\n", content_type);
-    int content_length_length = snprintf(NULL, 0, "Content-Length: %li\r\n", content.length);
-    
-    // Calculate the total length of the HTTP response
-    // + 2 for \r\n before content
-    int total_length = status_line_length + content_type_length + content_length_length + 2 + content.length; 
-    
-    // Allocate memory for the complete HTTP response
-    char *response = (char*)malloc(total_length);
-    if (response == NULL) {
-        return result;
+string early_hints_links(struct site *site, struct file_cache_entry *file) {
+    string links = string_init();
+    if (site == NULL || file == NULL || !file->rendered || strends(file->path, ".md") != 0) return links;
+    cJSON *stored = site_page(site, file->path);
+    if (stored == NULL) return links;
+    const char *template = cJSON_GetStringValue(cJSON_GetObjectItem(cJSON_GetObjectItem(stored, "page"), "template"));
+    if (template == NULL) template = "default";
+    // "early_hints": true for all templates, or an object with a switch
+    // for each template
+    cJSON *setting = cJSON_GetObjectItem(site->config, "early_hints");
+    bool enabled = cJSON_IsObject(setting) ? read_bool(setting, (char *)template, false) : cJSON_IsTrue(setting);
+    if (!enabled) return links;
+
+    pthread_mutex_lock(&early_hints_lock);
+    size_t index = 0;
+    while (index < site->hint_count && strcmp(site->hints[index]->template, template) != 0) index++;
+    struct early_hints *hints = index < site->hint_count ? site->hints[index] : NULL;
+    uint64_t now = metrics_now();
+    if (hints == NULL || !early_hints_current(hints, now)) {
+        struct early_hints *found = calloc(1, sizeof(struct early_hints));
+        struct early_hints **slots = hints ? site->hints : realloc(site->hints, (site->hint_count + 1) * sizeof(*slots));
+        if (found == NULL || slots == NULL) {
+            free(found);
+            pthread_mutex_unlock(&early_hints_lock);
+            return links;
+        }
+        found->template = strdup(template);
+        found->validated = now;
+        pthread_mutex_lock(&page_cache.lock);
+        found->sequence = page_cache.sequence;
+        pthread_mutex_unlock(&page_cache.lock);
+        char filename[MAX_PATH_LEN];
+        snprintf(filename, sizeof(filename), "%s" TEMPLATES_FOLDER "/%s.mustache", site->root, template);
+        early_hints_scan(site, found, filename, cJSON_GetObjectItem(site->metadata, "assets"));
+        early_hints_free(hints);
+        site->hints = slots;
+        if (hints == NULL) site->hint_count++;
+        site->hints[index] = found;
+        hints = found;
+    }
+    if (hints->length > 0) {
+        links.value = malloc(hints->length + 1);
+        if (links.value) {
+            memcpy(links.value, hints->links, hints->length + 1);
+            links.length = hints->length;
+            memory_count_string(hints->length + 1);
+        }
     }
+    pthread_mutex_unlock(&early_hints_lock);
+    return links;
+}
 
-    // Construct the HTTP response
-    // HTTP Status line
-    snprintf(response, total_length, "HTTP/1.1 %s\r\n", http_status);
-    // Content-Type
-    strcat(response, "Content-Type: ");
-    strcat(response, content_type);
-    strcat(response, "\r\n");
-    // Content-Length
-    char content_length_str[content_length_length];
-    sprintf(content_length_str, "Content-Length: %li\r\n", content.length);
-    strcat(response, content_length_str);
-    // Empty line to separate headers from the content
-    strcat(response, "\r\n"); 
-    // Content
-    if (content.value) {
-        strcat(response, content.value);
+string early_hints_response(const char *request, string links) {
+    string response = string_init();
+    if (links.value == NULL || strncmp(request, "GET ", 4) != 0) return response;
+    // HTTP/1.0 clients may not expect interim responses
+    const char *line_end = strstr(request, "\r\n");
+    if (line_end == NULL || line_end - request < 8 || memcmp(line_end - 8, "HTTP/1.1", 8) != 0) return response;
+    static const char status[] = "HTTP/1.1 103 Early Hints\r\n";
+    response.value = malloc(sizeof(status) - 1 + links.length + 3);
+    if (response.value) {
+        response.length = sprintf(response.value, "%s%s\r\n", status, links.value);
+        memory_count_string(response.length + 1);
     }
+    return response;
+}
 
-    result.value = response;
-    result.length = strlen(response);
-    return result;
+
+// Bundles ////////////////////////////////////////////////////////////////////
+
+
+static const char bundle_magic[8] = "CSBUNDLE";
+
+// Slot of a URL hash for the displacement of its bucket
+static uint32_t bundle_slot(uint64_t hash, uint32_t displacement, uint32_t slot_count) {
+    // splitmix64 finalizer
+    uint64_t value = hash + (displacement + 1ULL) * 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return (value ^ (value >> 31)) % slot_count;
 }
 
+// Checks that a null-terminated string starts at the offset
+static bool bundle_string_valid(const char *map, size_t size, uint64_t offset) {
+    return offset > 0 && offset < size && memchr(map + offset, '\0', size - offset) != NULL;
+}
 
-int file_exists(const char *path) {
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
+static bool bundle_table_valid(size_t size, uint64_t offset, uint64_t count, size_t item_size) {
+    return offset >= sizeof(struct bundle_header) && offset % 8 == 0 && offset <= size &&
+        count <= (size - offset) / item_size;
 }
 
-char* resource_path(char* request_path) {
-    static char filename[MAX_PATH_LEN];
-    int filenameLength = snprintf(filename, sizeof(filename), "static%s", request_path);
+struct bundle *bundle_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror("Failed to open the bundle");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    size_t size = file_stat.st_size;
+    void *map = size >= sizeof(struct bundle_header) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s is not a bundle\n", path);
+        return NULL;
+    }
 
-    // Check if the file exists as is
-    if (file_exists(filename)) {
-        return filename;
+    struct bundle *bundle = calloc(1, sizeof(struct bundle));
+    const struct bundle_header *header = map;
+    bool valid = bundle != NULL && memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) == 0 &&
+        header->version == BUNDLE_VERSION && header->size == size &&
+        header->bucket_count > 0 && header->slot_count > 0 &&
+        bundle_table_valid(size, header->buckets, header->bucket_count, sizeof(uint32_t)) &&
+        bundle_table_valid(size, header->slots, header->slot_count, sizeof(uint32_t)) &&
+        bundle_table_valid(size, header->routes, header->route_count, sizeof(struct bundle_route)) &&
+        bundle_string_valid(map, size, header->config);
+    if (valid) {
+        bundle->map = map;
+        bundle->size = size;
+        bundle->header = header;
+        bundle->buckets = (const uint32_t *)(bundle->map + header->buckets);
+        bundle->slots = (const uint32_t *)(bundle->map + header->slots);
+        bundle->routes = (const struct bundle_route *)(bundle->map + header->routes);
+        bundle->entries = calloc((size_t)header->route_count * BUNDLE_ENCODINGS + 1, sizeof(struct file_cache_entry));
+        valid = bundle->entries != NULL;
+    }
+    for (uint32_t i = 0; valid && i < header->slot_count; i++) {
+        valid = bundle->slots[i] < header->route_count || bundle->slots[i] == UINT32_MAX;
+    }
+
+    // Routes become file cache entries with their content mapped
+    for (uint32_t i = 0; valid && i < header->route_count; i++) {
+        const struct bundle_route *route = &bundle->routes[i];
+        valid = bundle_string_valid(map, size, route->url) && bundle_string_valid(map, size, route->path) &&
+            bundle_string_valid(map, size, route->content_type);
+        const char *content_type = bundle->map + route->content_type;
+        if (valid && strcmp(content_type, content_type_html) == 0) content_type = content_type_html;
+        if (valid && strcmp(content_type, content_type_json) == 0) content_type = content_type_json;
+        if (valid && strcmp(content_type, content_type_text) == 0) content_type = content_type_text;
+        for (int encoding = 0; valid && encoding < BUNDLE_ENCODINGS; encoding++) {
+            const struct bundle_body *body = &route->bodies[encoding];
+            if (encoding != BUNDLE_IDENTITY && body->offset == 0) continue;
+            valid = body->offset >= sizeof(struct bundle_header) && body->offset <= size &&
+                body->size <= size - body->offset && bundle_string_valid(map, size, body->headers);
+            struct file_cache_entry *entry = &bundle->entries[(size_t)i * BUNDLE_ENCODINGS + encoding];
+            entry->url = (char *)bundle->map + route->url;
+            entry->path = (char *)bundle->map + route->path;
+            entry->fd = -1;
+            entry->hash = file_cache_hash(entry->url);
+            entry->size = body->size;
+            entry->modified = header->created;
+            entry->content_type = content_type;
+            entry->map = bundle->map + body->offset;
+            entry->headers = valid && bundle->map[body->headers] != '\0' ? (char *)bundle->map + body->headers : NULL;
+            entry->bundle = bundle;
+            atomic_init(&entry->references, 1);
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "%s is not a version %i bundle\n", path, BUNDLE_VERSION);
+        if (bundle) free(bundle->entries);
+        free(bundle);
+        munmap(map, size);
+        return NULL;
+    }
+    atomic_init(&bundle->references, 1);
+    return bundle;
+}
+
+void bundle_release(struct bundle *bundle) {
+    if (bundle == NULL || atomic_fetch_sub(&bundle->references, 1) != 1) return;
+    munmap((void *)bundle->map, bundle->size);
+    free(bundle->entries);
+    free(bundle);
+}
+
+bool encoding_accepted(const char *accept, const char *encoding) {
+    size_t length = strlen(encoding);
+    for (const char *token = accept; token != NULL; token = strchr(token, ',')) {
+        if (*token == ',') token++;
+        while (*token == ' ' || *token == '\t') token++;
+        if (strncasecmp(token, encoding, length) != 0) continue;
+        const char *rest = token + length;
+        while (*rest == ' ' || *rest == '\t') rest++;
+        if (*rest == '\0' || *rest == ',') return true;
+        if (*rest != ';') continue;
+        // "gzip;q=0" declines the encoding
+        const char *quality = strstr(rest, "q=");
+        const char *next = strchr(rest, ',');
+        return quality == NULL || (next != NULL && quality > next) || strtod(quality + 2, NULL) > 0;
+    }
+    return false;
+}
+
+struct file_cache_entry *bundle_get(struct bundle *bundle, const char *url, const char *accept) {
+    const struct bundle_header *header = bundle->header;
+    uint64_t hash = file_cache_hash(url);
+    uint32_t displacement = bundle->buckets[hash % header->bucket_count];
+    uint32_t index = bundle->slots[bundle_slot(hash, displacement, header->slot_count)];
+    // A URL that is not in the table lands on another route or an empty slot
+    if (index >= header->route_count || strcmp(bundle->map + bundle->routes[index].url, url) != 0) return NULL;
+
+    struct file_cache_entry *entries = &bundle->entries[(size_t)index * BUNDLE_ENCODINGS];
+    struct file_cache_entry *entry = &entries[BUNDLE_IDENTITY];
+    if (accept != NULL && accept[0] != '\0') {
+        if (entries[BUNDLE_BROTLI].map != NULL && encoding_accepted(accept, "br")) {
+            entry = &entries[BUNDLE_BROTLI];
+        } else if (entries[BUNDLE_GZIP].map != NULL && encoding_accepted(accept, "gzip")) {
+            entry = &entries[BUNDLE_GZIP];
+        }
+    }
+    atomic_fetch_add(&bundle->references, 1);
+    return entry;
+}
+
+// Route of a bundle being packed
+struct pack_route {
+    char *url;
+    char *path;
+    const char *content_type;
+    string headers[BUNDLE_ENCODINGS];
+    struct bundle_body bodies[BUNDLE_ENCODINGS];
+};
+
+// Growable list of URLs to pack
+struct pack_urls {
+    char **values;
+    size_t count;
+    size_t capacity;
+};
+
+static void pack_add_url(struct pack_urls *urls, const char *url) {
+    if (urls->count == urls->capacity) {
+        size_t capacity = urls->capacity ? urls->capacity * 2 : 256;
+        char **values = realloc(urls->values, capacity * sizeof(char *));
+        if (values == NULL) return;
+        urls->values = values;
+        urls->capacity = capacity;
+    }
+    urls->values[urls->count++] = strdup(url);
+}
+
+static int pack_compare_urls(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Adds the URLs that resolve to the files of a directory, see resource_path
+static void pack_collect_urls(struct pack_urls *urls, cJSON *index, const char *path) {
+    char directory[MAX_PATH_LEN];
+    snprintf(directory, sizeof(directory), STATIC_FOLDER "%s", path);
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char url[MAX_PATH_LEN];
+        snprintf(url, sizeof(url), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            pack_collect_urls(urls, index, url);
+            continue;
+        }
+        if (entry->d_type != DT_REG) continue;
+        pack_add_url(urls, url);
+
+        // Pages are also served without their extension, index pages as
+        // their directory, children pages for the names in the site index
+        char *extension = strrchr(url, '.');
+        if (extension == NULL || (strcmp(extension, ".md") != 0 && strcmp(extension, ".html") != 0)) continue;
+        *extension = '\0';
+        pack_add_url(urls, url);
+        char *name = strrchr(url, '/') + 1;
+        if (strcmp(name, "index") == 0) {
+            *name = '\0';
+            pack_add_url(urls, url);
+            if (name - 1 > url) {
+                name[-1] = '\0';
+                pack_add_url(urls, url);
+            }
+        } else if (strcmp(name, "children") == 0) {
+            const char *parent = strrchr(path, '/');
+            cJSON *item;
+            cJSON_ArrayForEach(item, cJSON_GetObjectItem(index, parent ? parent + 1 : "")) {
+                const char *child = cJSON_GetStringValue(cJSON_GetObjectItem(item, "name"));
+                if (child == NULL) continue;
+                snprintf(url, sizeof(url), "%s/%s", path, child);
+                pack_add_url(urls, url);
+            }
+        }
     }
+    closedir(dir);
+}
+
+// Appends data at the alignment; returns its offset, 0 on errors
+static uint64_t pack_write(FILE *file, const void *data, size_t length, size_t alignment) {
+    static const char padding[BUNDLE_PAGE_SIZE];
+    off_t offset = ftello(file);
+    if (offset < 0) return 0;
+    size_t pad = (alignment - offset % alignment) % alignment;
+    if (fwrite(padding, 1, pad, file) != pad || fwrite(data, 1, length, file) != length) return 0;
+    return offset + pad;
+}
+
+// Appends a body, page aligned if it is larger than a page
+static uint64_t pack_write_body(FILE *file, const char *data, size_t length) {
+    return pack_write(file, data, length, length > BUNDLE_PAGE_SIZE ? BUNDLE_PAGE_SIZE : BUNDLE_ALIGNMENT);
+}
+
+#ifdef CSERVER_ZLIB
+// Compresses a body in gzip format; returns no value on failure
+static string pack_gzip(const char *data, size_t length) {
+    string result = string_init();
+    z_stream stream = { 0 };
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return result;
+    size_t capacity = deflateBound(&stream, length);
+    result.value = malloc(capacity);
+    if (result.value != NULL) {
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = length;
+        stream.next_out = (Bytef *)result.value;
+        stream.avail_out = capacity;
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+            result.length = stream.total_out;
+        } else {
+            free(result.value);
+            result.value = NULL;
+        }
+    }
+    deflateEnd(&stream);
+    return result;
+}
+#endif
+
+// Renders or reads a route and writes its bodies
+static bool pack_route(FILE *file, struct site *site, struct pack_route *route, const char *url,
+                       size_t *compressed) {
+    struct file_cache_entry *entry = file_cache_get(url);
+    if (entry == NULL) return false;
+    // Lua handlers answer every request themselves
+    if (strends(entry->path, ".lua") == 0) {
+        fprintf(stderr, "Skipped %s: Lua handlers cannot be packed\n", url);
+        file_cache_release(entry);
+        return false;
+    }
+
+    string content;
+    if (entry->rendered) {
+        // The context process_request renders the page with
+        cJSON *context = cJSON_CreateObject();
+        add_request(context, "GET", (char *)url, entry->path);
+        cJSON_AddItemReferenceToObject(context, "config", site->config);
+        cJSON_AddItemReferenceToObject(context, "site", site->metadata);
+        content = render_page(site, context, entry->path);
+        cJSON_Delete(context);
+    } else {
+        content = file_cache_read(entry);
+    }
+    route->url = strdup(url);
+    route->path = strdup(entry->path);
+    route->content_type = entry->content_type;
+    route->bodies[BUNDLE_IDENTITY].offset = content.value ? pack_write_body(file, content.value, content.length) : 0;
+    route->bodies[BUNDLE_IDENTITY].size = content.length;
+
+    // Variants precompressed next to raw files, like site.css.gz, and gzip
+    // for compressible bodies without one
+    static const char *extensions[BUNDLE_ENCODINGS] = { NULL, ".gz", ".br" };
+    for (int encoding = BUNDLE_GZIP; encoding < BUNDLE_ENCODINGS; encoding++) {
+        char variant_path[MAX_PATH_LEN];
+        snprintf(variant_path, sizeof(variant_path), "%s%s", entry->path, extensions[encoding]);
+        string variant = entry->rendered ? string_init() : read_file(variant_path);
+#ifdef CSERVER_ZLIB
+        if (variant.value == NULL && encoding == BUNDLE_GZIP && content.length >= BUNDLE_COMPRESS_MIN) {
+            variant = pack_gzip(content.value, content.length);
+            // Already compressed formats do not get much smaller
+            if (variant.value != NULL && variant.length > content.length - content.length / 8) {
+                string_free(variant);
+                variant = string_init();
+            }
+        }
+#endif
+        if (variant.value != NULL) {
+            route->bodies[encoding].offset = pack_write_body(file, variant.value, variant.length);
+            route->bodies[encoding].size = variant.length;
+            if (route->bodies[encoding].offset != 0) (*compressed)++;
+        }
+        string_free(variant);
+    }
+
+    // Caches keep the variants apart by Accept-Encoding
+    static const char *encoding_names[BUNDLE_ENCODINGS] = { NULL, "gzip", "br" };
+    bool variants = route->bodies[BUNDLE_GZIP].offset != 0 || route->bodies[BUNDLE_BROTLI].offset != 0;
+    for (int encoding = 0; encoding < BUNDLE_ENCODINGS; encoding++) {
+        char headers[1024];
+        int length = snprintf(headers, sizeof(headers), "%s", entry->headers ? entry->headers : "");
+        if (encoding != BUNDLE_IDENTITY) {
+            length += snprintf(headers + length, sizeof(headers) - length, "Content-Encoding: %s\r\n",
+                               encoding_names[encoding]);
+        }
+        if (variants) snprintf(headers + length, sizeof(headers) - length, "Vary: Accept-Encoding\r\n");
+        route->headers[encoding] = string_make(headers);
+    }
+    bool written = content.value != NULL && route->bodies[BUNDLE_IDENTITY].offset != 0;
+    string_free(content);
+    file_cache_release(entry);
+    return written;
+}
+
+
+static void pack_route_free(struct pack_route *route) {
+    free(route->url);
+    free(route->path);
+    for (int encoding = 0; encoding < BUNDLE_ENCODINGS; encoding++) string_free(route->headers[encoding]);
+    memset(route, 0, sizeof(struct pack_route));
+}
 
-    // Check if a directory exists with an index file
-    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, "/index.html");
-    if (file_exists(filename)) {
-        return filename;
+// Builds the perfect hash: buckets with the most routes are placed first,
+// each with the first displacement that puts all its routes in free slots
+static bool pack_hash(struct pack_route *routes, uint32_t route_count, uint32_t *buckets, uint32_t bucket_count,
+                      uint32_t *slots, uint32_t slot_count) {
+    uint64_t *hashes = malloc((route_count + 1) * sizeof(uint64_t));
+    uint32_t *starts = calloc(bucket_count + 1, sizeof(uint32_t));
+    uint32_t *filled = calloc(bucket_count, sizeof(uint32_t));
+    uint32_t *members = malloc((route_count + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc(bucket_count * sizeof(uint32_t));
+    uint32_t *candidates = malloc((route_count + 1) * sizeof(uint32_t));
+    bool result = hashes && starts && filled && members && order && candidates;
+
+    // Routes grouped by bucket
+    for (uint32_t i = 0; result && i < route_count; i++) {
+        hashes[i] = file_cache_hash(routes[i].url);
+        starts[hashes[i] % bucket_count + 1]++;
+    }
+    for (uint32_t i = 0; result && i < bucket_count; i++) {
+        starts[i + 1] += starts[i];
+        order[i] = i;
+    }
+    for (uint32_t i = 0; result && i < route_count; i++) {
+        uint32_t bucket = hashes[i] % bucket_count;
+        members[starts[bucket] + filled[bucket]++] = i;
     }
 
-    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, "/index.md");
-    if (file_exists(filename)) {
-        return filename;
+    // Insertion sort by bucket size, descending; most buckets have a few routes
+    for (uint32_t i = 1; result && i < bucket_count; i++) {
+        uint32_t bucket = order[i];
+        uint32_t j = i;
+        while (j > 0 && filled[order[j - 1]] < filled[bucket]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = bucket;
     }
 
-    // Reset the filename back to before checking for index files
-    filename[filenameLength] = '\0';
+    for (uint32_t i = 0; i < slot_count; i++) slots[i] = UINT32_MAX;
+    for (uint32_t i = 0; result && i < bucket_count; i++) {
+        uint32_t bucket = order[i];
+        uint32_t *bucket_members = &members[starts[bucket]];
+        bool placed = filled[bucket] == 0;
+        buckets[bucket] = 0;
+        for (uint32_t displacement = 0; !placed && displacement < (1U << 24); displacement++) {
+            placed = true;
+            for (uint32_t j = 0; placed && j < filled[bucket]; j++) {
+                candidates[j] = bundle_slot(hashes[bucket_members[j]], displacement, slot_count);
+                placed = slots[candidates[j]] == UINT32_MAX;
+                for (uint32_t k = 0; placed && k < j; k++) placed = candidates[k] != candidates[j];
+            }
+            if (placed) {
+                buckets[bucket] = displacement;
+                for (uint32_t j = 0; j < filled[bucket]; j++) slots[candidates[j]] = bucket_members[j];
+            }
+        }
+        result = placed;
+    }
+    free(hashes);
+    free(starts);
+    free(filled);
+    free(members);
+    free(order);
+    free(candidates);
+    return result;
+}
 
-    // Try appending .html and .md to the original URL
-    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, ".html");
-    if (file_exists(filename)) {
-        return filename;
+// Writes the strings, the route table and the hash tables after the bodies
+static bool pack_tables(FILE *file, struct site *site, struct pack_route *routes, struct bundle_header *header) {
+    struct bundle_route *table = calloc(header->route_count + 1, sizeof(struct bundle_route));
+    uint32_t *buckets = calloc(header->bucket_count, sizeof(uint32_t));
+    uint32_t *slots = calloc(header->slot_count, sizeof(uint32_t));
+    char *config = cJSON_PrintUnformatted(site->config);
+    bool result = table && buckets && slots && config &&
+        pack_hash(routes, header->route_count, buckets, header->bucket_count, slots, header->slot_count);
+    if (table && buckets && slots && config && !result) fprintf(stderr, "Failed to build the route table\n");
+
+    for (uint32_t i = 0; result && i < header->route_count; i++) {
+        struct pack_route *route = &routes[i];
+        table[i].url = pack_write(file, route->url, strlen(route->url) + 1, 1);
+        table[i].path = pack_write(file, route->path, strlen(route->path) + 1, 1);
+        table[i].content_type = pack_write(file, route->content_type, strlen(route->content_type) + 1, 1);
+        result = table[i].url != 0 && table[i].path != 0 && table[i].content_type != 0;
+        for (int encoding = 0; result && encoding < BUNDLE_ENCODINGS; encoding++) {
+            table[i].bodies[encoding] = route->bodies[encoding];
+            if (encoding != BUNDLE_IDENTITY && route->bodies[encoding].offset == 0) continue;
+            table[i].bodies[encoding].headers = pack_write(file, route->headers[encoding].value,
+                                                           route->headers[encoding].length + 1, 1);
+            result = table[i].bodies[encoding].headers != 0;
+        }
+    }
+    if (result) {
+        header->config = pack_write(file, config, strlen(config) + 1, 1);
+        header->routes = pack_write(file, table, header->route_count * sizeof(struct bundle_route), 8);
+        header->buckets = pack_write(file, buckets, header->bucket_count * sizeof(uint32_t), 8);
+        header->slots = pack_write(file, slots, header->slot_count * sizeof(uint32_t), 8);
+        off_t size = ftello(file);
+        header->size = size > 0 ? size : 0;
+        result = header->config != 0 && header->routes != 0 && header->buckets != 0 && header->slots != 0 &&
+            header->size != 0;
     }
+    free(table);
+    free(buckets);
+    free(slots);
+    cJSON_free(config);
+    return result;
+}
 
-    snprintf(filename + filenameLength, sizeof(filename) - filenameLength, ".md");
-    if (file_exists(filename)) {
-        return filename;
+int pack_site(char *path, char *bundle_path) {
+    // The bundle is written next to its final path and renamed, so that a
+    // reloading server maps either the old or the new one
+    char output[MAX_PATH_LEN], temporary[MAX_PATH_LEN], cwd[MAX_PATH_LEN];
+    if (bundle_path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) {
+        snprintf(output, sizeof(output), "%s", bundle_path);
+    } else {
+        snprintf(output, sizeof(output), "%.2047s/%.2047s", cwd, bundle_path);
+    }
+    snprintf(temporary, sizeof(temporary), "%.4090s.tmp", output);
+    if (chdir(path) != 0) {
+        perror("Failed path");
+        return EXIT_FAILURE;
     }
 
-    // Check if there's a directory that matches the path minus the last element
-    char* last_slash = strrchr(filename, '/');
-    if (last_slash != NULL) {
-        *last_slash = '\0'; // Null-terminate to get the preceding directory path
-        snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), "/children.html");
-        if (file_exists(filename)) {
-            return filename;
-        }
+    struct site *site = site_load();
+    if (site == NULL) return EXIT_FAILURE;
+    site_publish(site);
+    mustach_wrap_get_partial = load_partial;
+
+    // Every URL the site resolves, except children pages of names that are
+    // not in the site index
+    struct pack_urls urls = { 0 };
+    pack_collect_urls(&urls, cJSON_GetObjectItem(site->metadata, "index"), "");
+    cJSON *asset;
+    cJSON_ArrayForEach(asset, cJSON_GetObjectItem(site->metadata, "assets")) {
+        if (cJSON_IsString(asset)) pack_add_url(&urls, asset->valuestring);
     }
-    if (last_slash != NULL) {
-        *last_slash = '\0'; // Null-terminate to get the preceding directory path
-        snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), "/children.md");
-        if (file_exists(filename)) {
-            return filename;
+    pack_add_url(&urls, "/404");
+    qsort(urls.values, urls.count, sizeof(char *), pack_compare_urls);
+
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) perror("Failed to create the bundle");
+    struct pack_route *routes = calloc(urls.count + 1, sizeof(struct pack_route));
+    struct bundle_header header = { .version = BUNDLE_VERSION, .created = time(NULL) };
+    memcpy(header.magic, bundle_magic, sizeof(header.magic));
+    bool result = file != NULL && routes != NULL && fwrite(&header, sizeof(header), 1, file) == 1;
+
+    size_t compressed = 0;
+    for (size_t i = 0; result && i < urls.count; i++) {
+        if (i > 0 && strcmp(urls.values[i], urls.values[i - 1]) == 0) continue;
+        struct pack_route *route = &routes[header.route_count];
+        if (pack_route(file, site, route, urls.values[i], &compressed)) {
+            header.route_count++;
+        } else {
+            pack_route_free(route);
         }
     }
+    header.bucket_count = header.route_count / 4 + 1;
+    header.slot_count = header.route_count + header.route_count / 4 + 1;
+    result = result && pack_tables(file, site, routes, &header);
+    result = result && fseeko(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) result = false;
+    if (result && rename(temporary, output) != 0) {
+        perror("Failed to replace the bundle");
+        result = false;
+    }
+    if (result) {
+        printf("Packed %u routes, %zu precompressed variants, %.1f KB\n",
+               header.route_count, compressed, header.size / 1024.0);
+    } else if (file != NULL) {
+        fprintf(stderr, "Failed to write %s\n", output);
+        unlink(temporary);
+    }
 
-    return NULL;
+    for (size_t i = 0; i < urls.count; i++) free(urls.values[i]);
+    free(urls.values);
+    for (uint32_t i = 0; routes != NULL && i < header.route_count; i++) pack_route_free(&routes[i]);
+    free(routes);
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int strends(char *str, char *suffix) {
-    size_t str_len = strlen(str);
-    size_t suffix_len = strlen(suffix);
-    return strcmp(str + str_len - suffix_len, suffix);
-}
 
-// Trims string in place; 
-// works with allocated strings
-void trim(char *str) {
-    char *p = str;
-    int len = strlen(p);
-    if (len == 0) return;
+// Lua ////////////////////////////////////////////////////////////////////////
 
-    while(isspace(p[len - 1])) p[--len] = 0;
-    while(*p && isspace(*p)) ++p, --len;
 
-    memmove(str, p, len + 1);
+#ifdef CSERVER_LUA
+
+// Read-only view of a cJSON value owned by the server. Values are not
+// converted to Lua tables; the view is valid during the request it was
+// passed to.
+struct lua_json {
+    const cJSON *value;
+    uintptr_t generation;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    lua_State **states;             // idle states
+    int count;
+    int size;
+    _Atomic uintptr_t generation;   // request counter for stale views
+} lua_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The state's current request generation is kept in its extra space
+static uintptr_t lua_generation(lua_State *L) {
+    uintptr_t generation;
+    memcpy(&generation, lua_getextraspace(L), sizeof(generation));
+    return generation;
 }
 
-const char* get_content_type(char *request_path, char *resource_path) {
-    if (strends(resource_path, ".md") == 0 ||
-        strends(resource_path, ".html") == 0 ||
-        strends(resource_path, ".mustache") == 0) {
-        return content_type_html;
-    } else if (strends(resource_path, ".json") == 0) {
-        return content_type_json;
+static void lua_push_json(lua_State *L, const cJSON *value) {
+    if (value == NULL || cJSON_IsNull(value)) {
+        lua_pushnil(L);
+    } else if (cJSON_IsString(value)) {
+        lua_pushstring(L, value->valuestring);
+    } else if (cJSON_IsNumber(value)) {
+        if (value->valuedouble == (double)(lua_Integer)value->valuedouble) {
+            lua_pushinteger(L, (lua_Integer)value->valuedouble);
+        } else {
+            lua_pushnumber(L, value->valuedouble);
+        }
+    } else if (cJSON_IsBool(value)) {
+        lua_pushboolean(L, cJSON_IsTrue(value));
     } else {
-        return content_type_text;
+        struct lua_json *json = lua_newuserdatauv(L, sizeof(struct lua_json), 0);
+        json->value = value;
+        json->generation = lua_generation(L);
+        luaL_setmetatable(L, "cserver.json");
     }
 }
 
-void add_request(cJSON *context, char *method, char *request_path, char *resource_path) {
-    cJSON *request = cJSON_CreateObject();
-    cJSON *request_method = cJSON_CreateString(method);
-    cJSON_AddItemToObject(request, "method", request_method);
-    cJSON *request_request_path = cJSON_CreateString(request_path);
-    cJSON_AddItemToObject(request, "query", request_request_path);
-    cJSON *request_resource_path = cJSON_CreateString(resource_path);
-    cJSON_AddItemToObject(request, "resourcePath", request_resource_path);
-
-    // Extract the last and the one-but-last path components
-    char *path_copy = malloc(strlen(request_path));
-    strcpy(path_copy, request_path);
-    char *last_slash = strrchr(path_copy, '/');
-    char *page = last_slash ? last_slash + 1 : request_path;  // Point to the component after the last slash
-    cJSON_AddItemToObject(request, "page", cJSON_CreateString(page));
-    if (last_slash) {
-        *last_slash = '\0';
-        last_slash = strrchr(path_copy, '/');
-        if (last_slash) {
-            char *parent = last_slash + 1;
-            cJSON_AddItemToObject(request, "parent", cJSON_CreateString(parent));
-        }
+static const cJSON *lua_check_json(lua_State *L, int index) {
+    struct lua_json *json = luaL_checkudata(L, index, "cserver.json");
+    if (json->generation != lua_generation(L)) {
+        luaL_error(L, "site data used after its request");
     }
-    free(path_copy);
-    cJSON_AddItemToObject(context, "request", request);
+    return json->value;
 }
 
-void add_references(cJSON *context) {
-    cJSON *request = cJSON_GetObjectItem(context, "request");
-    cJSON *site = cJSON_GetObjectItem(context, "site");
-    cJSON *index = cJSON_GetObjectItem(site, "index");
-    cJSON *references = cJSON_CreateObject();
-
-    // Ensure all required objects exist
-    if (!request || !index) {
-        cJSON_AddItemToObject(context, "references", references);
-        return;
+static int lua_json_index(lua_State *L) {
+    const cJSON *value = lua_check_json(L, 1);
+    const cJSON *item = NULL;
+    if (cJSON_IsArray(value) && lua_isinteger(L, 2)) {
+        item = cJSON_GetArrayItem(value, (int)lua_tointeger(L, 2) - 1);
+    } else if (cJSON_IsObject(value) && lua_type(L, 2) == LUA_TSTRING) {
+        item = cJSON_GetObjectItemCaseSensitive(value, lua_tostring(L, 2));
     }
+    lua_push_json(L, item);
+    return 1;
+}
 
-    // Get the parent and page from the request object
-    cJSON *parent_item = cJSON_GetObjectItem(request, "parent");
-    cJSON *page_item = cJSON_GetObjectItem(request, "page");
+static int lua_json_newindex(lua_State *L) {
+    return luaL_error(L, "site data is read-only");
+}
 
-    const char *parent = parent_item ? parent_item->valuestring : NULL;
-    const char *page = page_item ? page_item->valuestring : NULL;
+static int lua_json_len(lua_State *L) {
+    lua_pushinteger(L, cJSON_GetArraySize(lua_check_json(L, 1)));
+    return 1;
+}
 
-    // Case 1: If both parent and page exist in the request
-    if (parent && page) {
-        cJSON *metadata_array = cJSON_GetObjectItem(index, parent);
-        if (metadata_array) {
-            cJSON *metadata_item;
-            cJSON_ArrayForEach(metadata_item, metadata_array) {
-                cJSON *name_item = cJSON_GetObjectItem(metadata_item, "name");
-                if (name_item && strcmp(name_item->valuestring, page) == 0) {
-                    // Page matches an item within this category, add its pages to references
-                    cJSON *pages = cJSON_GetObjectItem(metadata_item, "pages");
-                    if (pages) {
-                        cJSON_AddItemToObject(references, "pages", cJSON_Duplicate(pages, 1));
-                    }
-                    break;
-                }
-            }
-        }
-    // Case 2: If only page exists in the request
-    } else if (page) {
-        cJSON *metadata_array = cJSON_GetObjectItem(index, page);
-        if (metadata_array) {
-            cJSON_AddItemToObject(references, page, cJSON_Duplicate(metadata_array, 1));
-        }
+// Iterator over the children; the upvalues are the view, so that a kept
+// iterator fails like the view after its request, and the next child
+static int lua_json_next(lua_State *L) {
+    lua_check_json(L, lua_upvalueindex(1));
+    const cJSON *item = lua_touserdata(L, lua_upvalueindex(2));
+    if (item == NULL) return 0;
+    lua_pushlightuserdata(L, item->next);
+    lua_copy(L, -1, lua_upvalueindex(2));
+    lua_pop(L, 1);
+    lua_Integer index = lua_tointeger(L, lua_upvalueindex(3)) + 1;
+    lua_pushinteger(L, index);
+    lua_copy(L, -1, lua_upvalueindex(3));
+    lua_pop(L, 1);
+    if (item->string) {
+        lua_pushstring(L, item->string);
+    } else {
+        lua_pushinteger(L, index);
     }
-
-    cJSON_AddItemToObject(context, "references", references);
-}
-int read_int(cJSON *object, char *name, int default_value) {
-    cJSON *value_object = cJSON_GetObjectItem(object, name);
-    if (value_object == NULL) return default_value;
-    double value = cJSON_GetNumberValue(value_object);
-    if (isnan(value)) return default_value;
-    return (int)value; 
+    lua_push_json(L, item);
+    return 2;
 }
 
-string render_page(cJSON *context, char *path) {
+static int lua_json_pairs(lua_State *L) {
+    const cJSON *value = lua_check_json(L, 1);
+    lua_pushvalue(L, 1);
+    lua_pushlightuserdata(L, value->child);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, lua_json_next, 3);
+    return 1;
+}
 
-    string file_content = read_file(path);
-    if (file_content.value == NULL) return file_content;
+static const luaL_Reg lua_json_methods[] = {
+    { "__index", lua_json_index },
+    { "__newindex", lua_json_newindex },
+    { "__len", lua_json_len },
+    { "__pairs", lua_json_pairs },
+    { NULL, NULL }
+};
+
+static lua_State *lua_state_new() {
+    lua_State *L = luaL_newstate();
+    if (L == NULL) return NULL;
+    luaL_openlibs(L);
+    luaL_newmetatable(L, "cserver.json");
+    luaL_setfuncs(L, lua_json_methods, 0);
+    lua_pop(L, 1);
+    // Compiled scripts: path -> { version, function }
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "cserver.scripts");
+    return L;
+}
 
-    if (strends(path, ".md") == 0) {
-        
-        // Render markdown file
-        cJSON *page_metadata = cJSON_CreateObject();
-        substring markdown_content = skip_metadata(file_content, page_metadata);
-        cJSON_AddItemToObject(context, "page", page_metadata);
-        add_references(context);
-        string md_expanded_content = render_mustache(markdown_content, context);
-        string md_html_content = render_markdown(md_expanded_content);
-        string_free(file_content);
-        string_free(md_expanded_content);
-        
-        // context.content = rendered markdown data
-        cJSON *content = cJSON_CreateString(md_html_content.value);
-        cJSON_AddItemToObject(context, "content", content);
-        string_free(md_html_content);
+int lua_pool_init(cJSON *config) {
+    cJSON *lua_config = cJSON_GetObjectItem(config, "lua");
+    int size = read_int(lua_config, "states", LUA_STATES);
+    if (size < 1) size = 1;
+    lua_pool.states = calloc(size, sizeof(lua_State *));
+    if (lua_pool.states == NULL) return -1;
+    lua_pool.size = size;
+    while (lua_pool.count < size) {
+        lua_State *L = lua_state_new();
+        if (L == NULL) return -1;
+        lua_pool.states[lua_pool.count++] = L;
+    }
+    return 0;
+}
 
-        // mustache template for the file
-        char *template_name = "default";
-        cJSON *page_template_object = cJSON_GetObjectItem(page_metadata, "template");
-        if (page_template_object) {
-            template_name = page_template_object->valuestring;
-        }
-        string template = load_template(template_name);
-        if (template.value == NULL) {
-            template = string_make("{{{content}}}");
-        }
+void lua_pool_close() {
+    pthread_mutex_lock(&lua_pool.lock);
+    while (lua_pool.count > 0) lua_close(lua_pool.states[--lua_pool.count]);
+    free(lua_pool.states);
+    lua_pool.states = NULL;
+    lua_pool.size = 0;
+    pthread_mutex_unlock(&lua_pool.lock);
+}
 
-        // Render mustache template with the provided content
-        string html_content = render_mustache(template, context);
-        string_free(template);
+// Takes an idle state; more concurrent requests than states get new ones
+static lua_State *lua_pool_acquire() {
+    pthread_mutex_lock(&lua_pool.lock);
+    lua_State *L = lua_pool.count > 0 ? lua_pool.states[--lua_pool.count] : NULL;
+    pthread_mutex_unlock(&lua_pool.lock);
+    return L ? L : lua_state_new();
+}
 
-        return html_content;
+static void lua_pool_release(lua_State *L) {
+    pthread_mutex_lock(&lua_pool.lock);
+    if (lua_pool.count < lua_pool.size) {
+        lua_pool.states[lua_pool.count++] = L;
+        L = NULL;
+    }
+    pthread_mutex_unlock(&lua_pool.lock);
+    if (L) lua_close(L);
+}
 
-    } else if (strends(path, ".mustache") == 0) {
-        
-        // Render mustach file
-        string rendered_content = render_mustache(file_content, context);
-        if (file_content.value) free(file_content.value);
-        return rendered_content;
+// Pushes the compiled script, compiling it if the file changed
+static bool lua_load_script(lua_State *L, struct file_cache_entry *file) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "cserver.scripts");
+    if (lua_getfield(L, -1, file->path) == LUA_TTABLE) {
+        lua_rawgeti(L, -1, 1);
+        bool current = (uint64_t)lua_tointeger(L, -1) == file->version;
+        lua_pop(L, 1);
+        if (current) {
+            lua_rawgeti(L, -1, 2);
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+            return true;
+        }
+    }
+    lua_pop(L, 1);
+
+    string source = file_cache_read(file);
+    char chunk_name[MAX_PATH_LEN];
+    snprintf(chunk_name, sizeof(chunk_name), "@%s", file->path);
+    int result = luaL_loadbufferx(L, source.value ? source.value : "", source.length, chunk_name, "t");
+    string_free(source);
+    if (result != LUA_OK) {
+        lua_replace(L, -2);
+        return false;
+    }
+    lua_createtable(L, 2, 0);
+    lua_pushinteger(L, (lua_Integer)file->version);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 2);
+    lua_setfield(L, -3, file->path);
+    lua_replace(L, -2);
+    return true;
+}
 
-    } else {
-        
-        // Send raw file data
-        return file_content;
+static string lua_error_response(struct access_log_entry *log_entry) {
+    string message = string_make("Internal server error.");
+    string response = make_response(HTTP_STATUS_500, content_type_text, message);
+    log_entry->status = 500;
+    log_entry->bytes = message.length;
+    string_free(message);
+    return response;
+}
 
+string lua_response(cJSON *context, char *http_status, struct file_cache_entry *file,
+                    struct access_log_entry *log_entry) {
+    lua_State *L = lua_pool_acquire();
+    if (L == NULL) return lua_error_response(log_entry);
+    uintptr_t generation = atomic_fetch_add(&lua_pool.generation, 1) + 1;
+    memcpy(lua_getextraspace(L), &generation, sizeof(generation));
+
+    uint64_t stage_start = metrics_now();
+    string response = string_init();
+    if (lua_load_script(L, file)) {
+        lua_push_json(L, cJSON_GetObjectItem(context, "request"));
+        lua_push_json(L, cJSON_GetObjectItem(context, "site"));
+        lua_push_json(L, cJSON_GetObjectItem(context, "config"));
+        if (lua_pcall(L, 3, 2, 0) == LUA_OK) {
+            // The body is sent straight from the Lua string
+            substring body;
+            body.value = (char *)lua_tolstring(L, -2, &body.length);
+            const char *content_type = lua_isstring(L, -1) ? lua_tostring(L, -1) : content_type_html;
+            if (body.value) {
+                stage_start = metrics_record(STAGE_LUA, stage_start);
+                response = make_response(http_status, content_type, body);
+                metrics_record(STAGE_RESPONSE, stage_start);
+                log_entry->bytes = body.length;
+            } else {
+                lua_pushfstring(L, "%s: script returned no body", file->path);
+            }
+        }
+    }
+    if (response.value == NULL) {
+        fprintf(stderr, "Lua error: %s\n", lua_tostring(L, -1));
+        metrics_record(STAGE_LUA, stage_start);
+        response = lua_error_response(log_entry);
     }
+    lua_settop(L, 0);
+    memset(lua_getextraspace(L), 0, sizeof(generation));
+    lua_pool_release(L);
+    return response;
 }
 
+#endif
+
 
 // Markdown ///////////////////////////////////////////////////////////////////
 
 
-substring skip_metadata(string input_content, cJSON *metadata) {
-    substring result = { .value = input_content.value, .length = input_content.length };
-    // Check if the first line is ---
-    if (strncmp(result.value, "---\n", 4) != 0) {
-        // If not, return the original input_content
-        return result;
+size_t parse_front_matter(const char *content, size_t length, cJSON *metadata) {
+    size_t offset;
+    if (length >= 4 && strncmp(content, "---\n", 4) == 0) {
+        offset = 4;
+    } else if (length >= 5 && strncmp(content, "---\r\n", 5) == 0) {
+        offset = 5;
     } else {
-        // Skip the first line (---)
-        char *line = result.value + 4;
-        char *next_line = NULL;
-
-        // TODO: Skip commented (#) lines
-        while ((next_line = strstr(line, "\n")) != NULL) {
-            // Check for the end of the metadata section
-            if (line == next_line) {
-                result.value = next_line + 1;
-                result.length -= result.value - input_content.value;
-                // Return the pointer to the beginning of markdown content
-                // printf("input_content.length = %li, result.length = %li\n", input_content.length, result.length);
-                return result;
-            }
-
-            *next_line = '\0';
-            char *colon = strchr(line, ':');
-            if (colon != NULL) {
-                *colon = '\0';      // change to simplify memory management 
-                char *key = line;
-                char *value = colon + 1;
+        return 0;
+    }
+
+    // TODO: Skip commented (#) lines
+    bool closed = false;
+    while (offset < length) {
+        const char *line = content + offset;
+        const char *next_line = memchr(line, '\n', length - offset);
+        size_t line_length = next_line ? (size_t)(next_line - line) : length - offset;
+        offset += line_length + (next_line != NULL);
+        if (line_length > 0 && line[line_length - 1] == '\r') line_length--;
+
+        // A --- line closes the section and may be followed by an empty line
+        if (line_length == 0) break;
+        if (!closed && line_length == 3 && strncmp(line, "---", 3) == 0) {
+            closed = true;
+            continue;
+        }
+        if (closed) {
+            offset = line - content;
+            break;
+        }
+
+        const char *colon = memchr(line, ':', line_length);
+        if (colon != NULL) {
+            char *key = strndup(line, colon - line);
+            char *value = strndup(colon + 1, line + line_length - colon - 1);
+            if (key && value) {
                 trim(key);
                 trim(value);
                 cJSON_AddStringToObject(metadata, key, value);
-                *colon = ':';       // restore back
             }
-            *next_line = '\n';
-            line = next_line + 1;
+            free(key);
+            free(value);
         }
-        // If we are here, it means the page has no content, just metadata.
-        result.value = input_content.value + input_content.length;
-        result.length = 0;
-        return result;
     }
+    return offset < length ? offset : length;
 }
 
 typedef struct {
@@ -930,16 +8659,20 @@ void output_callback(const MD_CHAR* text, MD_SIZE size, void* userdata) {
 string render_markdown(string markdown_content) {
     html_buffer buf = { .output = NULL, .size = 0 };
     string result = string_init();
+    enum memory_subsystem previous = memory_enter(MEMORY_MARKDOWN);
 
     // Parse Markdown to HTML
     if (md_html(markdown_content.value, markdown_content.length, output_callback, &buf, MD_DIALECT_GITHUB, 0) != 0) {
         // Handle parsing error
         if (buf.output) free(buf.output);
+        memory_leave(previous);
         return result;
     }
 
     result.value = buf.output;
     result.length = buf.size;
+    if (result.value) memory_count_string(result.length + 1);
+    memory_leave(previous);
     return result;
 }
 
@@ -947,15 +8680,22 @@ string render_markdown(string markdown_content) {
 // Mustache ///////////////////////////////////////////////////////////////////
 
 
+// Fingerprinted asset URLs of the page being rendered, for partials
+static _Thread_local cJSON *render_assets = NULL;
+
 int load_partial(const char *name, struct mustach_sbuf *sbuf) {
     // Example of opening a file named after the partial. Adjust path as necessary.
     char filename[MAX_PATH_LEN];
-    snprintf(filename, sizeof(filename), "templates/partials/%s.mustache", name);
+    snprintf(filename, sizeof(filename), "%s" TEMPLATES_FOLDER "/partials/%s.mustache", site_directory(), name);
+    // Missing partials are recorded too, so that adding one refreshes the page
+    page_dependency_add(PAGE_DEPENDENCY_FILE, filename);
+    trace_begin("load_partial");
     FILE *file = fopen(filename, "r");
     
     if (!file) {
         // Return an error if the file cannot be opened
         // printf("Partial %s not found.\n", filename);
+        trace_end();
         return -1;
     }
     
@@ -969,43 +8709,237 @@ int load_partial(const char *name, struct mustach_sbuf *sbuf) {
     fread((char *)sbuf->value, 1, fsize, file);
     fclose(file);
     
-    // Null-terminate and set size
+    // Null-terminate and set size; mustach frees the buffer after use
     ((char *)sbuf->value)[fsize] = '\0';
     sbuf->length = fsize;
+    sbuf->freecb = free;
+    memory_count_string(fsize + 1);
+    page_dependency_scan(sbuf->value, sbuf->length);
+
+    substring partial = { .value = (char *)sbuf->value, .length = sbuf->length };
+    string expanded = expand_assets(partial, render_assets);
+    if (expanded.value) {
+        free((char *)sbuf->value);
+        sbuf->value = expanded.value;
+        sbuf->length = expanded.length;
+    }
+    trace_end();
     
     return 0;
 }
 
 string load_template(char* name) {
     char filename[MAX_PATH_LEN];
-    snprintf(filename, sizeof(filename), "templates/%s.mustache", name);
+    snprintf(filename, sizeof(filename), "%s" TEMPLATES_FOLDER "/%s.mustache", site_directory(), name);
+    page_dependency_add(PAGE_DEPENDENCY_FILE, filename);
+    enum memory_subsystem previous = memory_enter(MEMORY_MUSTACHE);
+    trace_begin("load_template");
     string template = read_file(filename);
+    trace_end();
+    memory_leave(previous);
     if (template.value == NULL) {
         // printf("Tempalte %s not found.\n", filename);
     }
     return template;
 }
 
-string render_mustache(string template_content, cJSON *context) {
-    string result = { .value = NULL, .length = 0 };
+// Writes the entity of a character that is escaped in HTML, the same ones
+// mustach escapes; returns its length
+static inline size_t html_entity(char *output, char c) {
+    switch (c) {
+        case '<': memcpy(output, "&lt;", 4); return 4;
+        case '>': memcpy(output, "&gt;", 4); return 4;
+        case '&': memcpy(output, "&amp;", 5); return 5;
+        case '"': memcpy(output, "&quot;", 6); return 6;
+    }
+    *output = c;
+    return 1;
+}
 
-    char* output = NULL;
-    size_t output_size = 0;
-    FILE* output_stream = open_memstream(&output, &output_size);
+static size_t html_escape_scalar(char *output, const char *input, size_t length) {
+    char *start = output;
+    const char *end = input + length;
+    while (input < end) {
+        // Clean runs are copied at once
+        const char *run = input;
+        while (input < end && *input != '<' && *input != '>' && *input != '&' && *input != '"') input++;
+        memcpy(output, run, input - run);
+        output += input - run;
+        if (input < end) output += html_entity(output, *input++);
+    }
+    return output - start;
+}
 
-    // Perform the mustach processing
-    int ret = mustach_cJSON_file(template_content.value, template_content.length, context, Mustach_With_AllExtensions, output_stream);
-    fflush(output_stream);
-    fclose(output_stream);
+#ifdef HTML_ESCAPE_X86
+// Copies a block with special characters at the set bits of `mask`
+static inline size_t html_escape_block(char *output, const char *input, size_t length, uint32_t mask) {
+    char *start = output;
+    size_t position = 0;
+    while (mask) {
+        size_t special = __builtin_ctz(mask);
+        memcpy(output, input + position, special - position);
+        output += special - position;
+        output += html_entity(output, input[special]);
+        position = special + 1;
+        mask &= mask - 1;
+    }
+    memcpy(output, input + position, length - position);
+    return output + length - position - start;
+}
+
+static size_t html_escape_sse2(char *output, const char *input, size_t length) {
+    char *start = output;
+    const char *end = input + length;
+    const __m128i less = _mm_set1_epi8('<'), greater = _mm_set1_epi8('>');
+    const __m128i ampersand = _mm_set1_epi8('&'), quote = _mm_set1_epi8('"');
+    while (end - input >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)input);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, less), _mm_cmpeq_epi8(block, greater)),
+            _mm_or_si128(_mm_cmpeq_epi8(block, ampersand), _mm_cmpeq_epi8(block, quote)));
+        uint32_t mask = _mm_movemask_epi8(special);
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)output, block);
+            output += 16;
+        } else {
+            output += html_escape_block(output, input, 16, mask);
+        }
+        input += 16;
+    }
+    return output - start + html_escape_scalar(output, input, end - input);
+}
+
+__attribute__((target("avx2")))
+static size_t html_escape_avx2(char *output, const char *input, size_t length) {
+    char *start = output;
+    const char *end = input + length;
+    const __m256i less = _mm256_set1_epi8('<'), greater = _mm256_set1_epi8('>');
+    const __m256i ampersand = _mm256_set1_epi8('&'), quote = _mm256_set1_epi8('"');
+    while (end - input >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)input);
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, less), _mm256_cmpeq_epi8(block, greater)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, ampersand), _mm256_cmpeq_epi8(block, quote)));
+        uint32_t mask = _mm256_movemask_epi8(special);
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)output, block);
+            output += 32;
+        } else {
+            output += html_escape_block(output, input, 32, mask);
+        }
+        input += 32;
+    }
+    return output - start + html_escape_sse2(output, input, end - input);
+}
+#endif
+
+static _Atomic int html_escape_kernel = HTML_ESCAPE_AUTO;
+
+static bool html_escape_supported(enum html_escape_kernel kernel) {
+#ifdef HTML_ESCAPE_X86
+    if (kernel == HTML_ESCAPE_AVX2) return __builtin_cpu_supports("avx2");
+    return kernel != HTML_ESCAPE_AUTO;
+#else
+    return kernel == HTML_ESCAPE_SCALAR;
+#endif
+}
+
+int html_escape_use(enum html_escape_kernel kernel) {
+    if (kernel == HTML_ESCAPE_AUTO) {
+        kernel = html_escape_supported(HTML_ESCAPE_AVX2) ? HTML_ESCAPE_AVX2 :
+                 html_escape_supported(HTML_ESCAPE_SSE2) ? HTML_ESCAPE_SSE2 : HTML_ESCAPE_SCALAR;
+    }
+    if (!html_escape_supported(kernel)) return -1;
+    atomic_store_explicit(&html_escape_kernel, kernel, memory_order_relaxed);
+    return 0;
+}
+
+size_t html_escape(char *output, const char *input, size_t length) {
+    int kernel = atomic_load_explicit(&html_escape_kernel, memory_order_relaxed);
+    if (kernel == HTML_ESCAPE_AUTO) {
+        html_escape_use(HTML_ESCAPE_AUTO);
+        kernel = atomic_load_explicit(&html_escape_kernel, memory_order_relaxed);
+    }
+#ifdef HTML_ESCAPE_X86
+    // Short values stay with the scalar loop
+    if (kernel == HTML_ESCAPE_AVX2 && length >= 32) return html_escape_avx2(output, input, length);
+    if (kernel != HTML_ESCAPE_SCALAR && length >= 16) return html_escape_sse2(output, input, length);
+#endif
+    return html_escape_scalar(output, input, length);
+}
+
+// Output of render_mustache, written directly rather than through stdio
+struct mustache_output {
+    char *value;
+    size_t length;
+    size_t capacity;
+};
+
+// Makes room for `length` more bytes and the terminating null
+static char *mustache_output_reserve(struct mustache_output *output, size_t length) {
+    if (output->length + length + 1 > output->capacity) {
+        size_t capacity = output->capacity ? output->capacity : 4096;
+        while (capacity < output->length + length + 1) capacity *= 2;
+        char *value = realloc(output->value, capacity);
+        if (value == NULL) return NULL;
+        output->value = value;
+        output->capacity = capacity;
+    }
+    return output->value + output->length;
+}
+
+// mustach output callback: literal text is copied, values are escaped
+// unless written with {{{ }}} or {{& }}
+static int mustache_emit(void *closure, const char *buffer, size_t size, int escape, FILE *file) {
+    struct mustache_output *output = closure;
+    // An escaped character takes at most 6 bytes
+    char *region = mustache_output_reserve(output, escape ? size * 6 : size);
+    if (region == NULL) return MUSTACH_ERROR_SYSTEM;
+    if (escape) {
+        output->length += html_escape(region, buffer, size);
+    } else {
+        memcpy(region, buffer, size);
+        output->length += size;
+    }
+    return MUSTACH_OK;
+}
+
+string render_mustache(string template_content, cJSON *context) {
+    string result = { .value = NULL, .length = 0 };
+    enum memory_subsystem previous = memory_enter(MEMORY_MUSTACHE);
+
+    // {{asset "path"}} tags are replaced before the mustach processing
+    render_assets = cJSON_GetObjectItem(cJSON_GetObjectItem(context, "site"), "assets");
+    string expanded = expand_assets(template_content, render_assets);
+    substring source = expanded.value ? expanded : template_content;
+    page_dependency_scan(source.value, source.length);
+
+    // Perform the mustach processing; pages are usually larger than
+    // their templates
+    struct mustache_output output = { .value = NULL };
+    if (mustache_output_reserve(&output, source.length * 2) == NULL) {
+        string_free(expanded);
+        memory_leave(previous);
+        return result;
+    }
+    int ret = mustach_cJSON_emit(source.value, source.length, context, Mustach_With_AllExtensions,
+                                 mustache_emit, &output);
+    string_free(expanded);
 
     // Check for errors in mustach processing
     if (ret != MUSTACH_OK) {
         fprintf(stderr, "Mustach processing error: %d\n", ret);
-        if (output) free(output);
+        free(output.value);
     } else {
-        result.value = output;
-        result.length = output_size;
+        // Cached pages keep their buffer; give the spare capacity back
+        output.value[output.length] = '\0';
+        char *value = realloc(output.value, output.length + 1);
+        if (value != NULL) output.value = value;
+        result.value = output.value;
+        result.length = output.length;
+        memory_count_string(output.length + 1);
     }
 
+    memory_leave(previous);
     return  result;
 }
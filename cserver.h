@@ -2,18 +2,136 @@
 #define CSERVER_H
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include "cjson/cJSON.h"
+#ifdef CSERVER_TLS
+#include <openssl/ssl.h>
+#endif
 
 #ifdef __cplusplus
     extern "C" {
 #endif
 
+struct mustach_sbuf;
+struct site;
+struct stat;
+struct early_hints;
+
 // Default port number
 #define PORT 3000
 // Default folder for static files
 #define STATIC_FOLDER "static"
+// Folder for page templates and partials
+#define TEMPLATES_FOLDER "templates"
+// Longest page summary taken from the Markdown body for `children`
+#define CHILDREN_SUMMARY_MAX 200
+// Longest Host header name a hosted site is looked up by
+#define SITE_HOST_MAX 256
 // Max path length
 #define MAX_PATH_LEN 4096
+// Number of entries in each worker's access log ring buffer
+#define ACCESS_LOG_RING_SIZE 1024
+// Access log write buffer size
+#define ACCESS_LOG_BATCH_SIZE 65536
+// Default path for Prometheus metrics
+#define METRICS_PATH "/__metrics"
+// Default size limit of the trace file, bytes
+#define TRACE_SIZE (64 * 1024 * 1024)
+// Spans recorded per traced request; later ones are dropped
+#define TRACE_SPANS 256
+// Nesting depth of trace spans
+#define TRACE_DEPTH 16
+// Interval between request count samples for instance stats, ms
+#define STATS_INTERVAL 1000
+// Number of samples requests per second are averaged over
+#define STATS_SAMPLES 10
+// Listening sockets a server can have
+#define LISTENERS_MAX 8
+// Binds tried, TIMER_TICK ms apart, while a previous instance releases an address
+#define LISTEN_RETRIES 20
+// Longest PROXY protocol header accepted, v1 headers are at most 107 bytes
+#define PROXY_HEADER_MAX 536
+// Request headers buffer size
+#define REQUEST_BUFFER_SIZE 4096
+// Default number of connections served by the io_uring backend
+#define URING_CONNECTIONS 256
+// Default size of each io_uring connection buffer
+#define URING_BUFFER_SIZE 16384
+// Outstanding accepts of the io_uring backend when client addresses are logged
+#define URING_ACCEPTS 8
+// Timer wheel resolution, ms
+#define TIMER_TICK 100
+// Timer wheel slots per level (2^bits) and levels; longer timeouts are clamped
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVELS 4
+// Default cap on open connections
+#define LIMIT_CONNECTIONS 1024
+// Default cap on open connections from one client address
+#define LIMIT_CONNECTIONS_PER_CLIENT 64
+// Default time to receive the request headers, ms
+#define LIMIT_HEADER_TIMEOUT 10000
+// Default interval of response transfer rate checks, ms
+#define LIMIT_WRITE_TIMEOUT 10000
+// Default minimum response transfer rate, bytes per second
+#define LIMIT_MIN_RATE 256
+// Default number of token buckets kept by the rate limiter
+#define RATE_LIMIT_ENTRIES 16384
+// Slots probed for a client's bucket before the oldest one is replaced
+#define RATE_LIMIT_PROBES 8
+// Default number of files kept open by the file cache
+#define FILE_CACHE_ENTRIES 1024
+// Default budget for files mapped by the file cache, bytes
+#define FILE_CACHE_SIZE (64 * 1024 * 1024)
+// Default size limit for mapped files, bytes
+#define FILE_CACHE_MAP_LIMIT (1024 * 1024)
+// Default interval between revalidations without inotify, ms
+#define FILE_CACHE_TTL 1000
+// Default number of rendered pages kept by the page cache
+#define PAGE_CACHE_ENTRIES 4096
+// Default budget for rendered pages, bytes
+#define PAGE_CACHE_SIZE (64 * 1024 * 1024)
+// Default number of Markdown bodies kept as HTML by the fragment cache
+#define FRAGMENT_CACHE_ENTRIES 1024
+// Default budget for cached Markdown HTML, bytes
+#define FRAGMENT_CACHE_SIZE (16 * 1024 * 1024)
+// Size limit for the Link headers of a template, bytes
+#define EARLY_HINTS_SIZE 2048
+// Templates and partials scanned for the links of a template
+#define EARLY_HINTS_FILES 32
+// Hex digits of asset fingerprints
+#define FINGERPRINT_LENGTH 12
+// Cache-Control of fingerprinted asset URLs
+#define FINGERPRINT_CACHE_CONTROL "public, max-age=31536000, immutable"
+// Default number of preinitialised Lua states
+#define LUA_STATES 4
+// Concurrent streams allowed on an HTTP/2 connection
+#define H2_MAX_STREAMS 100
+// HPACK dynamic table size for request headers
+#define H2_HEADER_TABLE_SIZE 4096
+// Largest HTTP/2 frame accepted from clients
+#define H2_MAX_FRAME_SIZE 16384
+// Largest request header block, with CONTINUATION frames
+#define H2_MAX_HEADER_BLOCK 65536
+// HTTP/2 output queued per write, bytes
+#define H2_OUTPUT_CHUNK 65536
+// Queued HTTP/2 output above which a connection is not read, bytes
+#define H2_OUTPUT_LIMIT (4 * H2_OUTPUT_CHUNK)
+// PING, SETTINGS and RST_STREAM frames a client may send per second
+#define H2_CONTROL_FRAMES 200
+// TLS sessions kept for resumption by session id
+#define TLS_SESSION_CACHE 1024
+// Bundle file format version; bundles of other versions are refused
+#define BUNDLE_VERSION 1
+// Alignment of bundled bodies; bodies larger than a page are page aligned
+#define BUNDLE_ALIGNMENT 64
+#define BUNDLE_PAGE_SIZE 4096
+// Smallest body compressed by `cserver pack`, bytes
+#define BUNDLE_COMPRESS_MIN 256
 
 // HTTP Status codes
 // source: https://developer.mozilla.org/en-US/docs/Web/HTTP/Status
@@ -22,6 +140,10 @@
 #define HTTP_STATUS_200 "200 OK"
 // 404 Not Found
 #define HTTP_STATUS_404 "404 Not Found"
+// 429 Too Many Requests
+#define HTTP_STATUS_429 "429 Too Many Requests"
+// 500 Internal Server Error
+#define HTTP_STATUS_500 "500 Internal Server Error"
 
 // Content Types
 extern const char *content_type_text;
@@ -66,6 +188,17 @@ string string_make(const char* value);
  */
 void string_free(string str);
 
+/**
+ * Checks whether a string ends with the suffix.
+ * 
+ * Parameters:
+ *  - str          Null-terminated string.
+ *  - suffix       Null-terminated suffix.
+ * 
+ * Returns 0 if `str` ends with `suffix`.
+ */
+int strends(char *str, char *suffix);
+
 /**
  * Reads the entire content of a file specified by the filename
  * into a string object.
@@ -94,7 +227,7 @@ int print_help();
  * Starts a new instance of `cserver` at path
  * 
  * Parameters:
- *  - path         Path to the server files
+ *  - path         Path to the server files, or a bundle file
  *  - cli_mode     `false` starts the server as a service
  *                 `true` runs it as a CLI app in terminal; closing `cserver`
  *                 with Ctrl+C will stop it.
@@ -105,7 +238,20 @@ int print_help();
 int start_server(char* path, bool cli_mode);
 
 /**
- * Lists the process IDs of all running instances of `cserver`.
+ * Renders a site into a bundle file served with `cserver run --bundle`.
+ * 
+ * Parameters:
+ *  - path         Path to the server files.
+ *  - bundle_path  Bundle file to write; replaced atomically.
+ * 
+ * Returns EXIT_SUCCESS on successful execution; EXIT_FAILURE if the command
+ * execution fails.
+ */
+int pack_site(char *path, char *bundle_path);
+
+/**
+ * Lists running instances of `cserver` with their uptime, requests per
+ * second, cache hit rate and resident memory.
  * 
  * Returns EXIT_SUCCESS on successful execution; EXIT_FAILURE if the command
  * execution fails.
@@ -124,10 +270,38 @@ int list_servers();
 int restart_server(char *path);
 
 /**
- * Stops a running `cserver` service with the provided PID.
+ * Reloads configuration and metadata of a running instance of `cserver`
+ * at the provided path without dropping connections.
+ * 
+ * Parameters:
+ *  - path         Path to the server files.
+ * 
+ * Returns EXIT_SUCCESS on successful execution; EXIT_FAILURE if the command
+ * execution fails.
+ */
+int reload_server(char *path);
+
+/**
+ * Asks the instance listening on the control socket to hand over its
+ * listening sockets. The instance stops accepting connections, finishes the
+ * requests in progress and exits.
+ * 
+ * Parameters:
+ *  - socket_path  Path to the control socket.
+ *  - descriptors  Receives the listening socket descriptors.
+ *  - max          Size of the descriptors array.
+ * 
+ * Returns the number of descriptors received; -1 if there is no running
+ * instance or the handoff fails.
+ */
+int control_handoff(const char *socket_path, int *descriptors, int max);
+
+/**
+ * Stops a running `cserver` service. Only instances in the registry
+ * are stopped.
  * 
  * Parameters:
- *  - id           Process ID
+ *  - id           Process ID or path to the server files
  * 
  * Returns EXIT_SUCCESS on successful execution; EXIT_FAILURE if the command
  * execution fails.
@@ -136,14 +310,18 @@ int stop_server(char *id);
 
 /**
  * Collects Markdown metadata and stores it into the provided `metadata`
- * cJSON object.
+ * cJSON object. The front matter of each page is kept in `pages` by file
+ * path, with the offset of the body and the file size and modification
+ * time it was parsed at.
  * 
  * Parameters:
  *  - metadata     `cJSON` object to store metadata values to.
+ *  - pages        `cJSON` object to store the parsed pages to.
+ *  - children     `cJSON` object to list pages with a title in, by directory.
  *  - base_path    Root directory of the web server
  *  - path         current directory, NULL
  */
-void collect_metadata(cJSON *metadata, char *base_path, char *path);
+void collect_metadata(cJSON *metadata, cJSON *pages, cJSON *children, char *base_path, char *path);
 
 /**
  * Create website index data based on the provided `metadata`
@@ -154,6 +332,20 @@ void collect_metadata(cJSON *metadata, char *base_path, char *path);
  */
 void create_index(cJSON *metadata);
 
+/**
+ * Completes the `children` lists collected by collect_metadata: pages with
+ * a title by their directory, like "notes" or "" for the top one, and the
+ * pages of each category by "category/<name>", from the categories of
+ * create_index. Entries have "title", "slug", "link", "published" and
+ * "summary", from the front matter or the first paragraph, and are sorted
+ * newest first.
+ * 
+ * Parameters:
+ *  - metadata     `cJSON` object with the collected metadata.
+ *  - children     Lists collected by collect_metadata.
+ */
+void create_children(cJSON *metadata, cJSON *children);
+
 /**
  * Generates an HTTP response string.
  *
@@ -168,6 +360,19 @@ void create_index(cJSON *metadata);
  */
 string make_response(char *http_status, const char *content_type, string content);
 
+/**
+ * Generates an HTTP response string with additional headers.
+ *
+ * Parameters
+ *  - http_status  HTTP status code and message.
+ *  - content_type The "Content-Type" header for the response.
+ *  - headers      Header lines, each ending with "\r\n"; may be empty.
+ *  - content      The content to include in the response body.
+ *
+ * Returns the HTTP response; the value is NULL if memory allocation fails.
+ */
+string make_response_headers(char *http_status, const char *content_type, const char *headers, string content);
+
 /**
  * Serves static files to the client over a socket connection.
  *
@@ -182,7 +387,8 @@ string make_response(char *http_status, const char *content_type, string content
 void serve_file(int socket, char *filename);
 
 /**
- * Translates the request path into a resource path (i.e., full file name).
+ * Translates the request path into a resource path (i.e., full file name)
+ * in the static folder of the site the thread serves, see site_enter.
  */
 char* resource_path(char *request_path);
 
@@ -206,16 +412,75 @@ void add_request(cJSON *context, char *method, char *request_path, char *resourc
 int read_int(cJSON *object, char *name, int default_value);
 
 /**
- * Renders a page at the path using the provided context object.
+ * Reads a string value from a cJSON object; if the value doesn't exist,
+ * return the provided default value.
+ *
+ * Parameters:
+ *  - object          cJSON object containing the `name` key
+ *  - name            value key name
+ *  - default_value   default string value
+ *
+ * Returns the value for `name` key in the object; if the key is not found
+ * or the value is not a string, it returns the `default_value` value.
+ */
+char* read_string(cJSON *object, char *name, char *default_value);
+
+/**
+ * Reads a floating point value from a cJSON object; if the value doesn't
+ * exist, return the provided default value.
+ *
+ * Parameters:
+ *  - object          cJSON object containing the `name` key
+ *  - name            value key name
+ *  - default_value   default value
+ *
+ * Returns the value for `name` key in the object; if the key is not found
+ * or the value is not a number, it returns the `default_value` value.
+ */
+double read_double(cJSON *object, char *name, double default_value);
+
+/**
+ * Reads a boolean value from a cJSON object with a given name. If the value
+ * does not exist, return the provided default value.
+ *
+ * Parameters:
+ *  - object          cJSON object containing the `name` key
+ *  - name            value key name
+ *  - default_value   default value
+ *
+ * Returns the value for `name` key in the object; if the key is not found
+ * or the value is not a boolean, it returns the `default_value` value.
+ */
+bool read_bool(cJSON *object, char *name, bool default_value);
+
+/**
+ * Copies the value of the request header `name` into `value`.
+ *
+ * Parameters:
+ *  - request      Raw request data (null-terminated).
+ *  - name         Header name, case insensitive.
+ *  - value        Output buffer.
+ *  - value_len    Output buffer size.
+ *
+ * Returns 0 if the header was found, -1 otherwise; `value` is set to an
+ * empty string when the header is missing.
+ */
+int request_header(const char *request, const char *name, char *value, size_t value_len);
+
+/**
+ * Renders a page at the path using the provided context object. Markdown
+ * pages use the front matter parsed when the site was loaded and are read
+ * from the start of the body, unless the file changed since.
  * 
  * Parameters:
+ *  - site         Site the page belongs to, or NULL to parse the front matter.
  *  - context      cJSON context object for Mustache renderer.
  *  - path         file path
  * 
  * Returns a string containing HTML of the page; returns raw file content
  * if the file is not a Markdown file or a Mustache template.
  */
-string render_page(cJSON *context, char *path);
+string render_page(struct site *site, cJSON *context, char *path);
 
 /**
  * Returns content type value for Content-Type header key.
@@ -229,69 +494,1900 @@ string render_page(cJSON *context, char *path);
 const char* get_content_type(char *request_path, char *resource_path);
 
 
-// Markdown ///////////////////////////////////////////////////////////////////
+// Registry ///////////////////////////////////////////////////////////////////
 
 
+// Running instances register in $XDG_RUNTIME_DIR/cserver, or in
+// /tmp/cserver-<uid> when it is not set: <pid>.json describes the instance,
+// <pid>.sock is its control socket.
+
 /**
- * Skips metadata and returns the pointer to markdown content inside input_content.
+ * Builds the path to a registry file, creating the registry directory
+ * if needed.
  * 
  * Parameters:
- * - input_content Markdown content with page metadata.
- * - metadata      cJSON object for page metadata.
+ *  - result       Buffer for the path.
+ *  - result_len   Buffer size.
+ *  - pid          Process ID; 0 returns the registry directory.
+ *  - extension    File extension, ".json" or ".sock".
  * 
- * Returns a substring pointing to the beginning of markdown content.
+ * Returns 0 on success; -1 if the path does not fit or the directory
+ * cannot be used.
+ */
+int registry_path(char *result, size_t result_len, pid_t pid, const char *extension);
+
+/**
+ * Registers a running instance.
  * 
- * All metadata parameters are stored in cJSON object.
- * New memory is not allocated here, free input_content only.
+ * Parameters:
+ *  - pid          Process ID.
+ *  - path         Absolute path to the server files.
+ *  - port         Listening port.
+ *  - started      Start time.
  * 
- * Expected metadata format:
+ * Returns 0 on success; -1 on failure.
+ */
+int registry_add(pid_t pid, const char *path, int port, time_t started);
+
+/**
+ * Removes the registry entry and the control socket of an instance.
  * 
- * ---
- * key: value
- * ---
- * <new line>
- * Markdown content
+ * Parameters:
+ *  - pid          Process ID.
  */
-substring skip_metadata(string input_content, cJSON *metadata);
+void registry_remove(pid_t pid);
 
 /**
- * Converts markdown content into HTML
+ * Reads the registry entry of an instance.
  * 
  * Parameters:
- *  - markdown_content A string object containing the Markdown text
+ *  - pid          Process ID.
  * 
- * Returns a string object containing the resulting HTML.
+ * Returns the entry object, to be freed with cJSON_Delete; NULL if the
+ * instance is not registered.
  */
-string render_markdown(string markdown_content);
+cJSON *registry_read(pid_t pid);
+
+/**
+ * Lists registered instances, removing entries of processes that no
+ * longer exist.
+ * 
+ * Returns an array of entry objects, to be freed with cJSON_Delete.
+ */
+cJSON *registry_list();
 
+/**
+ * Finds the registered instance serving the provided path.
+ * 
+ * Parameters:
+ *  - path         Path to the server files.
+ * 
+ * Returns the process ID; 0 if no instance serves the path.
+ */
+pid_t get_path_pid(char *path);
+
+/**
+ * Sends a command to the control socket of an instance: "stats", "reload",
+ * "stop" or "handoff".
+ * 
+ * Parameters:
+ *  - pid          Process ID.
+ *  - command      Command name.
+ * 
+ * Returns the response; value is NULL if the instance does not respond.
+ */
+string control_request(pid_t pid, const char *command);
+
+
+// Site ///////////////////////////////////////////////////////////////////////
 
-// Mustache ///////////////////////////////////////////////////////////////////
 
+// Configuration and metadata of a served site. Requests hold a reference
+// while they are processed, so a reload can replace the current site
+// without waiting for them.
+struct site {
+    cJSON *config;                  // config.json
+    cJSON *metadata;                // collected from static files
+    const char *metrics_path;       // points into config
+    uint64_t generation;            // differs for every load
+    uint64_t config_hash;           // json_hash of config
+    struct bundle *bundle;          // files are served from a bundle if set
+    cJSON *pages;                   // front matter of the Markdown pages by path
+    cJSON **page_index;             // hash table over pages
+    size_t page_slots;              // power of two
+    cJSON **children_index;         // hash table over metadata.children
+    size_t children_slots;          // power of two
+    char *root;                     // directory of the site files, "" or ending with '/'
+    char *host;                     // name the site is served for, NULL for the server site
+    struct site **hosts;            // sites in the "sites" directory, sorted by host
+    size_t host_count;
+    _Atomic bool stale;             // files changed, hosted site is loaded again
+    struct early_hints **hints;     // preload links by template, built on first use
+    size_t hint_count;
+    _Atomic int references;
+};
+
+// The site new requests are served with
+extern _Atomic(struct site *) current_site;
 
 /**
- * mustach library hook for partials, see mustach-wrap.h
+ * Reads config.json and collects metadata from the current directory, or
+ * opens the bundle set with site_use_bundle. If config.json sets "sites",
+ * every directory in it is a hosted site with its own config.json, static
+ * files and templates, served for the Host named like the directory.
+ * Hosted sites of the current site that did not change are kept.
+ * 
+ * Returns a new site with one reference; NULL if allocation fails or the
+ * bundle cannot be opened.
  */
-int load_partial(const char *name, struct mustach_sbuf *sbuf);
+struct site *site_load();
 
 /**
- * Loads a Mustache template file from a specified path.
+ * Marks hosted sites of the current site to be loaded again by the next
+ * site_load.
  * 
  * Parameters:
- *  - name         The name of the template file (without the extension
- *                 or path prefix) to load.
+ *  - path         Changed file, like "sites/example.com/static/index.md";
+ *                 NULL marks all hosted sites.
+ */
+void site_invalidate(const char *path);
+
+/**
+ * Finds the site a request is served with by its Host header.
  * 
- * Returns a string object containing the content of the template file.
+ * Parameters:
+ *  - site         Server site holding the hosted sites.
+ *  - request      Request headers.
+ * 
+ * Returns the hosted site named by the Host header, `site` if there is
+ * none; valid as long as the reference to `site` is held.
  */
-string load_template(char* name);
+struct site *site_host(struct site *site, const char *request);
 
 /**
- * Renders a Mustache template using the provided JSON context
+ * Makes the thread resolve files, templates and partials in the directory
+ * of the site, until the previous site is entered again.
  * 
  * Parameters:
- *  - template_content Mustache template content string
- *  - context          A pointer to a cJSON object that provides the context
- *                     for rendering the template.
+ *  - site         Site being served, NULL for the current directory.
+ * 
+ * Returns the site entered before.
+ */
+struct site *site_enter(struct site *site);
+
+/**
+ * Returns the directory of the site the thread serves, "" for the current
+ * directory; see site_enter.
+ */
+const char *site_directory();
+
+/**
+ * Makes site_load open a bundle instead of reading the current directory.
+ * 
+ * Parameters:
+ *  - path         Absolute path to the bundle file.
+ */
+void site_use_bundle(const char *path);
+
+/**
+ * Finds the front matter of a Markdown page collected with the site.
+ * 
+ * Parameters:
+ *  - site         Site.
+ *  - path         Page file path, like "static/notes/index.md".
+ * 
+ * Returns the "pages" entry of the file: "page" with the key/value pairs,
+ * "body", "size" and "modified"; NULL if the page is unknown.
+ */
+cJSON *site_page(struct site *site, const char *path);
+
+/**
+ * Finds the children listed for a URL, see create_children. Pages are
+ * rendered with them as `children`.
+ * 
+ * Parameters:
+ *  - site         Site.
+ *  - url          Request URL, like "/notes/" or "/category/demo".
+ * 
+ * Returns the array of children; NULL if the URL has none.
+ */
+cJSON *site_children(struct site *site, const char *url);
+
+/**
+ * Looks up the file a URL resolves to, in the site's bundle or the file
+ * cache. A precompressed variant is returned if the request accepts it.
+ * 
+ * Parameters:
+ *  - site         Site to serve.
+ *  - url          Request URL.
+ *  - request      Request headers for content negotiation, may be NULL.
+ * 
+ * Returns a file cache entry to release with file_cache_release; NULL if
+ * the URL does not resolve to a file.
+ */
+struct file_cache_entry *site_file(struct site *site, const char *url, const char *request);
+
+/**
+ * Returns a new reference to the current site; release it with site_release.
+ */
+struct site *site_acquire();
+
+/**
+ * Releases a reference to the site; the last reference frees it.
+ * 
+ * Parameters:
+ *  - site         Site to release, may be NULL.
+ */
+void site_release(struct site *site);
+
+/**
+ * Makes the site current and releases the previous one. Takes over the
+ * caller's reference.
  * 
+ * Parameters:
+ *  - site         Site returned by site_load.
+ */
+void site_publish(struct site *site);
+
+
+// Assets /////////////////////////////////////////////////////////////////////
+
+
+// Static files other than pages are fingerprinted when the site is loaded:
+// `site.assets` maps "css/site.css" to "/css/site.<fingerprint>.css", and
+// templates refer to it with {{asset "css/site.css"}}.
+
+/**
+ * Computes the fingerprint of a file's content.
+ *
+ * Parameters:
+ *  - fd           File descriptor.
+ *  - fingerprint  Buffer of FINGERPRINT_LENGTH + 1 bytes.
+ *
+ * Returns 0 on success; -1 if the file cannot be read.
+ */
+int file_fingerprint(int fd, char *fingerprint);
+
+/**
+ * Inserts a fingerprint before the extension of a URL.
+ *
+ * Parameters:
+ *  - buffer       Destination buffer.
+ *  - buffer_len   Buffer size.
+ *  - url          Asset URL, e.g. "/css/site.css".
+ *  - fingerprint  Fingerprint from `file_fingerprint`.
+ */
+void fingerprint_url(char *buffer, size_t buffer_len, const char *url, const char *fingerprint);
+
+/**
+ * Removes a fingerprint from a URL.
+ *
+ * Parameters:
+ *  - url          Requested URL.
+ *  - original     Receives the URL without the fingerprint.
+ *  - original_len Size of the `original` buffer.
+ *  - fingerprint  Receives the fingerprint, FINGERPRINT_LENGTH + 1 bytes.
+ *
+ * Returns `true` if the URL has a fingerprint.
+ */
+bool fingerprint_strip(const char *url, char *original, size_t original_len, char *fingerprint);
+
+/**
+ * Fingerprints static files other than pages.
+ *
+ * Parameters:
+ *  - assets       `cJSON` object to store the URLs to.
+ *  - base_path    Static folder.
+ *  - path         Subfolder, NULL for the static folder itself.
+ */
+void collect_assets(cJSON *assets, char *base_path, char *path);
+
+/**
+ * Finds the Cache-Control value for a URL in the "cache_policy" object of
+ * config.json; the longest matching URL prefix wins.
+ *
+ * Returns the header value; NULL if no policy applies.
+ */
+const char *cache_policy(cJSON *config, const char *url);
+
+/**
+ * Replaces {{asset "path"}} tags with fingerprinted URLs.
+ *
+ * Parameters:
+ *  - template     Template text.
+ *  - assets       `site.assets` object.
+ *
+ * Returns the expanded template; the value is NULL if there are no tags.
+ */
+string expand_assets(substring template, cJSON *assets);
+
+
+// Early hints ////////////////////////////////////////////////////////////////
+
+
+/**
+ * Appends `Link: rel=preload` header lines for the stylesheets, preloads
+ * and scripts referenced by `<link>` and `<script src>` tags in HTML.
+ * URLs with Mustache tags are skipped, lines already present are not
+ * repeated.
+ *
+ * Parameters:
+ *  - html         Template text, with assets expanded.
+ *  - links        Header lines, null-terminated.
+ *  - length       Length of the lines in `links`.
+ *  - size         Size of `links`.
+ *
+ * Returns the new length of the lines.
+ */
+size_t preload_links(substring html, char *links, size_t length, size_t size);
+
+/**
+ * Returns the `Link` header lines for a Markdown page: the preloads of its
+ * template and the partials the template includes, if "early_hints" in
+ * config.json enables them for the template. The links of a template are
+ * found when it is first used and found again after it or its partials
+ * change, which is checked like the dependencies of cached pages.
+ *
+ * Parameters:
+ *  - site         Site the page belongs to.
+ *  - file         Requested file, NULL if not found.
+ *
+ * Returns the header lines; the value is NULL if there are none.
+ */
+string early_hints_links(struct site *site, struct file_cache_entry *file);
+
+/**
+ * Returns the `103 Early Hints` response to send while the page for a GET
+ * request of an HTTP/1.1 client renders.
+ *
+ * Parameters:
+ *  - request      Request head.
+ *  - links        Links of the requested page from early_hints_links.
+ *
+ * Returns the interim response; the value is NULL if there are no links.
+ */
+string early_hints_response(const char *request, string links);
+
+/**
+ * Frees the links found for a template.
+ */
+void early_hints_free(struct early_hints *hints);
+
+
+// Access log /////////////////////////////////////////////////////////////////
+
+
+// Access log formats
+enum access_log_format {
+    ACCESS_LOG_COMBINED,            // Apache/nginx combined log format
+    ACCESS_LOG_JSON                 // one JSON object per line
+};
+
+struct access_log_entry {
+    struct timespec time;           // request start time, CLOCK_REALTIME
+    long duration_us;               // time to process the request
+    int status;                     // HTTP status code
+    size_t bytes;                   // response body size
+    char client[INET6_ADDRSTRLEN];
+    char method[8];
+    char url[512];
+    char protocol[12];              // HTTP version of the request line
+    char referer[256];
+    char user_agent[256];
+};
+
+/**
+ * Opens the access log and starts the background writer thread.
+ *
+ * Parameters:
+ *  - config       Server configuration; the `access_log` object sets
+ *                 `path` (file name, "-" for stdout), `format` ("combined"
+ *                 or "json"), `sample` (0...1, share of requests to log)
+ *                 and `flush` (max milliseconds between writes).
+ *  - workers      Number of request workers; each one gets its own ring
+ *                 buffer.
+ *  - cli_mode     Without a configured path, CLI mode logs to stdout and
+ *                 service mode doesn't log.
+ *
+ * Returns 0 on success, -1 if logging is disabled or the log can't be opened.
+ */
+int access_log_open(cJSON *config, int workers, bool cli_mode);
+
+/**
+ * Queues an entry for the background writer. Never blocks: the entry is
+ * dropped if the worker's ring buffer is full, or skipped by sampling.
+ *
+ * Parameters:
+ *  - worker       Index of the calling worker, 0...workers-1.
+ *  - entry        Entry to copy into the ring buffer.
+ */
+void access_log_write(int worker, struct access_log_entry *entry);
+
+/**
+ * Flushes pending entries, stops the writer thread and closes the log.
+ */
+void access_log_close();
+
+
+// Tracing ////////////////////////////////////////////////////////////////////
+
+
+// Spans of one traced request
+struct trace;
+
+/**
+ * Opens the trace file. Traced requests are appended to it in the Chrome
+ * trace event format, which Perfetto and chrome://tracing open.
+ *
+ * Parameters:
+ *  - config       Server configuration; the `trace` object sets `path`
+ *                 (trace file), `sample` (0...1, share of requests traced),
+ *                 `header` (request header that turns tracing on, none by
+ *                 default), `secret` (value the header must have, any if
+ *                 empty) and `max_size` (bytes, TRACE_SIZE by default;
+ *                 requests are no longer traced once the file is larger).
+ *
+ * Returns 0 on success, -1 if tracing is disabled or the file can't be opened.
+ */
+int trace_open(cJSON *config);
+
+/**
+ * Closes the trace file.
+ */
+void trace_close();
+
+/**
+ * Starts tracing a request if it is sampled or has the trace header. The
+ * trace becomes the calling thread's current trace, which trace_begin and
+ * trace_end record into.
+ *
+ * Parameters:
+ *  - request      Raw request data (null-terminated).
+ *
+ * Returns the trace, NULL if the request isn't traced.
+ */
+struct trace *trace_start(const char *request);
+
+/**
+ * Starts a span in the calling thread's current trace; spans nest until
+ * the matching trace_end. Does nothing if the thread has no trace.
+ *
+ * Parameters:
+ *  - name         Span name; must stay valid until the trace is finished.
+ */
+void trace_begin(const char *name);
+
+/**
+ * Ends the innermost open span of the calling thread's current trace.
+ */
+void trace_end();
+
+/**
+ * Marks the response as ready: the send span starts, and the trace is no
+ * longer the thread's current trace. Accepts NULL.
+ */
+void trace_sending(struct trace *trace);
+
+/**
+ * Appends the trace to the trace file and frees it. Accepts NULL.
+ *
+ * Parameters:
+ *  - trace        Trace from trace_start.
+ *  - log_entry    Status and size of the response.
+ *  - method       Request method.
+ *  - url          Request URL.
+ *  - request_start  Request start time from `metrics_now`.
+ */
+void trace_finish(struct trace *trace, struct access_log_entry *log_entry, const char *method,
+                  const char *url, uint64_t request_start);
+
+/**
+ * Frees a trace without writing it, for connections closed before the
+ * response. Accepts NULL.
+ */
+void trace_free(struct trace *trace);
+
+/**
+ * Formats an access log line, including the trailing new line.
+ *
+ * Parameters:
+ *  - buffer       Output buffer.
+ *  - buffer_len   Output buffer size.
+ *  - entry        Entry to format.
+ *  - format       ACCESS_LOG_COMBINED or ACCESS_LOG_JSON.
+ *
+ * Returns the line length; 0 if the line does not fit into the buffer.
+ */
+size_t format_access_log_entry(char *buffer, size_t buffer_len, struct access_log_entry *entry, enum access_log_format format);
+
+/**
+ * Returns the number of access log entries dropped because a worker's ring
+ * buffer was full.
+ */
+unsigned long access_log_dropped();
+
+
+// Metrics ////////////////////////////////////////////////////////////////////
+
+
+// Request pipeline stages
+enum metrics_stage {
+    STAGE_ACCEPT,
+    STAGE_RECV,                     // receiving and parsing the request
+    STAGE_RESOURCE_PATH,
+    STAGE_READ_FILE,
+    STAGE_MUSTACHE_CONTENT,         // Mustache pass over Markdown content
+    STAGE_MARKDOWN,
+    STAGE_MUSTACHE_TEMPLATE,        // Mustache pass over the page template
+    STAGE_LUA,                      // Lua handler
+    STAGE_RESPONSE,                 // make_response
+    STAGE_SEND,
+    STAGE_REQUEST,                  // whole request, from accept to close
+    STAGE_COUNT
+};
+
+// Log-linear histogram buckets: values below 2^HISTOGRAM_SUB_BITS are
+// counted exactly, larger values with 1/2^HISTOGRAM_SUB_BITS precision.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+// Largest tracked value is 2^HISTOGRAM_MAX_BITS, about 68 s in nanoseconds
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Histogram with a single writer; readers may merge it at any time.
+struct histogram {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+};
+
+/**
+ * Returns the histogram bucket index for the value.
+ */
+size_t histogram_bucket(uint64_t value);
+
+/**
+ * Returns the upper bound (exclusive) of values counted in the bucket.
+ */
+uint64_t histogram_bucket_limit(size_t index);
+
+/**
+ * Adds a value to the histogram; only one thread may record into a histogram.
+ */
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+/**
+ * Adds all values from `source` into `target`.
+ */
+void histogram_merge(struct histogram *target, struct histogram *source);
+
+/**
+ * Returns an approximate value at the percentile `p` (0...100).
+ */
+uint64_t histogram_percentile(struct histogram *histogram, double p);
+
+/**
+ * Returns current monotonic time in nanoseconds.
+ */
+uint64_t metrics_now();
+
+/**
+ * Records the time spent in the stage into the calling thread's histograms.
+ *
+ * Parameters:
+ *  - stage        Request pipeline stage.
+ *  - start        Stage start time from `metrics_now`.
+ *
+ * Returns the current time, which can be used as the start of the next stage.
+ */
+uint64_t metrics_record(enum metrics_stage stage, uint64_t start);
+
+/**
+ * Counts a response in the calling thread's counters.
+ *
+ * Parameters:
+ *  - status       HTTP status code.
+ *  - received     Request size in bytes.
+ *  - sent         Response size in bytes.
+ */
+void metrics_count_response(int status, size_t received, size_t sent);
+
+/**
+ * Returns the number of requests processed by all threads.
+ */
+uint64_t metrics_requests();
+
+/**
+ * Merges all threads' metrics and renders them in Prometheus text format.
+ */
+string metrics_render();
+
+
+// Memory /////////////////////////////////////////////////////////////////////
+
+
+// Parts of the server allocations are accounted to
+enum memory_subsystem {
+    MEMORY_OTHER,
+    MEMORY_REQUEST,                 // request context and response
+    MEMORY_MARKDOWN,
+    MEMORY_MUSTACHE,                // templates, partials and rendering
+    MEMORY_CACHE,                   // page cache copies
+    MEMORY_SITE,                    // configuration and metadata
+    MEMORY_SUBSYSTEMS
+};
+
+// Allocation counters of a subsystem, merged over all threads
+struct memory_stats {
+    uint64_t json_allocations;      // cJSON allocations
+    uint64_t json_bytes;            // cJSON bytes allocated and not freed yet
+    uint64_t string_allocations;    // strings made by the subsystem
+    uint64_t string_bytes;
+};
+
+/**
+ * Routes cJSON allocations through the accounting. Must be called before
+ * anything is allocated by cJSON.
+ */
+void memory_init();
+
+/**
+ * Accounts the calling thread's allocations to a subsystem.
+ *
+ * Returns the previous subsystem, to be restored with memory_leave.
+ */
+enum memory_subsystem memory_enter(enum memory_subsystem subsystem);
+
+/**
+ * Restores the subsystem returned by memory_enter.
+ */
+void memory_leave(enum memory_subsystem previous);
+
+/**
+ * Counts a string made by the current subsystem.
+ */
+void memory_count_string(size_t bytes);
+
+/**
+ * Reads the counters of a subsystem.
+ */
+void memory_stats(enum memory_subsystem subsystem, struct memory_stats *stats);
+
+/**
+ * Returns the bytes allocated from the heap and in use; 0 if the C library
+ * does not report it.
+ */
+size_t memory_heap();
+
+/**
+ * Returns the name of a subsystem, like "request".
+ */
+const char *memory_subsystem_name(enum memory_subsystem subsystem);
+
+/**
+ * Writes the counters of all subsystems as text, one line each.
+ */
+void memory_dump(FILE *stream);
+
+
+// File cache /////////////////////////////////////////////////////////////////
+
+
+// Open file of a resolved URL. Raw files up to the map limit are mapped, so
+// a hit is served without file system calls. Entries are reference counted
+// and stay valid after they are evicted until released.
+struct file_cache_entry {
+    char *url;                      // site directory and URL
+    char *path;                     // resolved resource path
+    int fd;                         // -1 for pages, mapped files and bundles
+    uint64_t hash;
+    off_t size;
+    time_t modified;
+    ino_t inode;
+    const char *content_type;
+    const char *map;                // file content, NULL if not mapped
+    char *headers;                  // Cache-Control header line, NULL if none
+    bool rendered;                  // Markdown or Mustache page
+    uint64_t validated;             // last check against the file system
+    uint64_t version;               // differs for every load
+    struct bundle *bundle;          // bundle the content is mapped from, NULL for files
+    _Atomic int references;
+    struct file_cache_entry *next;  // hash bucket
+    struct file_cache_entry *newer; // LRU list
+    struct file_cache_entry *older;
+};
+
+/**
+ * Sets up the file cache with the "file_cache" settings from config.json:
+ * entries, size, map_limit, ttl and inotify.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success; -1 if caching is disabled or fails to start.
+ */
+int file_cache_init(cJSON *config);
+
+/**
+ * Returns the inotify descriptor that reports changes in the static and
+ * templates folders, -1 if changes are not watched.
+ */
+int file_cache_descriptor();
+
+/**
+ * Adds inotify watches for a directory and its subdirectories.
+ *
+ * Parameters:
+ *  - directory    Directory path.
+ *
+ * Returns 0 on success; -1 if some directories are not watched.
+ */
+int file_cache_watch(const char *directory);
+
+/**
+ * Reads pending inotify events and drops the file cache entries and the
+ * rendered pages of changed files.
+ *
+ * Returns `true` if a Markdown page changed, was added or removed, so the
+ * metadata is out of date.
+ */
+bool file_cache_events();
+
+/**
+ * Drops entries of a file.
+ *
+ * Parameters:
+ *  - path         Resource path.
+ */
+void file_cache_invalidate(const char *path);
+
+/**
+ * Drops all entries.
+ */
+void file_cache_clear();
+
+/**
+ * Drops the entries that hold a descriptor and are not in use, when the
+ * process runs out of descriptors.
+ *
+ * Returns the number of entries dropped.
+ */
+size_t file_cache_shrink();
+
+/**
+ * Finds or opens the file a URL resolves to in the site the thread serves;
+ * entries of all sites share the cache limits.
+ *
+ * Parameters:
+ *  - url          Request URL.
+ *
+ * Returns a referenced entry to release with `file_cache_release`; NULL if
+ * the URL does not resolve to a file.
+ */
+struct file_cache_entry *file_cache_get(const char *url);
+
+/**
+ * Releases an entry returned by `file_cache_get`; NULL is ignored.
+ */
+void file_cache_release(struct file_cache_entry *entry);
+
+/**
+ * Reads the content of an entry.
+ *
+ * Returns the file content.
+ */
+string file_cache_read(struct file_cache_entry *entry);
+
+/**
+ * Reads file cache counters; any pointer may be NULL.
+ */
+void file_cache_stats(uint64_t *hits, uint64_t *misses, size_t *entries, size_t *mapped_bytes);
+
+
+// Page cache /////////////////////////////////////////////////////////////////
+
+
+// Input a rendered page is built from
+enum page_dependency_kind {
+    PAGE_DEPENDENCY_FILE,           // page, template or partial; recorded if missing too
+    PAGE_DEPENDENCY_METADATA,       // site metadata entry: "index/<key>" or "assets/<path>"
+    PAGE_DEPENDENCY_SITE            // all site metadata, for templates that read `site`
+};
+
+struct page_dependency {
+    enum page_dependency_kind kind;
+    char *name;
+    uint64_t state;                 // file modification time, size and inode, or json_hash
+};
+
+// Rendered page with the inputs recorded while it was rendered
+struct page_cache_entry {
+    char *key;                      // method and URL
+    uint64_t hash;
+    string content;
+    struct page_dependency *dependencies;
+    size_t dependency_count;
+    size_t dependency_capacity;
+    uint64_t site_generation;       // site the metadata dependencies were checked against
+    uint64_t config_hash;
+    uint64_t validated;             // last check of the files, without inotify
+    struct page_cache_entry *next;  // hash bucket
+    struct page_cache_entry *newer; // LRU list
+    struct page_cache_entry *older;
+};
+
+/**
+ * Sets up the page cache with the "page_cache" settings from config.json:
+ * entries and size. Files are checked like in the file cache.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success; -1 if caching is disabled or fails to start.
+ */
+int page_cache_init(cJSON *config);
+
+/**
+ * Renders a Markdown or Mustache page, or returns the cached rendering if
+ * none of its dependencies changed: the page file, its template and
+ * partials, the site index entries and asset URLs it used, and the
+ * configuration. Pages whose templates read `site` directly depend on all
+ * site metadata. A page the cache cannot keep, because it is over the
+ * budget, a file changed meanwhile or the cache is off, is shared with the
+ * later requests for it in the same batch of events, until
+ * page_cache_batch_end.
+ *
+ * Parameters:
+ *  - site         Site the page is rendered with.
+ *  - context      Request context from process_request.
+ *  - file         Page file.
+ *
+ * Returns the rendered page.
+ */
+string page_cache_render(struct site *site, cJSON *context, struct file_cache_entry *file);
+
+/**
+ * Releases the renderings shared by the requests of the batch of events
+ * just handled. Called by the I/O backends after each batch.
+ */
+void page_cache_batch_end();
+
+/**
+ * Records a dependency of the page being rendered by this thread; ignored
+ * outside page_cache_render.
+ *
+ * Parameters:
+ *  - kind         Dependency kind.
+ *  - name         File path, or metadata object and key; ignored for
+ *                 PAGE_DEPENDENCY_SITE.
+ */
+void page_dependency_add(enum page_dependency_kind kind, const char *name);
+
+/**
+ * Drops the pages that depend on a file.
+ *
+ * Parameters:
+ *  - path         File path relative to the site, like "templates/default.mustache".
+ *
+ * Returns the number of pages dropped.
+ */
+size_t page_cache_invalidate(const char *path);
+
+/**
+ * Drops all pages.
+ */
+void page_cache_clear();
+
+/**
+ * Hashes a JSON value: types, keys and values.
+ */
+uint64_t json_hash(const cJSON *item);
+
+/**
+ * Reads page cache counters; any pointer may be NULL.
+ */
+void page_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *invalidated, uint64_t *coalesced,
+                      size_t *entries, size_t *bytes);
+
+/**
+ * Sets up the fragment cache with the "fragment_cache" settings from
+ * config.json: entries and size. It keeps the HTML of Markdown bodies
+ * without Mustache tags, which is the same for every request, so pages
+ * that cannot be cached as a whole only render their template again.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success; -1 if caching is disabled or fails to start.
+ */
+int fragment_cache_init(cJSON *config);
+
+/**
+ * Finds the HTML of a Markdown page body.
+ *
+ * Parameters:
+ *  - path         Page file path.
+ *  - file_stat    Current state of the file; HTML of other states is dropped.
+ *
+ * Returns a copy of the HTML; value is NULL if it is not cached.
+ */
+string fragment_cache_get(const char *path, const struct stat *file_stat);
+
+/**
+ * Keeps the HTML of a Markdown page body. Fragments of changed files are
+ * also dropped with page_cache_invalidate and page_cache_clear.
+ *
+ * Parameters:
+ *  - path         Page file path.
+ *  - file_stat    State of the file the body was read from.
+ *  - html         HTML converted from the body; copied.
+ */
+void fragment_cache_put(const char *path, const struct stat *file_stat, string html);
+
+/**
+ * Reads fragment cache counters; any pointer may be NULL.
+ */
+void fragment_cache_stats(uint64_t *hits, uint64_t *misses, size_t *entries, size_t *bytes);
+
+
+// Bundles ////////////////////////////////////////////////////////////////////
+
+
+// A bundle is one read-only file with a site rendered by `cserver pack`:
+// the header, bodies aligned for mmap, then the route table. Routes are
+// found with a perfect hash: the URL hash selects a bucket, whose
+// displacement picks the slot of the route. Offsets are from the start of
+// the file.
+struct bundle_header {
+    char magic[8];                  // "CSBUNDLE"
+    uint32_t version;               // BUNDLE_VERSION
+    uint32_t route_count;
+    uint32_t bucket_count;
+    uint32_t slot_count;
+    uint64_t buckets;               // uint32_t displacement per bucket
+    uint64_t slots;                 // uint32_t route index per slot, UINT32_MAX if empty
+    uint64_t routes;                // struct bundle_route per route
+    uint64_t config;                // config.json, null-terminated
+    uint64_t size;                  // file size
+    uint64_t created;               // Unix time
+};
+
+// Encodings of bundled bodies, in order of preference after identity
+enum bundle_encoding {
+    BUNDLE_IDENTITY,
+    BUNDLE_GZIP,
+    BUNDLE_BROTLI,
+    BUNDLE_ENCODINGS
+};
+
+struct bundle_body {
+    uint64_t offset;                // 0 if the variant is missing
+    uint64_t size;
+    uint64_t headers;               // header lines, null-terminated
+};
+
+struct bundle_route {
+    uint64_t url;                   // null-terminated strings
+    uint64_t path;
+    uint64_t content_type;
+    struct bundle_body bodies[BUNDLE_ENCODINGS];
+};
+
+// Mapped bundle; entries are file cache entries pointing into the mapping,
+// so requests are served like mapped files. Each entry handed out holds a
+// reference to the bundle.
+struct bundle {
+    const char *map;
+    size_t size;
+    const struct bundle_header *header;
+    const uint32_t *buckets;
+    const uint32_t *slots;
+    const struct bundle_route *routes;
+    struct file_cache_entry *entries;   // BUNDLE_ENCODINGS per route
+    _Atomic int references;
+};
+
+/**
+ * Maps a bundle file and checks its header and tables.
+ *
+ * Parameters:
+ *  - path         Bundle file.
+ *
+ * Returns the bundle with one reference; NULL if the file is not a bundle
+ * of BUNDLE_VERSION.
+ */
+struct bundle *bundle_open(const char *path);
+
+/**
+ * Releases a reference to the bundle; the last reference unmaps it.
+ */
+void bundle_release(struct bundle *bundle);
+
+/**
+ * Looks up a route without file system access.
+ *
+ * Parameters:
+ *  - bundle       Bundle to search.
+ *  - url          Request URL.
+ *  - accept       Accept-Encoding header value, may be NULL.
+ *
+ * Returns the entry of the best accepted encoding with a new reference to
+ * the bundle, released with file_cache_release; NULL if there is no route.
+ */
+struct file_cache_entry *bundle_get(struct bundle *bundle, const char *url, const char *accept);
+
+/**
+ * Checks whether an Accept-Encoding header value accepts an encoding.
+ *
+ * Parameters:
+ *  - accept       Header value.
+ *  - encoding     Encoding name, like "gzip".
+ *
+ * Returns `true` if the encoding is listed without q=0.
+ */
+bool encoding_accepted(const char *accept, const char *encoding);
+
+
+// Lua ////////////////////////////////////////////////////////////////////////
+
+
+#ifdef CSERVER_LUA
+
+/**
+ * Creates the pool of Lua states with the standard libraries loaded. The
+ * pool size is "states" in the "lua" settings of config.json.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success; -1 on failure.
+ */
+int lua_pool_init(cJSON *config);
+
+/**
+ * Closes the idle Lua states.
+ */
+void lua_pool_close();
+
+/**
+ * Runs a `.lua` handler in a pooled state. The script is compiled once per
+ * state and file version and called with read-only views of the request,
+ * the site index and the configuration as `...`. It returns the body and
+ * optionally the content type.
+ *
+ * Parameters:
+ *  - context      Request context from process_request.
+ *  - http_status  HTTP status line value for a successful run.
+ *  - file         Script file.
+ *  - log_entry    Receives the status on errors and the content length.
+ *
+ * Returns the complete HTTP response; 500 if the script fails.
+ */
+string lua_response(cJSON *context, char *http_status, struct file_cache_entry *file,
+                    struct access_log_entry *log_entry);
+
+#endif
+
+
+// Request processing /////////////////////////////////////////////////////////
+
+
+/**
+ * Checks whether the request headers are complete or the request buffer
+ * of REQUEST_BUFFER_SIZE is full.
+ * 
+ * Parameters:
+ *  - request      Null-terminated request data received so far.
+ *  - length       Request data length.
+ * 
+ * Returns `true` if the request can be processed.
+ */
+bool request_complete(const char *request, size_t length);
+
+/**
+ * Reads the method and the URL from the request line.
+ * 
+ * Parameters:
+ *  - request      Null-terminated request data.
+ *  - method       Buffer of 8 bytes for the method.
+ *  - url          Buffer of 1024 bytes for the URL.
+ */
+void parse_request_line(const char *request, char *method, char *url);
+
+/**
+ * Renders the response for a parsed request.
+ * 
+ * Parameters:
+ *  - site         Site to serve.
+ *  - method       Request method.
+ *  - url          Request URL.
+ *  - file         File cache entry for the URL, NULL if not found.
+ *  - links        Links of the file from early_hints_links, NULL if none.
+ *  - log_entry    Receives the status and the content length.
+ * 
+ * Returns the complete HTTP response.
+ */
+string process_request(struct site *site, char *method, char *url, struct file_cache_entry *file,
+                       const char *links, struct access_log_entry *log_entry);
+
+/**
+ * Writes HTTP response headers into a buffer.
+ * 
+ * Parameters:
+ *  - buffer           Destination buffer.
+ *  - buffer_len       Buffer size.
+ *  - http_status      HTTP status line value, e.g. HTTP_STATUS_200.
+ *  - content_type     Content-Type header value.
+ *  - headers          Additional header lines, may be empty.
+ *  - content_length   Content length.
+ * 
+ * Returns the header length; 0 if the headers do not fit.
+ */
+size_t format_response_header(char *buffer, size_t buffer_len, const char *http_status,
+                              const char *content_type, const char *headers, size_t content_length);
+
+
+// Timers /////////////////////////////////////////////////////////////////////
+
+
+// Hierarchical timer wheel: TIMER_LEVELS levels of 2^TIMER_LEVEL_BITS slots,
+// each level TIMER_LEVEL_BITS bits coarser than the previous one. Scheduling
+// and cancelling are O(1); a timer moves down at most TIMER_LEVELS - 1 times
+// before it expires. Not thread-safe, each event loop owns its wheel.
+struct timer {
+    struct timer *next;             // NULL if not scheduled
+    struct timer *prev;
+    uint64_t expires;               // tick
+};
+
+struct timer_wheel {
+    uint64_t tick;                  // last processed tick
+    size_t count;                   // scheduled timers
+    struct timer slots[TIMER_LEVELS][1 << TIMER_LEVEL_BITS];
+};
+
+typedef void (*timer_callback)(struct timer *timer, void *data);
+
+/**
+ * Initialises an empty wheel.
+ *
+ * Parameters:
+ *  - wheel        Timer wheel.
+ *  - tick         Current tick from `timer_tick`.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick);
+
+/**
+ * Returns the current time in TIMER_TICK units.
+ */
+uint64_t timer_tick();
+
+/**
+ * Schedules a timer or moves a scheduled one.
+ *
+ * Parameters:
+ *  - wheel        Timer wheel.
+ *  - timer        Timer, zero-initialised before the first use.
+ *  - expires      Tick to expire at; past ticks expire with the next one.
+ */
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+
+/**
+ * Cancels a timer; unscheduled timers are ignored.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Advances the wheel, calling `expired` for every timer due. The timer is
+ * unscheduled before its callback, which may schedule it again or free it.
+ *
+ * Parameters:
+ *  - wheel        Timer wheel.
+ *  - tick         Current tick from `timer_tick`.
+ *  - expired      Callback for expired timers.
+ *  - data         Callback argument.
+ */
+void timer_advance(struct timer_wheel *wheel, uint64_t tick, timer_callback expired, void *data);
+
+
+// Listeners //////////////////////////////////////////////////////////////////
+
+
+// Client address in IPv6 form, IPv4 addresses mapped to ::ffff:0:0/96.
+// All zero when unknown: clients of Unix sockets without a PROXY header.
+struct client_address {
+    uint8_t bytes[16];
+};
+
+// Listening socket, from the "listen" list in config.json
+struct listener {
+    int socket;
+    char name[128];                 // canonical address: 127.0.0.1:80, [::1]:80, unix:path
+    bool proxy_protocol;            // connections start with a PROXY protocol header
+    bool tls;                       // TLS is offered, TCP listeners without PROXY only
+    bool unix_socket;
+};
+
+/**
+ * Parses a listen address: "unix:<path>", "<IPv4>:<port>", "[<IPv6>]:<port>"
+ * or a port alone for all IPv4 interfaces.
+ *
+ * Parameters:
+ *  - text         Address as written in config.json.
+ *  - address      Receives the socket address.
+ *  - address_len  Receives the socket address length.
+ *
+ * Returns 0 on success, -1 if the address is invalid.
+ */
+int listen_address_parse(const char *text, struct sockaddr_storage *address, socklen_t *address_len);
+
+/**
+ * Formats a socket address the way listener names are written.
+ *
+ * Parameters:
+ *  - address      Socket address.
+ *  - name         Output buffer.
+ *  - name_len     Output buffer size.
+ */
+void listen_address_format(const struct sockaddr *address, char *name, size_t name_len);
+
+/**
+ * Sets a client address from the peer address of a connection.
+ *
+ * Parameters:
+ *  - address      Client address to set; unknown for Unix sockets.
+ *  - peer         Peer address from accept, or NULL.
+ */
+void client_address_set(struct client_address *address, const struct sockaddr *peer);
+
+/**
+ * Parses a client address written by client_address_format.
+ *
+ * Returns 0 on success; -1 if the text is not an address, which leaves
+ * the address unknown.
+ */
+int client_address_parse(struct client_address *address, const char *text);
+
+/**
+ * Writes a client address for the access log: IPv4 addresses in dotted
+ * form, unknown ones as "-".
+ */
+void client_address_format(const struct client_address *address, char *text, size_t text_len);
+
+/**
+ * Returns `true` if the client address is unknown.
+ */
+bool client_address_unknown(const struct client_address *address);
+
+/**
+ * Parses a PROXY protocol v1 or v2 header at the start of a connection.
+ * The address is taken from PROXY TCP4/TCP6 (v1) and PROXY INET/INET6
+ * (v2) headers; UNKNOWN, LOCAL and Unix socket headers leave it as it is.
+ *
+ * Parameters:
+ *  - data         Data received on the connection.
+ *  - length       Received data length.
+ *  - address      Receives the client address.
+ *
+ * Returns the header length; 0 if more data is needed, -1 if the data does
+ * not start with a valid header.
+ */
+int proxy_header_parse(const char *data, size_t length, struct client_address *address);
+
+
+// Connection limits //////////////////////////////////////////////////////////
+
+
+// Caps and timeouts of an event loop, from the "limits" section of
+// config.json. Timeouts are in timer ticks, 0 for none.
+struct connection_limits {
+    unsigned max_connections;       // 0 for no cap
+    unsigned max_per_client;        // 0 for no cap
+    unsigned connections;
+    uint64_t header_timeout;
+    uint64_t write_timeout;
+    unsigned min_rate;              // bytes per second
+    struct { struct client_address address; unsigned count; } *clients;
+    size_t client_slots;            // power of two
+    size_t client_count;            // clients with connections
+};
+
+// Response for requests that time out
+extern const char *request_timeout_response;
+
+/**
+ * Reads the limits from the configuration; negative values count as 0,
+ * which disables a cap or a timeout. Positive timeouts are at least a tick.
+ *
+ * Returns 0 on success; -1 if the client table cannot be allocated.
+ */
+int limits_init(struct connection_limits *limits, cJSON *config);
+
+/**
+ * Frees the client table.
+ */
+void limits_free(struct connection_limits *limits);
+
+/**
+ * Counts a new connection if it is within the global and per-client caps.
+ * Unknown addresses are only held to the global cap.
+ *
+ * Parameters:
+ *  - limits       Event loop limits.
+ *  - address      Client address.
+ *
+ * Returns `false` if the connection must be closed.
+ */
+bool limits_admit(struct connection_limits *limits, const struct client_address *address);
+
+/**
+ * Releases a connection counted by `limits_admit`.
+ */
+void limits_release(struct connection_limits *limits, const struct client_address *address);
+
+/**
+ * Moves a connection to another client address, when a PROXY header names
+ * the client.
+ *
+ * Parameters:
+ *  - limits       Event loop limits.
+ *  - from         Address the connection was admitted with.
+ *  - to           Client address.
+ *
+ * Returns `false`, with the connection left at `from`, if the client is at
+ * its cap.
+ */
+bool limits_move(struct connection_limits *limits, const struct client_address *from,
+                 const struct client_address *to);
+
+/**
+ * Checks that a response has been sent at least at the minimum rate since
+ * the previous check, write_timeout ticks ago.
+ *
+ * Parameters:
+ *  - limits       Event loop limits.
+ *  - sent         Bytes sent so far.
+ *  - total        Response length.
+ *  - checked      Bytes sent at the previous check; updated.
+ *
+ * Returns `false` if the connection must be closed.
+ */
+bool limits_check_rate(struct connection_limits *limits, size_t sent, size_t total, size_t *checked);
+
+/**
+ * Schedules a connection timer `timeout` ticks from now, or cancels it when
+ * the timeout is 0, which disables it.
+ *
+ * Parameters:
+ *  - wheel        Timer wheel of the event loop.
+ *  - timer        Connection timer.
+ *  - timeout      header_timeout or write_timeout of the limits.
+ */
+void limits_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t timeout);
+
+/**
+ * Counts a connection closed because its request headers timed out.
+ */
+void limits_count_timeout();
+
+/**
+ * Reads the numbers of rejected and timed out connections.
+ */
+void limits_stats(unsigned long *rejected, unsigned long *timed_out);
+
+
+// Rate limits ////////////////////////////////////////////////////////////////
+
+
+// Token bucket of one client address for one rule. Workers share the table
+// without locks: the key and the state are updated with compare-and-swap.
+struct rate_limit_slot {
+    _Atomic uint64_t key;           // hash of the address and the rule prefix, 0 if free
+    _Atomic uint64_t state;         // refill time in microseconds << 24 | tokens in 1/256, 0 if full
+};
+
+/**
+ * Allocates the bucket table with "entries" from the "rate_limits" section
+ * of config.json. The table keeps its size after reloads; rules are read
+ * from the current configuration on every request.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success; -1 if rate limits are not configured or the table
+ * cannot be allocated.
+ */
+int rate_limits_init(cJSON *config);
+
+/**
+ * Returns `true` if requests are checked against rate limits.
+ */
+bool rate_limits_enabled();
+
+/**
+ * Takes a token from the client's bucket for the longest rule prefix that
+ * matches the URL. Rules are "rate" requests per second with up to "burst"
+ * requests at once; a rule with rate 0 exempts its prefix. When the probed
+ * slots are taken, the bucket refilled longest ago is replaced. Clients
+ * with unknown addresses are not limited.
+ *
+ * Parameters:
+ *  - config       Site configuration with the "rate_limits" rules.
+ *  - address      Client address.
+ *  - url          Request URL.
+ *  - retry_after  Receives the seconds until a token is available.
+ *
+ * Returns `false` if the request is over the limit.
+ */
+bool rate_limit_admit(cJSON *config, const struct client_address *address, const char *url,
+                      unsigned *retry_after);
+
+/**
+ * Makes the 429 response for a request over the limit.
+ *
+ * Parameters:
+ *  - retry_after  Retry-After value, seconds.
+ *  - log_entry    Receives the status and the content length.
+ */
+string rate_limit_response(unsigned retry_after, struct access_log_entry *log_entry);
+
+/**
+ * Reads the numbers of limited requests and replaced buckets.
+ */
+void rate_limits_stats(unsigned long *limited, unsigned long *evicted);
+
+
+// HTTP/2 /////////////////////////////////////////////////////////////////////
+
+
+// Growable byte buffer
+struct h2_buffer {
+    char *value;
+    size_t length;
+    size_t capacity;
+};
+
+// HPACK dynamic table field; name and value share one allocation
+struct hpack_field {
+    char *name;
+    size_t name_length;
+    char *value;
+    size_t value_length;
+};
+
+// HPACK dynamic table, oldest field first
+struct hpack_table {
+    struct hpack_field *fields;
+    size_t count;
+    size_t slots;
+    size_t size;                    // RFC 7541 size: lengths plus 32 per field
+    size_t max_size;                // current size limit set by the encoder
+    size_t limit;                   // size limit advertised to the peer
+};
+
+typedef void (*hpack_callback)(void *data, substring name, substring value);
+
+// Request stream of an HTTP/2 connection
+struct h2_stream {
+    uint32_t id;
+    struct h2_stream *next;
+    bool headers_received;
+    bool processed;                 // response rendered
+    char request[REQUEST_BUFFER_SIZE];  // request head rebuilt in HTTP/1.1 form
+    size_t request_length;
+    char method[8];
+    char url[1024];
+    string response;                // HTTP/1.1 response from process_request
+    size_t body;                    // offset of the body data to send next
+    size_t sent;                    // header block and body bytes sent
+    int64_t window;                 // send window
+    uint32_t parent;                // stream this one depends on, 0 for none
+    uint16_t weight;                // 1..256
+    uint8_t urgency;                // 0..7, from the priority header
+    uint64_t pass;                  // virtual time of the weighted scheduler
+    uint64_t request_start;
+    struct access_log_entry log_entry;
+    struct trace *trace;            // NULL unless the request is traced
+};
+
+// HTTP/2 connection state, independent of the I/O backend: input is passed
+// to h2_receive, output is taken with h2_output
+struct h2_session {
+    struct h2_buffer input;         // incomplete frame
+    struct h2_buffer pending;       // output being queued
+    struct h2_buffer sending;       // output being sent
+    struct h2_buffer header_block;  // header block awaiting CONTINUATION frames
+    uint32_t continuation;          // stream of the header block, 0 if none
+    bool continuation_end;          // the header block ends its stream
+    struct h2_stream *streams;
+    size_t stream_count;
+    uint32_t last_stream;
+    struct hpack_table decoder;
+    int64_t window;                 // connection send window
+    uint32_t initial_window;        // peer's initial stream window
+    uint32_t max_frame;             // peer's maximum frame size
+    uint64_t pass;
+    bool preface_received;
+    bool settings_received;
+    bool closing;                   // GOAWAY sent
+    bool peer_closing;              // GOAWAY received
+    bool failed;                    // connection error
+    uint64_t written;               // bytes sent with h2_flush
+    uint64_t control_start;         // second in which control frames are counted
+    uint32_t control_frames;        // PING, SETTINGS and RST_STREAM frames in that second
+    struct client_address address;  // client address for rate limits
+    struct access_log_entry log_template;
+};
+
+/**
+ * Initializes an HPACK dynamic table.
+ *
+ * Parameters:
+ *  - table        Table to initialize.
+ *  - max_size     Table size advertised to the peer.
+ */
+void hpack_table_init(struct hpack_table *table, size_t max_size);
+
+/**
+ * Frees the fields of an HPACK dynamic table.
+ */
+void hpack_table_free(struct hpack_table *table);
+
+/**
+ * Decodes a Huffman coded HPACK string.
+ *
+ * Parameters:
+ *  - data           Encoded data.
+ *  - length         Encoded data length.
+ *  - output         Buffer of at least `length * 8 / 5` bytes.
+ *  - output_length  Receives the decoded length.
+ *
+ * Returns 0 on success; -1 for invalid codes or padding.
+ */
+int hpack_huffman_decode(const uint8_t *data, size_t length, char *output, size_t *output_length);
+
+/**
+ * Decodes an HPACK header block, updating the dynamic table.
+ *
+ * Parameters:
+ *  - table          Decoder's dynamic table.
+ *  - data           Header block.
+ *  - length         Header block length.
+ *  - callback       Called for each field; name and value are valid
+ *                   during the call only and not null-terminated.
+ *  - callback_data  Passed to the callback.
+ *
+ * Returns 0 on success; -1 if the block cannot be decoded.
+ */
+int hpack_decode(struct hpack_table *table, const uint8_t *data, size_t length,
+                 hpack_callback callback, void *callback_data);
+
+/**
+ * Encodes the status and the headers of an HTTP/1.1 response as an HPACK
+ * header block. Common statuses are indexed, header names come from the
+ * static table where possible and the dynamic table is not used, so the
+ * encoder keeps no state. Connection-specific headers are dropped.
+ *
+ * Parameters:
+ *  - output       Buffer the header block is appended to.
+ *  - response     HTTP/1.1 response.
+ *  - length       Response length.
+ *  - status       Receives the status code.
+ *  - body_offset  Receives the offset of the response body.
+ *
+ * Returns 0 on success; -1 if the response head cannot be parsed.
+ */
+int h2_response_headers(struct h2_buffer *output, const char *response, size_t length,
+                        int *status, size_t *body_offset);
+
+/**
+ * Creates an HTTP/2 session with the server preface queued for output.
+ *
+ * Parameters:
+ *  - client       Client address for the access log.
+ *
+ * Returns the session, NULL if out of memory.
+ */
+struct h2_session *h2_session_create(const char *client);
+
+/**
+ * Starts an HTTP/2 session for a connection that sent the HTTP/2 preface
+ * or an `Upgrade: h2c` request, unless "http2" is false in config.json.
+ * An upgrade request is answered with 101 Switching Protocols and served
+ * as stream 1.
+ *
+ * Parameters:
+ *  - site         Site to serve.
+ *  - request      Data received on the connection so far.
+ *  - length       Received data length.
+ *  - client       Client address for the access log.
+ *
+ * Returns the session, NULL if the connection stays on HTTP/1.1.
+ */
+struct h2_session *h2_accept(struct site *site, const char *request, size_t length, const char *client);
+
+/**
+ * Frees the session; streams in progress are logged as they are.
+ */
+void h2_session_free(struct h2_session *session);
+
+/**
+ * Processes received data. Complete requests are rendered right away and
+ * their responses queued.
+ *
+ * Parameters:
+ *  - session      HTTP/2 session.
+ *  - site         Site to serve.
+ *  - data         Received data.
+ *  - length       Received data length.
+ *
+ * Returns 0 on success; -1 after a connection error, when the session
+ * only has a GOAWAY frame left to send.
+ */
+int h2_receive(struct h2_session *session, struct site *site, const char *data, size_t length);
+
+/**
+ * Returns the output to send, with DATA frames added as far as the flow
+ * control windows allow. The same data is returned until h2_output_sent is
+ * called, so it stays valid while it is written.
+ *
+ * Parameters:
+ *  - session      HTTP/2 session.
+ *  - length       Receives the output length, 0 if there is nothing to send.
+ */
+const char *h2_output(struct h2_session *session, size_t *length);
+
+/**
+ * Marks the output returned by h2_output as sent.
+ */
+void h2_output_sent(struct h2_session *session);
+
+/**
+ * Sends the output on a socket until it is sent or the socket is full.
+ *
+ * Parameters:
+ *  - session      HTTP/2 session.
+ *  - socket_desc  Connection socket.
+ *  - offset       Bytes of the current output sent already; kept between calls.
+ *
+ * Returns 1 if everything was sent, 0 if the socket is full, -1 on errors.
+ */
+int h2_flush(struct h2_session *session, int socket_desc, size_t *offset);
+
+/**
+ * Returns `true` when the connection can be closed: after a connection
+ * error or GOAWAY, with all streams finished and the output sent.
+ */
+bool h2_done(struct h2_session *session);
+
+/**
+ * Returns `true` if there are no streams in progress and no output.
+ */
+bool h2_idle(struct h2_session *session);
+
+/**
+ * Returns `true` while the session takes input; received data waits while
+ * more than H2_OUTPUT_LIMIT bytes of output are queued for the client.
+ */
+bool h2_reading(struct h2_session *session);
+
+/**
+ * Sends GOAWAY: streams in progress are finished, new ones are refused.
+ */
+void h2_shutdown(struct h2_session *session);
+
+/**
+ * Reads the numbers of HTTP/2 connections and streams since the start.
+ */
+void h2_stats(unsigned long *connections, unsigned long *streams);
+
+
+// TLS ////////////////////////////////////////////////////////////////////////
+
+
+#ifdef CSERVER_TLS
+
+/**
+ * Creates the TLS context from the "tls" settings in config.json:
+ * certificate and key (PEM files), session_cache, tickets and ktls. Without
+ * a certificate the server stays on plain HTTP.
+ *
+ * Parameters:
+ *  - config       Site configuration.
+ *
+ * Returns 0 on success or if TLS is not configured; -1 if the certificate
+ * or the key cannot be loaded.
+ */
+int tls_init(cJSON *config);
+
+/**
+ * Returns `true` if connections are served over TLS.
+ */
+bool tls_enabled();
+
+/**
+ * Frees the TLS context.
+ */
+void tls_free();
+
+/**
+ * Creates the server side TLS session of an accepted connection.
+ *
+ * Returns the session, NULL on failure.
+ */
+SSL *tls_accept(int socket_desc);
+
+/**
+ * Continues the handshake. When it completes, record encryption is handed
+ * to the kernel if the kernel supports TLS offload and "ktls" is enabled.
+ *
+ * Returns 0 when the handshake is complete; POLLIN or POLLOUT if it waits
+ * for the socket; -1 if it fails.
+ */
+int tls_handshake(SSL *tls);
+
+/**
+ * Reads application data. Returns like recv: the number of bytes, 0 when
+ * the peer closed the connection, -1 with errno EAGAIN if the session waits
+ * for the socket.
+ */
+ssize_t tls_recv(SSL *tls, void *buffer, size_t length);
+
+/**
+ * Writes application data; returns like send.
+ */
+ssize_t tls_send(SSL *tls, const void *data, size_t length);
+
+/**
+ * Sends file data: with kernel TLS the file is sent with sendfile without
+ * copies in user space, otherwise it is read and written as records.
+ *
+ * Parameters:
+ *  - tls          TLS session.
+ *  - fd           File descriptor.
+ *  - offset       File offset.
+ *  - length       Bytes to send.
+ *
+ * Returns like send.
+ */
+ssize_t tls_send_file(SSL *tls, int fd, off_t offset, size_t length);
+
+/**
+ * Sends close_notify if the handshake has completed and frees the session.
+ * The socket stays open.
+ */
+void tls_close(SSL *tls);
+
+/**
+ * Reads the numbers of completed handshakes, resumed sessions and
+ * connections with kernel TLS since the start.
+ */
+void tls_stats(unsigned long *handshakes, unsigned long *resumed, unsigned long *offloaded);
+
+#endif
+
+
+// I/O backends ///////////////////////////////////////////////////////////////
+
+
+// Selected with "io" in config.json; each backend falls back to the next
+// one if the system does not support it
+enum io_backend {
+    IO_BACKEND_BLOCKING,            // one connection at a time
+    IO_BACKEND_EPOLL,               // non-blocking sockets, Linux
+    IO_BACKEND_URING                // io_uring, Linux 5.19 or later
+};
+
+/**
+ * Parses the "io" configuration value: "io_uring", "epoll", "blocking"
+ * or "auto".
+ * 
+ * Parameters:
+ *  - name         Configuration value.
+ * 
+ * Returns the preferred backend available on this system.
+ */
+enum io_backend io_backend_parse(const char *name);
+
+/**
+ * Returns the configuration name of the backend.
+ */
+const char *io_backend_name(enum io_backend backend);
+
+
+// Markdown ///////////////////////////////////////////////////////////////////
+
+
+/**
+ * Parses the front matter of a Markdown page. The section ends with a
+ * `---` line or an empty line; an empty line after `---` is skipped too.
+ * 
+ * Parameters:
+ *  - content      Page content.
+ *  - length       Content length.
+ *  - metadata     cJSON object the key/value pairs are added to as strings.
+ * 
+ * Returns the offset of the Markdown body; 0 if there is no front matter.
+ * 
+ * Expected metadata format:
+ * 
+ * ---
+ * key: value
+ * ---
+ * <new line>
+ * Markdown content
+ */
+size_t parse_front_matter(const char *content, size_t length, cJSON *metadata);
+
+/**
+ * Converts markdown content into HTML
+ * 
+ * Parameters:
+ *  - markdown_content A string object containing the Markdown text
+ * 
+ * Returns a string object containing the resulting HTML.
+ */
+string render_markdown(string markdown_content);
+
+
+// Mustache ///////////////////////////////////////////////////////////////////
+
+
+/**
+ * mustach library hook for partials, see mustach-wrap.h
+ */
+int load_partial(const char *name, struct mustach_sbuf *sbuf);
+
+/**
+ * Loads a Mustache template file from a specified path.
+ * 
+ * Parameters:
+ *  - name         The name of the template file (without the extension
+ *                 or path prefix) to load.
+ * 
+ * Returns a string object containing the content of the template file.
+ */
+string load_template(char* name);
+
+// HTML escape implementations; AUTO picks the fastest the CPU supports
+enum html_escape_kernel {
+    HTML_ESCAPE_AUTO,
+    HTML_ESCAPE_SCALAR,
+    HTML_ESCAPE_SSE2,
+    HTML_ESCAPE_AVX2
+};
+
+/**
+ * Selects the HTML escape implementation, for tests and benchmarks.
+ *
+ * Returns 0 on success, -1 if the CPU does not support it.
+ */
+int html_escape_use(enum html_escape_kernel kernel);
+
+/**
+ * Escapes <, >, & and " as HTML entities, the way mustach escapes values.
+ * Runs without special characters are copied a vector at a time.
+ *
+ * Parameters:
+ *  - output       Buffer of at least `length * 6` bytes.
+ *  - input        Text to escape.
+ *  - length       Text length.
+ *
+ * Returns the length of the escaped text.
+ */
+size_t html_escape(char *output, const char *input, size_t length);
+
+/**
+ * Renders a Mustache template using the provided JSON context
+ * 
+ * Parameters:
+ *  - template_content Mustache template content string
+ *  - context          A pointer to a cJSON object that provides the context
+ *                     for rendering the template.
+ * 
+ * The output is written straight into a growing buffer, with values
+ * escaped by html_escape.
+ *
  * Returns a string object containing the rendered output.
  */
 string render_mustache(string template_content, cJSON *context);
@@ -0,0 +1,6 @@
+#!/bin/sh
+# Runs the benchmark suite; pass --help to see the options.
+# JSON results are labeled with the current version.
+label=$(git describe --always --dirty 2>/dev/null)
+cd tests
+./cserver-bench --label "$label" "$@"
@@ -0,0 +1,983 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../cserver.h"
+#include "mustach/mustach-wrap.h"
+#include "mustach/mustach-cjson.h"
+#ifdef CSERVER_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#endif
+
+// Benchmark settings
+struct settings {
+    char sizes[256];            // comma separated page counts
+    double min_time;            // seconds per microbenchmark
+    double load_duration;       // seconds per load test
+    int concurrency;            // load generator connections
+    int slow;                   // misbehaving connections kept open during load tests
+    char label[256];            // version label stored in the results
+    char io[64];                // comma separated I/O backends to load test
+    bool tls;                   // compare plaintext and TLS load tests
+    bool unix_socket;           // compare TCP loopback and Unix socket load tests
+    char output[MAX_PATH_LEN];  // results file, stdout if empty
+    bool keep;                  // keep generated sites
+    bool soak;                  // check memory growth under steady load
+};
+
+// Synthetic site /////////////////////////////////////////////////////////////
+
+static const char *bench_categories[] = { "Articles", "Notes", "Projects", "Talks", "Links" };
+#define BENCH_CATEGORIES (sizeof(bench_categories) / sizeof(bench_categories[0]))
+// Pages per directory
+#define BENCH_DIRECTORY_SIZE 1000
+// Size of the download file, above the file cache map limit
+#define BENCH_DOWNLOAD_SIZE (4 * 1024 * 1024)
+// Entries of the escape-heavy listing
+#define BENCH_LISTING_ENTRIES 2000
+// Pages requested by the soak test, few enough to stay cached
+#define SOAK_PAGES 64
+// Heap growth per request the soak test allows
+#define SOAK_TOLERANCE 16
+
+static int write_text(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fputs(text, file);
+    fclose(file);
+    return 0;
+}
+
+static const char *bench_template =
+    "<!DOCTYPE html>\n<html lang=\"en\">\n  <head>\n    <meta charset=\"utf-8\">\n"
+    "    <title>{{page.title}} - {{config.title}}</title>\n"
+    "    <link rel=\"stylesheet\" href=\"/css/site.css\">\n  </head>\n  <body>\n"
+    "{{>header}}\n{{{content}}}\n{{>footer}}\n  </body>\n</html>\n";
+
+static const char *bench_header =
+    "<header><nav>{{#site.index.category}}<a href=\"/category/{{name}}\">{{title}}</a> {{/site.index.category}}</nav></header>\n";
+
+static const char *bench_footer =
+    "<footer><small>{{page.author}} &middot; {{page.published}}</small></footer>\n";
+
+// Writes page `index` of the synthetic site
+static int write_page(const char *path, int index) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "---\n");
+    fprintf(file, "title: Page %i\n", index);
+    fprintf(file, "author: Author %i\n", index % 17);
+    fprintf(file, "category: %s\n", bench_categories[index % BENCH_CATEGORIES]);
+    fprintf(file, "tags: tag%i, tag%i\n", index % 31, index % 7);
+    fprintf(file, "published: 2024-%02i-%02i\n", index % 12 + 1, index % 28 + 1);
+    fprintf(file, "---\n\n");
+    fprintf(file, "# {{page.title}}\n\n");
+    for (int paragraph = 0; paragraph < 8; paragraph++) {
+        fprintf(file, "Paragraph %i of *page %i* with **strong text**, `code` and a [link](/page-%i). "
+            "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor "
+            "incididunt ut labore et dolore magna aliqua.\n\n", paragraph, index, paragraph);
+    }
+    fprintf(file, "- item one\n- item two\n- item three\n\n");
+    fprintf(file, "```\nint main() { return 0; }\n```\n");
+    fclose(file);
+    return 0;
+}
+
+// Writes config.json; short timeouts cut misbehaving clients off within a load test
+static int write_config(const char *site_path, int port, const char *io, bool tls, bool unix_socket) {
+    char path[MAX_PATH_LEN];
+    char listen[MAX_PATH_LEN + 64] = "";
+    if (unix_socket) {
+        snprintf(listen, sizeof(listen), ", \"listen\": [\"127.0.0.1:%i\", \"unix:%s/bench.sock\"]", port, site_path);
+    }
+    char config[MAX_PATH_LEN + 512];
+    snprintf(config, sizeof(config),
+        "{\"port\": %i, \"title\": \"Benchmark\", \"io\": \"%s\", \"access_log\": {\"sample\": 0}, "
+        "\"limits\": {\"header_timeout\": 1000, \"write_timeout\": 1000}%s%s}\n", port, io,
+        tls ? ", \"tls\": {\"certificate\": \"cert.pem\", \"key\": \"key.pem\"}" : "", listen);
+    snprintf(path, sizeof(path), "%s/config.json", site_path);
+    return write_text(path, config);
+}
+
+// Creates a site with `pages` Markdown pages in a temporary directory
+static int create_site(char *site_path, size_t site_path_len, int pages, int port) {
+    snprintf(site_path, site_path_len, "/tmp/cserver-bench-XXXXXX");
+    if (mkdtemp(site_path) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    char path[MAX_PATH_LEN];
+    const char *directories[] = { "static", "static/css", "static/category", "templates", "templates/partials" };
+    for (size_t i = 0; i < sizeof(directories) / sizeof(directories[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", site_path, directories[i]);
+        mkdir(path, 0755);
+    }
+
+    if (write_config(site_path, port, "auto", false, false) != 0) return -1;
+    snprintf(path, sizeof(path), "%s/templates/default.mustache", site_path);
+    if (write_text(path, bench_template) != 0) return -1;
+    snprintf(path, sizeof(path), "%s/templates/partials/header.mustache", site_path);
+    if (write_text(path, bench_header) != 0) return -1;
+    snprintf(path, sizeof(path), "%s/templates/partials/footer.mustache", site_path);
+    if (write_text(path, bench_footer) != 0) return -1;
+    snprintf(path, sizeof(path), "%s/static/css/site.css", site_path);
+    if (write_text(path, "html,body { font-family: sans-serif; }\n") != 0) return -1;
+    snprintf(path, sizeof(path), "%s/static/category/children.md", site_path);
+    if (write_text(path, "# {{request.page}}\n\n{{#references.pages}}\n- [{{title}}](/{{link}})\n{{/references.pages}}\n") != 0) return -1;
+
+    for (int i = 0; i < pages; i++) {
+        if (i % BENCH_DIRECTORY_SIZE == 0) {
+            snprintf(path, sizeof(path), "%s/static/section-%i", site_path, i / BENCH_DIRECTORY_SIZE);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/static/section-%i/page-%i.md", site_path, i / BENCH_DIRECTORY_SIZE, i);
+        if (write_page(path, i) != 0) return -1;
+    }
+    return 0;
+}
+
+#ifdef CSERVER_TLS
+// Writes a static file too large to be mapped by the file cache
+static int write_download(const char *site_path) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/static/download.bin", site_path);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return -1;
+    char block[65536];
+    memset(block, 'x', sizeof(block));
+    for (int i = 0; i < BENCH_DOWNLOAD_SIZE / (int)sizeof(block); i++) fwrite(block, 1, sizeof(block), file);
+    return fclose(file);
+}
+
+// Writes a self-signed certificate for localhost and its key
+static int write_certificate(const char *site_path) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    int result = -1;
+    if (key != NULL && certificate != NULL) {
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+        X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+        X509_set_pubkey(certificate, key);
+        X509_NAME *name = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(certificate, name);
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/cert.pem", site_path);
+        FILE *certificate_file = X509_sign(certificate, key, EVP_sha256()) > 0 ? fopen(path, "w") : NULL;
+        snprintf(path, sizeof(path), "%s/key.pem", site_path);
+        FILE *key_file = certificate_file ? fopen(path, "w") : NULL;
+        if (key_file && PEM_write_X509(certificate_file, certificate) && PEM_write_PrivateKey(key_file, key, NULL, NULL, 0, NULL, NULL)) {
+            result = 0;
+        }
+        if (certificate_file) fclose(certificate_file);
+        if (key_file) fclose(key_file);
+    }
+    if (result != 0) ERR_print_errors_fp(stderr);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return result;
+}
+#endif
+
+// Removes a directory tree
+static void remove_site(const char *site_path) {
+    DIR *dir = opendir(site_path);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    char path[MAX_PATH_LEN];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", site_path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            remove_site(path);
+        } else {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    rmdir(site_path);
+}
+
+// Microbenchmarks ////////////////////////////////////////////////////////////
+
+typedef void (*bench_function)(void *arg, int iteration);
+
+// Runs `function` until `min_time` passes and adds the results to `results`
+static void run_bench(cJSON *results, const char *name, bench_function function, void *arg, double min_time) {
+    struct histogram *histogram = calloc(1, sizeof(struct histogram));
+    uint64_t start = metrics_now();
+    uint64_t deadline = start + (uint64_t)(min_time * 1e9);
+    uint64_t now = start;
+    int iterations = 0;
+    while (now < deadline || iterations == 0) {
+        uint64_t op_start = now;
+        function(arg, iterations++);
+        now = metrics_now();
+        histogram_record(histogram, now - op_start);
+    }
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "iterations", iterations);
+    cJSON_AddNumberToObject(result, "ns_per_op", (double)(now - start) / iterations);
+    cJSON_AddNumberToObject(result, "p50_ns", histogram_percentile(histogram, 50));
+    cJSON_AddNumberToObject(result, "p99_ns", histogram_percentile(histogram, 99));
+    cJSON_AddItemToObject(results, name, result);
+    fprintf(stderr, "  %-22s %10i iterations %12.0f ns/op\n", name, iterations, (double)(now - start) / iterations);
+    free(histogram);
+}
+
+struct bench_data {
+    int pages;
+    string page;                // Markdown page with metadata
+    string body;                // page content after metadata
+    string html;                // rendered page content
+    string template;
+    cJSON *context;
+    struct site *site;
+    char urls[64][128];
+    string escape_input;        // text with a special character every few words
+    char *escape_output;
+    string listing;             // listing template with escaped values
+    cJSON *listing_context;
+};
+
+static void bench_collect_metadata(void *arg, int iteration) {
+    cJSON *metadata = cJSON_CreateObject();
+    cJSON *pages = cJSON_CreateObject();
+    cJSON *children = cJSON_CreateObject();
+    collect_metadata(metadata, pages, children, "static", NULL);
+    create_index(metadata);
+    cJSON_Delete(children);
+    cJSON_Delete(pages);
+    cJSON_Delete(metadata);
+}
+
+static void bench_resource_path(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    resource_path(data->urls[iteration % 64]);
+}
+
+static void bench_parse_front_matter(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    cJSON *metadata = cJSON_CreateObject();
+    parse_front_matter(data->page.value, data->page.length, metadata);
+    cJSON_Delete(metadata);
+}
+
+static void bench_render_markdown(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    string html = render_markdown(data->body);
+    string_free(html);
+}
+
+static void bench_render_mustache(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    string html = render_mustache(data->template, data->context);
+    string_free(html);
+}
+
+static void bench_html_escape(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    html_escape(data->escape_output, data->escape_input.value, data->escape_input.length);
+}
+
+static void bench_render_listing(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    string html = render_mustache(data->listing, data->listing_context);
+    string_free(html);
+}
+
+// The listing rendered through a memstream with mustach's own escaping
+static void bench_render_listing_stdio(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    char *html = NULL;
+    size_t html_size = 0;
+    FILE *stream = open_memstream(&html, &html_size);
+    mustach_cJSON_file(data->listing.value, data->listing.length, data->listing_context,
+                       Mustach_With_AllExtensions, stream);
+    fclose(stream);
+    free(html);
+}
+
+// Escape-heavy input: a listing of BENCH_LISTING_ENTRIES entries and 64 KB of text
+static void create_escape_data(struct bench_data *data) {
+    const char *words[] = { "Q&A", "templates", "\"fast\"", "paths", "<b>bold</b>", "rendering", "and", "caches" };
+    string text = string_init();
+    for (int i = 0; text.length < 65536; i++) {
+        const char *word = words[i * 7 % 8];
+        text.value = realloc(text.value, text.length + strlen(word) + 2);
+        text.length += sprintf(text.value + text.length, "%s ", word);
+    }
+    data->escape_input = text;
+    data->escape_output = malloc(text.length * 6);
+
+    data->listing = string_make("<ul>\n{{#entries}}<li><a href=\"{{url}}\" title=\"{{title}}\">{{title}}</a>"
+                                "<p>{{summary}}</p></li>\n{{/entries}}</ul>\n");
+    data->listing_context = cJSON_CreateObject();
+    cJSON *entries = cJSON_AddArrayToObject(data->listing_context, "entries");
+    for (int i = 0; i < BENCH_LISTING_ENTRIES; i++) {
+        char title[128], url[64], summary[201];
+        snprintf(title, sizeof(title), "Q&A #%i: \"fast\" <b>paths</b> for templates", i);
+        snprintf(url, sizeof(url), "/notes/page-%i?ref=list&sort=date", i);
+        snprintf(summary, sizeof(summary), "%s", text.value + i % 1024);
+        cJSON *entry = cJSON_CreateObject();
+        cJSON_AddStringToObject(entry, "title", title);
+        cJSON_AddStringToObject(entry, "url", url);
+        cJSON_AddStringToObject(entry, "summary", summary);
+        cJSON_AddItemToArray(entries, entry);
+    }
+}
+
+static void bench_make_response(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    string response = make_response(HTTP_STATUS_200, content_type_html, data->html);
+    string_free(response);
+}
+
+static void bench_render_page(void *arg, int iteration) {
+    struct bench_data *data = arg;
+    cJSON *context = cJSON_CreateObject();
+    cJSON_AddItemReferenceToObject(context, "site", data->site->metadata);
+    char *path = resource_path(data->urls[iteration % 64]);
+    string html = render_page(data->site, context, path);
+    string_free(html);
+    cJSON_Delete(context);
+}
+
+static void run_microbenchmarks(cJSON *results, struct bench_data *data, struct settings *settings) {
+    run_bench(results, "collect_metadata", bench_collect_metadata, data, settings->min_time);
+
+    data->site = site_load();
+    for (int i = 0; i < 64; i++) {
+        int page = (int)((long)i * 7919 % data->pages);
+        snprintf(data->urls[i], sizeof(data->urls[i]), "/section-%i/page-%i", page / BENCH_DIRECTORY_SIZE, page);
+    }
+    run_bench(results, "resource_path", bench_resource_path, data, settings->min_time);
+
+    char *path = resource_path(data->urls[0]);
+    data->page = read_file(path);
+    run_bench(results, "parse_front_matter", bench_parse_front_matter, data, settings->min_time);
+
+    cJSON *page_metadata = cJSON_CreateObject();
+    size_t body = parse_front_matter(data->page.value, data->page.length, page_metadata);
+    data->body = (string){ .value = data->page.value + body, .length = data->page.length - body };
+    run_bench(results, "render_markdown", bench_render_markdown, data, settings->min_time);
+
+    data->html = render_markdown(data->body);
+    data->template = load_template("default");
+    data->context = cJSON_CreateObject();
+    cJSON_AddItemToObject(data->context, "page", page_metadata);
+    cJSON_AddItemReferenceToObject(data->context, "site", data->site->metadata);
+    cJSON_AddStringToObject(data->context, "content", data->html.value);
+    run_bench(results, "render_mustache", bench_render_mustache, data, settings->min_time);
+    run_bench(results, "make_response", bench_make_response, data, settings->min_time);
+    run_bench(results, "render_page", bench_render_page, data, settings->min_time);
+
+    // Escaping: each kernel the CPU supports, then the listing through the
+    // direct buffer with the scalar and the default kernel, and through stdio
+    create_escape_data(data);
+    const char *kernels[] = { NULL, "html_escape_scalar", "html_escape_sse2", "html_escape_avx2" };
+    for (int kernel = HTML_ESCAPE_SCALAR; kernel <= HTML_ESCAPE_AVX2; kernel++) {
+        if (html_escape_use(kernel) != 0) continue;
+        run_bench(results, kernels[kernel], bench_html_escape, data, settings->min_time);
+    }
+    html_escape_use(HTML_ESCAPE_SCALAR);
+    run_bench(results, "render_listing_scalar", bench_render_listing, data, settings->min_time);
+    html_escape_use(HTML_ESCAPE_AUTO);
+    run_bench(results, "render_listing", bench_render_listing, data, settings->min_time);
+    run_bench(results, "render_listing_stdio", bench_render_listing_stdio, data, settings->min_time);
+    string_free(data->escape_input);
+    free(data->escape_output);
+    string_free(data->listing);
+    cJSON_Delete(data->listing_context);
+
+    cJSON_Delete(data->context);
+    site_release(data->site);
+    string_free(data->page);
+    string_free(data->html);
+    string_free(data->template);
+}
+
+// Load generator /////////////////////////////////////////////////////////////
+
+struct load_client {
+    pthread_t thread;
+    int port;
+    uint64_t deadline;
+    int pages;
+    const char *url;            // requested URL, NULL for pages and every fourth time the stylesheet
+    const char *unix_path;      // Unix socket to connect to, NULL for TCP loopback
+    unsigned int seed;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long bytes;
+    struct histogram *latency;
+#ifdef CSERVER_TLS
+    SSL_CTX *tls;               // NULL for plaintext
+    SSL_SESSION *session;       // resumed by the next request
+    unsigned long resumed;
+#endif
+};
+
+// Sends one request and reads the response until the server closes the connection
+static long load_request(struct load_client *client, const char *url) {
+    int socket_desc = socket(client->unix_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (socket_desc < 0) return -1;
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct sockaddr_un unix_address = { .sun_family = AF_UNIX };
+    int connected;
+    if (client->unix_path) {
+        snprintf(unix_address.sun_path, sizeof(unix_address.sun_path), "%s", client->unix_path);
+        connected = connect(socket_desc, (struct sockaddr *)&unix_address, sizeof(unix_address));
+    } else {
+        connected = connect(socket_desc, (struct sockaddr *)&address, sizeof(address));
+    }
+    if (connected != 0) {
+        close(socket_desc);
+        return -1;
+    }
+
+    char request[512];
+    int request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: localhost\r\nUser-Agent: cserver-bench\r\nConnection: close\r\n\r\n", url);
+    char buffer[16384];
+    long total = 0;
+    long received;
+#ifdef CSERVER_TLS
+    if (client->tls != NULL) {
+        SSL *tls = SSL_new(client->tls);
+        SSL_set_fd(tls, socket_desc);
+        if (client->session != NULL) SSL_set_session(tls, client->session);
+        if (SSL_connect(tls) != 1 || SSL_write(tls, request, request_len) != request_len) {
+            SSL_free(tls);
+            close(socket_desc);
+            return -1;
+        }
+        if (SSL_session_reused(tls)) client->resumed++;
+        while ((received = SSL_read(tls, buffer, sizeof(buffer))) > 0) {
+            if (total == 0 && strncmp(buffer, "HTTP/1.1 200", 12) != 0) total = -1;
+            if (total >= 0) total += received;
+        }
+        // TLS 1.3 tickets arrive after the handshake; a session stays
+        // resumable only after close_notify
+        SSL_shutdown(tls);
+        SSL_SESSION_free(client->session);
+        client->session = SSL_get1_session(tls);
+        SSL_free(tls);
+        close(socket_desc);
+        return received < 0 ? -1 : total;
+    }
+#endif
+    if (send(socket_desc, request, request_len, 0) != request_len) {
+        close(socket_desc);
+        return -1;
+    }
+
+    while ((received = recv(socket_desc, buffer, sizeof(buffer), 0)) > 0) {
+        if (total == 0 && strncmp(buffer, "HTTP/1.1 200", 12) != 0) total = -1;
+        if (total >= 0) total += received;
+    }
+    close(socket_desc);
+    return received < 0 ? -1 : total;
+}
+
+static void *load_client_thread(void *arg) {
+    struct load_client *client = arg;
+    char url[128];
+    while (metrics_now() < client->deadline) {
+        // Every fourth request is a static asset
+        int page = rand_r(&client->seed) % client->pages;
+        if (client->url != NULL) {
+            snprintf(url, sizeof(url), "%s", client->url);
+        } else if (page % 4 == 0) {
+            snprintf(url, sizeof(url), "/css/site.css");
+        } else {
+            snprintf(url, sizeof(url), "/section-%i/page-%i", page / BENCH_DIRECTORY_SIZE, page);
+        }
+        uint64_t start = metrics_now();
+        long bytes = load_request(client, url);
+        if (bytes < 0) {
+            client->errors++;
+            continue;
+        }
+        histogram_record(client->latency, metrics_now() - start);
+        client->requests++;
+        client->bytes += bytes;
+    }
+    return NULL;
+}
+
+// Misbehaving clients: idle connections, headers sent a byte at a time and
+// readers that never drain the response. Each one holds its connection until
+// the server closes it, then opens another.
+struct slow_client {
+    pthread_t thread;
+    int port;
+    uint64_t deadline;
+    int kind;
+    unsigned long connections;
+    unsigned long closed;       // connections the server ended first
+};
+
+static void *slow_client_thread(void *arg) {
+    struct slow_client *client = arg;
+    const char *request = "GET /css/site.css HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    while (metrics_now() < client->deadline) {
+        int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+        if (socket_desc < 0) break;
+        int buffer_size = 1024;
+        setsockopt(socket_desc, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        struct timeval interval = { .tv_sec = 0, .tv_usec = 200000 };
+        setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, &interval, sizeof(interval));
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(socket_desc, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            close(socket_desc);
+            continue;
+        }
+        client->connections++;
+        if (client->kind == 2) send(socket_desc, request, strlen(request), MSG_NOSIGNAL);
+
+        size_t position = 0;
+        bool closed = false;
+        while (!closed && metrics_now() < client->deadline) {
+            char byte;
+            if (client->kind == 1 && position < strlen(request) - 2) {
+                // Never completes the header
+                if (send(socket_desc, &request[position++], 1, MSG_NOSIGNAL) != 1) closed = true;
+            }
+            // Reads a byte per interval; recv times out while the server keeps the connection
+            ssize_t received = recv(socket_desc, &byte, 1, 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) closed = true;
+            if (received > 0 && client->kind != 2) closed = true;
+            if (received > 0) nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 200000000 }, NULL);
+        }
+        if (closed) client->closed++;
+        close(socket_desc);
+    }
+    return NULL;
+}
+
+// Returns a free TCP port on the loopback interface
+static int free_port() {
+    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = 0 };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    int port = -1;
+    if (bind(socket_desc, (struct sockaddr *)&address, address_len) == 0 &&
+        getsockname(socket_desc, (struct sockaddr *)&address, &address_len) == 0) {
+        port = ntohs(address.sin_port);
+    }
+    close(socket_desc);
+    return port;
+}
+
+// Waits until the server accepts connections; big sites take a while to index
+static int wait_for_server(int port, pid_t pid) {
+    while (1) {
+        int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int connected = connect(socket_desc, (struct sockaddr *)&address, sizeof(address));
+        close(socket_desc);
+        if (connected == 0) return 0;
+        if (waitpid(pid, NULL, WNOHANG) == pid) return -1;
+        struct timespec delay = { .tv_sec = 0, .tv_nsec = 100000000 };
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Starts the server in a child process, returns its pid or -1
+static pid_t fork_server(char *site_path, int port, const char *io, bool tls, bool unix_socket) {
+    write_config(site_path, port, io, tls, unix_socket);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Server process; CLI mode keeps it attached to the benchmark
+        freopen("/dev/null", "w", stdout);
+        exit(start_server(site_path, true));
+    }
+    if (pid < 0 || wait_for_server(port, pid) != 0) {
+        fprintf(stderr, "Failed to start the server\n");
+        return -1;
+    }
+    return pid;
+}
+
+// Load test of one kind: "pages", "static" or "download"; over a Unix
+// socket with `unix_socket`
+static void run_load(cJSON *results, char *site_path, int port, int pages, struct settings *settings,
+                     const char *io, const char *kind, bool tls, bool unix_socket) {
+    pid_t pid = fork_server(site_path, port, io, tls, unix_socket);
+    if (pid < 0) return;
+    char unix_path[MAX_PATH_LEN];
+    snprintf(unix_path, sizeof(unix_path), "%s/bench.sock", site_path);
+
+    struct load_client *clients = calloc(settings->concurrency, sizeof(struct load_client));
+    struct slow_client *slow_clients = calloc(settings->slow, sizeof(struct slow_client));
+    uint64_t start = metrics_now();
+    uint64_t deadline = start + (uint64_t)(settings->load_duration * 1e9);
+    for (int i = 0; i < settings->slow; i++) {
+        slow_clients[i].port = port;
+        slow_clients[i].deadline = deadline;
+        slow_clients[i].kind = i % 3;
+        pthread_create(&slow_clients[i].thread, NULL, slow_client_thread, &slow_clients[i]);
+    }
+    for (int i = 0; i < settings->concurrency; i++) {
+        clients[i].port = port;
+        clients[i].deadline = deadline;
+        clients[i].pages = pages;
+        clients[i].url = strcmp(kind, "static") == 0 ? "/css/site.css" :
+                         strcmp(kind, "download") == 0 ? "/download.bin" : NULL;
+        clients[i].unix_path = unix_socket ? unix_path : NULL;
+#ifdef CSERVER_TLS
+        if (tls) {
+            clients[i].tls = SSL_CTX_new(TLS_client_method());
+            SSL_CTX_set_options(clients[i].tls, SSL_OP_IGNORE_UNEXPECTED_EOF);
+        }
+#endif
+        clients[i].seed = i + 1;
+        clients[i].latency = calloc(1, sizeof(struct histogram));
+        pthread_create(&clients[i].thread, NULL, load_client_thread, &clients[i]);
+    }
+
+    struct histogram *latency = calloc(1, sizeof(struct histogram));
+    unsigned long requests = 0, errors = 0, bytes = 0, resumed = 0;
+    for (int i = 0; i < settings->concurrency; i++) {
+        pthread_join(clients[i].thread, NULL);
+        histogram_merge(latency, clients[i].latency);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        free(clients[i].latency);
+#ifdef CSERVER_TLS
+        resumed += clients[i].resumed;
+        SSL_SESSION_free(clients[i].session);
+        SSL_CTX_free(clients[i].tls);
+#endif
+    }
+    double elapsed = (metrics_now() - start) / 1e9;
+    unsigned long slow_connections = 0, slow_closed = 0;
+    for (int i = 0; i < settings->slow; i++) {
+        pthread_join(slow_clients[i].thread, NULL);
+        slow_connections += slow_clients[i].connections;
+        slow_closed += slow_clients[i].closed;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "concurrency", settings->concurrency);
+    cJSON_AddNumberToObject(result, "duration_s", elapsed);
+    cJSON_AddNumberToObject(result, "requests", requests);
+    cJSON_AddNumberToObject(result, "errors", errors);
+    cJSON_AddNumberToObject(result, "requests_per_s", requests / elapsed);
+    cJSON_AddNumberToObject(result, "bytes_per_s", bytes / elapsed);
+    cJSON_AddNumberToObject(result, "p50_ns", histogram_percentile(latency, 50));
+    cJSON_AddNumberToObject(result, "p90_ns", histogram_percentile(latency, 90));
+    cJSON_AddNumberToObject(result, "p99_ns", histogram_percentile(latency, 99));
+    cJSON_AddNumberToObject(result, "max_ns", histogram_percentile(latency, 100));
+    if (tls) cJSON_AddNumberToObject(result, "resumed", resumed);
+    if (settings->slow > 0) {
+        cJSON_AddNumberToObject(result, "slow_clients", settings->slow);
+        cJSON_AddNumberToObject(result, "slow_connections", slow_connections);
+        cJSON_AddNumberToObject(result, "slow_closed", slow_closed);
+    }
+    cJSON_AddItemToObject(results, kind, result);
+    char name[64];
+    snprintf(name, sizeof(name), "load %s %s%s", io, tls ? "tls " : unix_socket ? "unix " : "", kind);
+    fprintf(stderr, "  %-26s %10.0f requests/s, %8.1f MB/s, p99 %.0f us, %lu errors\n",
+        name, requests / elapsed, bytes / elapsed / 1e6, histogram_percentile(latency, 99) / 1e3, errors);
+
+    if (settings->slow > 0) {
+        fprintf(stderr, "  %-26s %10lu slow connections, %lu closed by the server\n", "", slow_connections, slow_closed);
+    }
+
+    free(latency);
+    free(clients);
+    free(slow_clients);
+}
+
+// Memory soak test /////////////////////////////////////////////////////////////
+
+// Reads a metric without labels from the metrics page, -1 if it is missing
+static double read_metric(int port, const char *name) {
+    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_desc < 0) return -1;
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *request = "GET " METRICS_PATH " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    if (connect(socket_desc, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        send(socket_desc, request, strlen(request), 0) != (ssize_t)strlen(request)) {
+        close(socket_desc);
+        return -1;
+    }
+    size_t capacity = 65536, length = 0;
+    char *page = malloc(capacity);
+    ssize_t received;
+    while ((received = recv(socket_desc, page + length, capacity - length - 1, 0)) > 0) {
+        length += received;
+        if (length + 1 == capacity) page = realloc(page, capacity *= 2);
+    }
+    close(socket_desc);
+    page[length] = '\0';
+
+    double value = -1;
+    size_t name_length = strlen(name);
+    for (char *line = page; line != NULL; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (strncmp(line, name, name_length) == 0 && line[name_length] == ' ') {
+            value = atof(line + name_length + 1);
+            break;
+        }
+    }
+    free(page);
+    return value;
+}
+
+// Sums cserver_memory_json_bytes over all subsystems
+static double read_json_bytes(int port) {
+    double total = 0;
+    for (int subsystem = 0; subsystem < MEMORY_SUBSYSTEMS; subsystem++) {
+        char name[128];
+        snprintf(name, sizeof(name), "cserver_memory_json_bytes{subsystem=\"%s\"}", memory_subsystem_name(subsystem));
+        double bytes = read_metric(port, name);
+        if (bytes < 0) return -1;
+        total += bytes;
+    }
+    return total;
+}
+
+// Runs the load generator for `duration` seconds, returns the request count
+static unsigned long soak_load(int port, int pages, int concurrency, double duration) {
+    struct load_client *clients = calloc(concurrency, sizeof(struct load_client));
+    uint64_t deadline = metrics_now() + (uint64_t)(duration * 1e9);
+    for (int i = 0; i < concurrency; i++) {
+        clients[i].port = port;
+        clients[i].deadline = deadline;
+        clients[i].pages = pages;
+        clients[i].seed = i + 1;
+        clients[i].latency = calloc(1, sizeof(struct histogram));
+        pthread_create(&clients[i].thread, NULL, load_client_thread, &clients[i]);
+    }
+    unsigned long requests = 0;
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        free(clients[i].latency);
+    }
+    free(clients);
+    return requests;
+}
+
+// Serves a fixed set of pages until the caches are warm, then checks that
+// the heap and the live cJSON allocations stay flat for the load duration.
+// Returns -1 if either grows by more than SOAK_TOLERANCE bytes per request.
+static int run_soak(cJSON *results, char *site_path, int port, int pages, struct settings *settings, const char *io) {
+    pid_t pid = fork_server(site_path, port, io, false, false);
+    if (pid < 0) return -1;
+
+    // Few enough pages for every one to be cached during the warm-up
+    int soak_pages = pages < SOAK_PAGES ? pages : SOAK_PAGES;
+    double warm_up = settings->load_duration / 4 > 1 ? settings->load_duration / 4 : 1;
+    soak_load(port, soak_pages, settings->concurrency, warm_up);
+    double heap_start = read_metric(port, "cserver_memory_heap_bytes");
+    double json_start = read_json_bytes(port);
+    unsigned long requests = soak_load(port, soak_pages, settings->concurrency, settings->load_duration);
+    double heap_end = read_metric(port, "cserver_memory_heap_bytes");
+    double json_end = read_json_bytes(port);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    if (requests == 0 || heap_start < 0 || json_start < 0) {
+        fprintf(stderr, "  %-26s no requests or metrics\n", "soak");
+        return -1;
+    }
+    double heap_growth = (heap_end - heap_start) / requests;
+    double json_growth = (json_end - json_start) / requests;
+    bool passed = heap_growth <= SOAK_TOLERANCE && json_growth <= SOAK_TOLERANCE;
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddNumberToObject(result, "requests", requests);
+    cJSON_AddNumberToObject(result, "heap_start", heap_start);
+    cJSON_AddNumberToObject(result, "heap_end", heap_end);
+    cJSON_AddNumberToObject(result, "json_start", json_start);
+    cJSON_AddNumberToObject(result, "json_end", json_end);
+    cJSON_AddNumberToObject(result, "heap_bytes_per_request", heap_growth);
+    cJSON_AddNumberToObject(result, "json_bytes_per_request", json_growth);
+    cJSON_AddBoolToObject(result, "passed", passed);
+    cJSON_AddItemToObject(results, "soak", result);
+    char name[64];
+    snprintf(name, sizeof(name), "soak %s", io);
+    fprintf(stderr, "  %-26s %10lu requests, heap %+.2f bytes/request, cJSON %+.2f bytes/request%s\n",
+        name, requests, heap_growth, json_growth, passed ? "" : ", FAILED");
+    return passed ? 0 : -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void print_usage() {
+    printf("Usage: cserver-bench [options]\n");
+    printf("  --sizes <n,n,...>     Site sizes in pages (default 1000,10000,100000)\n");
+    printf("  --time <seconds>      Minimum time per microbenchmark (default 1)\n");
+    printf("  --duration <seconds>  Load test duration (default 5)\n");
+    printf("  --concurrency <n>     Load test connections (default 8)\n");
+    printf("  --slow <n>            Misbehaving connections kept open during load tests (default 0)\n");
+    printf("  --io <name,name,...>  I/O backends to load test (default blocking,epoll,io_uring)\n");
+    printf("  --tls                 Compare plaintext and TLS load tests, with a large download (build with TLS=1)\n");
+    printf("  --unix                Compare TCP loopback and Unix socket load tests\n");
+    printf("  --label <text>        Version label stored in the results\n");
+    printf("  --output <file>       Write JSON results to a file instead of stdout\n");
+    printf("  --keep                Keep generated sites\n");
+    printf("  --soak                Check heap growth under steady load; fails above %i bytes/request\n",
+           SOAK_TOLERANCE);
+}
+
+int main(int argc, char **argv) {
+    memory_init();
+    struct settings settings = {
+        .sizes = "1000,10000,100000", .min_time = 1, .load_duration = 5, .concurrency = 8,
+        .label = "", .io = "blocking,epoll,io_uring", .output = "", .keep = false
+    };
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--sizes") == 0 && has_value) {
+            snprintf(settings.sizes, sizeof(settings.sizes), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--time") == 0 && has_value) {
+            settings.min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && has_value) {
+            settings.load_duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--concurrency") == 0 && has_value) {
+            settings.concurrency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slow") == 0 && has_value) {
+            settings.slow = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io") == 0 && has_value) {
+            snprintf(settings.io, sizeof(settings.io), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--tls") == 0) {
+#ifndef CSERVER_TLS
+            fprintf(stderr, "--tls needs a build with TLS=1\n");
+            return EXIT_FAILURE;
+#endif
+            settings.tls = true;
+        } else if (strcmp(argv[i], "--unix") == 0) {
+            settings.unix_socket = true;
+        } else if (strcmp(argv[i], "--label") == 0 && has_value) {
+            snprintf(settings.label, sizeof(settings.label), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            snprintf(settings.output, sizeof(settings.output), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            settings.keep = true;
+        } else if (strcmp(argv[i], "--soak") == 0) {
+            settings.soak = true;
+        } else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (settings.concurrency < 1) settings.concurrency = 1;
+    if (settings.slow < 0) settings.slow = 0;
+
+    char cwd[MAX_PATH_LEN];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return EXIT_FAILURE;
+    signal(SIGPIPE, SIG_IGN);
+
+    cJSON *output = cJSON_CreateObject();
+    cJSON_AddStringToObject(output, "label", settings.label);
+    cJSON_AddNumberToObject(output, "timestamp", (double)time(NULL));
+    cJSON *runs = cJSON_AddArrayToObject(output, "runs");
+    bool soak_failed = false;
+
+    // collect_metadata uses strtok, keep a separate state here
+    char *sizes = strdup(settings.sizes);
+    char *sizes_state = NULL;
+    for (char *size = strtok_r(sizes, ",", &sizes_state); size != NULL; size = strtok_r(NULL, ",", &sizes_state)) {
+        struct bench_data data = { .pages = atoi(size) };
+        if (data.pages < 1) continue;
+
+        char site_path[MAX_PATH_LEN];
+        int port = free_port();
+        fprintf(stderr, "Site with %i pages\n", data.pages);
+        if (create_site(site_path, sizeof(site_path), data.pages, port) != 0) {
+            remove_site(site_path);
+            continue;
+        }
+#ifdef CSERVER_TLS
+        if (settings.tls && (write_download(site_path) != 0 || write_certificate(site_path) != 0)) {
+            remove_site(site_path);
+            continue;
+        }
+#endif
+
+        cJSON *run = cJSON_CreateObject();
+        cJSON_AddNumberToObject(run, "pages", data.pages);
+        cJSON *benchmarks = cJSON_AddObjectToObject(run, "benchmarks");
+        chdir(site_path);
+        mustach_wrap_get_partial = load_partial;
+        run_microbenchmarks(benchmarks, &data, &settings);
+        // Mixed pages and the static fast path for each I/O backend
+        cJSON *load = cJSON_AddObjectToObject(benchmarks, "load");
+        char *backends = strdup(settings.io);
+        char *backends_state = NULL;
+        for (char *io = strtok_r(backends, ",", &backends_state); io != NULL; io = strtok_r(NULL, ",", &backends_state)) {
+            cJSON *backend = cJSON_AddObjectToObject(load, io);
+            run_load(backend, site_path, port, data.pages, &settings, io, "pages", false, false);
+            run_load(backend, site_path, port, data.pages, &settings, io, "static", false, false);
+            if (settings.unix_socket) {
+                // The same load without the TCP stack
+                cJSON *unix_socket = cJSON_AddObjectToObject(backend, "unix");
+                run_load(unix_socket, site_path, port, data.pages, &settings, io, "pages", false, true);
+                run_load(unix_socket, site_path, port, data.pages, &settings, io, "static", false, true);
+            }
+            if (settings.soak && run_soak(backend, site_path, port, data.pages, &settings, io) != 0) {
+                soak_failed = true;
+            }
+            if (!settings.tls) continue;
+            // The same load over TLS; io_uring serves TLS with epoll
+            run_load(backend, site_path, port, data.pages, &settings, io, "download", false, false);
+            if (strcmp(io, "io_uring") == 0) continue;
+            cJSON *tls = cJSON_AddObjectToObject(backend, "tls");
+            run_load(tls, site_path, port, data.pages, &settings, io, "pages", true, false);
+            run_load(tls, site_path, port, data.pages, &settings, io, "static", true, false);
+            run_load(tls, site_path, port, data.pages, &settings, io, "download", true, false);
+        }
+        free(backends);
+        chdir(cwd);
+        cJSON_AddItemToArray(runs, run);
+
+        if (!settings.keep) remove_site(site_path);
+    }
+    free(sizes);
+
+    char *json = cJSON_Print(output);
+    if (settings.output[0]) {
+        write_text(settings.output, json);
+    } else {
+        printf("%s\n", json);
+    }
+    cJSON_free(json);
+    cJSON_Delete(output);
+    return soak_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
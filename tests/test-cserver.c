@@ -1,6 +1,26 @@
+#define _GNU_SOURCE                 // memmem
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef CSERVER_TLS
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "../cserver.h" 
 
 // Test definitions
@@ -87,6 +107,1408 @@ int test_get_content_type() {
     return 0;
 }
 
+int test_request_header() {
+    printf("- test_request_header ");
+    const char *request = "GET / HTTP/1.1\r\nHost: localhost\r\nuser-agent:  curl/8.0\r\n\r\n";
+    char value[64];
+    if (request_header(request, "User-Agent", value, sizeof(value)) != 0 || strcmp(value, "curl/8.0") != 0 ||
+        request_header(request, "Referer", value, sizeof(value)) != -1 || value[0] != '\0') {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_front_matter() {
+    printf("- test_front_matter ");
+    const char *pages[] = {
+        "---\ntitle: One\n---\n\n# Body",
+        "---\r\ntitle : One\r\n---\r\n# Body",
+        "---\ntitle: One\n\n# Body",
+        "# Body",
+    };
+    size_t bodies[] = { 20, 23, 16, 0 };
+    int failed = 0;
+    for (int i = 0; i < 4; i++) {
+        cJSON *metadata = cJSON_CreateObject();
+        size_t body = parse_front_matter(pages[i], strlen(pages[i]), metadata);
+        const char *title = read_string(metadata, "title", "");
+        failed |= body != bodies[i] || strcmp(title, i < 3 ? "One" : "") != 0;
+        cJSON_Delete(metadata);
+    }
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_html_escape() {
+    printf("- test_html_escape ");
+    // Each special character at every position around the vector widths
+    const char specials[] = "<>&\"";
+    const char *entities[] = { "&lt;", "&gt;", "&amp;", "&quot;" };
+    char input[80], output[80 * 6], expected[80 * 6];
+    int failed = 0;
+    for (int kernel = HTML_ESCAPE_SCALAR; kernel <= HTML_ESCAPE_AVX2; kernel++) {
+        if (html_escape_use(kernel) != 0) continue;
+        for (size_t length = 0; length <= sizeof(input); length++) {
+            for (size_t position = 0; position < length; position++) {
+                int special = (length + position) % 4;
+                memset(input, 'a', length);
+                input[position] = specials[special];
+                // A second one in the same block
+                if (position + 3 < length) input[position + 3] = '&';
+                size_t expected_length = 0;
+                for (size_t i = 0; i < length; i++) {
+                    const char *found = strchr(specials, input[i]);
+                    if (found) {
+                        const char *entity = entities[found - specials];
+                        memcpy(expected + expected_length, entity, strlen(entity));
+                        expected_length += strlen(entity);
+                    } else {
+                        expected[expected_length++] = input[i];
+                    }
+                }
+                size_t output_length = html_escape(output, input, length);
+                failed |= output_length != expected_length || memcmp(output, expected, output_length) != 0;
+            }
+        }
+    }
+    html_escape_use(HTML_ESCAPE_AUTO);
+
+    cJSON *context = cJSON_Parse("{\"title\": \"Tom & \\\"Jerry\\\" <3\", \"raw\": \"<b>\"}");
+    string template = string_make("<p>{{title}}</p>{{{raw}}}{{&raw}}");
+    string html = render_mustache(template, context);
+    failed |= html.value == NULL || strcmp(html.value, "<p>Tom &amp; &quot;Jerry&quot; &lt;3</p><b><b>") != 0;
+    string_free(html);
+    string_free(template);
+    cJSON_Delete(context);
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_memory() {
+    printf("- test_memory ");
+    enum memory_subsystem previous = memory_enter(MEMORY_REQUEST);
+    struct memory_stats before, during, after;
+    memory_stats(MEMORY_REQUEST, &before);
+    cJSON *object = cJSON_CreateObject();
+    cJSON_AddStringToObject(object, "title", "One");
+    memory_stats(MEMORY_REQUEST, &during);
+    cJSON_Delete(object);
+    string text = string_make("text");
+    memory_stats(MEMORY_REQUEST, &after);
+    string_free(text);
+    memory_leave(previous);
+    if (during.json_allocations < before.json_allocations + 3 || during.json_bytes <= before.json_bytes ||
+        after.json_bytes != before.json_bytes || after.string_allocations != before.string_allocations + 1) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_format_access_log_entry() {
+    printf("- test_format_access_log_entry ");
+    struct access_log_entry entry = { .status = 200, .bytes = 13, .duration_us = 42 };
+    strcpy(entry.client, "127.0.0.1");
+    strcpy(entry.method, "GET");
+    strcpy(entry.url, "/\"quoted\"");
+    strcpy(entry.protocol, "HTTP/2");
+    strcpy(entry.user_agent, "curl/8.0");
+    char line[1024];
+    size_t length = format_access_log_entry(line, sizeof(line), &entry, ACCESS_LOG_COMBINED);
+    if (length == 0 || strncmp(line, "127.0.0.1 - - [", 15) != 0 ||
+        strstr(line, " HTTP/2\" 200 13 \"-\" \"curl/8.0\"\n") == NULL) {
+        printf("failed: %s\n", line);
+        return 1;
+    }
+    length = format_access_log_entry(line, sizeof(line), &entry, ACCESS_LOG_JSON);
+    if (length == 0 || line[length - 1] != '\n' ||
+        strstr(line, "\"url\":\"/\\\"quoted\\\"\",\"protocol\":\"HTTP/2\"") == NULL ||
+        strstr(line, "\"status\":200,\"bytes\":13") == NULL) {
+        printf("failed: %s\n", line);
+        return 1;
+    }
+    // Too small buffer
+    if (format_access_log_entry(line, 16, &entry, ACCESS_LOG_JSON) != 0) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_trace() {
+    printf("- test_trace ");
+    const char *path = "/tmp/cserver-test-trace.json";
+    unlink(path);
+    // The header is off unless configured
+    cJSON *config = cJSON_Parse("{\"trace\": {\"path\": \"/tmp/cserver-test-trace.json\"}}");
+    int failed = trace_open(config) != 0;
+    failed |= trace_start("GET / HTTP/1.1\r\nX-Trace: 1\r\n\r\n") != NULL;
+    trace_close();
+    cJSON_Delete(config);
+    config = cJSON_Parse("{\"trace\": {\"path\": \"/tmp/cserver-test-trace.json\", "
+        "\"header\": \"X-Trace\", \"secret\": \"s3cret\", \"max_size\": 4096}}");
+    failed |= trace_open(config) != 0;
+    // Without sampling only requests with the header and the secret are traced
+    failed |= trace_start("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n") != NULL;
+    failed |= trace_start("GET / HTTP/1.1\r\nX-Trace: 1\r\n\r\n") != NULL;
+    struct trace *trace = trace_start("GET / HTTP/1.1\r\nX-Trace: s3cret\r\n\r\n");
+    failed |= trace == NULL;
+    uint64_t request_start = metrics_now();
+    trace_begin("render_page");
+    trace_begin("render_markdown");
+    trace_end();
+    trace_end();
+    trace_sending(trace);
+    trace_begin("ignored");
+    trace_end();
+    struct access_log_entry entry = { .status = 200, .bytes = 5 };
+    trace_finish(trace, &entry, "GET", "/", request_start);
+    // Requests stop being traced once the file reaches max_size
+    for (int i = 0; i < 100; i++) {
+        trace = trace_start("GET / HTTP/1.1\r\nX-Trace: s3cret\r\n\r\n");
+        if (trace == NULL) break;
+        trace_finish(trace, &entry, "GET", "/", metrics_now());
+    }
+    failed |= trace != NULL;
+    trace_close();
+    cJSON_Delete(config);
+    struct stat file_stat;
+    failed |= stat(path, &file_stat) != 0 || file_stat.st_size > 4096;
+
+    string content = read_file(path);
+    failed |= content.value == NULL || strncmp(content.value, "[\n", 2) != 0 ||
+        strstr(content.value, "\"name\":\"render_markdown\"") == NULL ||
+        strstr(content.value, "\"name\":\"send\"") == NULL ||
+        strstr(content.value, "\"status\":200") == NULL || strstr(content.value, "ignored") != NULL;
+    string_free(content);
+    unlink(path);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_histogram() {
+    printf("- test_histogram ");
+    // Every value must fall below its bucket limit and above the previous one
+    for (uint64_t value = 0; value < 100000; value += 7) {
+        size_t bucket = histogram_bucket(value);
+        if (value >= histogram_bucket_limit(bucket) ||
+            (bucket > 0 && value < histogram_bucket_limit(bucket - 1))) {
+            printf("failed: value %llu, bucket %zu.\n", (unsigned long long)value, bucket);
+            return 1;
+        }
+    }
+    struct histogram *histogram = calloc(1, sizeof(struct histogram));
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram_record(histogram, value);
+    }
+    uint64_t median = histogram_percentile(histogram, 50);
+    uint64_t p99 = histogram_percentile(histogram, 99);
+    free(histogram);
+    // 3 sub-bucket bits give 12.5% precision
+    if (median < 500 || median > 563 || p99 < 990 || p99 > 1114) {
+        printf("failed: p50 %llu, p99 %llu.\n", (unsigned long long)median, (unsigned long long)p99);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+// Temporary site directory; tests run in it like `cserver run` in a site
+struct temp_site {
+    char directory[32];
+    char cwd[4096];
+};
+
+// Creates an empty directory and makes it the working directory
+static bool temp_site_create(struct temp_site *temp) {
+    strcpy(temp->directory, "/tmp/cserver-test-XXXXXX");
+    return mkdtemp(temp->directory) != NULL && getcwd(temp->cwd, sizeof(temp->cwd)) != NULL &&
+        chdir(temp->directory) == 0;
+}
+
+// Removes a directory tree
+static void remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    char child[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            remove_tree(child);
+        } else {
+            unlink(child);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+// Goes back to the previous working directory and removes the site with
+// whatever the test left in it
+static void temp_site_remove(struct temp_site *temp) {
+    chdir(temp->cwd);
+    remove_tree(temp->directory);
+}
+
+int test_registry() {
+    printf("- test_registry ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    setenv("XDG_RUNTIME_DIR", temp.directory, 1);
+
+    // An exited process
+    pid_t exited = fork();
+    if (exited == 0) _exit(0);
+    waitpid(exited, NULL, 0);
+
+    registry_add(getpid(), "/srv/site", 8080, time(NULL));
+    registry_add(exited, "/srv/other", 8081, time(NULL));
+    cJSON *instances = registry_list();
+    cJSON *instance = cJSON_GetArrayItem(instances, 0);
+    int count = cJSON_GetArraySize(instances);
+    int failed = count != 1 || read_int(instance, "pid", 0) != getpid() ||
+        strcmp(read_string(instance, "path", ""), "/srv/site") != 0 ||
+        read_int(instance, "port", 0) != 8080 || registry_read(exited) != NULL;
+    cJSON_Delete(instances);
+
+    registry_remove(getpid());
+    instances = registry_list();
+    failed |= cJSON_GetArraySize(instances) != 0;
+    cJSON_Delete(instances);
+
+    temp_site_remove(&temp);
+    unsetenv("XDG_RUNTIME_DIR");
+    if (failed) {
+        printf("failed: %i instances listed.\n", count);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_rate_limit() {
+    printf("- test_rate_limit ");
+    cJSON *config = cJSON_Parse("{\"rate_limits\": {\"entries\": 64, \"rules\": {"
+                                "\"/\": {\"rate\": 1, \"burst\": 2}, \"/css/\": {\"rate\": 0}, "
+                                "\"/poll/\": {\"rate\": 1, \"burst\": 1}, \"/slow/\": {\"rate\": 0.001}}}}");
+    if (rate_limits_init(config) != 0) {
+        cJSON_Delete(config);
+        printf("failed: no rate limit table.\n");
+        return 1;
+    }
+    struct client_address client, other, unknown = { { 0 } };
+    client_address_parse(&client, "10.0.0.1");
+    client_address_parse(&other, "2001:db8::1");
+    unsigned retry_after = 0;
+    int failed = !rate_limit_admit(config, &client, "/", &retry_after) ||
+        !rate_limit_admit(config, &client, "/about", &retry_after) ||
+        rate_limit_admit(config, &client, "/", &retry_after) || retry_after != 1 ||
+        !rate_limit_admit(config, &other, "/", &retry_after) ||
+        !rate_limit_admit(config, &client, "/css/site.css", &retry_after);
+    // Clients of Unix sockets without a PROXY header are not limited
+    for (int i = 0; i < 4; i++) failed |= !rate_limit_admit(config, &unknown, "/", &retry_after);
+    unsigned long limited, evicted;
+    rate_limits_stats(&limited, &evicted);
+    failed |= limited != 1;
+
+    // Rates below one token per request interval still add up
+    failed |= !rate_limit_admit(config, &other, "/slow/", &retry_after) ||
+        rate_limit_admit(config, &other, "/slow/", &retry_after) || retry_after != 1000;
+    int admitted = 0, polls = 0;
+    uint64_t start = metrics_now();
+    while (metrics_now() - start < 1100000000ULL) {
+        admitted += rate_limit_admit(config, &other, "/poll/", &retry_after);
+        polls++;
+        usleep(2000);
+    }
+    cJSON_Delete(config);
+    if (failed || admitted != 2) {
+        printf("failed: %i of %i polls admitted.\n", admitted, polls);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_limits() {
+    printf("- test_limits ");
+    // Negative values disable the caps and the timeouts
+    cJSON *config = cJSON_Parse("{\"limits\": {\"connections\": -1, \"connections_per_client\": -5, "
+                                "\"header_timeout\": -1000, \"write_timeout\": 0, \"min_rate\": -10}}");
+    struct connection_limits limits;
+    int failed = limits_init(&limits, config) != 0 || limits.max_connections != 0 || limits.max_per_client != 0 ||
+        limits.header_timeout != 0 || limits.write_timeout != 0 || limits.min_rate != 0 || limits.clients != NULL;
+    limits_free(&limits);
+    cJSON_Delete(config);
+
+    // Short timeouts take a tick; the per-client cap works without the
+    // global one, past the initial size of its table
+    config = cJSON_Parse("{\"limits\": {\"connections\": 0, \"connections_per_client\": 2, \"header_timeout\": 50}}");
+    failed |= limits_init(&limits, config) != 0 || limits.header_timeout != 1 || limits.clients == NULL;
+    struct client_address client;
+    client_address_parse(&client, "10.0.0.1");
+    failed |= !limits_admit(&limits, &client) || !limits_admit(&limits, &client) || limits_admit(&limits, &client);
+    for (int i = 1; i <= LIMIT_CONNECTIONS * 2; i++) {
+        struct client_address other = client;
+        memcpy(other.bytes, &i, sizeof(i));
+        failed |= !limits_admit(&limits, &other);
+    }
+    limits_release(&limits, &client);
+    failed |= !limits_admit(&limits, &client) || limits_admit(&limits, &client) ||
+        limits.connections != LIMIT_CONNECTIONS * 2 + 2;
+    limits_free(&limits);
+    cJSON_Delete(config);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_proxy_header() {
+    printf("- test_proxy_header ");
+    struct client_address address = { { 0 } };
+    char client[64];
+    const char *v1 = "PROXY TCP4 192.0.2.7 198.51.100.1 51234 80\r\nGET / HTTP/1.1\r\n\r\n";
+    int failed = proxy_header_parse(v1, strlen(v1), &address) != (int)strlen(v1) - 18;
+    client_address_format(&address, client, sizeof(client));
+    failed |= strcmp(client, "192.0.2.7") != 0;
+    const char *v1_ipv6 = "PROXY TCP6 2001:db8::7 2001:db8::1 51234 443\r\n";
+    failed |= proxy_header_parse(v1_ipv6, strlen(v1_ipv6), &address) != (int)strlen(v1_ipv6);
+    client_address_format(&address, client, sizeof(client));
+    failed |= strcmp(client, "2001:db8::7") != 0;
+
+    // Incomplete headers need more data; anything else is rejected
+    failed |= proxy_header_parse("PRO", 3, &address) != 0 ||
+        proxy_header_parse(v1, 20, &address) != 0 ||
+        proxy_header_parse("GET / HTTP/1.1\r\n", 16, &address) != -1 ||
+        proxy_header_parse("PROXY TCP4 nowhere 1 2 3\r\n", 26, &address) != -1 ||
+        proxy_header_parse("PROXY SCTP\r\n", 12, &address) != -1;
+
+    // v2 with an IPv4 address and a TLV to skip, then LOCAL from the proxy itself
+    unsigned char v2[32] = "\r\n\r\n\0\r\nQUIT\n\x21\x11\x00\x10"
+                           "\xc0\x00\x02\x09" "\xc6\x33\x64\x01" "\xc8\x22\x00\x50" "\x04\x00\x01\x00";
+    failed |= proxy_header_parse((char *)v2, 15, &address) != 0 ||
+        proxy_header_parse((char *)v2, 32, &address) != 32;
+    client_address_format(&address, client, sizeof(client));
+    failed |= strcmp(client, "192.0.2.9") != 0;
+    v2[12] = 0x20;
+    v2[13] = 0x00;
+    failed |= proxy_header_parse((char *)v2, 32, &address) != 32;
+    client_address_format(&address, client, sizeof(client));
+    failed |= strcmp(client, "192.0.2.9") != 0;
+    v2[12] = 0x31;
+    failed |= proxy_header_parse((char *)v2, 32, &address) != -1;
+
+    // Listen addresses
+    struct sockaddr_storage listen_address;
+    socklen_t listen_address_len;
+    char name[128];
+    const char *texts[] = { "8080", "127.0.0.1:8080", "[::1]:8443", "unix:cserver.sock" };
+    const char *names[] = { "0.0.0.0:8080", "127.0.0.1:8080", "[::1]:8443", "unix:cserver.sock" };
+    for (int i = 0; i < 4; i++) {
+        failed |= listen_address_parse(texts[i], &listen_address, &listen_address_len) != 0;
+        listen_address_format((struct sockaddr *)&listen_address, name, sizeof(name));
+        failed |= strcmp(name, names[i]) != 0;
+    }
+    failed |= listen_address_parse("::1:80", &listen_address, &listen_address_len) != -1 ||
+        listen_address_parse("127.0.0.1:http", &listen_address, &listen_address_len) != -1 ||
+        listen_address_parse("unix:", &listen_address, &listen_address_len) != -1;
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_file_cache() {
+    printf("- test_file_cache ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    FILE *file = fopen("static/site.css", "w");
+    fputs("body {}", file);
+    fclose(file);
+
+    cJSON *config = cJSON_Parse("{\"file_cache\": {\"inotify\": false, \"ttl\": 0}}");
+    file_cache_init(config);
+    cJSON_Delete(config);
+
+    struct file_cache_entry *first = file_cache_get("/site.css");
+    struct file_cache_entry *second = file_cache_get("/site.css");
+    int failed = first == NULL || first != second || first->map == NULL ||
+        first->size != 7 || memcmp(first->map, "body {}", 7) != 0 ||
+        file_cache_get("/missing.css") != NULL;
+    file_cache_release(first);
+    file_cache_release(second);
+
+    file_cache_invalidate("static/site.css");
+    struct file_cache_entry *third = file_cache_get("/site.css");
+    failed |= third == NULL || third->size != 7;
+    file_cache_release(third);
+
+    uint64_t hits, misses;
+    size_t entries;
+    file_cache_stats(&hits, &misses, &entries, NULL);
+    failed |= hits != 1 || misses != 3 || entries != 1;
+    file_cache_clear();
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed: %llu hits, %llu misses.\n", (unsigned long long)hits, (unsigned long long)misses);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+static string render_cached(struct site *site, struct file_cache_entry *file) {
+    cJSON *context = cJSON_Parse("{\"request\": {\"method\": \"GET\", \"query\": \"/page\"}}");
+    string result = page_cache_render(site, context, file);
+    cJSON_Delete(context);
+    return result;
+}
+
+int test_page_cache() {
+    printf("- test_page_cache ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("templates", 0700);
+    FILE *file = fopen("static/page.md", "w");
+    fputs("Text", file);
+    fclose(file);
+    file = fopen("templates/default.mustache", "w");
+    fputs("One", file);
+    fclose(file);
+
+    cJSON *config = cJSON_Parse("{\"page_cache\": {\"entries\": 4, \"size\": 16}}");
+    page_cache_init(config);
+    struct site site = {.config = config, .config_hash = json_hash(config), .generation = 1};
+    struct file_cache_entry page = {.path = "static/page.md"};
+
+    // The second request is served from the cache
+    string first = render_cached(&site, &page);
+    string second = render_cached(&site, &page);
+    page_cache_batch_end();
+    string cached = render_cached(&site, &page);
+    int failed = first.value == NULL || second.value == NULL || cached.value == NULL ||
+        strcmp(first.value, "One") != 0 || strcmp(second.value, "One") != 0 || strcmp(cached.value, "One") != 0;
+    string_free(first);
+    string_free(second);
+    string_free(cached);
+
+    // A changed template drops the page; other files do not
+    failed |= page_cache_invalidate("templates/custom.mustache") != 0;
+    file = fopen("templates/default.mustache", "w");
+    fputs("Two", file);
+    fclose(file);
+    failed |= page_cache_invalidate("templates/default.mustache") != 1;
+    string third = render_cached(&site, &page);
+    failed |= third.value == NULL || strcmp(third.value, "Two") != 0;
+    string_free(third);
+
+    // A page over the budget is shared in the batch, then rendered again
+    file = fopen("static/large.md", "w");
+    fputs("---\ntemplate: large\n---\nText", file);
+    fclose(file);
+    file = fopen("templates/large.mustache", "w");
+    fputs("A page larger than the budget of the cache", file);
+    fclose(file);
+    struct file_cache_entry large = {.path = "static/large.md"};
+    cJSON *context = cJSON_Parse("{\"request\": {\"method\": \"GET\", \"query\": \"/large\"}}");
+    for (int i = 0; i < 3; i++) {
+        if (i == 2) page_cache_batch_end();
+        string content = page_cache_render(&site, context, &large);
+        failed |= content.value == NULL || strncmp(content.value, "A page larger", 13) != 0;
+        string_free(content);
+    }
+    cJSON_Delete(context);
+
+    uint64_t hits, misses, coalesced;
+    size_t entries;
+    page_cache_stats(&hits, &misses, NULL, &coalesced, &entries, NULL);
+    failed |= hits != 2 || misses != 4 || coalesced != 1 || entries != 1;
+    page_cache_clear();
+    cJSON_Delete(config);
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed: %llu hits, %llu misses.\n", (unsigned long long)hits, (unsigned long long)misses);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+static string render_fragment(struct site *site, char *path) {
+    cJSON *context = cJSON_CreateObject();
+    add_request(context, "GET", "/page", path);
+    string result = render_page(site, context, path);
+    cJSON_Delete(context);
+    return result;
+}
+
+int test_fragment_cache() {
+    printf("- test_fragment_cache ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("templates", 0700);
+    FILE *file = fopen("static/plain.md", "w");
+    fputs("---\ntitle: Plain\n---\nText\n", file);
+    fclose(file);
+    file = fopen("static/tagged.md", "w");
+    fputs("{{request.page}}\n", file);
+    fclose(file);
+    file = fopen("templates/default.mustache", "w");
+    fputs("{{page.title}}:{{{content}}}", file);
+    fclose(file);
+
+    cJSON *config = cJSON_Parse("{\"fragment_cache\": {\"entries\": 4}}");
+    fragment_cache_init(config);
+    cJSON_Delete(config);
+    struct site *site = site_load();
+
+    uint64_t hits, misses;
+    size_t entries;
+    string first = render_fragment(site, "static/plain.md");
+    string second = render_fragment(site, "static/plain.md");
+    string tagged = render_fragment(site, "static/tagged.md");
+    fragment_cache_stats(&hits, &misses, &entries, NULL);
+    int failed = first.value == NULL || second.value == NULL || strcmp(first.value, second.value) != 0 ||
+        strncmp(first.value, "Plain:<p>Text</p>", 17) != 0 || tagged.value == NULL ||
+        strstr(tagged.value, "page") == NULL || hits != 1 || misses != 1 || entries != 1;
+    string_free(first);
+    string_free(second);
+    string_free(tagged);
+
+    // A changed file is converted again
+    page_cache_invalidate("static/plain.md");
+    fragment_cache_stats(NULL, NULL, &entries, NULL);
+    failed |= entries != 0;
+    site_release(site);
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed: %llu hits, %llu misses.\n", (unsigned long long)hits, (unsigned long long)misses);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_early_hints() {
+    printf("- test_early_hints ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("templates", 0700);
+    mkdir("templates/partials", 0700);
+    FILE *file = fopen("config.json", "w");
+    fputs("{\"early_hints\": {\"default\": true}}", file);
+    fclose(file);
+    file = fopen("static/page.md", "w");
+    fputs("---\ntitle: Page\n---\nText\n", file);
+    fclose(file);
+    file = fopen("static/other.md", "w");
+    fputs("---\ntemplate: other\n---\nText\n", file);
+    fclose(file);
+    file = fopen("templates/default.mustache", "w");
+    fputs("<link rel=\"stylesheet\" href=\"/css/site.css\">\n"
+          "<link rel='preload' href='/fonts/text.woff2' as='font' crossorigin>\n"
+          "<link rel=\"icon\" href=\"/favicon.ico\">\n"
+          "<script src=\"{{page.script}}\"></script>\n"
+          "{{> head}}{{{content}}}", file);
+    fclose(file);
+    file = fopen("templates/partials/head.mustache", "w");
+    fputs("<script type=\"module\" src=\"/js/app.js\"></script><LINK REL=stylesheet HREF=/css/site.css>", file);
+    fclose(file);
+
+    struct site *site = site_load();
+    struct file_cache_entry page = { .path = "static/page.md", .rendered = true };
+    struct file_cache_entry other = { .path = "static/other.md", .rendered = true };
+    string links = early_hints_links(site, &page);
+    string response = early_hints_response("GET /page HTTP/1.1\r\nHost: a\r\n\r\n", links);
+    string old_client = early_hints_response("GET /page HTTP/1.0\r\n\r\n", links);
+    string disabled = early_hints_links(site, &other);
+    const char *expected =
+        "HTTP/1.1 103 Early Hints\r\n"
+        "Link: </css/site.css>; rel=preload; as=style\r\n"
+        "Link: </fonts/text.woff2>; rel=preload; as=font; crossorigin\r\n"
+        "Link: </js/app.js>; rel=modulepreload\r\n"
+        "\r\n";
+    int failed = response.value == NULL || strcmp(response.value, expected) != 0 ||
+        old_client.value != NULL || disabled.value != NULL ||
+        early_hints_response("GET /other HTTP/1.1\r\n\r\n", disabled).value != NULL;
+    string_free(response);
+    string_free(links);
+
+    // A changed partial is scanned again once it is reported
+    file = fopen("templates/partials/head.mustache", "w");
+    fputs("<script src=\"/js/main.js\" defer></script>", file);
+    fclose(file);
+    links = early_hints_links(site, &page);
+    failed |= links.value == NULL || strstr(links.value, "app.js") == NULL;
+    string_free(links);
+    page_cache_invalidate("templates/partials/head.mustache");
+    links = early_hints_links(site, &page);
+    failed |= links.value == NULL || strstr(links.value, "Link: </js/main.js>; rel=preload; as=script\r\n") == NULL ||
+        strstr(links.value, "app.js") != NULL;
+    string_free(links);
+    site_release(site);
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_children() {
+    printf("- test_children ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("static/notes", 0700);
+    const char *files[][2] = {
+        { "static/notes/index.md", "---\ntitle: Notes\n---\n# Notes\n" },
+        { "static/notes/first.md", "---\ntitle: First\ncategory: Field Notes\npublished: 2024-01-02\n---\n"
+                                   "# First\n\n{{page.title}}\n\nThe first note\nis short.\n\nMore.\n" },
+        // Front matter keys named like the lists of the site
+        { "static/notes/second.md", "---\ntitle: Second\ncategory: Field Notes\npublished: 2024-03-04\n"
+                                    "slug: two\nsummary: Given\npages: 3\nchildren: none\n---\nBody\n" },
+        { "static/notes/draft.md", "No title\n" },
+        { "static/notes/long.md", NULL },
+    };
+    // A summary of text without spaces, cut within a character
+    char long_page[512] = "---\ntitle: Long\npublished: 2023-01-01\n---\n";
+    for (int i = 0; i < 100; i++) strcat(long_page, "\xe8\xaa\x9e");
+    files[4][1] = long_page;
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        FILE *file = fopen(files[i][0], "w");
+        fputs(files[i][1], file);
+        fclose(file);
+    }
+
+    struct site *site = site_load();
+    cJSON *notes = site ? site_children(site, "/notes/?page=2") : NULL;
+    cJSON *category = site ? site_children(site, "/category/field-notes") : NULL;
+    cJSON *top = site ? site_children(site, "/") : NULL;
+    cJSON *newest = cJSON_GetArrayItem(notes, 0);
+    cJSON *oldest = cJSON_GetArrayItem(notes, 1);
+    const char *long_summary = read_string(cJSON_GetArrayItem(notes, 2), "summary", "");
+    int failed = cJSON_GetArraySize(notes) != 3 || cJSON_GetArraySize(category) != 2 ||
+        strlen(long_summary) != 66 * 3 + 3 || strcmp(long_summary + 66 * 3, "...") != 0 ||
+        cJSON_GetArraySize(top) != 1 || site_children(site, "/missing") != NULL ||
+        strcmp(read_string(newest, "title", ""), "Second") != 0 ||
+        strcmp(read_string(newest, "slug", ""), "two") != 0 ||
+        strcmp(read_string(newest, "summary", ""), "Given") != 0 ||
+        strcmp(read_string(oldest, "link", ""), "notes/first") != 0 ||
+        strcmp(read_string(oldest, "slug", ""), "first") != 0 ||
+        strcmp(read_string(oldest, "published", ""), "2024-01-02") != 0 ||
+        strcmp(read_string(oldest, "summary", ""), "The first note is short.") != 0 ||
+        strcmp(read_string(cJSON_GetArrayItem(category, 1), "title", ""), "First") != 0 ||
+        strcmp(read_string(cJSON_GetArrayItem(top, 0), "title", ""), "Notes") != 0 ||
+        site_page(site, "static/notes/second.md") == NULL;
+    site_release(site);
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_sites() {
+    printf("- test_sites ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("sites", 0700);
+    mkdir("sites/Example.com", 0700);
+    mkdir("sites/Example.com/static", 0700);
+    FILE *file = fopen("config.json", "w");
+    fputs("{\"sites\": \"sites\"}", file);
+    fclose(file);
+    file = fopen("static/index.html", "w");
+    fputs("Server", file);
+    fclose(file);
+    file = fopen("sites/Example.com/static/index.html", "w");
+    fputs("Hosted", file);
+    fclose(file);
+
+    struct site *site = site_load();
+    struct site *hosted = site && site->host_count == 1 ? site->hosts[0] : NULL;
+    int failed = hosted == NULL || strcmp(hosted->host, "example.com") != 0 ||
+        strcmp(hosted->root, "sites/Example.com/") != 0 ||
+        site_host(site, "GET / HTTP/1.1\r\nHost: EXAMPLE.com.:8080\r\n\r\n") != hosted ||
+        site_host(site, "GET / HTTP/1.1\r\nHost: example.org\r\n\r\n") != site ||
+        site_host(site, "GET / HTTP/1.0\r\n\r\n") != site;
+    if (!failed) {
+        // The same URL is a different file in each site
+        struct file_cache_entry *server_file = site_file(site, "/", NULL);
+        struct file_cache_entry *hosted_file = site_file(hosted, "/", NULL);
+        failed |= server_file == NULL || hosted_file == NULL || server_file->size != 6 ||
+            strncmp(hosted_file->path, "sites/Example.com/static/", 25) != 0 ||
+            strcmp(server_file->path, hosted_file->path) == 0;
+        file_cache_release(server_file);
+        file_cache_release(hosted_file);
+        file_cache_clear();
+
+        // Unchanged hosted sites are kept by a reload
+        site_publish(site);
+        struct site *reloaded = site_load();
+        failed |= reloaded == NULL || reloaded->host_count != 1 || reloaded->hosts[0] != hosted;
+        site_invalidate("sites/Example.com/static/index.md");
+        struct site *changed = site_load();
+        failed |= changed == NULL || changed->host_count != 1 || changed->hosts[0] == hosted;
+        site_release(reloaded);
+        site_release(changed);
+    } else {
+        site_release(site);
+    }
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_bundle() {
+    struct temp_site temp;
+    char bundle_path[4096];
+    if (!temp_site_create(&temp)) {
+        printf("- test_bundle failed: no temporary directory.\n");
+        return 1;
+    }
+    mkdir("static", 0700);
+    mkdir("static/docs", 0700);
+    FILE *file = fopen("static/site.css", "w");
+    fputs("body {}", file);
+    fclose(file);
+    file = fopen("static/site.css.gz", "w");
+    fputs("gzip", file);
+    fclose(file);
+    file = fopen("static/docs/index.md", "w");
+    fputs("Docs", file);
+    fclose(file);
+    file = fopen("config.json", "w");
+    fputs("{\"fingerprint\": false}", file);
+    fclose(file);
+    snprintf(bundle_path, sizeof(bundle_path), "%s/site.bundle", temp.directory);
+    int failed = pack_site(temp.directory, bundle_path) != EXIT_SUCCESS;
+    printf("- test_bundle ");
+
+    struct bundle *bundle = bundle_open(bundle_path);
+    failed |= bundle == NULL;
+    if (bundle != NULL) {
+        // Every URL that resolves to a file, the variant only if accepted
+        const char *urls[] = { "/site.css", "/site.css.gz", "/docs/index.md", "/docs/index", "/docs/", "/docs" };
+        for (size_t i = 0; i < sizeof(urls) / sizeof(urls[0]); i++) {
+            struct file_cache_entry *entry = bundle_get(bundle, urls[i], NULL);
+            failed |= entry == NULL || strcmp(entry->url, urls[i]) != 0;
+            file_cache_release(entry);
+        }
+        failed |= bundle_get(bundle, "/missing", NULL) != NULL;
+        struct file_cache_entry *plain = bundle_get(bundle, "/site.css", "br;q=1, gzip;q=0");
+        struct file_cache_entry *gzip = bundle_get(bundle, "/site.css", "deflate, gzip");
+        failed |= plain == NULL || plain->size != 7 || memcmp(plain->map, "body {}", 7) != 0;
+        failed |= gzip == NULL || gzip->size != 4 || strstr(gzip->headers, "Content-Encoding: gzip") == NULL;
+        file_cache_release(plain);
+        file_cache_release(gzip);
+        struct file_cache_entry *page = bundle_get(bundle, "/docs", NULL);
+        failed |= page == NULL || page->rendered || strstr(page->map, "<p>Docs</p>") == NULL;
+        file_cache_release(page);
+        bundle_release(bundle);
+    }
+
+    temp_site_remove(&temp);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+int test_fingerprint() {
+    printf("- test_fingerprint ");
+    char url[256];
+    char original[256];
+    char fingerprint[FINGERPRINT_LENGTH + 1];
+    fingerprint_url(url, sizeof(url), "/css/site.css", "0123456789ab");
+    int failed = strcmp(url, "/css/site.0123456789ab.css") != 0;
+    failed |= !fingerprint_strip(url, original, sizeof(original), fingerprint) ||
+        strcmp(original, "/css/site.css") != 0 || strcmp(fingerprint, "0123456789ab") != 0;
+    fingerprint_url(url, sizeof(url), "/v1.2/LICENSE", "0123456789ab");
+    failed |= strcmp(url, "/v1.2/LICENSE.0123456789ab") != 0;
+    failed |= fingerprint_strip("/css/site.css", original, sizeof(original), fingerprint);
+
+    cJSON *assets = cJSON_Parse("{\"css/site.css\": \"/css/site.0123456789ab.css\"}");
+    substring template = { .value = "<link href=\"{{asset \"css/site.css\"}}\">{{asset 'js/app.js' }}{{asset}}", .length = 0 };
+    template.length = strlen(template.value);
+    string expanded = expand_assets(template, assets);
+    failed |= expanded.value == NULL ||
+        strcmp(expanded.value, "<link href=\"/css/site.0123456789ab.css\">/js/app.js{{asset}}") != 0;
+    string_free(expanded);
+    substring plain = { .value = "{{title}}", .length = 9 };
+    failed |= expand_assets(plain, assets).value != NULL;
+    cJSON_Delete(assets);
+
+    if (failed) {
+        printf("failed: %s.\n", url);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+struct test_timer {
+    struct timer timer;
+    uint64_t expired;
+};
+
+static void test_timer_expired(struct timer *timer, void *data) {
+    ((struct test_timer *)timer)->expired = *(uint64_t *)data;
+}
+
+int test_timer_wheel() {
+    printf("- test_timer_wheel ");
+    struct timer_wheel *wheel = malloc(sizeof(struct timer_wheel));
+    uint64_t start = 1000;
+    timer_wheel_init(wheel, start);
+    uint64_t delays[] = { 1, 63, 64, 100, 4095, 5000, 300000, 20000 };
+    int count = sizeof(delays) / sizeof(delays[0]);
+    struct test_timer timers[8] = { 0 };
+    for (int i = 0; i < count; i++) timer_schedule(wheel, &timers[i].timer, start + delays[i]);
+    // Cancelled and rescheduled timers
+    timer_cancel(wheel, &timers[7].timer);
+    timer_schedule(wheel, &timers[5].timer, start + 5001);
+    delays[5] = 5001;
+
+    uint64_t tick = start;
+    while (tick < start + 400000) {
+        tick += 7;
+        timer_advance(wheel, tick, test_timer_expired, &tick);
+    }
+    // Expired on the first advance that passed the tick
+    int failed = wheel->count != 0 || timers[7].expired != 0;
+    for (int i = 0; i < 7; i++) {
+        uint64_t due = start + delays[i];
+        uint64_t expected = start + (delays[i] + 6) / 7 * 7;
+        failed |= timers[i].expired != expected || timers[i].expired < due;
+    }
+    free(wheel);
+
+    // Connection caps
+    cJSON *config = cJSON_Parse("{\"limits\": {\"connections\": 3, \"connections_per_client\": 2}}");
+    struct connection_limits limits;
+    limits_init(&limits, config);
+    cJSON_Delete(config);
+    struct client_address first, second;
+    client_address_parse(&first, "10.0.0.1");
+    client_address_parse(&second, "10.0.0.2");
+    failed |= !limits_admit(&limits, &first) || !limits_admit(&limits, &first) || limits_admit(&limits, &first);
+    failed |= !limits_admit(&limits, &second) || limits_admit(&limits, &second);
+    limits_release(&limits, &first);
+    failed |= !limits_admit(&limits, &second) || limits_admit(&limits, &first);
+    // A PROXY header moves the connection to the client it names
+    limits_release(&limits, &second);
+    failed |= !limits_move(&limits, &second, &first) || limits_move(&limits, &second, &first);
+    limits_free(&limits);
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+// Collects decoded fields as "name: value" lines
+static void test_hpack_field(void *data, substring name, substring value) {
+    char *fields = data;
+    size_t length = strlen(fields);
+    snprintf(fields + length, 1024 - length, "%.*s: %.*s\n", (int)name.length, name.value, (int)value.length, value.value);
+}
+
+int test_hpack() {
+    printf("- test_hpack ");
+    // RFC 7541 C.4.1 and C.4.2: Huffman coded requests, the second one refers to the dynamic table
+    const uint8_t first[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff
+    };
+    const uint8_t second[] = { 0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf };
+    struct hpack_table table;
+    hpack_table_init(&table, 4096);
+    char fields[1024] = "";
+    int failed = hpack_decode(&table, first, sizeof(first), test_hpack_field, fields) != 0 ||
+        strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n") != 0 ||
+        table.size != 57;
+    fields[0] = '\0';
+    failed |= hpack_decode(&table, second, sizeof(second), test_hpack_field, fields) != 0 ||
+        strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n") != 0 ||
+        table.size != 110;
+    // Unknown index and padding that is not a prefix of EOS
+    const uint8_t invalid[] = { 0xc0 };
+    const uint8_t padding[] = { 0xf1, 0x00 };
+    char output[8];
+    size_t output_length;
+    failed |= hpack_decode(&table, invalid, sizeof(invalid), test_hpack_field, fields) == 0;
+    failed |= hpack_huffman_decode(padding, sizeof(padding), output, &output_length) == 0;
+    hpack_table_free(&table);
+
+    // Response headers: indexed status, lowercase names, no connection headers
+    string content = string_make("Not here");
+    string response = make_response_headers(HTTP_STATUS_404, "text/html", "Connection: close\r\nX-Id: 7\r\n", content);
+    struct h2_buffer block = { 0 };
+    int status;
+    size_t body;
+    hpack_table_init(&table, 4096);
+    fields[0] = '\0';
+    failed |= h2_response_headers(&block, response.value, response.length, &status, &body) != 0 ||
+        status != 404 || strcmp(response.value + body, "Not here") != 0 || (uint8_t)block.value[0] != 0x8d ||
+        hpack_decode(&table, (uint8_t *)block.value, block.length, test_hpack_field, fields) != 0 ||
+        strcmp(fields, ":status: 404\ncontent-type: text/html\ncontent-length: 8\nx-id: 7\n") != 0;
+    hpack_table_free(&table);
+    free(block.value);
+    string_free(response);
+    string_free(content);
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+// Finds a RST_STREAM frame with an error code in HTTP/2 output
+static bool test_h2_reset(const char *output, size_t length, uint32_t stream_id, uint32_t error) {
+    const uint8_t *frame = (const uint8_t *)output;
+    const uint8_t *end = frame + length;
+    while (end - frame >= 9) {
+        size_t frame_length = (size_t)frame[0] << 16 | frame[1] << 8 | frame[2];
+        uint32_t id = (uint32_t)frame[5] << 24 | frame[6] << 16 | frame[7] << 8 | frame[8];
+        if (frame[3] == 3 && id == stream_id && frame_length == 4 && frame[12] == error) return true;
+        frame += 9 + frame_length;
+    }
+    return false;
+}
+
+int test_h2_malformed() {
+    printf("- test_h2_malformed ");
+    struct h2_session *session = h2_session_create("127.0.0.1");
+    char input[256];
+    size_t length = 0;
+    memcpy(input, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+    length += 24;
+    memcpy(input + length, "\x00\x00\x00\x04\x00\x00\x00\x00\x00", 9);
+    length += 9;
+    // GET / with a header value that would add a header line, then
+    // GET with a space in the path
+    const uint8_t injected[] = { 0x82, 0x86, 0x84, 0x00, 0x01, 'x', 0x06, 'a', '\r', '\n', 'X', ':', '1' };
+    const uint8_t spaced[] = { 0x82, 0x86, 0x04, 0x07, '/', ' ', 'H', 'T', 'T', 'P', '/' };
+    const uint8_t *blocks[] = { injected, spaced };
+    size_t block_lengths[] = { sizeof(injected), sizeof(spaced) };
+    for (int i = 0; i < 2; i++) {
+        uint8_t header[9] = { 0, 0, block_lengths[i], 1, 0x05, 0, 0, 0, 1 + 2 * i };
+        memcpy(input + length, header, 9);
+        memcpy(input + length + 9, blocks[i], block_lengths[i]);
+        length += 9 + block_lengths[i];
+    }
+    int failed = h2_receive(session, NULL, input, length) != 0;
+    size_t output_length;
+    const char *output = h2_output(session, &output_length);
+    failed |= !test_h2_reset(output, output_length, 1, 1) || !test_h2_reset(output, output_length, 3, 1) ||
+        session->stream_count != 0;
+    h2_session_free(session);
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+// Finds a GOAWAY frame with an error code in HTTP/2 output
+static bool test_h2_goaway(const char *output, size_t length, uint32_t error) {
+    const uint8_t *frame = (const uint8_t *)output;
+    const uint8_t *end = frame + length;
+    while (end - frame >= 9) {
+        size_t frame_length = (size_t)frame[0] << 16 | frame[1] << 8 | frame[2];
+        if (frame[3] == 7 && frame_length == 8 && frame[16] == error) return true;
+        frame += 9 + frame_length;
+    }
+    return false;
+}
+
+int test_h2_state() {
+    printf("- test_h2_state ");
+    const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\x00\x00\x00\x04\x00\x00\x00\x00\x00";
+    // Open requests on streams 1, 3 and 5, waiting for their bodies
+    const char opened[] =
+        "\x00\x00\x03\x01\x04\x00\x00\x00\x01\x82\x86\x84"
+        "\x00\x00\x03\x01\x04\x00\x00\x00\x03\x82\x86\x84"
+        "\x00\x00\x03\x01\x04\x00\x00\x00\x05\x82\x86\x84";
+    // Stream 3 depends on 1, then 1 on 3; the window of 5 is raised to the maximum
+    const char frames[] =
+        "\x00\x00\x05\x02\x00\x00\x00\x00\x03\x00\x00\x00\x01\x0f"
+        "\x00\x00\x05\x02\x00\x00\x00\x00\x01\x00\x00\x00\x03\x0f"
+        "\x00\x00\x04\x08\x00\x00\x00\x00\x05\x7f\xff\x00\x00";
+    struct h2_session *session = h2_session_create("127.0.0.1");
+    int failed = h2_receive(session, NULL, preface, sizeof(preface) - 1) != 0 ||
+        h2_receive(session, NULL, opened, sizeof(opened) - 1) != 0 ||
+        h2_receive(session, NULL, frames, sizeof(frames) - 1) != 0 || session->stream_count != 3;
+    // The former dependent is moved to the former parent instead of a cycle
+    for (struct h2_stream *stream = session->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == 1) failed |= stream->parent != 3;
+        if (stream->id == 3) failed |= stream->parent != 0;
+        if (stream->id == 5) failed |= stream->window != 0x7fffffff;
+    }
+    // A larger initial window would overflow the window of stream 5
+    const char settings[] = "\x00\x00\x06\x04\x00\x00\x00\x00\x00\x00\x04\x00\x01\x00\x00";
+    h2_receive(session, NULL, settings, sizeof(settings) - 1);
+    size_t output_length;
+    const char *output = h2_output(session, &output_length);
+    failed |= !test_h2_goaway(output, output_length, 3);
+    h2_session_free(session);
+
+    // Headers on a stream below the last one opened
+    session = h2_session_create("127.0.0.1");
+    const char reopened[] =
+        "\x00\x00\x03\x01\x04\x00\x00\x00\x03\x82\x86\x84"
+        "\x00\x00\x03\x01\x04\x00\x00\x00\x01\x82\x86\x84";
+    h2_receive(session, NULL, preface, sizeof(preface) - 1);
+    h2_receive(session, NULL, reopened, sizeof(reopened) - 1);
+    output = h2_output(session, &output_length);
+    failed |= !test_h2_goaway(output, output_length, 5);
+    h2_session_free(session);
+
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+// Starts a server for the directory in a child process; returns its port,
+// -1 if it did not start
+static int test_server_start(char *directory, pid_t *pid) {
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        _exit(start_server(directory, true));
+    }
+    // The server is listening once it is in the registry
+    for (int i = 0; i < 500; i++) {
+        cJSON *instance = registry_read(*pid);
+        int port = read_int(instance, "port", -1);
+        cJSON_Delete(instance);
+        if (port > 0) return port;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void test_server_stop(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    registry_remove(pid);
+}
+
+#ifdef CSERVER_TLS
+// Writes a self-signed certificate and its key to a PEM file
+static int test_certificate(const char *path) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    FILE *file = fopen(path, "w");
+    int result = key == NULL || certificate == NULL || file == NULL ? -1 : 0;
+    if (result == 0) {
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+        X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(certificate, X509_get_subject_name(certificate));
+        X509_set_pubkey(certificate, key);
+        if (X509_sign(certificate, key, EVP_sha256()) == 0 || PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL) != 1 ||
+            PEM_write_X509(file, certificate) != 1) {
+            result = -1;
+        }
+    }
+    if (file) fclose(file);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return result;
+}
+#endif
+
+// Requests a URL from a server on localhost; returns the body if the
+// response is a 200 with all of its Content-Length, NULL otherwise
+static char *test_download(int port, bool tls, const char *url, size_t *length) {
+    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(socket_desc, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(socket_desc);
+        return NULL;
+    }
+#ifdef CSERVER_TLS
+    SSL_CTX *context = tls ? SSL_CTX_new(TLS_client_method()) : NULL;
+    SSL *session = context ? SSL_new(context) : NULL;
+    if (session) SSL_set_fd(session, socket_desc);
+    if (tls && (session == NULL || SSL_connect(session) != 1)) tls = false, url = NULL;
+#endif
+    char request[256];
+    int request_length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", url);
+    size_t size = 1 << 16, received = 0, expected = 0;
+    char *response = url ? malloc(size) : NULL;
+    char *body = NULL;
+#ifdef CSERVER_TLS
+    if (tls && response && SSL_write(session, request, request_length) != request_length) {
+        free(response);
+        response = NULL;
+    }
+#endif
+    if (!tls && response && send(socket_desc, request, request_length, 0) != request_length) {
+        free(response);
+        response = NULL;
+    }
+    while (response) {
+        if (received == size) {
+            char *larger = realloc(response, size * 2);
+            if (larger == NULL) break;
+            response = larger;
+            size *= 2;
+        }
+        ssize_t count;
+#ifdef CSERVER_TLS
+        if (tls) count = SSL_read(session, response + received, size - received); else
+#endif
+        count = recv(socket_desc, response + received, size - received, 0);
+        if (count <= 0) break;
+        received += count;
+        // The response is complete with all of its Content-Length
+        char *header_end = memmem(response, received, "\r\n\r\n", 4);
+        if (header_end && expected == 0) {
+            char *field = memmem(response, header_end - response, "Content-Length: ", 16);
+            expected = field ? strtoul(field + 16, NULL, 10) : 0;
+        }
+        if (header_end && strncmp(response, "HTTP/1.1 200 ", 13) == 0 &&
+            (size_t)(response + received - header_end - 4) == expected) {
+            *length = expected;
+            body = malloc(expected + 1);
+            if (body) memcpy(body, header_end + 4, expected);
+            break;
+        }
+    }
+    free(response);
+#ifdef CSERVER_TLS
+    SSL_free(session);
+    SSL_CTX_free(context);
+#endif
+    close(socket_desc);
+    return body;
+}
+
+// io_uring may be missing from the kernel or blocked by a seccomp filter
+static bool test_uring_available() {
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+    struct io_uring_params params = { 0 };
+    int ring = syscall(__NR_io_uring_setup, 1, &params);
+    if (ring < 0) return errno != ENOSYS && errno != EPERM;
+    close(ring);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int test_large_file() {
+    printf("- test_large_file ");
+    struct temp_site temp;
+    if (!temp_site_create(&temp)) {
+        printf("failed: no temporary directory.\n");
+        return 1;
+    }
+    setenv("XDG_RUNTIME_DIR", temp.directory, 1);
+    mkdir("static", 0700);
+    mkdir("templates", 0700);
+    // Larger than the map limit, so it is sent from its descriptor
+    size_t size = 3 * 1024 * 1024 + 17;
+    char *content = malloc(size);
+    for (size_t i = 0; i < size; i++) content[i] = i * 7 % 251;
+    FILE *file = fopen("static/large.bin", "w");
+    fwrite(content, 1, size, file);
+    fclose(file);
+
+    const char *backends[] = { "blocking", "epoll", "uring" };
+    bool uring = test_uring_available();
+    int failed = 0;
+    for (int tls = 0; tls < 2; tls++) {
+#ifdef CSERVER_TLS
+        if (tls && test_certificate("tls.pem") != 0) failed |= 1;
+#else
+        // HTTPS needs a build with TLS=1
+        if (tls) break;
+#endif
+        for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+            // TLS connections are served by epoll instead of io_uring
+            if (strcmp(backends[i], "uring") == 0 && (!uring || tls)) continue;
+            file = fopen("config.json", "w");
+            fprintf(file, "{\"listen\": [\"127.0.0.1:0\"], \"io\": \"%s\", "
+                    "\"file_cache\": {\"map_limit\": 4096}%s}", backends[i],
+                    tls ? ", \"tls\": {\"certificate\": \"tls.pem\"}" : "");
+            fclose(file);
+            pid_t pid;
+            int port = test_server_start(temp.directory, &pid);
+            size_t length = 0;
+            char *body = port > 0 ? test_download(port, tls, "/large.bin", &length) : NULL;
+            if (body == NULL || length != size || memcmp(body, content, size) != 0) {
+                printf("%s%s ", backends[i], tls ? " with TLS" : "");
+                failed |= 1;
+            }
+            free(body);
+            test_server_stop(pid);
+        }
+    }
+    free(content);
+
+    temp_site_remove(&temp);
+    unsetenv("XDG_RUNTIME_DIR");
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+#ifdef CSERVER_LUA
+int test_lua() {
+    printf("- test_lua ");
+    cJSON *config = cJSON_Parse("{\"lua\": {\"states\": 1}}");
+    cJSON *context = cJSON_Parse("{\"request\": {\"url\": \"/count\"}, \"site\": {}}");
+    int failed = lua_pool_init(config) != 0;
+    // The global counts the runs in the only state of the pool
+    const char *counter = "local request = ...\n"
+                          "runs = (runs or 0) + 1\n"
+                          "return request.url .. ' ' .. runs, 'text/plain'\n";
+    const char *broken = "runs = runs + 1\nerror('broken')\n";
+    struct file_cache_entry script = { .path = "count.lua", .map = counter, .size = strlen(counter), .version = 1 };
+    struct file_cache_entry failing = { .path = "broken.lua", .map = broken, .size = strlen(broken), .version = 1 };
+    struct access_log_entry entry = { .status = 200 };
+    string response = lua_response(context, HTTP_STATUS_200, &script, &entry);
+    failed |= response.value == NULL || strncmp(response.value, "HTTP/1.1 200 OK\r\n", 17) != 0 ||
+        strstr(response.value, "Content-Type: text/plain\r\n") == NULL ||
+        strcmp(response.value + response.length - 8, "/count 1") != 0 || entry.bytes != 8;
+    string_free(response);
+
+    // A failing script answers 500 and its state goes back to the pool
+    fflush(stdout);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    response = lua_response(context, HTTP_STATUS_200, &failing, &entry);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    close(null);
+    failed |= response.value == NULL || strncmp(response.value, "HTTP/1.1 500 ", 13) != 0 || entry.status != 500;
+    string_free(response);
+    response = lua_response(context, HTTP_STATUS_200, &script, &entry);
+    failed |= response.value == NULL || strcmp(response.value + response.length - 8, "/count 3") != 0;
+    string_free(response);
+
+    // An iterator kept past its request fails instead of reading freed data
+    const char *keeping = "local request = ...\n"
+                          "if kept then\n"
+                          "    local ok, message = pcall(kept)\n"
+                          "    return tostring(ok) .. ' ' .. message, 'text/plain'\n"
+                          "end\n"
+                          "kept = pairs(request)\n"
+                          "return (kept()), 'text/plain'\n";
+    struct file_cache_entry keeper = { .path = "keep.lua", .map = keeping, .size = strlen(keeping), .version = 1 };
+    cJSON *kept_context = cJSON_Parse("{\"request\": {\"url\": \"/keep\", \"method\": \"GET\"}}");
+    response = lua_response(kept_context, HTTP_STATUS_200, &keeper, &entry);
+    cJSON_Delete(kept_context);
+    failed |= response.value == NULL || strcmp(response.value + response.length - 3, "url") != 0;
+    string_free(response);
+    response = lua_response(context, HTTP_STATUS_200, &keeper, &entry);
+    failed |= response.value == NULL || strstr(response.value, "\r\n\r\nfalse ") == NULL ||
+        strstr(response.value, "site data used after its request") == NULL;
+    string_free(response);
+
+    lua_pool_close();
+    cJSON_Delete(context);
+    cJSON_Delete(config);
+    if (failed) {
+        printf("failed.\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+#endif
+
 int test_rendering(char *name) {  
 
   printf("- %s ", name);
@@ -110,7 +1532,7 @@ int test_rendering(char *name) {
   }
 
   cJSON *context = cJSON_CreateObject();
-  string rendered_content = render_page(context, md_filename);
+  string rendered_content = render_page(NULL, context, md_filename);
   if (rendered_content.value == NULL) {
     printf("failed: no result.\n");
     return 1;
@@ -134,8 +1556,9 @@ int test_rendering(char *name) {
 
 int main() {
 
+  memory_init();
   printf("Running cserver tests...\n");
-  int total = 8;
+  int total = 32;
   int failed = 0;
 
   failed += test_string_init();
@@ -143,6 +1566,34 @@ int main() {
   failed += test_read_file();
   failed += test_make_response();
   failed += test_get_content_type();
+  failed += test_request_header();
+  failed += test_front_matter();
+  failed += test_html_escape();
+  failed += test_memory();
+  failed += test_format_access_log_entry();
+  failed += test_trace();
+  failed += test_histogram();
+  failed += test_registry();
+  failed += test_rate_limit();
+  failed += test_limits();
+  failed += test_proxy_header();
+  failed += test_file_cache();
+  failed += test_page_cache();
+  failed += test_fragment_cache();
+  failed += test_early_hints();
+  failed += test_children();
+  failed += test_sites();
+  failed += test_bundle();
+  failed += test_fingerprint();
+  failed += test_timer_wheel();
+  failed += test_hpack();
+  failed += test_h2_malformed();
+  failed += test_h2_state();
+  failed += test_large_file();
+#ifdef CSERVER_LUA
+  total++;
+  failed += test_lua();
+#endif
   failed += test_rendering("test-md-metadata");
   failed += test_rendering("test-md-only");
   failed += test_rendering("test-metadata-only");